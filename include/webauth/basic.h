@@ -181,6 +181,18 @@ int webauth_context_init(struct webauth_context **, WA_APR_POOL_T *)
 int webauth_context_init_apr(struct webauth_context **, WA_APR_POOL_T *)
     __attribute__((__nonnull__));
 
+/*
+ * Reset a WebAuth context for reuse.  All memory allocated from the context
+ * is freed, and the last error, the logging and ticket cache callbacks, and
+ * any WebKDC or user information service configuration are cleared, but the
+ * context itself remains valid.  This lets a long-running server keep one
+ * context per thread and reset it between requests instead of creating a new
+ * one for each request.  Anything previously returned by WebAuth functions
+ * using this context must not be used after this call.
+ */
+void webauth_context_reset(struct webauth_context *)
+    __attribute__((__nonnull__));
+
 /*
  * Free a WebAuth context.  After this call, the contents of the provided
  * webauth_context struct will be invalid and should not be reused without
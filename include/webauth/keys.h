@@ -83,6 +83,12 @@ struct webauth_keyring_entry {
  * serialized to disk.  We could just use the apr_array_header_t directly, but
  * it's not typed and we could end up with the wrong header.  Wrap it in a
  * struct so that we get the benefits of type checking.
+ *
+ * Keyrings must be created with webauth_keyring_new or a function that
+ * returns a new keyring, since the library keeps a private index of the keys
+ * by valid_after time alongside this struct.  Entries should only be added or
+ * removed with webauth_keyring_add and webauth_keyring_remove, which keep
+ * that index current.
  */
 struct webauth_keyring {
     WA_APR_ARRAY_HEADER_T *entries;
@@ -72,6 +72,26 @@ struct webauth_krb5_change_config {
     time_t timeout;             /* Network timeout, or 0 for no timeout */
 };
 
+/*
+ * Callbacks for an application-provided cache of service tickets.  Keys are
+ * opaque binary strings and tickets are encrypted before they're stored.
+ * The get callback should set ticket and length to a copy of the ticket that
+ * stays valid until the end of the current request and return true, or
+ * return false if it has no ticket for that key.  The put callback is given
+ * the expiration time of the ticket and may discard the ticket.
+ */
+typedef int (*webauth_krb5_ticket_get_func)(struct webauth_context *,
+                                            void *data, const void *key,
+                                            size_t key_len,
+                                            const void **ticket,
+                                            size_t *length);
+typedef void (*webauth_krb5_ticket_put_func)(struct webauth_context *,
+                                             void *data, const void *key,
+                                             size_t key_len,
+                                             const void *ticket,
+                                             size_t length,
+                                             time_t expiration);
+
 /* Flags for webauth_krb5_get_principal and webauth_krb5_read_auth. */
 enum webauth_krb5_canon {
     WA_KRB5_CANON_NONE  = 0,    /* Do not canonicalize principals. */
@@ -105,6 +125,40 @@ int webauth_krb5_new(struct webauth_context *, struct webauth_krb5 **)
 void webauth_krb5_free(struct webauth_context *, struct webauth_krb5 *)
     __attribute__((__nonnull__));
 
+/*
+ * Keep the Kerberos library context created by the next webauth_krb5_new call
+ * in the WebAuth context and share it with all later webauth_krb5 contexts
+ * created from that WebAuth context, including after webauth_context_reset,
+ * rather than creating a new one each time.  Creating a Kerberos library
+ * context rereads the Kerberos configuration and loads plugins, which is a
+ * significant part of the cost of a WebKDC request.  The configuration files
+ * are checked at most once a second and the shared context is recreated once
+ * it is no longer in use if any of them have changed.
+ *
+ * Kerberos library contexts must not be used by more than one thread at a
+ * time, so this should only be called for a WebAuth context that is used by
+ * a single thread.
+ */
+int webauth_krb5_reuse_context(struct webauth_context *)
+    __attribute__((__nonnull__));
+
+/*
+ * Set the callbacks for a cache of service tickets, or clear them if either
+ * callback is NULL.  When set, webauth_krb5_make_auth and
+ * webauth_krb5_export_cred look for a cached service ticket before asking
+ * the KDC for one, and offer tickets they get from the KDC to the cache, if
+ * the webauth_krb5 context was initialized with webauth_krb5_import_cred.
+ * Tickets are keyed and encrypted with keys derived from the imported
+ * credential and the client and server principals, so only a context
+ * holding the same credential can find or read them.  The data pointer is
+ * passed through to the callbacks.  The callbacks are cleared by
+ * webauth_context_reset.
+ */
+void webauth_krb5_set_ticket_cache(struct webauth_context *,
+                                   webauth_krb5_ticket_get_func,
+                                   webauth_krb5_ticket_put_func, void *data)
+    __attribute__((__nonnull__(1)));
+
 /*
  * Configure the path to a credential cache to use for FAST armor during
  * password authentication requests, or NULL to disable use of FAST armor.  If
@@ -229,6 +283,15 @@ int webauth_krb5_get_cache(struct webauth_context *, struct webauth_krb5 *,
                            char **)
     __attribute__((__nonnull__));
 
+/*
+ * Close the ticket cache without destroying it, so that it's still there
+ * after the context is freed.  By default, the ticket cache is destroyed
+ * along with the context.  Nothing that needs the ticket cache can be done
+ * with the context afterwards.
+ */
+int webauth_krb5_keep_cache(struct webauth_context *, struct webauth_krb5 *)
+    __attribute__((__nonnull__));
+
 /*
  * Get the realm from the context.  This should only be called after a
  * successful call to webauth_krb5_init_via_* or webauth_krb5_import_cred.
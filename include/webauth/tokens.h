@@ -271,6 +271,19 @@ struct webauth_token {
     } token;
 };
 
+/*
+ * One token in a batch to decode with webauth_token_decode_batch.  The caller
+ * sets type and token, and the remaining members are set by decoding.
+ */
+struct webauth_token_batch {
+    enum webauth_token_type type;       /* Expected type or WA_TOKEN_ANY. */
+    const char *token;                  /* Base64-encoded token. */
+    struct webauth_token *decoded;      /* Decoded token or NULL on error. */
+    int status;                         /* WebAuth status of decoding. */
+    const char *error;                  /* Error message if decoding failed. */
+    unsigned long trials;               /* Number of keys tried. */
+};
+
 BEGIN_DECLS
 
 /*
@@ -304,6 +317,21 @@ int webauth_token_decode_raw(struct webauth_context *, enum webauth_token_type,
                              struct webauth_token **)
     __attribute__((__nonnull__));
 
+/*
+ * Decode several tokens with the same keyring, such as all of the cookies
+ * sent with a request.  This gives the same results as calling
+ * webauth_token_decode on each token, but uses one allocation for all of
+ * them and shares the key search between tokens with the same key hint.  The
+ * result, status, error message, and number of keys tried for each token are
+ * stored in its element of the array.  Returns WA_ERR_NONE if every token was
+ * decoded and otherwise the status of the first that wasn't, and
+ * webauth_error_message will return the error for that token.
+ */
+int webauth_token_decode_batch(struct webauth_context *,
+                               struct webauth_token_batch *, size_t,
+                               const struct webauth_keyring *)
+    __attribute__((__nonnull__));
+
 /*
  * Encode a token.  Takes a token struct and a keyring to use for encryption,
  * and stores in the token argument the newly created token (in pool-allocated
@@ -326,8 +354,10 @@ int webauth_token_encode_raw(struct webauth_context *,
 
 /*
  * Decrypts a token.  The best decryption key on the ring will be tried first,
- * and if that fails all the remaining keys will be tried.  Returns the
- * decrypted data in output and its length in output_len.
+ * and if that fails the remaining keys will be tried, nearest in valid_after
+ * time to the best key first, up to the limit set with
+ * webauth_token_decrypt_limit.  Returns the decrypted data in output and its
+ * length in output_len.
  *
  * Returns WA_ERR_NONE, WA_ERR_NO_MEM, WA_ERR_CORRUPT, WA_ERR_BAD_HMAC, or
  * WA_ERR_BAD_KEY.
@@ -337,6 +367,24 @@ int webauth_token_decrypt(struct webauth_context *, const void *input,
                           const struct webauth_keyring *)
     __attribute__((__nonnull__));
 
+/*
+ * Set the maximum number of keys to try when decrypting a token, including
+ * the best key for its key hint.  This bounds the work done for tokens that
+ * were not encrypted with any key in the keyring, such as forged or stale
+ * cookies.  0, the default, means to try every key.  This applies to every
+ * function that decrypts tokens with this context.
+ */
+void webauth_token_decrypt_limit(struct webauth_context *, unsigned long)
+    __attribute__((__nonnull__));
+
+/*
+ * Returns the number of keys tried while decrypting the most recent token
+ * with this context, whether or not decryption succeeded.  A value greater
+ * than one means the token's key hint did not find its key.
+ */
+unsigned long webauth_token_decrypt_trials(const struct webauth_context *)
+    __attribute__((__nonnull__));
+
 /*
  * Encrypts an input buffer (normally encoded attributes) into a token, using
  * the key from the keyring that has the most recent valid valid_from time.
@@ -38,6 +38,8 @@
 struct webauth_context;
 struct webauth_factors;
 struct webauth_keyring;
+struct webauth_user_cache;
+struct webauth_user_pool;
 
 /*
  * General configuration information for the WebKDC functions.  The WebKDC
@@ -53,6 +55,8 @@ struct webauth_webkdc_config {
     const char *fast_armor_path;        /* Path to cache for FAST armor. */
     const WA_APR_ARRAY_HEADER_T *permitted_realms; /* Array of char * realms */
     const WA_APR_ARRAY_HEADER_T *local_realms;     /* Array of char * realms */
+    time_t login_deadline;      /* Limit for concurrent login calls (s). */
+    int speculative_userinfo;   /* Call user info before password login. */
 };
 
 /*
@@ -167,6 +171,16 @@ enum webauth_user_protocol {
  * and the remote call fails, webauth_user_info will return a minimal result
  * saying that the user can only do password authentication.  The
  * webauth_user_validate call ignores ignore_failure and always must succeed.
+ *
+ * pool, if not NULL, is a pool of connections created with
+ * webauth_user_pool_new.  Connections are then taken from and returned to
+ * that pool instead of being opened and closed for each call.
+ *
+ * cache, if not NULL, is a cache of user information results created with
+ * webauth_user_cache_new.  webauth_user_info then returns a cached result for
+ * the same user, IP address, random multifactor flag, URL origin (scheme,
+ * host, and port), and factors if it hasn't expired instead of calling the
+ * user information service.
  */
 struct webauth_user_config {
     enum webauth_user_protocol protocol;
@@ -179,6 +193,27 @@ struct webauth_user_config {
     time_t timeout;             /* Network timeout, or 0 for no timeout. */
     int ignore_failure;         /* Whether to continue despite remote fail. */
     int json;                   /* Whether to use JSON for communication. */
+    struct webauth_user_pool *pool;     /* Connections to reuse, or NULL. */
+    struct webauth_user_cache *cache;   /* Cached results, or NULL. */
+};
+
+/* Statistics for a pool of connections to the user information service. */
+struct webauth_user_pool_stats {
+    unsigned long created;      /* New connections opened. */
+    unsigned long reused;       /* Idle connections reused. */
+    unsigned long expired;      /* Idle connections closed as too old. */
+    unsigned long retried;      /* Calls retried after a reused one failed. */
+    unsigned long renewed;      /* Times credentials were obtained. */
+    unsigned long idle;         /* Connections currently idle. */
+};
+
+/* Statistics for a cache of user information results. */
+struct webauth_user_cache_stats {
+    unsigned long hits;         /* Results returned from the cache. */
+    unsigned long misses;       /* Calls with no unexpired cached result. */
+    unsigned long stores;       /* Results added to the cache. */
+    unsigned long flushed;      /* Results dropped for invalidated tokens. */
+    unsigned long entries;      /* Results currently cached. */
 };
 
 /*
@@ -256,6 +291,44 @@ int webauth_user_config(struct webauth_context *,
                         const struct webauth_user_config *)
     __attribute__((__nonnull__));
 
+/*
+ * Create a pool of connections to the user information service that keeps up
+ * to size idle connections, each for at most timeout seconds, along with the
+ * Kerberos credentials obtained from the keytab to open them, which are
+ * renewed shortly before they expire.  The pool can be shared by WebAuth
+ * contexts in different threads by setting the pool member of the
+ * webauth_user_config struct.  It's freed and its connections are closed
+ * once the pool of the context that created it and the pools of all contexts
+ * configured to use it with webauth_user_config have been cleared or
+ * destroyed.  Currently only remctl connections are pooled.
+ */
+int webauth_user_pool_new(struct webauth_context *, unsigned long size,
+                          unsigned long timeout, struct webauth_user_pool **)
+    __attribute__((__nonnull__));
+
+/* Return statistics about the use of a connection pool. */
+void webauth_user_pool_stats(struct webauth_user_pool *,
+                             struct webauth_user_pool_stats *)
+    __attribute__((__nonnull__));
+
+/*
+ * Create a cache of webauth_user_info results that holds up to size results,
+ * each for at most ttl seconds.  This avoids repeating the same user
+ * information service call for a burst of single sign-on requests, at the
+ * cost of results being up to ttl seconds out of date, so ttl should be
+ * short.  Only successful results are cached.  Like a connection pool, the
+ * cache can be shared by WebAuth contexts in different threads by setting the
+ * cache member of the webauth_user_config struct and is freed the same way.
+ */
+int webauth_user_cache_new(struct webauth_context *, unsigned long size,
+                           unsigned long ttl, struct webauth_user_cache **)
+    __attribute__((__nonnull__));
+
+/* Return statistics about the use of a result cache. */
+void webauth_user_cache_stats(struct webauth_user_cache *,
+                              struct webauth_user_cache_stats *)
+    __attribute__((__nonnull__));
+
 /*
  * Obtain user information for a given user.  The IP address of the user (as a
  * string) is also provided.  If NULL, it defaults to 127.0.0.1 for the XML
@@ -17,7 +17,6 @@
 #include <portable/apr.h>
 #include <portable/system.h>
 
-#include <apr_hash.h>
 #include <errno.h>
 #include <limits.h>
 #include <netinet/in.h>
@@ -28,15 +27,48 @@
 #include <webauth/tokens.h>
 
 /*
- * Stores metadata about a particular attribute in encoded data.  This is
- * stored as the value in a hash of attributes, with the key being the
- * attribute name.
+ * Stores metadata about a particular attribute in encoded data.  The name and
+ * data point into the encoded data, which has been modified in place so that
+ * both are nul-terminated.  rule is the index of the matching encoding rule,
+ * either top-level or nested in a repeated attribute, or -1 if there isn't
+ * one.
  */
 struct value {
+    const char *name;
+    size_t name_length;
     void *data;
     size_t length;
+    int rule;
 };
 
+/*
+ * The attributes found in encoded data, and the length of that data.  Tokens
+ * rarely have more than a dozen attributes, so decoding uses an array of
+ * STACK_ATTRS values on the stack and only allocates pool memory for larger
+ * encodings.
+ */
+struct attrs {
+    struct value *values;
+    size_t count;
+    size_t length;
+};
+#define STACK_ATTRS 32
+
+/*
+ * A repeated attribute seen while decoding.  Holds the rule for the count,
+ * the array of elements allocated for it, the number of elements, and, for
+ * each element, a mask of the nested attributes seen so far.
+ */
+struct repeat {
+    const struct wai_encoding *rule;
+    void *elements;
+    uint32_t count;
+    uint64_t *seen;
+};
+
+/* The bit for a rule index in a mask of seen attributes. */
+#define RULE_BIT(n) (UINT64_C(1) << (n))
+
 /*
  * Macros used to resolve a void * pointer to a struct and an offset into a
  * pointer to the appropriate type.  Scary violations of the C type system
@@ -69,16 +101,55 @@ decode_error_set(struct webauth_context *ctx, int s, const char *desc,
 
 
 /*
- * Convert the attribute-encoded data to a hash table of attribute names to
- * values, where values are represented by struct value.  This destructively
- * modifies the encoded form in place to avoid having to make another copy of
- * the data.  Returns a WebAuth status code.
+ * Find an attribute by name, returning NULL if it isn't present.  Only used
+ * for the token type, which isn't part of any encoding rules.
+ */
+static struct value *
+find_attr(const struct attrs *attrs, const char *name, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < attrs->count; i++)
+        if (attrs->values[i].name_length == length
+            && memcmp(attrs->values[i].name, name, length) == 0)
+            return &attrs->values[i];
+    return NULL;
+}
+
+
+/*
+ * Find the rule for an attribute name, returning its index in the rules or -1
+ * if there is no rule for that name.  Rules generated by encoding-rules come
+ * with a lookup function that switches on the name; otherwise, fall back on a
+ * linear search.
+ */
+static int
+find_rule(const struct wai_encoding *rules, const char *name, size_t length)
+{
+    int i;
+
+    if (rules->lookup != NULL)
+        return rules->lookup(name, length);
+    for (i = 0; rules[i].attr != NULL; i++)
+        if (strlen(rules[i].attr) == length
+            && memcmp(rules[i].attr, name, length) == 0)
+            return i;
+    return -1;
+}
+
+
+/*
+ * Split the attribute-encoded data into attribute names and values, stored
+ * in the provided struct attrs.  This destructively modifies the encoded form
+ * in place to avoid having to make another copy of the data.  stack is space
+ * for STACK_ATTRS values provided by the caller; if there are more attributes
+ * than that, pool memory is used instead.  Duplicate attributes are detected
+ * later when matching them to rules.  Returns a WebAuth status code.
  */
 static int
 decode_attrs(struct webauth_context *ctx, void *data, size_t length,
-             apr_hash_t **output)
+             struct value *stack, struct attrs *attrs)
 {
-    apr_hash_t *attrs;
     struct value *values;
     size_t i, n, offset;
     char *name, *value;
@@ -105,18 +176,17 @@ decode_attrs(struct webauth_context *ctx, void *data, size_t length,
         }
     }
 
-    /*
-     * We know roughly how many attributes there are.  Allocate data
-     * structures.
-     */
-    attrs = apr_hash_make(ctx->pool);
-    values = apr_pcalloc(ctx->pool, attr_count * sizeof(struct value));
+    /* We know roughly how many attributes there are.  Find space for them. */
+    if (attr_count <= STACK_ATTRS)
+        values = stack;
+    else
+        values = apr_palloc(ctx->pool, attr_count * sizeof(struct value));
 
     /*
      * Now, do the decoding.  As we go, we'll make two transformations:
      * nul-terminate the attribute name by replacing the = with a nul
      * character, and rewrite the value to unescape any semicolons.  When we
-     * find the end of an attribute, we store it in the table.  This is where
+     * find the end of an attribute, we store it in the array.  This is where
      * we do all the syntax checking.
      */
     i = 0;
@@ -154,27 +224,25 @@ decode_attrs(struct webauth_context *ctx, void *data, size_t length,
         if (i >= length || in[i] != ';')
             goto corrupt;
 
-        /* Check whether we have a duplicate. */
-        if (apr_hash_get(attrs, name, strlen(name)) != NULL) {
-            wai_error_set(ctx, WA_ERR_CORRUPT, "duplicate attribute %s", name);
-            return WA_ERR_CORRUPT;
-        }
-
         /*
-         * We have a valid key/value pair.  Store it in the table and
-         * nul-terminate in case it's a number encoded as a string to save us
-         * some effort later.
+         * We have a valid key/value pair.  Store it in the array and
+         * nul-terminate the value so that strings can be used in place and
+         * numbers encoded as strings can be parsed directly.
          */
         in[i - offset] = '\0';
+        values[n].name = name;
+        values[n].name_length = strlen(name);
         values[n].data = value;
         values[n].length = (in + i) - value - offset;
-        apr_hash_set(attrs, name, strlen(name), (const void *) &values[n]);
+        values[n].rule = -1;
         n++;
         i++;
     }
 
-    /* Success.  Store the table in our output variable and return. */
-    *output = attrs;
+    /* Success.  Store the final count and return. */
+    attrs->values = values;
+    attrs->count = n;
+    attrs->length = length;
     return WA_ERR_NONE;
 
 corrupt:
@@ -186,7 +254,9 @@ corrupt:
  * Decode attribute data, possibly hex-encoded.  Takes the WebAuth context,
  * the value, the memory location to which to write the data, the memory
  * location to which to write the length, and a flag saying whether the value
- * is hex-encoded.  Returns a WebAuth error code.
+ * is hex-encoded.  The decoded data points into the encoded data, and
+ * hex-encoded values are decoded in place, since the decoded form is never
+ * longer.  Returns a WebAuth error code.
  */
 static int
 decode_data(struct webauth_context *ctx, struct value *value, void **output,
@@ -199,33 +269,19 @@ decode_data(struct webauth_context *ctx, struct value *value, void **output,
         s = wai_hex_decoded_length(value->length, &length);
         if (s != WA_ERR_NONE)
             return wai_error_set(ctx, s, "invalid hex-encoded data");
-        *output = apr_pcalloc(ctx->pool, length);
-        s = wai_hex_decode(value->data, value->length, *output, size, length);
+        s = wai_hex_decode(value->data, value->length, value->data, size,
+                           length);
         if (s != WA_ERR_NONE)
             return wai_error_set(ctx, s, "invalid hex-encoded data");
+        *output = value->data;
     } else {
-        *output = apr_pmemdup(ctx->pool, value->data, value->length);
+        *output = value->data;
         *size = value->length;
     }
     return WA_ERR_NONE;
 }
 
 
-/*
- * Decode an attribute value as a string.  This is very similar to the
- * non-ascii case of decode_data, except that we nul-terminate the result.
- * Takes the WebAuth context, the value, and the location to which to write
- * the string.
- */
-static void
-decode_string(struct webauth_context *ctx, struct value *value, char **output)
-{
-    *output = apr_palloc(ctx->pool, value->length + 1);
-    memcpy(*output, value->data, value->length);
-    (*output)[value->length] = '\0';
-}
-
-
 /*
  * Decode an attribute value as a number.  All numbers are either encoded as
  * an ASCII string representing the number or as a network-byte-order 32-bit
@@ -260,93 +316,244 @@ corrupt:
 }
 
 
+/*
+ * Decode the value of a single attribute into the data structure according to
+ * its rule.  Repeated attributes are handled by decode_by_rule.  Returns a
+ * WebAuth status code.
+ */
+static int
+decode_value(struct webauth_context *ctx, const struct wai_encoding *rule,
+             struct value *value, void *result)
+{
+    int s = WA_ERR_NONE;
+    uint32_t uint32;
+
+    switch (rule->type) {
+    case WA_TYPE_DATA:
+        s = decode_data(ctx, value, LOC_DATA(result, rule->offset),
+                        LOC_SIZE(result, rule->len_offset), rule->ascii);
+        break;
+    case WA_TYPE_STRING:
+        *LOC_STRING(result, rule->offset) = value->data;
+        break;
+    case WA_TYPE_INT32:
+        s = decode_number(ctx, value, &uint32, rule->ascii);
+        if (s == WA_ERR_NONE)
+            *LOC_INT32(result, rule->offset) = (int32_t) uint32;
+        break;
+    case WA_TYPE_UINT32:
+        s = decode_number(ctx, value, &uint32, rule->ascii);
+        if (s == WA_ERR_NONE)
+            *LOC_UINT32(result, rule->offset) = uint32;
+        break;
+    case WA_TYPE_ULONG:
+        s = decode_number(ctx, value, &uint32, rule->ascii);
+        if (s == WA_ERR_NONE)
+            *LOC_ULONG(result, rule->offset) = uint32;
+        break;
+    case WA_TYPE_TIME:
+        s = decode_number(ctx, value, &uint32, rule->ascii);
+        if (s == WA_ERR_NONE)
+            *LOC_TIME(result, rule->offset) = (time_t) uint32;
+        break;
+    case WA_TYPE_REPEAT:
+        /* Only one level of nesting, so never seen here. */
+        break;
+    }
+    return s;
+}
+
+
+/*
+ * Returns true if every rule in an encoding is optional.  Otherwise, each
+ * element of a repeated attribute using that encoding needs at least one
+ * attribute, which bounds the count of elements by the number of attributes.
+ */
+static bool
+all_optional(const struct wai_encoding *rules)
+{
+    const struct wai_encoding *rule;
+
+    for (rule = rules; rule->attr != NULL; rule++)
+        if (!rule->optional)
+            return false;
+    return true;
+}
+
+
+/*
+ * Split the name of an attribute that may belong to a repeated element into
+ * the attribute name of the nested rule and the element number appended to
+ * it, which must be less than count.  Returns the length of the nested
+ * attribute name, or 0 if the name doesn't end in a valid element number.
+ */
+static size_t
+split_element(const struct value *value, uint32_t count, uint32_t *element)
+{
+    const char *name = value->name;
+    size_t i, start;
+    uint64_t n = 0;
+
+    start = value->name_length;
+    while (start > 0 && name[start - 1] >= '0' && name[start - 1] <= '9')
+        start--;
+    if (start == 0 || start == value->name_length)
+        return 0;
+    if (name[start] == '0' && value->name_length - start > 1)
+        return 0;
+    for (i = start; i < value->name_length; i++) {
+        n = n * 10 + (name[i] - '0');
+        if (n >= count)
+            return 0;
+    }
+    *element = n;
+    return start;
+}
+
+
 /*
  * Given an encoding specification, an attribute list, and a data structure,
- * decode attributes into that data structure.  Takes a separate pool to use
- * rather than using the normal WebAuth context pool.  Context is a string to
- * prepend to the description for error reporting.  If element is non-zero, we
- * are handling a repeated attribute encoding, and the element number is
- * appended to the attribute name when decoding it.
+ * decode attributes into that data structure.  Each attribute is matched to
+ * its rule with the lookup function for the rules and its value is stored
+ * directly, so this is a single pass over the attributes plus a second pass
+ * over any attributes left unmatched if the rules include repeated
+ * attributes.  Afterwards, check for duplicates among the attributes without
+ * rules and that every required attribute was seen.
  *
  * This is an internal helper function used by wai_decode.
  */
 static int
 decode_by_rule(struct webauth_context *ctx, const struct wai_encoding *rules,
-               apr_hash_t *attrs, const void *result, const char *context,
-               unsigned long element)
+               const struct attrs *attrs, void *result)
 {
+    struct repeat repeats[WA_ENCODING_MAX_REPEATS];
+    struct repeat *repeat;
     const struct wai_encoding *rule;
-    const char *attr;
-    struct value *value;
-    unsigned long i;
-    int s;
+    struct value *value, *other;
+    size_t i, j, length;
+    size_t nrepeats = 0;
+    uint64_t seen = 0;
+    uint32_t count, element;
+    int n, s;
     void *data;
-    void **repeat;
-    uint32_t uint32;
 
-    for (rule = rules; rule->attr != NULL; rule++) {
-        if (context == NULL)
-            attr = rule->attr;
-        else
-            attr = apr_psprintf(ctx->pool, "%s%lu", rule->attr, element);
-        value = apr_hash_get(attrs, attr, strlen(attr));
-        s = WA_ERR_NONE;
-
-        /* If this attribute isn't optional, missing data is an error. */
-        if (value == NULL) {
-            if (rule->optional)
-                continue;
-            s = WA_ERR_CORRUPT;
-            decode_error_set(ctx, s, rule->desc, context, element);
+    /*
+     * Match each attribute to a rule.  encoding-rules guarantees that there
+     * are few enough rules and repeated attributes to fit in seen and
+     * repeats.
+     */
+    for (i = 0; i < attrs->count; i++) {
+        value = &attrs->values[i];
+        n = find_rule(rules, value->name, value->name_length);
+        value->rule = n;
+        if (n < 0)
+            continue;
+        if (seen & RULE_BIT(n))
+            return wai_error_set(ctx, WA_ERR_CORRUPT,
+                                 "duplicate attribute %s", value->name);
+        seen |= RULE_BIT(n);
+        rule = &rules[n];
+        if (rule->type != WA_TYPE_REPEAT) {
+            s = decode_value(ctx, rule, value, result);
+            if (s != WA_ERR_NONE)
+                return s;
+            continue;
+        }
+
+        /*
+         * A repeated attribute.  Allocate the elements now and decode the
+         * nested attributes once all the counts are known.  The count comes
+         * from the input, so bound it before allocating: no element can take
+         * less than a byte of the input, and if any nested attribute is
+         * required, each element needs an attribute of its own.  Also make
+         * sure the allocation sizes can't overflow.
+         */
+        s = decode_number(ctx, value, &count, rule->ascii);
+        if (s != WA_ERR_NONE)
             return s;
+        length = count;
+        if (length > attrs->length
+            || (length > attrs->count && !all_optional(rule->repeat))
+            || (rule->size > 0 && length > SIZE_MAX / rule->size)
+            || length > SIZE_MAX / sizeof(uint64_t)) {
+            decode_error_set(ctx, WA_ERR_CORRUPT, rule->desc, NULL, 0);
+            return WA_ERR_CORRUPT;
         }
-            
-        /* Otherwise, interpret the value by data type. */
-        switch (rule->type) {
-        case WA_TYPE_DATA:
-            s = decode_data(ctx, value, LOC_DATA(result, rule->offset),
-                            LOC_SIZE(result, rule->len_offset), rule->ascii);
-            break;
-        case WA_TYPE_STRING:
-            decode_string(ctx, value, LOC_STRING(result, rule->offset));
-            break;
-        case WA_TYPE_INT32:
-            s = decode_number(ctx, value, &uint32, rule->ascii);
-            if (s == WA_ERR_NONE)
-                *LOC_INT32(result, rule->offset) = (int32_t) uint32;
-            break;
-        case WA_TYPE_UINT32:
-            s = decode_number(ctx, value, &uint32, rule->ascii);
-            if (s == WA_ERR_NONE)
-                *LOC_UINT32(result, rule->offset) = uint32;
-            break;
-        case WA_TYPE_ULONG:
-            s = decode_number(ctx, value, &uint32, rule->ascii);
-            if (s == WA_ERR_NONE)
-                *LOC_ULONG(result, rule->offset) = uint32;
-            break;
-        case WA_TYPE_TIME:
-            s = decode_number(ctx, value, &uint32, rule->ascii);
-            if (s == WA_ERR_NONE)
-                *LOC_TIME(result, rule->offset) = (time_t) uint32;
-            break;
-        case WA_TYPE_REPEAT:
-            s = decode_number(ctx, value, &uint32, rule->ascii);
+        *LOC_UINT32(result, rule->len_offset) = count;
+        repeat = &repeats[nrepeats++];
+        repeat->rule = rule;
+        repeat->count = count;
+        repeat->elements = apr_pcalloc(ctx->pool, rule->size * length);
+        repeat->seen = apr_pcalloc(ctx->pool, sizeof(uint64_t) * length);
+        *LOC_DATA(result, rule->offset) = repeat->elements;
+    }
+
+    /*
+     * If there were repeated attributes, match the attributes without a
+     * top-level rule to the nested rules by stripping the element number.
+     * Anything that matches neither is ignored.
+     */
+    for (i = 0; nrepeats > 0 && i < attrs->count; i++) {
+        value = &attrs->values[i];
+        if (value->rule >= 0)
+            continue;
+        for (j = 0; j < nrepeats; j++) {
+            repeat = &repeats[j];
+            length = split_element(value, repeat->count, &element);
+            if (length == 0)
+                continue;
+            n = find_rule(repeat->rule->repeat, value->name, length);
+            if (n < 0)
+                continue;
+            if (repeat->seen[element] & RULE_BIT(n))
+                return wai_error_set(ctx, WA_ERR_CORRUPT,
+                                     "duplicate attribute %s", value->name);
+            repeat->seen[element] |= RULE_BIT(n);
+            value->rule = n;
+            data = (char *) repeat->elements + element * repeat->rule->size;
+            s = decode_value(ctx, &repeat->rule->repeat[n], value, data);
             if (s != WA_ERR_NONE)
-                break;
-            *LOC_UINT32(result, rule->len_offset) = uint32;
-            repeat = LOC_DATA(result, rule->offset);
-            *repeat = apr_palloc(ctx->pool, rule->size * uint32);
-            for (i = 0; i < uint32; i++) {
-                data = (char *) *repeat + i * rule->size;
-                s = decode_by_rule(ctx, rule->repeat, attrs, data, attr, i);
-                if (s != WA_ERR_NONE)
-                    return s;
-            }
+                return s;
             break;
         }
-        if (s != WA_ERR_NONE)
-            return s;
+    }
+
+    /*
+     * Duplicates of attributes with rules were caught above.  Also reject
+     * duplicates of attributes without rules, such as the token type, as the
+     * decoder always has.  There are normally only one or two of these.
+     */
+    for (i = 0; i < attrs->count; i++) {
+        value = &attrs->values[i];
+        if (value->rule >= 0)
+            continue;
+        for (j = i + 1; j < attrs->count; j++) {
+            other = &attrs->values[j];
+            if (other->rule < 0 && other->name_length == value->name_length
+                && memcmp(other->name, value->name, value->name_length) == 0)
+                return wai_error_set(ctx, WA_ERR_CORRUPT,
+                                     "duplicate attribute %s", value->name);
+        }
+    }
+
+    /* Check that every attribute that isn't optional was present. */
+    for (n = 0, rule = rules; rule->attr != NULL; n++, rule++)
+        if (!(seen & RULE_BIT(n)) && !rule->optional) {
+            decode_error_set(ctx, WA_ERR_CORRUPT, rule->desc, NULL, 0);
+            return WA_ERR_CORRUPT;
+        }
+    for (j = 0; j < nrepeats; j++) {
+        repeat = &repeats[j];
+        for (element = 0; element < repeat->count; element++) {
+            rule = repeat->rule->repeat;
+            for (n = 0; rule->attr != NULL; n++, rule++)
+                if (!(repeat->seen[element] & RULE_BIT(n))
+                    && !rule->optional) {
+                    decode_error_set(ctx, WA_ERR_CORRUPT, rule->desc,
+                                     repeat->rule->attr, element);
+                    return WA_ERR_CORRUPT;
+                }
+        }
     }
     return WA_ERR_NONE;
 }
@@ -354,51 +561,54 @@ decode_by_rule(struct webauth_context *ctx, const struct wai_encoding *rules,
 
 /*
  * Given an encoding specification, attribute-encoded data, and a data
- * structure, decode that data into the data structure as newly-allocated pool
- * memory.
+ * structure, decode that data into the data structure.  The data is copied
+ * into pool memory once and decoded in place, so strings and data in the
+ * result point into that copy.
  */
 int
 wai_decode(struct webauth_context *ctx, const struct wai_encoding *rules,
            const void *input, size_t length, void *data)
 {
-    apr_hash_t *attrs;
+    struct value stack[STACK_ATTRS];
+    struct attrs attrs;
     int s;
     void *buf;
 
     buf = apr_pmemdup(ctx->pool, input, length);
-    s = decode_attrs(ctx, buf, length, &attrs);
+    s = decode_attrs(ctx, buf, length, stack, &attrs);
     if (s != WA_ERR_NONE)
         return s;
-    return decode_by_rule(ctx, rules, attrs, data, NULL, 0);
+    return decode_by_rule(ctx, rules, &attrs, data);
 }
 
 
 /*
  * Similar to wai_decode, but decodes a WebAuth token, including handling the
- * determination of the type of the token from the attributes.  This does not
- * perform any sanity checking on the token data; that must be done by
- * higher-level code.
+ * determination of the type of the token from the attributes.  The input is
+ * decoded in place without copying it, so strings and data in the token point
+ * into the input.  This does not perform any sanity checking on the token
+ * data; that must be done by higher-level code.
  */
 int
-wai_decode_token(struct webauth_context *ctx, const void *input,
-                 size_t length, struct webauth_token *token)
+wai_decode_token(struct webauth_context *ctx, void *input, size_t length,
+                 struct webauth_token *token)
 {
-    apr_hash_t *attrs;
+    struct value stack[STACK_ATTRS];
+    struct attrs attrs;
     int s;
-    void *buf, *data;
+    void *data;
     struct value *value;
-    char *type;
+    const char *type;
     const struct wai_encoding *rules;
 
     memset(token, 0, sizeof(*token));
-    buf = apr_pmemdup(ctx->pool, input, length);
-    s = decode_attrs(ctx, buf, length, &attrs);
+    s = decode_attrs(ctx, input, length, stack, &attrs);
     if (s != WA_ERR_NONE)
         return s;
-    value = apr_hash_get(attrs, "t", strlen("t"));
+    value = find_attr(&attrs, "t", strlen("t"));
     if (value == NULL)
         return wai_error_set(ctx, WA_ERR_CORRUPT, "no token type attribute");
-    decode_string(ctx, value, &type);
+    type = value->data;
     token->type = webauth_token_type_code(type);
     if (token->type == WA_TOKEN_UNKNOWN) {
         wai_error_set(ctx, WA_ERR_CORRUPT, "unknown token type %s", type);
@@ -407,5 +617,5 @@ wai_decode_token(struct webauth_context *ctx, const void *input,
     s = wai_token_encoding(ctx, token, &rules, (const void **) &data);
     if (s != WA_ERR_NONE)
         return s;
-    return decode_by_rule(ctx, rules, attrs, data, NULL, 0);
+    return decode_by_rule(ctx, rules, &attrs, data);
 }
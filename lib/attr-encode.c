@@ -39,6 +39,21 @@
 #define LOC_ULONG(d, o)  (unsigned long *) (void *)((char *) (d) + (o))
 
 
+/*
+ * State for encoding.  Encoding is done in two passes over the rules with the
+ * same code: the first, with output set to NULL, only counts the bytes
+ * required, and the second writes them into a buffer of exactly that size.
+ * now is the time used for creation times, fixed across both passes so that
+ * they agree.
+ */
+struct encoder {
+    struct webauth_context *ctx;
+    char *output;
+    size_t used;
+    time_t now;
+};
+
+
 /*
  * Report an error while encoding an attribute.  Takes the WebAuth context,
  * status, description, context (for repeated elements), and element number
@@ -58,86 +73,163 @@ encode_error_set(struct webauth_context *ctx, int s, const char *desc,
 
 
 /*
- * Append an attribute and value to the output buffer.  Takes the output
- * buffer, the attribute key (as a string), the value and its length, and a
- * flag indicating whether to hex-encode the data.  Returns a WebAuth error
- * code.
+ * Format an unsigned number in decimal into the end of the provided buffer,
+ * which must be large enough for any unsigned long, and return a pointer to
+ * the first digit.  The number of digits is the distance from there to the
+ * end of the buffer.
  */
-static int
-encode_data(struct wai_buffer *output, const char *attr, const void *data,
-            size_t length, bool ascii)
+static char *
+format_number(char *end, unsigned long value)
 {
-    size_t hexlen, i, enclen;
-    const char *in = data;
+    char *p = end;
+
+    do {
+        *--p = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    return p;
+}
+
+
+/*
+ * Append length bytes of data to the output, or only count them if we're
+ * computing the length.
+ */
+static void
+put_bytes(struct encoder *enc, const void *data, size_t length)
+{
+    if (enc->output != NULL)
+        memcpy(enc->output + enc->used, data, length);
+    enc->used += length;
+}
+
+
+/* Append a single character to the output. */
+static void
+put_char(struct encoder *enc, char c)
+{
+    if (enc->output != NULL)
+        enc->output[enc->used] = c;
+    enc->used++;
+}
+
+
+/*
+ * Append an attribute name and the following equal sign to the output.  If
+ * context is not NULL, this is an attribute of a repeated element, and the
+ * element number is appended to the name.
+ */
+static void
+put_name(struct encoder *enc, const char *attr, const char *context,
+         unsigned long element)
+{
+    char digits[sizeof(unsigned long) * 3];
+    char *end = digits + sizeof(digits);
     char *p;
-    int s;
 
-    wai_buffer_append_sprintf(output, "%s=", attr);
-    if (ascii) {
-        hexlen = wai_hex_encoded_length(length);
-        wai_buffer_resize(output, output->used + hexlen + 1);
-        s = wai_hex_encode(data, length, output->data + output->used,
-                           &hexlen, hexlen);
-        if (s != WA_ERR_NONE)
-            return s;
-        output->used += hexlen;
-        output->data[output->used] = ';';
-        output->used++;
-    } else {
-        for (i = 0, enclen = 0; i < length; i++, enclen++)
-            if (in[i] == ';')
-                enclen++;
-        wai_buffer_resize(output, output->used + enclen + 1);
-        for (i = 0, p = output->data + output->used; i < length; i++, p++) {
-            *p = in[i];
-            if (in[i] == ';') {
-                p++;
-                *p = ';';
-            }
+    put_bytes(enc, attr, strlen(attr));
+    if (context != NULL) {
+        p = format_number(end, element);
+        put_bytes(enc, p, end - p);
+    }
+    put_char(enc, '=');
+}
+
+
+/*
+ * Append a value to the output, doubling any semicolons, followed by the
+ * terminating semicolon.
+ */
+static void
+put_escaped(struct encoder *enc, const void *data, size_t length)
+{
+    const char *in = data;
+    const char *end = in + length;
+    const char *semi;
+
+    while (in < end) {
+        semi = memchr(in, ';', end - in);
+        if (semi == NULL) {
+            put_bytes(enc, in, end - in);
+            break;
         }
-        *p = ';';
-        output->used += enclen + 1;
+        put_bytes(enc, in, semi - in + 1);
+        put_char(enc, ';');
+        in = semi + 1;
     }
-    return WA_ERR_NONE;
+    put_char(enc, ';');
+}
+
+
+/*
+ * Append a value to the output hex-encoded, followed by the terminating
+ * semicolon.
+ */
+static void
+put_hex(struct encoder *enc, const void *data, size_t length)
+{
+    size_t hexlen;
+
+    hexlen = wai_hex_encoded_length(length);
+    if (enc->output != NULL)
+        wai_hex_encode(data, length, enc->output + enc->used, &hexlen,
+                       hexlen);
+    enc->used += hexlen;
+    put_char(enc, ';');
 }
 
 
 /*
- * Encode an attribute and numeric value to the output buffer.  Takes the
- * output buffer, the attribute key (as a string), the value as an unsigned
- * integer, and a flag indicating whether to format the number as a string.
+ * Append a numeric value to the output, either as decimal digits or as a
+ * 32-bit number in network byte order, followed by the terminating
+ * semicolon.
  */
 static void
-encode_number(struct wai_buffer *output, const char *attr, unsigned long value,
-              bool ascii)
+put_number(struct encoder *enc, unsigned long value, bool ascii)
 {
-    if (ascii)
-        wai_buffer_append_sprintf(output, "%s=%lu;", attr, value);
-    else {
-        uint32_t data = value;
+    char digits[sizeof(unsigned long) * 3];
+    char *end = digits + sizeof(digits);
+    char *p;
+    uint32_t data;
 
-        data = htonl(data);
-        encode_data(output, attr, &data, sizeof(data), false);
+    if (ascii) {
+        p = format_number(end, value);
+        put_bytes(enc, p, end - p);
+        put_char(enc, ';');
+    } else {
+        data = htonl((uint32_t) value);
+        put_escaped(enc, &data, sizeof(data));
     }
 }
 
 
 /*
- * Given an encoding specification, a data source, and a buffer, encode into
- * attribute form in the given buffer.  Context is a string to prepend to the
- * description for error reporting.  If context is non-NULL, we are handling a
- * repeated attribute encoding, and the element number is appended to the
- * attribute name when encoding it.
+ * Append the token type attribute to the output.  Token types never contain
+ * semicolons, so the value is not escaped.
+ */
+static void
+put_type(struct encoder *enc, const char *type)
+{
+    put_bytes(enc, "t=", 2);
+    put_bytes(enc, type, strlen(type));
+    put_char(enc, ';');
+}
+
+
+/*
+ * Given an encoding specification and a data source, encode into attribute
+ * form, or just compute the length of that encoding if enc->output is NULL.
+ * If context is non-NULL, we are handling a repeated attribute encoding, and
+ * the element number is appended to the attribute name when encoding it.
+ * Context is also used for error reporting.
  *
  * This is an internal helper function used by wai_encode.
  */
 static int
-encode_to_attrs(struct webauth_context *ctx, const struct wai_encoding *rules,
-                const void *input, struct wai_buffer *output,
-                const char *context, unsigned long element)
+encode_to_attrs(struct encoder *enc, const struct wai_encoding *rules,
+                const void *input, const char *context, unsigned long element)
 {
     const struct wai_encoding *rule;
-    const char *attr;
     unsigned long i;
     int s;
     void *data, *repeat;
@@ -149,10 +241,6 @@ encode_to_attrs(struct webauth_context *ctx, const struct wai_encoding *rules,
     unsigned long ulong;
 
     for (rule = rules; rule->attr != NULL; rule++) {
-        if (context == NULL)
-            attr = rule->attr;
-        else
-            attr = apr_psprintf(ctx->pool, "%s%lu", rule->attr, element);
         s = WA_ERR_NONE;
         switch (rule->type) {
         case WA_TYPE_DATA:
@@ -164,7 +252,11 @@ encode_to_attrs(struct webauth_context *ctx, const struct wai_encoding *rules,
                 break;
             }
             size = *LOC_SIZE(input, rule->len_offset);
-            s = encode_data(output, attr, data, size, rule->ascii);
+            put_name(enc, rule->attr, context, element);
+            if (rule->ascii)
+                put_hex(enc, data, size);
+            else
+                put_escaped(enc, data, size);
             break;
         case WA_TYPE_STRING:
             string = *LOC_STRING(input, rule->offset);
@@ -174,50 +266,55 @@ encode_to_attrs(struct webauth_context *ctx, const struct wai_encoding *rules,
                 s = WA_ERR_INVALID;
                 break;
             }
-            s = encode_data(output, attr, string, strlen(string), false);
+            put_name(enc, rule->attr, context, element);
+            put_escaped(enc, string, strlen(string));
             break;
         case WA_TYPE_INT32:
             int32 = *LOC_INT32(input, rule->offset);
             if (rule->optional && int32 == 0)
                 break;
-            encode_number(output, attr, int32, rule->ascii);
+            put_name(enc, rule->attr, context, element);
+            put_number(enc, int32, rule->ascii);
             break;
         case WA_TYPE_UINT32:
             uint32 = *LOC_UINT32(input, rule->offset);
             if (rule->optional && uint32 == 0)
                 break;
-            encode_number(output, attr, uint32, rule->ascii);
+            put_name(enc, rule->attr, context, element);
+            put_number(enc, uint32, rule->ascii);
             break;
         case WA_TYPE_ULONG:
             ulong = *LOC_ULONG(input, rule->offset);
             if (rule->optional && ulong == 0)
                 break;
-            encode_number(output, attr, ulong, rule->ascii);
+            put_name(enc, rule->attr, context, element);
+            put_number(enc, ulong, rule->ascii);
             break;
         case WA_TYPE_TIME:
             timev = *LOC_TIME(input, rule->offset);
             if (rule->creation && timev == 0)
-                timev = time(NULL);
+                timev = enc->now;
             if (rule->optional && timev == 0)
                 break;
-            encode_number(output, attr, timev, rule->ascii);
+            put_name(enc, rule->attr, context, element);
+            put_number(enc, timev, rule->ascii);
             break;
         case WA_TYPE_REPEAT:
             uint32 = *LOC_UINT32(input, rule->len_offset);
             if (rule->optional && uint32 == 0)
                 break;
-            encode_number(output, attr, uint32, rules->ascii);
+            put_name(enc, rule->attr, context, element);
+            put_number(enc, uint32, rule->ascii);
             for (i = 0; i < uint32; i++) {
                 repeat = *LOC_STRING(input, rule->offset) + rule->size * i;
-                s = encode_to_attrs(ctx, rule->repeat, repeat, output,
-                                    attr, i);
+                s = encode_to_attrs(enc, rule->repeat, repeat, rule->attr, i);
                 if (s != WA_ERR_NONE)
                     return s;
             }
             break;
         }
         if (s != WA_ERR_NONE) {
-            encode_error_set(ctx, s, rule->desc, context, element);
+            encode_error_set(enc->ctx, s, rule->desc, context, element);
             return s;
         }
     }
@@ -225,40 +322,80 @@ encode_to_attrs(struct webauth_context *ctx, const struct wai_encoding *rules,
 }
 
 
+/*
+ * Encode the token type, if type is not NULL, and then the data following the
+ * rules.  This is done once to count the bytes and then again to write them
+ * into newly allocated pool memory of exactly the right size plus header
+ * bytes of space before the encoded attributes and trailer bytes after them.
+ * Stores a pointer to the encoded attributes and their length.
+ */
+static int
+encode(struct webauth_context *ctx, const struct wai_encoding *rules,
+       const void *data, const char *type, size_t header, size_t trailer,
+       void **output, size_t *length)
+{
+    struct encoder enc;
+    int s;
+
+    /* Compute the length. */
+    enc.ctx = ctx;
+    enc.output = NULL;
+    enc.used = 0;
+    enc.now = time(NULL);
+    if (type != NULL)
+        put_type(&enc, type);
+    s = encode_to_attrs(&enc, rules, data, NULL, 0);
+    if (s != WA_ERR_NONE)
+        return s;
+
+    /* Allocate the buffer and encode into it. */
+    *length = enc.used;
+    enc.output = apr_palloc(ctx->pool, header + enc.used + trailer);
+    enc.output += header;
+    enc.used = 0;
+    if (type != NULL)
+        put_type(&enc, type);
+    s = encode_to_attrs(&enc, rules, data, NULL, 0);
+    if (s != WA_ERR_NONE)
+        return s;
+    *output = enc.output;
+    return WA_ERR_NONE;
+}
+
+
 /*
  * Given an encoding specification and a pointer to the data to encode, encode
  * into attributes and return the encoded string in newly-allocated pool
- * memory.  Takes a separate pool to use rather than using the normal WebAuth
- * context pool, since attribute encoding can churn a lot of memory.
+ * memory.  The result is nul-terminated, although the nul is not included in
+ * the length.
  */
 int
 wai_encode(struct webauth_context *ctx, const struct wai_encoding *rules,
            const void *data, void **output, size_t *length)
 {
-    struct wai_buffer *buffer;
     int s;
 
-    buffer = wai_buffer_new(ctx->pool);
-    s = encode_to_attrs(ctx, rules, data, buffer, NULL, 0);
+    s = encode(ctx, rules, data, NULL, 0, 1, output, length);
     if (s != WA_ERR_NONE)
         return s;
-    *output = buffer->data;
-    *length = buffer->used;
+    ((char *) *output)[*length] = '\0';
     return WA_ERR_NONE;
 }
 
 
 /*
  * Similar to wai_encode, but encodes a WebAuth token, including adding the
- * appropriate encoding of the token type.  This does not perform any sanity
- * checking on the token data; that must be done by higher-level code.
+ * appropriate encoding of the token type.  The encoded attributes are
+ * allocated with room for the token header before them and padding after
+ * them so that wai_token_encrypt can encrypt them in place.  This does not
+ * perform any sanity checking on the token data; that must be done by
+ * higher-level code.
  */
 int
 wai_encode_token(struct webauth_context *ctx,
                  const struct webauth_token *token, void **output,
                  size_t *length)
 {
-    struct wai_buffer *buffer;
     int s;
     const char *type;
     const struct wai_encoding *rules;
@@ -267,13 +404,7 @@ wai_encode_token(struct webauth_context *ctx,
     s = wai_token_encoding(ctx, token, &rules, &data);
     if (s != WA_ERR_NONE)
         return s;
-    buffer = wai_buffer_new(ctx->pool);
     type = webauth_token_type_string(token->type);
-    wai_buffer_append_sprintf(buffer, "t=%s;", type);
-    s = encode_to_attrs(ctx, rules, data, buffer, NULL, 0);
-    if (s != WA_ERR_NONE)
-        return s;
-    *output = buffer->data;
-    *length = buffer->used;
-    return WA_ERR_NONE;
+    return encode(ctx, rules, data, type, WA_TOKEN_HEADER_SIZE,
+                  WA_TOKEN_PADDING_MAX, output, length);
 }
@@ -0,0 +1,454 @@
+/*
+ * Base64 encoding and decoding.
+ *
+ * Tokens are base64-encoded for use in cookies and URLs.  This is the
+ * standard base64 alphabet with padding, producing the same results as
+ * apr_base64_encode and apr_base64_decode, including the latter's behavior of
+ * decoding everything up to the first character outside the alphabet.
+ *
+ * Where the compiler supports it, there are SSSE3 and AVX2 implementations
+ * that encode 12 or 24 bytes and decode 16 or 32 characters at a time, chosen
+ * at runtime based on the CPU.  SSE2 alone has no byte shuffle, which these
+ * algorithms depend on.  The portable code handles everything else and the
+ * bytes left over.  The vector algorithms are those described by Wojciech
+ * Muła and Daniel Lemire.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#if HAVE_X86_SIMD
+# include <immintrin.h>
+#endif
+
+#include <lib/internal.h>
+
+/* The base64 alphabet. */
+static const char base64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*
+ * Maps each character to its value in the base64 alphabet, or to 0xff if it
+ * is not part of the alphabet.  The padding character is not part of the
+ * alphabet and ends decoding like any other.
+ */
+#define X 0xff
+static const unsigned char unbase64[256] = {
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, 62,  X,  X,  X, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61,  X,  X,  X,  X,  X,  X,
+     X,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,  X,  X,  X,  X,  X,
+     X, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X
+};
+#undef X
+
+
+#if HAVE_X86_SIMD
+
+/*
+ * Given 12 bytes of input in the low 12 bytes of a vector, return the 16
+ * base64 characters that encode them.  Each group of three bytes is shuffled
+ * into a 32-bit word so that its four 6-bit indices can be moved into
+ * separate bytes with two multiplies, and the indices are then mapped to the
+ * alphabet by adding an offset looked up from the range each falls in.
+ */
+__attribute__((__target__("ssse3")))
+static __m128i
+ssse3_base64_chars(__m128i in)
+{
+    __m128i t0, t1, t2, t3, indices, reduced, less;
+    const __m128i shuffle = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+                                          7, 6, 8, 7, 10, 9, 11, 10);
+    const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '+' - 62,
+                                          '/' - 63, 'A', 0, 0);
+
+    in = _mm_shuffle_epi8(in, shuffle);
+    t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    indices = _mm_or_si128(t1, t3);
+    reduced = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    reduced = _mm_or_si128(reduced, _mm_and_si128(less, _mm_set1_epi8(13)));
+    return _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, reduced));
+}
+
+
+/*
+ * Encode length bytes, which must be a multiple of 12, into base64.  Each
+ * load reads 16 bytes, so there must be at least four more bytes of input
+ * after the end.
+ */
+__attribute__((__target__("ssse3")))
+static void
+ssse3_base64_encode(const unsigned char *input, size_t length, char *output)
+{
+    __m128i in;
+    size_t i;
+
+    for (i = 0; i < length; i += 12) {
+        in = _mm_loadu_si128((const __m128i *) (input + i));
+        _mm_storeu_si128((__m128i *) (output + i / 3 * 4),
+                         ssse3_base64_chars(in));
+    }
+}
+
+
+/*
+ * The same as ssse3_base64_chars, but for 24 bytes at a time, 12 in the low
+ * bytes of each 128-bit lane.
+ */
+__attribute__((__target__("avx2")))
+static __m256i
+avx2_base64_chars(__m256i in)
+{
+    __m256i t0, t1, t2, t3, indices, reduced, less;
+    const __m256i shuffle = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+                                             7, 6, 8, 7, 10, 9, 11, 10,
+                                             1, 0, 2, 1, 4, 3, 5, 4,
+                                             7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i offsets = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '+' - 62,
+                                             '/' - 63, 'A', 0, 0,
+                                             'a' - 26, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '+' - 62,
+                                             '/' - 63, 'A', 0, 0);
+
+    in = _mm256_shuffle_epi8(in, shuffle);
+    t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    indices = _mm256_or_si256(t1, t3);
+    reduced = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+    less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+    less = _mm256_and_si256(less, _mm256_set1_epi8(13));
+    reduced = _mm256_or_si256(reduced, less);
+    return _mm256_add_epi8(indices, _mm256_shuffle_epi8(offsets, reduced));
+}
+
+
+/*
+ * The same as ssse3_base64_encode, but for a multiple of 24 bytes.  Each
+ * 128-bit lane is loaded separately so that each gets 12 bytes of input,
+ * which reads 16 bytes at an offset of 12, so there must be at least four
+ * more bytes of input after the end.
+ */
+__attribute__((__target__("avx2")))
+static void
+avx2_base64_encode(const unsigned char *input, size_t length, char *output)
+{
+    __m128i low, high;
+    __m256i in;
+    size_t i;
+
+    for (i = 0; i < length; i += 24) {
+        low = _mm_loadu_si128((const __m128i *) (input + i));
+        high = _mm_loadu_si128((const __m128i *) (input + i + 12));
+        in = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+        _mm256_storeu_si256((__m256i *) (output + i / 3 * 4),
+                            avx2_base64_chars(in));
+    }
+}
+
+
+/*
+ * Decode 16 base64 characters into the low 12 bytes of the returned vector.
+ * The characters are validated and mapped to their 6-bit values by looking
+ * up their high and low nibbles, which is exact for this alphabet.  If any
+ * character is outside the alphabet, sets *valid to false and the result is
+ * garbage.
+ */
+__attribute__((__target__("ssse3")))
+static __m128i
+ssse3_base64_values(__m128i in, bool *valid)
+{
+    __m128i high, low, lo, hi, roll, values, merged;
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x11, 0x11, 0x13, 0x1a,
+                                         0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+                                         0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+                                         0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                           0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                       -1, -1, -1, -1);
+
+    high = _mm_and_si128(_mm_srli_epi32(in, 4), mask);
+    low = _mm_and_si128(in, mask);
+    lo = _mm_shuffle_epi8(lut_lo, low);
+    hi = _mm_shuffle_epi8(lut_hi, high);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi),
+                                         _mm_setzero_si128())) != 0xffff)
+        *valid = false;
+    roll = _mm_add_epi8(_mm_cmpeq_epi8(in, _mm_set1_epi8('/')), high);
+    values = _mm_add_epi8(in, _mm_shuffle_epi8(lut_roll, roll));
+    merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(merged, pack);
+}
+
+
+/*
+ * Decode base64 characters a vector at a time, stopping before the first
+ * vector that contains a character outside the alphabet.  Each store writes
+ * 16 bytes, four more than it decodes, so this stops while there are still at
+ * least eight characters left.  Returns the number of characters decoded,
+ * which will be a multiple of 16.
+ */
+__attribute__((__target__("ssse3")))
+static size_t
+ssse3_base64_decode(const unsigned char *input, size_t length,
+                    unsigned char *output)
+{
+    __m128i in, out;
+    size_t i;
+    bool valid = true;
+
+    for (i = 0; i + 24 <= length; i += 16) {
+        in = _mm_loadu_si128((const __m128i *) (input + i));
+        out = ssse3_base64_values(in, &valid);
+        if (!valid)
+            break;
+        _mm_storeu_si128((__m128i *) (output + i / 4 * 3), out);
+    }
+    return i;
+}
+
+
+/*
+ * The same as ssse3_base64_values, but for 32 characters at a time, which are
+ * decoded into the low 24 bytes of the returned vector.
+ */
+__attribute__((__target__("avx2")))
+static __m256i
+avx2_base64_values(__m256i in, bool *valid)
+{
+    __m256i high, low, lo, hi, roll, values, merged;
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x11, 0x11, 0x13, 0x1a,
+                                            0x1b, 0x1b, 0x1b, 0x1a,
+                                            0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x11, 0x11, 0x13, 0x1a,
+                                            0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+                                            0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+                                            0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                              0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71, -71,
+                                              0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                          14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                          14, 13, 12, -1, -1, -1, -1);
+
+    high = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask);
+    low = _mm256_and_si256(in, mask);
+    lo = _mm256_shuffle_epi8(lut_lo, low);
+    hi = _mm256_shuffle_epi8(lut_hi, high);
+    if (!_mm256_testz_si256(lo, hi))
+        *valid = false;
+    roll = _mm256_add_epi8(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('/')),
+                           high);
+    values = _mm256_add_epi8(in, _mm256_shuffle_epi8(lut_roll, roll));
+    merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+    merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+    merged = _mm256_shuffle_epi8(merged, pack);
+    return _mm256_permutevar8x32_epi32(merged,
+                                       _mm256_setr_epi32(0, 1, 2, 4, 5, 6,
+                                                         3, 7));
+}
+
+
+/*
+ * The same as ssse3_base64_decode, but for 32 characters at a time.  Each
+ * store writes 32 bytes, eight more than it decodes, so this stops while
+ * there are still at least 16 characters left.
+ */
+__attribute__((__target__("avx2")))
+static size_t
+avx2_base64_decode(const unsigned char *input, size_t length,
+                   unsigned char *output)
+{
+    __m256i in, out;
+    size_t i;
+    bool valid = true;
+
+    for (i = 0; i + 48 <= length; i += 32) {
+        in = _mm256_loadu_si256((const __m256i *) (input + i));
+        out = avx2_base64_values(in, &valid);
+        if (!valid)
+            break;
+        _mm256_storeu_si256((__m256i *) (output + i / 4 * 3), out);
+    }
+    return i;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+
+/*
+ * Given the length of data, return the length of its base64 encoding, not
+ * including the nul terminator.
+ */
+size_t
+wai_base64_encoded_length(size_t length)
+{
+    return (length + 2) / 3 * 4;
+}
+
+
+/*
+ * Given the length of base64-encoded data, return the maximum length of the
+ * decoded data.
+ */
+size_t
+wai_base64_decoded_length(size_t length)
+{
+    return (length + 3) / 4 * 3;
+}
+
+
+/*
+ * Encode length bytes of input in base64 into output, which must have room
+ * for wai_base64_encoded_length(length) plus one bytes.  The result is padded
+ * and nul-terminated.  Returns the length of the encoding.
+ */
+size_t
+wai_base64_encode(const void *input, size_t length, char *output)
+{
+    const unsigned char *in = input;
+    char *out = output;
+#if HAVE_X86_SIMD
+    size_t done = 0;
+#endif
+
+    /*
+     * Encode as much as possible a vector at a time.  The vector code reads
+     * four bytes past the end of what it encodes.
+     */
+#if HAVE_X86_SIMD
+    if (length >= 28 && __builtin_cpu_supports("avx2")) {
+        done = (length - 4) / 24 * 24;
+        avx2_base64_encode(in, done, out);
+    } else if (length >= 16 && __builtin_cpu_supports("ssse3")) {
+        done = (length - 4) / 12 * 12;
+        ssse3_base64_encode(in, done, out);
+    }
+    in += done;
+    out += done / 3 * 4;
+    length -= done;
+#endif
+
+    /* Encode the remaining bytes three at a time. */
+    for (; length >= 3; length -= 3, in += 3) {
+        *out++ = base64[in[0] >> 2];
+        *out++ = base64[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+        *out++ = base64[((in[1] & 0x0f) << 2) | (in[2] >> 6)];
+        *out++ = base64[in[2] & 0x3f];
+    }
+
+    /* Encode and pad the last one or two bytes. */
+    if (length > 0) {
+        *out++ = base64[in[0] >> 2];
+        if (length == 1) {
+            *out++ = base64[(in[0] & 0x03) << 4];
+            *out++ = '=';
+        } else {
+            *out++ = base64[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+            *out++ = base64[(in[1] & 0x0f) << 2];
+        }
+        *out++ = '=';
+    }
+    *out = '\0';
+    return out - output;
+}
+
+
+/*
+ * Decode base64 data of the given length into output, which must have room
+ * for wai_base64_decoded_length(length) bytes.  Decoding stops at the end of
+ * the data or at the first character outside the base64 alphabet, such as
+ * padding.  A single character left over at the end is ignored.  Returns the
+ * length of the decoded data.
+ */
+size_t
+wai_base64_decode(const char *input, size_t length, void *output)
+{
+    const unsigned char *in = (const unsigned char *) input;
+    unsigned char *out = output;
+    unsigned char a, b, c, d;
+#if HAVE_X86_SIMD
+    size_t done = 0;
+#endif
+
+    /* Decode as much as possible a vector at a time. */
+#if HAVE_X86_SIMD
+    if (length >= 48 && __builtin_cpu_supports("avx2"))
+        done = avx2_base64_decode(in, length, out);
+    if (length - done >= 24 && __builtin_cpu_supports("ssse3"))
+        done += ssse3_base64_decode(in + done, length - done,
+                                    out + done / 4 * 3);
+    in += done;
+    out += done / 4 * 3;
+    length -= done;
+#endif
+
+    /* Decode the remaining characters four at a time. */
+    for (; length >= 4; length -= 4, in += 4) {
+        a = unbase64[in[0]];
+        b = unbase64[in[1]];
+        c = unbase64[in[2]];
+        d = unbase64[in[3]];
+        if ((a | b | c | d) == 0xff)
+            break;
+        *out++ = (a << 2) | (b >> 4);
+        *out++ = (b << 4) | (c >> 2);
+        *out++ = (c << 6) | d;
+    }
+
+    /* Decode whatever is left before the end or an invalid character. */
+    if (length >= 2) {
+        a = unbase64[in[0]];
+        b = unbase64[in[1]];
+        if (a != 0xff && b != 0xff) {
+            *out++ = (a << 2) | (b >> 4);
+            c = (length >= 3) ? unbase64[in[2]] : 0xff;
+            if (c != 0xff) {
+                *out++ = (b << 4) | (c >> 2);
+                d = (length >= 4) ? unbase64[in[3]] : 0xff;
+                if (d != 0xff)
+                    *out++ = (c << 6) | d;
+            }
+        }
+    }
+    return out - (unsigned char *) output;
+}
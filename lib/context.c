@@ -21,16 +21,22 @@
 
 
 /*
- * Given a pool, allocate a WebAuth context from that pool and return it.
+ * Given a pool, allocate a WebAuth context from that pool and return it.  All
+ * other allocations are done from a sub-pool of that pool so that
+ * webauth_context_reset can discard them without freeing the context.
+ * Returns a WebAuth status code.
  */
-static struct webauth_context *
-init_context(apr_pool_t *pool)
+static int
+init_context(struct webauth_context **context, apr_pool_t *pool)
 {
     struct webauth_context *ctx;
 
     ctx = apr_pcalloc(pool, sizeof(struct webauth_context));
-    ctx->pool = pool;
-    return ctx;
+    ctx->base = pool;
+    if (apr_pool_create(&ctx->pool, pool) != APR_SUCCESS)
+        return WA_ERR_APR;
+    *context = ctx;
+    return WA_ERR_NONE;
 }
 
 
@@ -69,8 +75,7 @@ webauth_context_init(struct webauth_context **context, apr_pool_t *parent)
     if (apr_pool_create(&pool, parent) != APR_SUCCESS)
         return WA_ERR_APR;
     apr_pool_abort_set(pool_failure, pool);
-    *context = init_context(pool);
-    return WA_ERR_NONE;
+    return init_context(context, pool);
 }
 
 
@@ -94,8 +99,32 @@ webauth_context_init_apr(struct webauth_context **context, apr_pool_t *parent)
     if (apr_pool_create(&pool, parent) != APR_SUCCESS)
         return WA_ERR_APR;
     apr_pool_abort_set(pool_failure, pool);
-    *context = init_context(pool);
-    return WA_ERR_NONE;
+    return init_context(context, pool);
+}
+
+
+/*
+ * Reset a WebAuth context so that it can be reused for an unrelated series of
+ * calls, such as the next request handled by the same thread of a server.
+ * This frees all memory allocated from the context and forgets the error,
+ * logging and ticket cache callbacks, and WebKDC and user information service
+ * configuration, but keeps the context itself and any Kerberos library
+ * context kept by webauth_krb5_reuse_context.
+ */
+void
+webauth_context_reset(struct webauth_context *ctx)
+{
+    apr_pool_clear(ctx->pool);
+    ctx->error  = NULL;
+    ctx->status = WA_ERR_NONE;
+    memset(&ctx->warn,   0, sizeof(ctx->warn));
+    memset(&ctx->notice, 0, sizeof(ctx->notice));
+    memset(&ctx->info,   0, sizeof(ctx->info));
+    memset(&ctx->trace,  0, sizeof(ctx->trace));
+    ctx->decrypt_trials = 0;
+    ctx->webkdc = NULL;
+    ctx->user   = NULL;
+    memset(&ctx->tickets, 0, sizeof(ctx->tickets));
 }
 
 
@@ -5,6 +5,13 @@
  * various ways, such as parsing and combining them and determining whether
  * one is a subset of another.  Those utility functions are collected here.
  *
+ * Factor codes are interned when a set of factors is created.  Each of the
+ * factor codes that WebAuth knows about gets a bit in a bitset, so checking
+ * for them and comparing sets of them is just bit arithmetic.  Any other
+ * factor codes are kept as strings in a separate list, which is normally
+ * empty.  The order of the factors is kept separately so that converting a
+ * set back to a string gives the factors in the order they were added.
+ *
  * Written by Russ Allbery <eagle@eyrie.org>
  * Copyright 2011, 2013, 2014
  *     The Board of Trustees of the Leland Stanford Junior University
@@ -22,104 +29,254 @@
 #include <webauth/factors.h>
 
 /*
- * Stores a set of factors that we want to perform operations on.  This is a
- * list of authentication methods (like "p", "o1", etc.) plus flags for
- * multifactor and random multifactor.  Those flags are just optimizations
- * (and may be worth dropping).
+ * The factor codes we know about, in the order of their bits in the bitset.
+ * The enum and the table must be kept in sync.
+ */
+enum factor_code {
+    F_COOKIE,
+    F_DEVICE,
+    F_HUMAN,
+    F_KERBEROS,
+    F_MOBILE_PUSH,
+    F_MULTIFACTOR,
+    F_OTP,
+    F_OTP1,
+    F_OTP2,
+    F_OTP3,
+    F_PASSWORD,
+    F_RANDOM_MULTIFACTOR,
+    F_UNKNOWN,
+    F_VOICE,
+    F_X509,
+    F_X509_1,
+    F_X509_2,
+    F_X509_3,
+    F_COUNT                             /* Must be last. */
+};
+static const char * const known_factors[F_COUNT] = {
+    WA_FA_COOKIE,
+    WA_FA_DEVICE,
+    WA_FA_HUMAN,
+    WA_FA_KERBEROS,
+    WA_FA_MOBILE_PUSH,
+    WA_FA_MULTIFACTOR,
+    WA_FA_OTP,
+    WA_FA_OTP "1",
+    WA_FA_OTP "2",
+    WA_FA_OTP "3",
+    WA_FA_PASSWORD,
+    WA_FA_RANDOM_MULTIFACTOR,
+    WA_FA_UNKNOWN,
+    WA_FA_VOICE,
+    WA_FA_X509,
+    WA_FA_X509 "1",
+    WA_FA_X509 "2",
+    WA_FA_X509 "3"
+};
+
+/* Bit for a known factor code and masks for the classes of factors. */
+#define BIT(code)       ((apr_uint32_t) 1 << (code))
+#define MASK_OTP        (BIT(F_OTP) | BIT(F_OTP1) | BIT(F_OTP2) | BIT(F_OTP3))
+#define MASK_X509                                                       \
+    (BIT(F_X509) | BIT(F_X509_1) | BIT(F_X509_2) | BIT(F_X509_3))
+
+/*
+ * Stores a set of factors that we want to perform operations on.  known is
+ * the bitset of known factor codes and unknown holds any other factor codes
+ * as strings.  order lists the factors in order, as either an enum
+ * factor_code or F_COUNT plus the index into unknown.  It's normally
+ * allocated along with the struct and never changes once the set has been
+ * created, so sets can be compared without allocating memory.
  */
 struct webauth_factors {
-    int multifactor;                    /* "m" (two factors in use) */
-    int random;                         /* "rm" (random multifactor) */
-    apr_array_header_t *factors;        /* Array of char * factor codes. */
+    apr_uint32_t known;                 /* Bitset of known factor codes. */
+    apr_array_header_t *unknown;        /* Array of char * other codes. */
+    int count;                          /* Number of entries in order. */
+    int *order;                         /* Factors in the order added. */
 };
 
 
 /*
- * Scan a set of factors and add a synthesized multifactor factor if it
- * includes authentications from multiple factors.
+ * Return the known factor code for a factor string, or -1 if it's not one of
+ * the factors we know about.
  */
-static void
-maybe_synthesize_multifactor(struct webauth_factors *factors)
+static int
+factor_code(const char *factor)
 {
-    int types, i;
-    const char *factor;
-    bool human    = false;
-    bool mobile   = false;
-    bool otp      = false;
-    bool password = false;
-    bool voice    = false;
-    bool x509     = false;
+    size_t i;
 
-    /* If this set of factors already includes multifactor, do nothing. */
-    if (factors->multifactor)
-        return;
+    for (i = 0; i < ARRAY_SIZE(known_factors); i++)
+        if (strcmp(factor, known_factors[i]) == 0)
+            return (int) i;
+    return -1;
+}
 
-    /* Scan the factors and count how many classes we have. */
-    for (i = 0; i < factors->factors->nelts; i++) {
-        factor = APR_ARRAY_IDX(factors->factors, i, const char *);
-        if      (strcmp(factor, WA_FA_HUMAN)       == 0) human    = true;
-        else if (strcmp(factor, WA_FA_MOBILE_PUSH) == 0) mobile   = true;
-        else if (strcmp(factor, WA_FA_PASSWORD)    == 0) password = true;
-        else if (strcmp(factor, WA_FA_VOICE)       == 0) voice    = true;
-        else if (factor[0] == 'o')                       otp      = true;
-        else if (factor[0] == 'x')                       x509     = true;
-    }
-    types = (int) human + mobile + password + otp + voice + x509;
 
-    /* If we have factors from more than one class, synthesize multifactor. */
-    if (types >= 2) {
-        factors->multifactor = true;
-        APR_ARRAY_PUSH(factors->factors, const char *) = WA_FA_MULTIFACTOR;
-    }
+/*
+ * Return the string for an entry in the order array of a set of factors.
+ */
+static const char *
+factor_string(const struct webauth_factors *factors, int code)
+{
+    if (code < F_COUNT)
+        return known_factors[code];
+    return APR_ARRAY_IDX(factors->unknown, code - F_COUNT, const char *);
 }
 
 
 /*
- * Return a copy of a webauth_factors struct in newly-allocated pool memory.
- * This does not deep-copy the factor strings; eventually, webauth_factors
- * will be opaque so this won't be needed.
+ * Allocate a new, empty set of factors with room for size factors.
  */
 static struct webauth_factors *
-factors_copy(struct webauth_context *ctx,
-             const struct webauth_factors *factors)
+factors_alloc(struct webauth_context *ctx, int size)
 {
-    struct webauth_factors *copy;
+    struct webauth_factors *factors;
+    size_t length;
+
+    length = sizeof(struct webauth_factors) + (size_t) size * sizeof(int);
+    factors = apr_pcalloc(ctx->pool, length);
+    factors->order = (int *) (factors + 1);
+    return factors;
+}
+
+
+/*
+ * Add a factor to the end of a set of factors, which must have room for it.
+ * This doesn't check whether the factor is already present.
+ */
+static void
+factors_add(struct webauth_context *ctx, struct webauth_factors *factors,
+            const char *factor)
+{
+    int code;
+
+    code = factor_code(factor);
+    if (code >= 0)
+        factors->known |= BIT(code);
+    else {
+        if (factors->unknown == NULL)
+            factors->unknown = apr_array_make(ctx->pool, 2, sizeof(char *));
+        code = F_COUNT + factors->unknown->nelts;
+        APR_ARRAY_PUSH(factors->unknown, const char *) = factor;
+    }
+    factors->order[factors->count++] = code;
+}
+
 
-    if (factors == NULL) {
-        copy = apr_pcalloc(ctx->pool, sizeof(struct webauth_factors));
-        copy->factors = apr_array_make(ctx->pool, 1, sizeof(const char *));
+/*
+ * Add an entry from the order array of another set of factors to the end of
+ * a set of factors, which must have room for it.  Known factors don't need to
+ * be looked up again.
+ */
+static void
+factors_add_code(struct webauth_context *ctx, struct webauth_factors *factors,
+                 const struct webauth_factors *source, int code)
+{
+    if (code < F_COUNT) {
+        factors->known |= BIT(code);
+        factors->order[factors->count++] = code;
     } else {
-        copy = apr_pmemdup(ctx->pool, factors, sizeof(*factors));
-        copy->factors = apr_array_copy(ctx->pool, factors->factors);
+        factors_add(ctx, factors, factor_string(source, code));
     }
-    return copy;
 }
 
 
 /*
- * Returns true if the given webauth_factors struct satisfies the provided
- * factor, and false otherwise.  As a special case, factor sets containing
- * multifactor are always considered to satisfy random multifactor as well.
+ * Returns true if a set of factors contains an unknown factor.
  */
 static bool
-factors_satisfies(const struct webauth_factors *factors, const char *factor)
+contains_unknown(const struct webauth_factors *factors, const char *factor)
 {
     int i;
-    const char *candidate;
 
-    if (factors == NULL || apr_is_empty_array(factors->factors))
+    if (factors->unknown == NULL)
         return false;
-    if (strcmp(factor, WA_FA_RANDOM_MULTIFACTOR) == 0 && factors->multifactor)
-        return true;
-    for (i = 0; i < factors->factors->nelts; i++) {
-        candidate = APR_ARRAY_IDX(factors->factors, i, const char *);
-        if (strcmp(factor, candidate) == 0)
+    for (i = 0; i < factors->unknown->nelts; i++)
+        if (strcmp(factor, APR_ARRAY_IDX(factors->unknown, i, char *)) == 0)
             return true;
-    }
     return false;
 }
 
 
+/*
+ * Returns true if a set of factors contains an entry from the order array of
+ * another set of factors.
+ */
+static bool
+contains_code(const struct webauth_factors *factors,
+              const struct webauth_factors *source, int code)
+{
+    if (code < F_COUNT)
+        return (factors->known & BIT(code)) != 0;
+    return contains_unknown(factors, factor_string(source, code));
+}
+
+
+/*
+ * Scan a set of factors and add a synthesized multifactor factor if it
+ * includes authentications from multiple factors.  The set must have room
+ * for one more factor.
+ */
+static void
+maybe_synthesize_multifactor(struct webauth_context *ctx,
+                             struct webauth_factors *factors)
+{
+    int types, i;
+    const char *factor;
+    apr_uint32_t known = factors->known;
+    bool otp  = (known & MASK_OTP) != 0;
+    bool x509 = (known & MASK_X509) != 0;
+
+    /* If this set of factors already includes multifactor, do nothing. */
+    if (known & BIT(F_MULTIFACTOR))
+        return;
+
+    /* Unknown factors may still be OTP or X.509 factors. */
+    if (factors->unknown != NULL)
+        for (i = 0; i < factors->unknown->nelts; i++) {
+            factor = APR_ARRAY_IDX(factors->unknown, i, const char *);
+            if (factor[0] == 'o')
+                otp = true;
+            else if (factor[0] == 'x')
+                x509 = true;
+        }
+
+    /* Count how many classes we have. */
+    types = (int) otp + x509;
+    types += (known & BIT(F_HUMAN)) != 0;
+    types += (known & BIT(F_MOBILE_PUSH)) != 0;
+    types += (known & BIT(F_PASSWORD)) != 0;
+    types += (known & BIT(F_VOICE)) != 0;
+
+    /* If we have factors from more than one class, synthesize multifactor. */
+    if (types >= 2)
+        factors_add_code(ctx, factors, NULL, F_MULTIFACTOR);
+}
+
+
+/*
+ * Return a copy of a webauth_factors struct in newly-allocated pool memory,
+ * with room for extra more factors.  This does not deep-copy the strings of
+ * unknown factors.
+ */
+static struct webauth_factors *
+factors_copy(struct webauth_context *ctx,
+             const struct webauth_factors *factors, int extra)
+{
+    struct webauth_factors *copy;
+
+    if (factors == NULL)
+        return factors_alloc(ctx, extra);
+    copy = factors_alloc(ctx, factors->count + extra);
+    copy->known = factors->known;
+    copy->count = factors->count;
+    memcpy(copy->order, factors->order, (size_t) factors->count * sizeof(int));
+    if (factors->unknown != NULL)
+        copy->unknown = apr_array_copy(ctx->pool, factors->unknown);
+    return copy;
+}
+
+
 /*
  * Return all the factors as a newly pool-allocated array.  We do a deep copy
  * just in case the factors came from a different context.
@@ -128,10 +285,16 @@ apr_array_header_t *
 webauth_factors_array(struct webauth_context *ctx,
                       const struct webauth_factors *factors)
 {
-    if (factors == NULL || apr_is_empty_array(factors->factors))
+    apr_array_header_t *result;
+    int i;
+
+    if (factors == NULL || factors->count == 0)
         return apr_array_make(ctx->pool, 1, sizeof(const char *));
-    else
-        return apr_array_copy(ctx->pool, factors->factors);
+    result = apr_array_make(ctx->pool, factors->count, sizeof(const char *));
+    for (i = 0; i < factors->count; i++)
+        APR_ARRAY_PUSH(result, const char *)
+            = factor_string(factors, factors->order[i]);
+    return result;
 }
 
 
@@ -145,17 +308,14 @@ webauth_factors_contains(struct webauth_context *ctx UNUSED,
                          const struct webauth_factors *factors,
                          const char *factor)
 {
-    int i;
-    const char *candidate;
+    int code;
 
-    if (factors == NULL || apr_is_empty_array(factors->factors))
+    if (factors == NULL || factors->count == 0)
         return false;
-    for (i = 0; i < factors->factors->nelts; i++) {
-        candidate = APR_ARRAY_IDX(factors->factors, i, const char *);
-        if (strcmp(factor, candidate) == 0)
-            return true;
-    }
-    return false;
+    code = factor_code(factor);
+    if (code >= 0)
+        return (factors->known & BIT(code)) != 0;
+    return contains_unknown(factors, factor);
 }
 
 
@@ -170,24 +330,12 @@ webauth_factors_new(struct webauth_context *ctx,
 {
     struct webauth_factors *result;
     int i;
-    const char *factor;
-
-    /* Create the new webauth_factors struct and copy the factors. */
-    result = apr_pcalloc(ctx->pool, sizeof(struct webauth_factors));
-    if (factors != NULL)
-        result->factors = apr_array_copy(ctx->pool, factors);
-    else
-        result->factors = apr_array_make(ctx->pool, 1, sizeof(const char *));
-
-    /* Fill out the multifactor and random multifactor data. */
-    for (i = 0; i < result->factors->nelts; i++) {
-        factor = APR_ARRAY_IDX(result->factors, i, const char *);
-        if (strcmp(factor, WA_FA_MULTIFACTOR) == 0)
-            result->multifactor = true;
-        else if (strcmp(factor, WA_FA_RANDOM_MULTIFACTOR) == 0)
-            result->random = true;
-    }
 
+    if (factors == NULL)
+        return factors_alloc(ctx, 0);
+    result = factors_alloc(ctx, factors->nelts);
+    for (i = 0; i < factors->nelts; i++)
+        factors_add(ctx, result, APR_ARRAY_IDX(factors, i, const char *));
     return result;
 }
 
@@ -203,16 +351,25 @@ webauth_factors_parse(struct webauth_context *ctx, const char *input)
     struct webauth_factors *factors;
     char *copy;
     char *last = NULL;
-    const char *factor;
+    const char *factor, *p;
+    int size;
 
     /*
      * Create an empty webauth_factors struct and return it if the string is
      * NULL or empty.
      */
-    factors = apr_pcalloc(ctx->pool, sizeof(struct webauth_factors));
-    factors->factors = apr_array_make(ctx->pool, 1, sizeof(const char *));
     if (input == NULL || input[0] == '\0')
-        return factors;
+        return factors_alloc(ctx, 0);
+
+    /*
+     * There can't be more factors than one more than the number of commas,
+     * plus we may add multifactor.
+     */
+    size = 2;
+    for (p = input; *p != '\0'; p++)
+        if (*p == ',')
+            size++;
+    factors = factors_alloc(ctx, size);
 
     /*
      * Always duplicate the input string to isolate the newly-created
@@ -220,27 +377,14 @@ webauth_factors_parse(struct webauth_context *ctx, const char *input)
      */
     copy = apr_pstrdup(ctx->pool, input);
 
-    /*
-     * Walk through each factor and add it to the array.  In the process, set
-     * the booleans for multifactor and random multifactor if we see them.
-     */
+    /* Walk through each factor and add it if it's not a duplicate. */
     for (factor = apr_strtok(copy, ",", &last); factor != NULL;
-         factor = apr_strtok(NULL, ",", &last)) {
-
-        /* Only add the factor if it's not a duplicate. */
-        if (webauth_factors_contains(ctx, factors, factor))
-            continue;
-
-        /* Add the factor and set the multifactor and random flags. */
-        APR_ARRAY_PUSH(factors->factors, const char *) = factor;
-        if (strcmp(factor, WA_FA_MULTIFACTOR) == 0)
-            factors->multifactor = true;
-        else if (strcmp(factor, WA_FA_RANDOM_MULTIFACTOR) == 0)
-            factors->random = true;
-    }
+         factor = apr_strtok(NULL, ",", &last))
+        if (!webauth_factors_contains(ctx, factors, factor))
+            factors_add(ctx, factors, factor);
 
     /* See if we should synthesize a multifactor factor. */
-    maybe_synthesize_multifactor(factors);
+    maybe_synthesize_multifactor(ctx, factors);
 
     /* Return the result. */
     return factors;
@@ -258,34 +402,24 @@ webauth_factors_union(struct webauth_context *ctx,
                       const struct webauth_factors *two)
 {
     struct webauth_factors *result;
-    int i;
-    const char *factor;
+    int i, code;
 
     /* Handle trivial cases. */
-    if (one == NULL || apr_is_empty_array(one->factors))
-        return factors_copy(ctx, two);
-    else if (two == NULL || apr_is_empty_array(two->factors))
-        return factors_copy(ctx, one);
-
-    /* We have to merge. */
-    result = factors_copy(ctx, one);
-    for (i = 0; i < two->factors->nelts; i++) {
-        factor = APR_ARRAY_IDX(two->factors, i, const char *);
-
-        /* Check whether the factor already exists in the result. */
-        if (webauth_factors_contains(ctx, result, factor))
-            continue;
-
-        /* Add the new factor to the result. */
-        APR_ARRAY_PUSH(result->factors, const char *) = factor;
-        if (strcmp(factor, WA_FA_MULTIFACTOR) == 0)
-            result->multifactor = true;
-        else if (strcmp(factor, WA_FA_RANDOM_MULTIFACTOR) == 0)
-            result->random = true;
+    if (one == NULL || one->count == 0)
+        return factors_copy(ctx, two, 0);
+    else if (two == NULL || two->count == 0)
+        return factors_copy(ctx, one, 0);
+
+    /* We have to merge, adding the factors from two not already present. */
+    result = factors_copy(ctx, one, two->count + 1);
+    for (i = 0; i < two->count; i++) {
+        code = two->order[i];
+        if (!contains_code(result, two, code))
+            factors_add_code(ctx, result, two, code);
     }
 
     /* See if we should synthesize a multifactor factor. */
-    maybe_synthesize_multifactor(result);
+    maybe_synthesize_multifactor(ctx, result);
 
     /* Return the result. */
     return result;
@@ -301,40 +435,65 @@ char *
 webauth_factors_string(struct webauth_context *ctx,
                        const struct webauth_factors *factors)
 {
-    if (factors == NULL || apr_is_empty_array(factors->factors))
+    const char *factor;
+    char *result, *p;
+    size_t length = 0;
+    int i;
+
+    if (factors == NULL || factors->count == 0)
         return NULL;
-    return apr_array_pstrcat(ctx->pool, factors->factors, ',');
+    for (i = 0; i < factors->count; i++)
+        length += strlen(factor_string(factors, factors->order[i])) + 1;
+    result = apr_palloc(ctx->pool, length);
+    p = result;
+    for (i = 0; i < factors->count; i++) {
+        factor = factor_string(factors, factors->order[i]);
+        if (i > 0)
+            *p++ = ',';
+        length = strlen(factor);
+        memcpy(p, factor, length);
+        p += length;
+    }
+    *p = '\0';
+    return result;
 }
 
 
 /*
  * Given two sets of factors (struct webauth_factors), return true if the
- * first set satisfies the second set, false otherwise.
+ * first set satisfies the second set, false otherwise.  As a special case,
+ * factor sets containing multifactor are always considered to satisfy random
+ * multifactor as well.
  */
 int
 webauth_factors_satisfies(struct webauth_context *ctx UNUSED,
                           const struct webauth_factors *one,
                           const struct webauth_factors *two)
 {
+    apr_uint32_t needed;
     const char *factor;
     int i;
 
     if (two == NULL)
         return true;
-    if (!one->multifactor && two->multifactor)
+    needed = two->known;
+    if (one->known & BIT(F_MULTIFACTOR))
+        needed &= ~BIT(F_RANDOM_MULTIFACTOR);
+    if ((needed & ~one->known) != 0)
         return false;
-    for (i = 0; i < two->factors->nelts; i++) {
-        factor = APR_ARRAY_IDX(two->factors, i, const char *);
-        if (!factors_satisfies(one, factor))
-            return false;
-    }
+    if (two->unknown != NULL)
+        for (i = 0; i < two->unknown->nelts; i++) {
+            factor = APR_ARRAY_IDX(two->unknown, i, const char *);
+            if (!contains_unknown(one, factor))
+                return false;
+        }
     return true;
 }
 
 
 /*
  * Given two sets of factors (struct webauth_factor), return a new set
- * containing all factors present in the first that are not present in the
+ * containing all factors present in the first that are not satisfied by the
  * second.  This does not synthesize multifactor in the result.
  */
 struct webauth_factors *
@@ -343,34 +502,29 @@ webauth_factors_subtract(struct webauth_context *ctx,
                          const struct webauth_factors *two)
 {
     struct webauth_factors *result;
-    const char *factor;
-    int i;
+    apr_uint32_t satisfied;
+    int i, code;
 
     /* Handle some trivial cases. */
     if (one == NULL)
         return NULL;
-    if (two == NULL) {
-        result = apr_pmemdup(ctx->pool, one, sizeof(struct webauth_factors));
-        result->factors = apr_array_copy(ctx->pool, one->factors);
-        return result;
-    }
-
-    /* Create the new set of factors that we will return. */
-    result = apr_pcalloc(ctx->pool, sizeof(struct webauth_factors));
-    result->factors = apr_array_make(ctx->pool, 2, sizeof(const char *));
-
-    /*
-     * Walk the list of factors in one and, for each, check whether it's
-     * satisifed by two.  This is O(n^2), but factor lists tend to be small.
-     */
-    for (i = 0; i < one->factors->nelts; i++) {
-        factor = APR_ARRAY_IDX(one->factors, i, const char *);
-        if (!factors_satisfies(two, factor)) {
-            APR_ARRAY_PUSH(result->factors, const char *) = factor;
-            if (strcmp(factor, WA_FA_MULTIFACTOR) == 0)
-                result->multifactor = true;
-            if (strcmp(factor, WA_FA_RANDOM_MULTIFACTOR) == 0)
-                result->random = true;
+    if (two == NULL)
+        return factors_copy(ctx, one, 0);
+
+    /* Multifactor satisfies random multifactor. */
+    satisfied = two->known;
+    if (satisfied & BIT(F_MULTIFACTOR))
+        satisfied |= BIT(F_RANDOM_MULTIFACTOR);
+
+    /* Keep each factor in one that isn't satisfied by two. */
+    result = factors_alloc(ctx, one->count);
+    for (i = 0; i < one->count; i++) {
+        code = one->order[i];
+        if (code < F_COUNT) {
+            if ((satisfied & BIT(code)) == 0)
+                factors_add_code(ctx, result, one, code);
+        } else if (!contains_unknown(two, factor_string(one, code))) {
+            factors_add_code(ctx, result, one, code);
         }
     }
     return result;
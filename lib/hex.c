@@ -1,6 +1,12 @@
 /*
  * General WebAuth utility functions.
  *
+ * Hex encoding and decoding are used for the ASCII forms of keys and other
+ * data in attribute encodings, such as keyring files.  Where the compiler
+ * supports it, there are SSE2 and AVX2 implementations that handle 16 or 32
+ * bytes at a time, chosen at runtime based on the CPU, and the portable code
+ * handles everything else and the bytes left over.
+ *
  * Written by Roland Schemers
  * Copyright 2002, 2009, 2010, 2014
  *     The Board of Trustees of the Leland Stanford Junior University
@@ -12,22 +18,265 @@
 #include <portable/system.h>
 
 #include <assert.h>
-#include <ctype.h>
+#if HAVE_X86_SIMD
+# include <immintrin.h>
+#endif
 
 #include <lib/internal.h>
 #include <webauth/basic.h>
 
+/* Used for hex encoding. */
+static const char hex[] = "0123456789abcdef";
+
 /*
- * Converts a hex digit to a number.   This macro will return non-sensical
- * results if given invalid hex digits.
+ * Used for hex decoding.  Maps each character to its value as a hex digit,
+ * or to 0xff if it is not a hex digit.
  */
-#define HEX2INT(c) \
-    (isdigit(c) ? ((c) - '0') \
-                : (((c) >= 'A' && (c) <= 'F') ? ((c) - 'A' + 10) \
-                                              : ((c) - 'a' + 10)))
+#define X 0xff
+static const unsigned char unhex[256] = {
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,
+    X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X
+};
+#undef X
 
-/* Used for hex encoding. */
-static char hex[] = "0123456789abcdef";
+
+#if HAVE_X86_SIMD
+
+/*
+ * Convert each byte of a vector of values from 0 to 15 to the corresponding
+ * lowercase hex digit: '0' plus the value, plus the distance from '9' + 1 to
+ * 'a' if the value is more than 9.
+ */
+static __m128i
+sse2_hex_digits(__m128i n)
+{
+    __m128i letter;
+
+    letter = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+    letter = _mm_and_si128(letter, _mm_set1_epi8('a' - '9' - 1));
+    n = _mm_add_epi8(n, _mm_set1_epi8('0'));
+    return _mm_add_epi8(n, letter);
+}
+
+
+/*
+ * Hex-encode length bytes, which must be a multiple of 16, from the end of
+ * the input backwards so that the output may overlap the input.
+ */
+static void
+sse2_hex_encode(const unsigned char *input, size_t length, char *output)
+{
+    __m128i data, high, low, mask;
+
+    mask = _mm_set1_epi8(0x0f);
+    while (length > 0) {
+        length -= 16;
+        data = _mm_loadu_si128((const __m128i *) (input + length));
+        high = sse2_hex_digits(_mm_and_si128(_mm_srli_epi16(data, 4), mask));
+        low = sse2_hex_digits(_mm_and_si128(data, mask));
+        _mm_storeu_si128((__m128i *) (output + length * 2),
+                         _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i *) (output + length * 2 + 16),
+                         _mm_unpackhi_epi8(high, low));
+    }
+}
+
+
+/*
+ * The same as sse2_hex_digits, but for 32 bytes at a time.
+ */
+__attribute__((__target__("avx2")))
+static __m256i
+avx2_hex_digits(__m256i n)
+{
+    __m256i letter;
+
+    letter = _mm256_cmpgt_epi8(n, _mm256_set1_epi8(9));
+    n = _mm256_add_epi8(n, _mm256_set1_epi8('0'));
+    letter = _mm256_and_si256(letter, _mm256_set1_epi8('a' - '9' - 1));
+    return _mm256_add_epi8(n, letter);
+}
+
+
+/*
+ * The same as sse2_hex_encode, but for a multiple of 32 bytes.  The unpack
+ * instructions work within each 128-bit lane, so the lanes have to be put
+ * back in order before storing.
+ */
+__attribute__((__target__("avx2")))
+static void
+avx2_hex_encode(const unsigned char *input, size_t length, char *output)
+{
+    __m256i data, high, low, first, second, mask;
+
+    mask = _mm256_set1_epi8(0x0f);
+    while (length > 0) {
+        length -= 32;
+        data = _mm256_loadu_si256((const __m256i *) (input + length));
+        high = _mm256_and_si256(_mm256_srli_epi16(data, 4), mask);
+        high = avx2_hex_digits(high);
+        low = avx2_hex_digits(_mm256_and_si256(data, mask));
+        first = _mm256_unpacklo_epi8(high, low);
+        second = _mm256_unpackhi_epi8(high, low);
+        _mm256_storeu_si256((__m256i *) (output + length * 2),
+                            _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256((__m256i *) (output + length * 2 + 32),
+                            _mm256_permute2x128_si256(first, second, 0x31));
+    }
+}
+
+
+/*
+ * Convert a vector of hex digits to their values, setting the bytes of
+ * *invalid for any characters that are not hex digits.  Uppercase and
+ * lowercase letters are folded together.  Signed comparisons are fine since
+ * any byte with the high bit set compares less than every digit.
+ */
+static __m128i
+sse2_hex_values(__m128i c, __m128i *invalid)
+{
+    __m128i digit, letter, lower;
+
+    digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                          _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                           _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    *invalid = _mm_or_si128(*invalid,
+                            _mm_andnot_si128(_mm_or_si128(digit, letter),
+                                             _mm_set1_epi8(-1)));
+    c = _mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0')));
+    lower = _mm_and_si128(letter,
+                          _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)));
+    return _mm_or_si128(c, lower);
+}
+
+
+/*
+ * Combine pairs of hex digit values into bytes.  Each 16-bit element holds
+ * the value of the high digit in its low byte and the value of the low digit
+ * in its high byte, and ends up holding the decoded byte.
+ */
+static __m128i
+sse2_hex_combine(__m128i values)
+{
+    __m128i high, low;
+
+    high = _mm_slli_epi16(_mm_and_si128(values, _mm_set1_epi16(0x0f)), 4);
+    low = _mm_srli_epi16(values, 8);
+    return _mm_or_si128(high, low);
+}
+
+
+/*
+ * Hex-decode length characters, which must be a multiple of 32, going
+ * forward so that the output may overlap the input.  Returns false if any
+ * character is not a hex digit, in which case the output is garbage.
+ */
+static bool
+sse2_hex_decode(const unsigned char *input, size_t length,
+                unsigned char *output)
+{
+    __m128i first, second, invalid;
+    size_t i;
+
+    invalid = _mm_setzero_si128();
+    for (i = 0; i < length; i += 32) {
+        first = _mm_loadu_si128((const __m128i *) (input + i));
+        second = _mm_loadu_si128((const __m128i *) (input + i + 16));
+        first = sse2_hex_combine(sse2_hex_values(first, &invalid));
+        second = sse2_hex_combine(sse2_hex_values(second, &invalid));
+        _mm_storeu_si128((__m128i *) (output + i / 2),
+                         _mm_packus_epi16(first, second));
+    }
+    return _mm_movemask_epi8(invalid) == 0;
+}
+
+
+/*
+ * The same as sse2_hex_values, but for 32 bytes at a time.
+ */
+__attribute__((__target__("avx2")))
+static __m256i
+avx2_hex_values(__m256i c, __m256i *invalid)
+{
+    __m256i digit, letter, lower, valid;
+
+    digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+                             _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+    lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    letter = _mm256_and_si256(
+        _mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+    valid = _mm256_or_si256(digit, letter);
+    *invalid = _mm256_or_si256(*invalid,
+                               _mm256_andnot_si256(valid,
+                                                   _mm256_set1_epi8(-1)));
+    c = _mm256_and_si256(digit, _mm256_sub_epi8(c, _mm256_set1_epi8('0')));
+    lower = _mm256_and_si256(letter,
+                             _mm256_sub_epi8(lower,
+                                             _mm256_set1_epi8('a' - 10)));
+    return _mm256_or_si256(c, lower);
+}
+
+
+/*
+ * The same as sse2_hex_combine, but for 32 bytes at a time.
+ */
+__attribute__((__target__("avx2")))
+static __m256i
+avx2_hex_combine(__m256i values)
+{
+    __m256i high, low;
+
+    high = _mm256_and_si256(values, _mm256_set1_epi16(0x0f));
+    high = _mm256_slli_epi16(high, 4);
+    low = _mm256_srli_epi16(values, 8);
+    return _mm256_or_si256(high, low);
+}
+
+
+/*
+ * The same as sse2_hex_decode, but for a multiple of 64 characters.  The pack
+ * instruction works within each 128-bit lane, so the 64-bit quarters have to
+ * be put back in order before storing.
+ */
+__attribute__((__target__("avx2")))
+static bool
+avx2_hex_decode(const unsigned char *input, size_t length,
+                unsigned char *output)
+{
+    __m256i first, second, packed, invalid;
+    size_t i;
+
+    invalid = _mm256_setzero_si256();
+    for (i = 0; i < length; i += 64) {
+        first = _mm256_loadu_si256((const __m256i *) (input + i));
+        second = _mm256_loadu_si256((const __m256i *) (input + i + 32));
+        first = avx2_hex_combine(avx2_hex_values(first, &invalid));
+        second = avx2_hex_combine(avx2_hex_values(second, &invalid));
+        packed = _mm256_packus_epi16(first, second);
+        packed = _mm256_permute4x64_epi64(packed, 0xd8);
+        _mm256_storeu_si256((__m256i *) (output + i / 2), packed);
+    }
+    return _mm256_movemask_epi8(invalid) == 0;
+}
+
+#endif /* HAVE_X86_SIMD */
 
 
 /*
@@ -63,29 +312,51 @@ wai_hex_decoded_length(size_t length, size_t *out_length)
  * the buffer pointed to by output.  Store the encoded length in output_len.
  * output must point to at least max_output_len bytes of space.  Returns a
  * WA_ERR code.
+ *
+ * The encoding is done from the end backwards so that output may be the same
+ * as input.  The bytes past the last multiple of the vector size are done
+ * first, and then the vector code handles the rest.
  */
 int
 wai_hex_encode(const char *input, size_t input_len, char *output,
                size_t *output_len, size_t max_output_len)
 {
-    size_t out_len;
-    unsigned char *s;
+    size_t out_len, blocks;
+    const unsigned char *s;
     unsigned char *d;
+#if HAVE_X86_SIMD
+    bool avx2;
+#endif
 
     *output_len = 0;
     out_len = 2 * input_len;
-    s = (unsigned char *) input + input_len - 1;
-    d = (unsigned char *) output + out_len - 1;
-
     if (max_output_len < out_len)
         return WA_ERR_NO_ROOM;
 
-    while (input_len) {
+    /* Determine how much the vector code can handle. */
+    blocks = 0;
+#if HAVE_X86_SIMD
+    avx2 = input_len >= 32 && __builtin_cpu_supports("avx2");
+    blocks = input_len - input_len % (avx2 ? 32 : 16);
+#endif
+
+    /* Encode the remaining bytes at the end. */
+    s = (const unsigned char *) input + input_len - 1;
+    d = (unsigned char *) output + out_len - 1;
+    while (input_len > blocks) {
         *d-- = hex[*s & 15];
         *d-- = hex[*s-- >> 4];
         input_len--;
     }
 
+    /* Encode the rest a vector at a time. */
+#if HAVE_X86_SIMD
+    if (avx2)
+        avx2_hex_encode((const unsigned char *) input, blocks, output);
+    else if (blocks > 0)
+        sse2_hex_encode((const unsigned char *) input, blocks, output);
+#endif
+
     *output_len = out_len;
     return WA_ERR_NONE;
 }
@@ -102,6 +373,7 @@ wai_hex_decode(char *input, size_t input_len, char *output,
 {
     unsigned char *s = (unsigned char *) input;
     unsigned char *d = (unsigned char *) output;
+    unsigned char high, low;
     size_t n;
 
     assert(input != NULL);
@@ -121,14 +393,34 @@ wai_hex_decode(char *input, size_t input_len, char *output,
     if (max_output_len < (input_len / 2))
         return WA_ERR_NO_ROOM;
 
+    /* Decode as much as possible a vector at a time. */
     n = input_len;
+#if HAVE_X86_SIMD
+    if (n >= 64 && __builtin_cpu_supports("avx2")) {
+        if (!avx2_hex_decode(s, n - n % 64, d))
+            return WA_ERR_CORRUPT;
+        s += n - n % 64;
+        d += (n - n % 64) / 2;
+        n %= 64;
+    }
+    if (n >= 32) {
+        if (!sse2_hex_decode(s, n - n % 32, d))
+            return WA_ERR_CORRUPT;
+        s += n - n % 32;
+        d += (n - n % 32) / 2;
+        n %= 32;
+    }
+#endif
+
+    /* Decode the remaining characters. */
     while (n) {
-        if (isxdigit(*s) && isxdigit(*(s + 1))) {
-            *d++ = (unsigned char) ((HEX2INT(*s) << 4) + HEX2INT(*(s + 1)));
-            s += 2;
-            n -= 2;
-        } else
+        high = unhex[s[0]];
+        low = unhex[s[1]];
+        if (high == 0xff || low == 0xff)
             return WA_ERR_CORRUPT;
+        *d++ = (unsigned char) ((high << 4) | low);
+        s += 2;
+        n -= 2;
     }
     *output_len = input_len / 2;
 
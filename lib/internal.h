@@ -20,11 +20,19 @@
 #include <apr_tables.h>         /* apr_array_header_t */
 #include <apr_xml.h>            /* apr_xml_elem */
 #include <webauth/basic.h>      /* enum webauth_log_level, webauth_log_func */
+#include <webauth/krb5.h>       /* webauth_krb5_ticket_{get,put}_func */
 
+struct wai_job;
+struct wai_key_state;
+struct wai_krb5_cache;
+struct wai_user_info_call;
+struct webauth_key;
 struct webauth_keyring;
 struct webauth_token;
 struct webauth_token_request;
+struct webauth_user_cache;
 struct webauth_user_info;
+struct webauth_user_pool;
 struct webauth_user_validate;
 struct webauth_webkdc_login_request;
 struct webauth_webkdc_login_response;
@@ -39,11 +47,28 @@ struct wai_log_callback {
     void *data;
 };
 
+/*
+ * A function run as a background job.  It's called with the job's WebAuth
+ * context and the data passed to wai_job_start and returns a WebAuth status.
+ */
+typedef int (*wai_job_func)(struct webauth_context *, void *);
+
+/*
+ * Callbacks for a service ticket cache, set by webauth_krb5_set_ticket_cache.
+ * Both callbacks are set or neither is.
+ */
+struct wai_ticket_cache {
+    webauth_krb5_ticket_get_func get;
+    webauth_krb5_ticket_put_func put;
+    void *data;
+};
+
 /*
  * The internal context struct, which holds any state information required for
  * general WebAuth library interfaces.
  */
 struct webauth_context {
+    apr_pool_t *base;           /* Pool holding the context itself. */
     apr_pool_t *pool;           /* Pool used for all memory allocations. */
     const char *error;          /* Error message from last failure. */
     int status;                 /* WebAuth status code from last failure. */
@@ -54,6 +79,13 @@ struct webauth_context {
     struct wai_log_callback info;
     struct wai_log_callback trace;
 
+    /*
+     * Maximum number of keys to try when decrypting a token (0 for no limit)
+     * and the number tried for the most recent token.
+     */
+    unsigned long decrypt_limit;
+    unsigned long decrypt_trials;
+
     /* The below are used only for the WebKDC functions. */
 
     /* General WebKDC configuration. */
@@ -61,6 +93,16 @@ struct webauth_context {
 
     /* Configuration for contacting the user metadata service. */
     struct webauth_user_config *user;
+
+    /* Cache of service tickets obtained from imported credentials. */
+    struct wai_ticket_cache tickets;
+
+    /*
+     * Kerberos library context shared by all webauth_krb5 contexts created
+     * from this context if webauth_krb5_reuse_context was called.  This is
+     * allocated from base, so it survives webauth_context_reset.
+     */
+    struct wai_krb5_cache *krb5;
 };
 
 /*
@@ -106,6 +148,12 @@ enum wai_encoding_type {
  * inside the repeated structure.
  *
  * Only one level of nesting of WA_TYPE_REPEAT is supported.
+ *
+ * Every rule in a table generated by encoding-rules also points to a lookup
+ * function for that table, which maps an attribute name to the index of its
+ * rule or returns -1 if there is no such rule.  The decoder uses this to
+ * match each attribute in the encoded data to its rule without building a
+ * hash.  Tables without a lookup function are searched linearly.
  */
 struct wai_encoding {
     const char *attr;                   /* Attribute name in encoding */
@@ -118,10 +166,45 @@ struct wai_encoding {
     size_t len_offset;                  /* Offset of data value length */
     size_t size;                        /* Size of nested structure */
     const struct wai_encoding *repeat;  /* Rules for nested structure */
+    int (*lookup)(const char *, size_t); /* Map attribute name to rule */
 };
 
 /* Used as the terminator for an encoding specification. */
-#define WA_ENCODING_END { NULL, NULL, 0, false, false, false, 0, 0, 0, NULL }
+#define WA_ENCODING_END \
+    { NULL, NULL, 0, false, false, false, 0, 0, 0, NULL, NULL }
+
+/*
+ * Limits on the encoding rules for a single struct.  The decoder tracks the
+ * attributes it has seen in a 64-bit mask and the repeated attributes in a
+ * fixed-size array.  The encoding-rules script enforces both.
+ */
+#define WA_ENCODING_MAX_RULES   64
+#define WA_ENCODING_MAX_REPEATS 4
+
+/*
+ * The space around encoded token attributes needed to encrypt them in place:
+ * the key hint, nonce, and HMAC before them and at most one AES block of
+ * padding after them.  wai_encode_token reserves this space so that
+ * wai_token_encrypt doesn't have to copy the attributes.
+ */
+#define WA_TOKEN_HEADER_SIZE 40
+#define WA_TOKEN_PADDING_MAX 16
+
+/*
+ * One token in a batch passed to wai_token_decrypt_batch.  The caller fills
+ * in the input and buffer and sets status to WA_ERR_NONE, or sets status and
+ * error to skip the token.  The remaining members are set by decryption.
+ */
+struct wai_token_decrypt {
+    const void *input;          /* Encrypted token. */
+    size_t input_len;           /* Length of encrypted token. */
+    void *buffer;               /* Space for decryption, input_len bytes. */
+    void *output;               /* Decrypted attributes, inside buffer. */
+    size_t output_len;          /* Length of decrypted attributes. */
+    unsigned long trials;       /* Number of keys tried. */
+    int status;                 /* WebAuth status of decryption. */
+    const char *error;          /* Error message if status is an error. */
+};
 
 /*
  * Encoding rules.  These are defined in the lib/rules-*.c files, which in
@@ -264,6 +347,14 @@ struct wai_webkdc_login_state {
 
     /* Permitted authorization identities from the identity ACL. */
     const apr_array_header_t *permitted_authz;
+
+    /*
+     * Deadline for calls made in background jobs, or 0 if calls are made one
+     * at a time, and the user information call started before the login.
+     */
+    time_t deadline;
+    struct wai_job *info_job;
+    struct wai_user_info_call *info_call;
 };
 
 BEGIN_DECLS
@@ -306,7 +397,8 @@ bool wai_buffer_find_string(struct wai_buffer *, const char *, size_t start,
 
 /*
  * Decode the binary attribute representation into the struct pointed to by
- * data following the provided rules.
+ * data following the provided rules.  The input is copied once into pool
+ * memory and decoded strings and data point into that copy.
  */
 int wai_decode(struct webauth_context *, const struct wai_encoding *,
                const void *input, size_t, void *data)
@@ -314,11 +406,13 @@ int wai_decode(struct webauth_context *, const struct wai_encoding *,
 
 /*
  * Similar to wai_decode, but decodes a WebAuth token, including handling the
- * determination of the type of the token from the attributes.  Uses the
- * memory pool from the WebAuth context.  This does not perform any sanity
- * checking on the token data; that must be done by higher-level code.
+ * determination of the type of the token from the attributes.  Unlike
+ * wai_decode, the input is not copied.  It is modified in place and the
+ * strings and data in the decoded token point into it, so it must live at
+ * least as long as the token.  This does not perform any sanity checking on
+ * the token data; that must be done by higher-level code.
  */
-int wai_decode_token(struct webauth_context *, const void *input, size_t,
+int wai_decode_token(struct webauth_context *, void *input, size_t,
                      struct webauth_token *)
     __attribute__((__nonnull__));
 
@@ -333,8 +427,11 @@ int wai_encode(struct webauth_context *, const struct wai_encoding *,
 
 /*
  * Similar to wai_encode, but encodes a WebAuth token, including adding the
- * appropriate encoding of the token type.  This does not perform any sanity
- * checking on the token data; that must be done by higher-level code.
+ * appropriate encoding of the token type.  The result is not nul-terminated
+ * and has WA_TOKEN_HEADER_SIZE bytes of space before it and
+ * WA_TOKEN_PADDING_MAX bytes after it in the same allocation, for use with
+ * wai_token_encrypt.  This does not perform any sanity checking on the token
+ * data; that must be done by higher-level code.
  */
 int wai_encode_token(struct webauth_context *,
                      const struct webauth_token *, void **, size_t *)
@@ -438,6 +535,98 @@ int wai_hex_decode(char *input, size_t input_len, char *output,
                    size_t *output_length, size_t max_output_len)
     __attribute__((__nonnull__));
 
+/*
+ * Returns the length of the base64 encoding of data of the given length, not
+ * including room for a nul terminator.
+ */
+size_t wai_base64_encoded_length(size_t length)
+    __attribute__((__const__));
+
+/*
+ * Returns the maximum length of the data encoded by base64 of the given
+ * length.
+ */
+size_t wai_base64_decoded_length(size_t length)
+    __attribute__((__const__));
+
+/*
+ * Base64-encodes the given data into output, which must have room for
+ * wai_base64_encoded_length(length) plus one bytes.  The result is padded and
+ * nul-terminated.  Returns the length of the encoding.
+ */
+size_t wai_base64_encode(const void *input, size_t length, char *output)
+    __attribute__((__nonnull__));
+
+/*
+ * Base64-decodes the given data into output, which must have room for
+ * wai_base64_decoded_length(length) bytes.  Like apr_base64_decode, decoding
+ * stops at the first character that isn't in the base64 alphabet, including
+ * padding.  Returns the length of the decoded data.
+ */
+size_t wai_base64_decode(const char *input, size_t length, void *output)
+    __attribute__((__nonnull__));
+
+/*
+ * Create a background job on behalf of a WebAuth context, with its own
+ * context and pool that last until both the job has finished and the caller's
+ * pool has been cleared.  Data passed to the job should be allocated from the
+ * job's context, returned by wai_job_context, unless the caller keeps it
+ * alive until then.
+ */
+int wai_job_create(struct webauth_context *, struct wai_job **)
+    __attribute__((__nonnull__));
+struct webauth_context *wai_job_context(struct wai_job *)
+    __attribute__((__nonnull__));
+
+/* Run a function in the background, or immediately if that isn't possible. */
+void wai_job_start(struct wai_job *, wai_job_func, void *data)
+    __attribute__((__nonnull__(1, 2)));
+
+/*
+ * Wait for a job until the deadline (0 for no limit), passing on its log
+ * messages and errors.  Returns the job's status, or WA_ERR_REMOTE_TIMEOUT if
+ * it didn't finish in time.
+ */
+int wai_job_wait(struct webauth_context *, struct wai_job *, time_t deadline)
+    __attribute__((__nonnull__));
+
+/*
+ * Precomputed crypto state for a key, kept by keyrings for their keys so that
+ * encrypting or decrypting a token doesn't redo the key setup.
+ * wai_key_state_new returns NULL for a key that can't be used.
+ * wai_key_state_valid returns true if the state was computed for that key
+ * with its current key material, and wai_key_state_free wipes a state that
+ * is no longer needed.  Otherwise, states are wiped when their pool is
+ * cleared.
+ */
+struct wai_key_state *wai_key_state_new(struct webauth_context *,
+                                        const struct webauth_key *)
+    __attribute__((__nonnull__));
+bool wai_key_state_valid(const struct wai_key_state *,
+                         const struct webauth_key *)
+    __attribute__((__nonnull__));
+void wai_key_state_free(struct wai_key_state *)
+    __attribute__((__nonnull__));
+
+/*
+ * Store in keys the keys of a keyring in the order in which they should be
+ * tried to decrypt a token with the given key hint, stopping after max keys,
+ * and return the number of keys stored.  The best key for the hint comes
+ * first, followed by the other keys by increasing distance from it in
+ * valid_after order.
+ */
+size_t wai_keyring_decrypt_keys(const struct webauth_keyring *, time_t hint,
+                                const struct webauth_key **keys, size_t max)
+    __attribute__((__nonnull__));
+
+/*
+ * Return the crypto state the keyring keeps for one of its keys, or NULL if
+ * it has none.  The caller should check it with wai_key_state_valid.
+ */
+const struct wai_key_state *wai_keyring_state(const struct webauth_keyring *,
+                                             const struct webauth_key *)
+    __attribute__((__nonnull__));
+
 /*
  * Log a message at various possible log levels.  This is controlled by the
  * configured callback.  If the callback is NULL, the message will be silently
@@ -462,6 +651,41 @@ void wai_log_error(struct webauth_context *, enum webauth_log_level, int,
                    const char *format, ...)
     __attribute__((__nonnull__(1), __format__(printf, 4, 5)));
 
+/*
+ * Encrypt encoded token attributes in place.  The attributes must have
+ * WA_TOKEN_HEADER_SIZE bytes of space before them and WA_TOKEN_PADDING_MAX
+ * bytes after them in the same allocation, as returned by wai_encode_token.
+ * Stores a pointer to the start of the token, WA_TOKEN_HEADER_SIZE bytes
+ * before the attributes, and its length.
+ */
+int wai_token_encrypt(struct webauth_context *, void *input, size_t,
+                      void **output, size_t *output_len,
+                      const struct webauth_keyring *)
+    __attribute__((__nonnull__));
+
+/*
+ * Decrypt a token into a caller-provided buffer, which must be at least as
+ * long as the token and must not overlap it.  Stores a pointer to the
+ * decrypted attributes, which will be somewhere inside the buffer, and their
+ * length.  This avoids the allocation and copy of webauth_token_decrypt.
+ */
+int wai_token_decrypt(struct webauth_context *, const void *input, size_t,
+                      void *buffer, void **output, size_t *output_len,
+                      const struct webauth_keyring *)
+    __attribute__((__nonnull__));
+
+/*
+ * Decrypt several tokens with the same keyring, sharing the key search
+ * between tokens with the same key hint.  Each token's result, error
+ * message, and number of keys tried is stored in its struct.  Returns
+ * WA_ERR_NONE if every token decrypted and otherwise the status of the first
+ * that didn't, with the context error set to its message.
+ */
+int wai_token_decrypt_batch(struct webauth_context *,
+                            struct wai_token_decrypt *, size_t,
+                            const struct webauth_keyring *)
+    __attribute__((__nonnull__));
+
 /*
  * Map a token type code to the corresponding encoding rule set and data
  * pointer.  Takes the token struct (which must have the type filled out), and
@@ -508,6 +732,39 @@ int wai_token_merge_webkdc_proxy_factor(struct webauth_context *,
                                         struct webauth_token **)
     __attribute__((__nonnull__(1, 2, 4)));
 
+/*
+ * Look up, store, and flush results in the user information result cache of
+ * the context's user information configuration, if any.  wai_user_cache_get
+ * returns true and sets the last argument to a copy of the result if one is
+ * cached for those arguments.  wai_user_cache_flush drops all results for a
+ * user.
+ */
+bool wai_user_cache_get(struct webauth_context *, const char *user,
+                        const char *ip, int random_mf, const char *url,
+                        const char *factors, struct webauth_user_info **)
+    __attribute__((__nonnull__(1, 2, 7)));
+void wai_user_cache_put(struct webauth_context *, const char *user,
+                        const char *ip, int random_mf, const char *url,
+                        const char *factors, const struct webauth_user_info *)
+    __attribute__((__nonnull__(1, 2, 7)));
+void wai_user_cache_flush(struct webauth_context *, const char *user)
+    __attribute__((__nonnull__));
+
+/*
+ * Take or drop a reference to a shared connection pool or result cache.
+ * webauth_user_config takes one for the context it configures, which is
+ * dropped when that context's pool is cleared, and the pool or cache is
+ * freed when the last reference is dropped.
+ */
+void wai_user_cache_hold(struct webauth_user_cache *)
+    __attribute__((__nonnull__));
+void wai_user_cache_release(struct webauth_user_cache *)
+    __attribute__((__nonnull__));
+void wai_user_pool_hold(struct webauth_user_pool *)
+    __attribute__((__nonnull__));
+void wai_user_pool_release(struct webauth_user_pool *)
+    __attribute__((__nonnull__));
+
 /*
  * Make a remctl call to the user information service and return the results
  * in the provided buffer.
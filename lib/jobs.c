@@ -0,0 +1,416 @@
+/*
+ * Background jobs for calls to remote services.
+ *
+ * Some WebKDC operations call remote services that don't depend on each
+ * other, such as the KDC and the user information service, and making those
+ * calls one after another makes a login take the sum of their latencies.  A
+ * job runs a function in a separate thread with its own WebAuth context so
+ * that the caller can do other work in the meantime and then collect the
+ * result, waiting for it up to a deadline.
+ *
+ * The job's context has its own root pool, since APR pools that share an
+ * allocator can't be used from two threads at once, and its own copy of the
+ * user information service configuration, which is all the remote calls made
+ * in jobs need.  That copy holds references to any shared connection pool and
+ * result cache, so they stay around while an abandoned job still uses them
+ * even if the server configuration that created them is freed.  It has no
+ * logging callbacks, since the caller's callbacks may refer to a request
+ * that's gone by the time an abandoned job finishes.  Instead, log messages
+ * are saved and passed to the caller's callbacks when the result is
+ * collected.
+ *
+ * A job that misses its deadline is abandoned and keeps running until its
+ * remote call returns.  The job's memory is freed when both the job has
+ * finished and the caller's pool has been cleared, whichever is last, so
+ * anything the job returns stays valid until the caller's pool is cleared.
+ * The thread is created from the job's pool, and APR still uses that memory
+ * after the thread function returns, so the thread is joined before the pool
+ * is destroyed.  If the thread itself drops the last reference, it can't join
+ * itself, so it puts the job on a list of finished jobs instead, and the
+ * next call to wai_job_create joins and frees it.
+ *
+ * If APR doesn't support threads, or a thread can't be created, the job runs
+ * immediately when started.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+#include <portable/system.h>
+
+#include <apr_atomic.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
+
+#include <lib/internal.h>
+#include <util/macros.h>
+#include <webauth/basic.h>
+#include <webauth/webkdc.h>
+
+/* A log message saved by a job. */
+struct saved_message {
+    enum webauth_log_level level;
+    const char *message;
+};
+
+/*
+ * A job.  The pool holds everything, including the job's WebAuth context and
+ * the thread, if one was created.  done and refs are protected by the mutex
+ * if there is one.  refs counts the caller and the thread, if the thread is
+ * running.  next links jobs on the list of finished jobs.
+ */
+struct wai_job {
+    apr_pool_t *pool;
+    struct webauth_context *ctx;
+    wai_job_func func;
+    void *data;
+    int status;
+    apr_array_header_t *messages;       /* Array of struct saved_message */
+    bool done;
+    unsigned int refs;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *finished;
+    apr_thread_t *thread;
+    struct wai_job *next;
+#endif
+};
+
+#if APR_HAS_THREADS
+/*
+ * Jobs whose thread dropped the last reference, waiting to be joined and
+ * freed.  Jobs are pushed with compare-and-swap and the whole list is taken
+ * at once with an exchange, so no lock is needed.
+ */
+static volatile void *finished_jobs = NULL;
+#endif
+
+
+/*
+ * Save a log message from the job so that it can be logged in the caller's
+ * context.  There is one callback per log level.
+ */
+static void
+save_message(struct webauth_context *ctx, struct wai_job *job,
+             enum webauth_log_level level, const char *message)
+{
+    struct saved_message *saved;
+
+    saved = apr_array_push(job->messages);
+    saved->level = level;
+    saved->message = apr_pstrdup(ctx->pool, message);
+}
+
+static void
+save_trace(struct webauth_context *ctx, void *data, const char *message)
+{
+    save_message(ctx, data, WA_LOG_TRACE, message);
+}
+
+static void
+save_info(struct webauth_context *ctx, void *data, const char *message)
+{
+    save_message(ctx, data, WA_LOG_INFO, message);
+}
+
+static void
+save_notice(struct webauth_context *ctx, void *data, const char *message)
+{
+    save_message(ctx, data, WA_LOG_NOTICE, message);
+}
+
+static void
+save_warn(struct webauth_context *ctx, void *data, const char *message)
+{
+    save_message(ctx, data, WA_LOG_WARN, message);
+}
+
+
+/*
+ * Free a job, first joining its thread if it has one.
+ */
+static void
+free_job(struct wai_job *job)
+{
+#if APR_HAS_THREADS
+    apr_status_t code;
+
+    if (job->thread != NULL)
+        apr_thread_join(&code, job->thread);
+#endif
+    apr_pool_destroy(job->pool);
+}
+
+
+#if APR_HAS_THREADS
+/*
+ * Join and free all the jobs on the list of finished jobs.
+ */
+static void
+reap_jobs(void)
+{
+    struct wai_job *job, *next;
+
+    job = apr_atomic_xchgptr(&finished_jobs, NULL);
+    for (; job != NULL; job = next) {
+        next = job->next;
+        free_job(job);
+    }
+}
+
+
+/*
+ * Put a job whose thread dropped the last reference on the list of finished
+ * jobs.  This is called from that thread, which can't join itself.
+ */
+static void
+retire_job(struct wai_job *job)
+{
+    void *head;
+
+    do {
+        head = apr_atomic_casptr(&finished_jobs, NULL, NULL);
+        job->next = head;
+    } while (apr_atomic_casptr(&finished_jobs, job, head) != head);
+}
+#endif
+
+
+/*
+ * Drop a reference to a job, freeing it if that was the last one.  thread is
+ * true if this is the reference of the job's thread.
+ */
+static void
+release_job(struct wai_job *job, bool thread)
+{
+    bool last;
+
+#if APR_HAS_THREADS
+    if (job->mutex != NULL)
+        apr_thread_mutex_lock(job->mutex);
+#endif
+    last = (--job->refs == 0);
+#if APR_HAS_THREADS
+    if (job->mutex != NULL)
+        apr_thread_mutex_unlock(job->mutex);
+#endif
+    if (!last)
+        return;
+#if APR_HAS_THREADS
+    if (thread) {
+        retire_job(job);
+        return;
+    }
+#endif
+    free_job(job);
+}
+
+
+/*
+ * Drop the caller's reference to a job when the caller's pool is cleared.
+ * This is registered as a cleanup on that pool.
+ */
+static apr_status_t
+cleanup_job(void *data)
+{
+    release_job(data, false);
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Create a job on behalf of a WebAuth context.  The job gets its own context
+ * with a copy of the user information service configuration, if any.  Any
+ * data passed to the job function that the caller doesn't keep alive until
+ * the job finishes must be allocated from the job's context, which is
+ * returned by wai_job_context.
+ */
+int
+wai_job_create(struct webauth_context *ctx, struct wai_job **result)
+{
+    struct wai_job *job;
+    apr_pool_t *pool;
+    apr_status_t code;
+    int s;
+
+    *result = NULL;
+#if APR_HAS_THREADS
+    reap_jobs();
+#endif
+    code = apr_pool_create(&pool, NULL);
+    if (code != APR_SUCCESS)
+        return wai_error_set_apr(ctx, WA_ERR_APR, code, "cannot create pool");
+    job = apr_pcalloc(pool, sizeof(struct wai_job));
+    job->pool = pool;
+    job->refs = 1;
+    job->messages = apr_array_make(pool, 2, sizeof(struct saved_message));
+    s = webauth_context_init_apr(&job->ctx, pool);
+    if (s != WA_ERR_NONE) {
+        apr_pool_destroy(pool);
+        return wai_error_set(ctx, s, "cannot create job context");
+    }
+    if (ctx->user != NULL) {
+        s = webauth_user_config(job->ctx, ctx->user);
+        if (s != WA_ERR_NONE) {
+            wai_error_set(ctx, s, "%s", webauth_error_message(job->ctx, s));
+            apr_pool_destroy(pool);
+            return s;
+        }
+    }
+    webauth_log_callback(job->ctx, WA_LOG_TRACE,  save_trace,  job);
+    webauth_log_callback(job->ctx, WA_LOG_INFO,   save_info,   job);
+    webauth_log_callback(job->ctx, WA_LOG_NOTICE, save_notice, job);
+    webauth_log_callback(job->ctx, WA_LOG_WARN,   save_warn,   job);
+#if APR_HAS_THREADS
+    code = apr_thread_mutex_create(&job->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                   pool);
+    if (code == APR_SUCCESS)
+        code = apr_thread_cond_create(&job->finished, pool);
+    if (code != APR_SUCCESS)
+        job->mutex = NULL;
+#endif
+    apr_pool_cleanup_register(ctx->pool, job, cleanup_job,
+                              apr_pool_cleanup_null);
+    *result = job;
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Return the WebAuth context that a job will run with.
+ */
+struct webauth_context *
+wai_job_context(struct wai_job *job)
+{
+    return job->ctx;
+}
+
+
+#if APR_HAS_THREADS
+/*
+ * The body of a job thread.  Runs the job function, marks the job done,
+ * wakes up the caller if it's waiting, and drops the thread's reference.
+ * The job isn't freed until the thread has been joined, but once the
+ * reference is dropped the thread must not touch the job.
+ */
+static void * APR_THREAD_FUNC
+run_job(apr_thread_t *thread UNUSED, void *data)
+{
+    struct wai_job *job = data;
+    int status;
+
+    status = job->func(job->ctx, job->data);
+    apr_thread_mutex_lock(job->mutex);
+    job->status = status;
+    job->done = true;
+    apr_thread_cond_signal(job->finished);
+    apr_thread_mutex_unlock(job->mutex);
+    release_job(job, true);
+    return NULL;
+}
+#endif
+
+
+/*
+ * Start a job, calling func with the job's context and data in a new thread.
+ * The thread is joinable so that it can be joined before the job's pool, from
+ * which it is created, is destroyed.  If that isn't possible, call it now.
+ */
+void
+wai_job_start(struct wai_job *job, wai_job_func func, void *data)
+{
+    job->func = func;
+    job->data = data;
+#if APR_HAS_THREADS
+    if (job->mutex != NULL) {
+        job->refs++;
+        if (apr_thread_create(&job->thread, NULL, run_job, job, job->pool)
+            == APR_SUCCESS)
+            return;
+        job->thread = NULL;
+        job->refs--;
+    }
+#endif
+    job->status = func(job->ctx, data);
+    job->done = true;
+}
+
+
+/*
+ * Wait for a job to finish, but not past the deadline (a time in seconds
+ * since epoch, or 0 to wait as long as it takes).  Passes on any messages the
+ * job logged and returns its status, copying its error message into the
+ * caller's context.  If the job doesn't finish in time, returns
+ * WA_ERR_REMOTE_TIMEOUT and abandons the job.
+ */
+int
+wai_job_wait(struct webauth_context *ctx, struct wai_job *job,
+             time_t deadline)
+{
+    struct saved_message *saved;
+    const char *error;
+    bool done;
+    int i, s;
+
+    /*
+     * The thread sets done and status with the mutex locked, so read them
+     * with it locked as well.  Once done is set, the thread no longer touches
+     * anything else in the job except to drop its reference.
+     */
+#if APR_HAS_THREADS
+    if (job->mutex != NULL) {
+        apr_interval_time_t timeout;
+        time_t now;
+
+        apr_thread_mutex_lock(job->mutex);
+        while (!job->done) {
+            if (deadline == 0)
+                apr_thread_cond_wait(job->finished, job->mutex);
+            else {
+                now = time(NULL);
+                if (now >= deadline)
+                    break;
+                timeout = apr_time_from_sec(deadline - now);
+                apr_thread_cond_timedwait(job->finished, job->mutex,
+                                          timeout);
+            }
+        }
+        done = job->done;
+        s = job->status;
+        apr_thread_mutex_unlock(job->mutex);
+    } else {
+        done = job->done;
+        s = job->status;
+    }
+#else
+    done = job->done;
+    s = job->status;
+#endif
+    if (!done) {
+        s = WA_ERR_REMOTE_TIMEOUT;
+        return wai_error_set(ctx, s, "deadline exceeded");
+    }
+
+    /* Pass on the saved messages, once. */
+    for (i = 0; i < job->messages->nelts; i++) {
+        saved = &APR_ARRAY_IDX(job->messages, i, struct saved_message);
+        switch (saved->level) {
+        case WA_LOG_TRACE:  wai_log_trace(ctx,  "%s", saved->message); break;
+        case WA_LOG_INFO:   wai_log_info(ctx,   "%s", saved->message); break;
+        case WA_LOG_NOTICE: wai_log_notice(ctx, "%s", saved->message); break;
+        case WA_LOG_WARN:   wai_log_warn(ctx,   "%s", saved->message); break;
+        }
+    }
+    apr_array_clear(job->messages);
+
+    /* Copy the error, if any. */
+    if (s != WA_ERR_NONE) {
+        error = webauth_error_message(job->ctx, s);
+        ctx->error  = apr_pstrdup(ctx->pool, error);
+        ctx->status = s;
+    }
+    return s;
+}
@@ -23,6 +23,37 @@
 /* The version of the keyring file format that we implement. */
 #define KEYRING_VERSION 1
 
+/*
+ * A keyring as allocated by webauth_keyring_new.  The public struct comes
+ * first, so a pointer to it is also a pointer to this struct, and the index
+ * of the entries is kept here so that it isn't part of the public ABI.
+ *
+ * order holds the positions of the keyring entries sorted by valid_after
+ * time, with entries that have the same time kept in keyring order, and size
+ * is its allocated length.  generation is incremented by every change made
+ * through webauth_keyring_add and webauth_keyring_remove, and indexed is the
+ * generation the index was built for, so the index is only used if it
+ * reflects the current entries.  count is the number of entries it was built
+ * for, which also guards against entries pushed or popped directly.
+ *
+ * states holds the precomputed crypto state for the key of each entry, in
+ * keyring order, and is rebuilt along with the index.  A state may be NULL if
+ * the key can't be used.
+ */
+struct keyring {
+    struct webauth_keyring ring;
+    unsigned long generation;
+    unsigned long indexed;
+    size_t count;
+    size_t size;
+    size_t *order;
+    struct wai_key_state **states;
+};
+
+/* Convert a public keyring pointer to the full struct. */
+#define KEYRING(r)       ((struct keyring *) (r))
+#define KEYRING_CONST(r) ((const struct keyring *) (r))
+
 
 /*
  * Create a new keyring.  Takes one argument specifying the initial capacity
@@ -31,14 +62,143 @@
 struct webauth_keyring *
 webauth_keyring_new(struct webauth_context *ctx, size_t capacity)
 {
-    struct webauth_keyring *ring;
+    struct keyring *ring;
     size_t size = sizeof(struct webauth_keyring_entry);
 
     if (capacity < 1)
         capacity = 1;
-    ring = apr_palloc(ctx->pool, sizeof(struct webauth_keyring));
-    ring->entries = apr_array_make(ctx->pool, capacity, size);
-    return ring;
+    ring = apr_pcalloc(ctx->pool, sizeof(struct keyring));
+    ring->ring.entries = apr_array_make(ctx->pool, capacity, size);
+    return &ring->ring;
+}
+
+
+/*
+ * Return the valid_after time of the entry at the given sorted position in
+ * the keyring index.
+ */
+static time_t
+index_valid_after(const struct webauth_keyring *ring, size_t position)
+{
+    const struct webauth_keyring_entry *entry;
+    size_t n = KEYRING_CONST(ring)->order[position];
+
+    entry = &APR_ARRAY_IDX(ring->entries, n, struct webauth_keyring_entry);
+    return entry->valid_after;
+}
+
+
+/*
+ * Rebuild the index of a keyring after entries are added or removed.  This is
+ * an insertion sort, which is linear for the common case of keys added in
+ * valid_after order and, since keyrings are small, fast enough otherwise.
+ * The sort is stable, so entries with the same valid_after time stay in
+ * keyring order.
+ */
+static void
+index_rebuild(struct webauth_context *ctx, struct webauth_keyring *ring)
+{
+    struct keyring *index = KEYRING(ring);
+    struct wai_key_state **states;
+    const struct webauth_key *key;
+    size_t i, j, count;
+    time_t valid;
+
+    count = ring->entries->nelts;
+    if (index->size < count) {
+        index->size = (count < 4) ? 4 : count * 2;
+        index->order = apr_palloc(ctx->pool, index->size * sizeof(size_t));
+    }
+    for (i = 0; i < count; i++) {
+        valid = APR_ARRAY_IDX(ring->entries, i,
+                              struct webauth_keyring_entry).valid_after;
+        for (j = i; j > 0 && index_valid_after(ring, j - 1) > valid; j--)
+            index->order[j] = index->order[j - 1];
+        index->order[j] = i;
+    }
+
+    /*
+     * Compute the crypto state for each key, reusing the state of keys that
+     * were already in the keyring and wiping the state of keys that are gone.
+     */
+    states = apr_pcalloc(ctx->pool, (count + 1) * sizeof(*states));
+    for (i = 0; i < count; i++) {
+        key = APR_ARRAY_IDX(ring->entries, i,
+                            struct webauth_keyring_entry).key;
+        for (j = 0; j < index->count && index->states != NULL; j++) {
+            if (index->states[j] == NULL)
+                continue;
+            if (wai_key_state_valid(index->states[j], key)) {
+                states[i] = index->states[j];
+                index->states[j] = NULL;
+                break;
+            }
+        }
+        if (states[i] == NULL)
+            states[i] = wai_key_state_new(ctx, key);
+    }
+    for (j = 0; j < index->count && index->states != NULL; j++)
+        if (index->states[j] != NULL)
+            wai_key_state_free(index->states[j]);
+    index->states = states;
+    index->count = count;
+    index->indexed = index->generation;
+}
+
+
+/*
+ * Return true if the keyring index reflects the current entries.
+ */
+static bool
+index_usable(const struct webauth_keyring *ring)
+{
+    const struct keyring *index = KEYRING_CONST(ring);
+
+    if (index->indexed != index->generation)
+        return false;
+    return index->count == (size_t) ring->entries->nelts;
+}
+
+
+/*
+ * Return the number of entries in the keyring index with a valid_after time
+ * less than or equal to the given time, found by binary search.  This is the
+ * sorted position just past the last such entry.
+ */
+static size_t
+index_upper_bound(const struct webauth_keyring *ring, time_t when)
+{
+    size_t low = 0;
+    size_t high = KEYRING_CONST(ring)->count;
+    size_t middle;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (index_valid_after(ring, middle) <= when)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+
+/*
+ * Append a key to a keyring without updating the index, which is then out of
+ * date until the next index_rebuild.  Makes a copy of the key.
+ */
+static void
+keyring_push(struct webauth_context *ctx, struct webauth_keyring *ring,
+             time_t creation, time_t valid_after,
+             const struct webauth_key *key)
+{
+    struct webauth_keyring_entry entry;
+
+    entry.creation = creation;
+    entry.valid_after = valid_after;
+    entry.key = webauth_key_copy(ctx, key);
+    APR_ARRAY_PUSH(ring->entries, struct webauth_keyring_entry) = entry;
+    KEYRING(ring)->generation++;
 }
 
 
@@ -53,12 +213,8 @@ webauth_keyring_add(struct webauth_context *ctx, struct webauth_keyring *ring,
                     time_t creation, time_t valid_after,
                     const struct webauth_key *key)
 {
-    struct webauth_keyring_entry entry;
-
-    entry.creation = creation;
-    entry.valid_after = valid_after;
-    entry.key = webauth_key_copy(ctx, key);
-    APR_ARRAY_PUSH(ring->entries, struct webauth_keyring_entry) = entry;
+    keyring_push(ctx, ring, creation, valid_after, key);
+    index_rebuild(ctx, ring);
 }
 
 
@@ -100,10 +256,85 @@ webauth_keyring_remove(struct webauth_context *ctx,
         APR_ARRAY_IDX(entries, i - 1, struct webauth_keyring_entry) = *entry;
     }
     apr_array_pop(entries);
+    KEYRING(ring)->generation++;
+    index_rebuild(ctx, ring);
     return WA_ERR_NONE;
 }
 
 
+/*
+ * Find the sorted position in the keyring index of the best entry for the
+ * given usage and hint, following the rules described for
+ * webauth_keyring_best_key, by binary search.  Returns -1 if there is no
+ * suitable entry.  For encryption, the first of several entries with the same
+ * valid_after time wins; for decryption, the last.
+ */
+static ssize_t
+index_best(const struct webauth_keyring *ring, enum webauth_key_usage usage,
+           time_t hint, time_t now)
+{
+    size_t n;
+    time_t valid;
+
+    if (usage == WA_KEY_DECRYPT && hint < now)
+        now = hint;
+    n = index_upper_bound(ring, now);
+    if (n == 0)
+        return -1;
+    if (usage == WA_KEY_ENCRYPT) {
+        valid = index_valid_after(ring, n - 1);
+        while (n > 1 && index_valid_after(ring, n - 2) == valid)
+            n--;
+    }
+    return n - 1;
+}
+
+
+/*
+ * Find the best entry in the keyring for the given usage and hint, following
+ * the rules described for webauth_keyring_best_key.  Returns the position of
+ * the entry in the keyring, or -1 if there is no suitable entry.  Uses the
+ * index if the keyring has one; otherwise, all entries are scanned.
+ */
+static ssize_t
+best_entry(const struct webauth_keyring *ring, enum webauth_key_usage usage,
+           time_t hint, time_t now)
+{
+    size_t i;
+    time_t valid;
+    ssize_t best;
+    struct webauth_keyring_entry *entry, *found;
+
+    if (index_usable(ring)) {
+        best = index_best(ring, usage, hint, now);
+        return (best < 0) ? -1 : (ssize_t) KEYRING_CONST(ring)->order[best];
+    }
+
+    /* Without an index, scan the whole keyring. */
+    best = -1;
+    found = NULL;
+    for (i = 0; i < (size_t) ring->entries->nelts; i++) {
+        entry = &APR_ARRAY_IDX(ring->entries, i, struct webauth_keyring_entry);
+        valid = entry->valid_after;
+        if (valid > now)
+            continue;
+        if (usage == WA_KEY_ENCRYPT) {
+            if (found == NULL || valid > found->valid_after) {
+                best = i;
+                found = entry;
+            }
+        } else {
+            if (hint >= valid
+                && (found == NULL || valid >= found->valid_after)) {
+                best = i;
+                found = entry;
+            }
+        }
+    }
+    return best;
+}
+
+
 /*
  * Given a keyring and a timestamp hint, return the best key in the keyring.
  * The timestamp is used to select the key that was most likely used at that
@@ -124,32 +355,114 @@ webauth_keyring_best_key(struct webauth_context *ctx,
                          enum webauth_key_usage usage, time_t hint,
                          const struct webauth_key **output)
 {
-    size_t i;
-    time_t now, valid;
-    struct webauth_keyring_entry *best, *entry;
+    ssize_t best;
+    struct webauth_keyring_entry *entry;
 
     *output = NULL;
-    now = time(NULL);
-    best = NULL;
+    best = best_entry(ring, usage, hint, time(NULL));
+    if (best < 0)
+        return wai_error_set(ctx, WA_ERR_NOT_FOUND, "no valid keys");
+    entry = &APR_ARRAY_IDX(ring->entries, best, struct webauth_keyring_entry);
+    *output = entry->key;
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Return the crypto state the keyring keeps for one of its keys, or NULL if
+ * it has none because the index is out of date or the key isn't in the
+ * keyring.  The state still has to be checked against the key, since the key
+ * data may have been changed since it was computed.
+ */
+const struct wai_key_state *
+wai_keyring_state(const struct webauth_keyring *ring,
+                  const struct webauth_key *key)
+{
+    const struct webauth_keyring_entry *entry;
+    size_t i;
+
+    if (!index_usable(ring))
+        return NULL;
     for (i = 0; i < (size_t) ring->entries->nelts; i++) {
-        entry = &APR_ARRAY_IDX(ring->entries, i, struct webauth_keyring_entry);
-        valid = entry->valid_after;
-        if (valid > now)
-            continue;
-        if (usage == WA_KEY_ENCRYPT) {
-            if (best == NULL || valid > best->valid_after)
-                best = entry;
-        } else {
-            if (hint >= valid && (best == NULL || valid >= best->valid_after))
-                best = entry;
+        entry = &APR_ARRAY_IDX(ring->entries, i,
+                               struct webauth_keyring_entry);
+        if (entry->key == key)
+            return KEYRING_CONST(ring)->states[i];
+    }
+    return NULL;
+}
+
+
+/*
+ * Store in keys the order in which the keys of a keyring should be tried to
+ * decrypt a token with the given hint, up to max keys, and return the number
+ * stored.  The best decryption key for the hint comes first.  With an index,
+ * the remaining keys follow in order of increasing distance from that key in
+ * valid_after order, alternating between newer and older keys, since a key
+ * hint that picks the wrong key is normally due to clock skew or a keyring
+ * that was updated at a slightly different time.  Without an index, the
+ * remaining keys follow in keyring order.
+ */
+size_t
+wai_keyring_decrypt_keys(const struct webauth_keyring *ring, time_t hint,
+                         const struct webauth_key **keys, size_t max)
+{
+    size_t count, n, i, pivot, distance;
+    ssize_t best;
+    const struct webauth_keyring_entry *entry;
+
+    count = ring->entries->nelts;
+    if (max > count)
+        max = count;
+    if (max == 0)
+        return 0;
+
+    /* Without an index, try the best key and then the rest in order. */
+    if (!index_usable(ring)) {
+        best = best_entry(ring, WA_KEY_DECRYPT, hint, time(NULL));
+        n = 0;
+        if (best >= 0) {
+            entry = &APR_ARRAY_IDX(ring->entries, best,
+                                   struct webauth_keyring_entry);
+            keys[n++] = entry->key;
         }
+        for (i = 0; i < count && n < max; i++) {
+            if ((ssize_t) i == best)
+                continue;
+            entry = &APR_ARRAY_IDX(ring->entries, i,
+                                   struct webauth_keyring_entry);
+            keys[n++] = entry->key;
+        }
+        return n;
     }
-    if (best == NULL)
-        return wai_error_set(ctx, WA_ERR_NOT_FOUND, "no valid keys");
-    else {
-        *output = best->key;
-        return WA_ERR_NONE;
+
+    /*
+     * Find the sorted position of the best key.  If there is none, the hint
+     * is earlier than every key, so start with the oldest.
+     */
+    best = index_best(ring, WA_KEY_DECRYPT, hint, time(NULL));
+    pivot = (best < 0) ? 0 : (size_t) best;
+
+    /* Walk outwards from the pivot, newer key first. */
+    entry = &APR_ARRAY_IDX(ring->entries, KEYRING_CONST(ring)->order[pivot],
+                           struct webauth_keyring_entry);
+    keys[0] = entry->key;
+    n = 1;
+    for (distance = 1; n < max; distance++) {
+        if (pivot + distance < count) {
+            i = KEYRING_CONST(ring)->order[pivot + distance];
+            entry = &APR_ARRAY_IDX(ring->entries, i,
+                                   struct webauth_keyring_entry);
+            keys[n++] = entry->key;
+        }
+        if (n < max && distance <= pivot) {
+            i = KEYRING_CONST(ring)->order[pivot - distance];
+            entry = &APR_ARRAY_IDX(ring->entries, i,
+                                   struct webauth_keyring_entry);
+            keys[n++] = entry->key;
+        }
     }
+    return n;
 }
 
 
@@ -195,9 +508,9 @@ webauth_keyring_decode(struct webauth_context *ctx, const char *input,
                                entry->key, &key);
         if (s != WA_ERR_NONE)
             return s;
-        webauth_keyring_add(ctx, ring, entry->creation, entry->valid_after,
-                            key);
+        keyring_push(ctx, ring, entry->creation, entry->valid_after, key);
     }
+    index_rebuild(ctx, ring);
     *output = ring;
     return WA_ERR_NONE;
 }
@@ -30,6 +30,7 @@
 #include <portable/krb5.h>
 #include <portable/system.h>
 
+#include <openssl/sha.h>
 #ifdef HAVE_REMCTL
 # include <remctl.h>
 #endif
@@ -37,7 +38,23 @@
 #include <lib/internal.h>
 #include <util/macros.h>
 #include <webauth/basic.h>
+#include <webauth/keys.h>
 #include <webauth/krb5.h>
+#include <webauth/tokens.h>
+
+/*
+ * Cached service tickets with less than this many seconds of life left are
+ * ignored, so that we don't hand out a ticket that expires before the
+ * application server can use it.
+ */
+#define TICKET_MIN_LIFE 60
+
+/*
+ * The in-memory copy of the FAST armor cache is refreshed from the file when
+ * its credentials have less than this many seconds of life left, even if the
+ * file doesn't appear to have changed.
+ */
+#define ARMOR_MIN_LIFE (5 * 60)
 
 /*
  * A WebAuth Kerberos context.  This represents a local identity and set of
@@ -51,6 +68,66 @@ struct webauth_krb5 {
     krb5_principal princ;
     const char *fast_armor_path;
     struct webauth_krb5_change_config change;
+    struct wai_krb5_cache *shared;      /* Set if ctx is borrowed */
+    bool have_tgt_id;                   /* Set if initialized by import */
+    unsigned char tgt_id[SHA256_DIGEST_LENGTH];
+};
+
+/*
+ * A Kerberos library context kept in a WebAuth context for reuse, along with
+ * the Kerberos configuration files and their modification times when it was
+ * created.  refs counts the webauth_krb5 contexts currently using it, and
+ * stale is set if the configuration changed while it was in use.  keytabs
+ * holds the in-memory copies of keytab files made with that context, and
+ * armor the in-memory copy of the FAST armor cache.
+ */
+struct wai_krb5_cache {
+    apr_pool_t *pool;
+    krb5_context ctx;
+    unsigned long refs;
+    bool stale;
+    time_t checked;                     /* When files were last checked */
+    apr_array_header_t *files;          /* Array of struct config_file */
+    apr_array_header_t *keytabs;        /* Array of struct keytab_snapshot */
+    struct armor_snapshot *armor;
+};
+
+/*
+ * An in-memory copy of a keytab file.  kt is kept open so that the MEMORY
+ * keytab named by name stays around, and the file's modification time and
+ * size at the time of the copy are used to notice when it changes.  Each
+ * copy gets a new name, since memory keytabs are global to the process.
+ */
+struct keytab_snapshot {
+    const char *path;
+    krb5_keytab kt;
+    char name[64];
+    unsigned long generation;
+    apr_time_t mtime;
+    apr_off_t size;
+    time_t checked;                     /* When the file was last checked */
+};
+
+/*
+ * An in-memory copy of a FAST armor ticket cache file, kept the same way as
+ * keytab copies.  expires is the latest expiration time of the credentials
+ * in the copy.
+ */
+struct armor_snapshot {
+    const char *path;
+    krb5_ccache cc;
+    char name[64];
+    unsigned long generation;
+    apr_time_t mtime;
+    time_t expires;
+    time_t checked;                     /* When the file was last checked */
+    bool warned;                        /* Warned that the file is expiring */
+};
+
+/* A Kerberos configuration file and its modification time, or 0 if none. */
+struct config_file {
+    const char *path;
+    apr_time_t mtime;
 };
 
 /*
@@ -174,6 +251,267 @@ decode_principal(struct webauth_context *ctx, struct webauth_krb5 *kc,
 }
 
 
+/*
+ * Copy the entries of a keytab into a new memory keytab and replace the
+ * current copy in the snapshot with it.  Returns false if the keytab can't be
+ * read, in which case the snapshot is left unchanged.
+ */
+static bool
+copy_keytab(struct webauth_krb5 *kc, struct keytab_snapshot *snap)
+{
+    krb5_keytab file = NULL;
+    krb5_keytab copy = NULL;
+    krb5_kt_cursor cursor;
+    krb5_keytab_entry entry;
+    krb5_error_code code;
+    char name[sizeof(snap->name)];
+
+    snprintf(name, sizeof(name), "MEMORY:webauth-%p-%lu", (void *) snap,
+             ++snap->generation);
+    code = krb5_kt_resolve(kc->ctx, snap->path, &file);
+    if (code != 0)
+        return false;
+    code = krb5_kt_resolve(kc->ctx, name, &copy);
+    if (code == 0)
+        code = krb5_kt_start_seq_get(kc->ctx, file, &cursor);
+    if (code == 0) {
+        while ((code = krb5_kt_next_entry(kc->ctx, file, &entry,
+                                          &cursor)) == 0) {
+            code = krb5_kt_add_entry(kc->ctx, copy, &entry);
+            krb5_kt_free_entry(kc->ctx, &entry);
+            if (code != 0)
+                break;
+        }
+        krb5_kt_end_seq_get(kc->ctx, file, &cursor);
+        if (code == KRB5_KT_END)
+            code = 0;
+    }
+    krb5_kt_close(kc->ctx, file);
+
+    /* Closing the last handle to a memory keytab destroys it. */
+    if (code != 0) {
+        if (copy != NULL)
+            krb5_kt_close(kc->ctx, copy);
+        return false;
+    }
+    if (snap->kt != NULL)
+        krb5_kt_close(kc->ctx, snap->kt);
+    snap->kt = copy;
+    memcpy(snap->name, name, sizeof(name));
+    return true;
+}
+
+
+/*
+ * Return the name of an up-to-date in-memory copy of a keytab file, making
+ * or refreshing the copy if needed, so that verifying authenticators doesn't
+ * read the keytab file each time.  The file is checked for changes at most
+ * once a second.  Returns NULL if the keytab isn't a file or can't be copied,
+ * in which case the caller should use the keytab directly.
+ */
+static const char *
+snapshot_keytab(struct webauth_context *ctx, struct webauth_krb5 *kc,
+                const char *path)
+{
+    struct wai_krb5_cache *cache = kc->shared;
+    struct keytab_snapshot *snap = NULL;
+    const char *file;
+    apr_finfo_t finfo;
+    time_t now;
+    int i;
+
+    /* Only FILE keytabs can be checked for changes. */
+    if (strncmp(path, "FILE:", strlen("FILE:")) == 0)
+        file = path + strlen("FILE:");
+    else if (path[0] == '/' || strchr(path, ':') == NULL)
+        file = path;
+    else
+        return NULL;
+
+    /* Find the existing snapshot, if any. */
+    for (i = 0; i < cache->keytabs->nelts; i++) {
+        snap = APR_ARRAY_IDX(cache->keytabs, i, struct keytab_snapshot *);
+        if (strcmp(snap->path, path) == 0)
+            break;
+        snap = NULL;
+    }
+    if (snap == NULL) {
+        snap = apr_pcalloc(cache->pool, sizeof(struct keytab_snapshot));
+        snap->path = apr_pstrdup(cache->pool, path);
+        APR_ARRAY_PUSH(cache->keytabs, struct keytab_snapshot *) = snap;
+    }
+
+    /* Use the current copy unless the file has changed. */
+    now = time(NULL);
+    if (snap->kt != NULL && now == snap->checked)
+        return snap->name;
+    snap->checked = now;
+    if (apr_stat(&finfo, file, APR_FINFO_MTIME | APR_FINFO_SIZE, ctx->pool)
+        != APR_SUCCESS)
+        return NULL;
+    if (snap->kt != NULL && finfo.mtime == snap->mtime
+        && finfo.size == snap->size)
+        return snap->name;
+    if (!copy_keytab(kc, snap))
+        return NULL;
+    snap->mtime = finfo.mtime;
+    snap->size = finfo.size;
+    return snap->name;
+}
+
+
+#ifdef HAVE_KRB5_GET_INIT_CREDS_OPT_SET_FAST_CCACHE_NAME
+/*
+ * Copy the credentials in a ticket cache into a new memory cache and replace
+ * the current copy in the snapshot with it.  Returns false if the cache can't
+ * be read, in which case the snapshot is left unchanged.
+ */
+static bool
+copy_armor(struct webauth_krb5 *kc, struct armor_snapshot *snap)
+{
+    krb5_ccache file = NULL;
+    krb5_ccache copy = NULL;
+    krb5_principal princ = NULL;
+    krb5_cc_cursor cursor;
+    krb5_creds creds;
+    krb5_error_code code;
+    time_t expires = 0;
+    char name[sizeof(snap->name)];
+
+    snprintf(name, sizeof(name), "MEMORY:webauth-armor-%p-%lu",
+             (void *) snap, ++snap->generation);
+    code = krb5_cc_resolve(kc->ctx, snap->path, &file);
+    if (code != 0)
+        return false;
+    code = krb5_cc_get_principal(kc->ctx, file, &princ);
+    if (code == 0)
+        code = krb5_cc_resolve(kc->ctx, name, &copy);
+    if (code == 0)
+        code = krb5_cc_initialize(kc->ctx, copy, princ);
+    if (code == 0)
+        code = krb5_cc_start_seq_get(kc->ctx, file, &cursor);
+    if (code == 0) {
+        while ((code = krb5_cc_next_cred(kc->ctx, file, &cursor,
+                                         &creds)) == 0) {
+            if (creds.times.endtime > expires)
+                expires = creds.times.endtime;
+            code = krb5_cc_store_cred(kc->ctx, copy, &creds);
+            krb5_free_cred_contents(kc->ctx, &creds);
+            if (code != 0)
+                break;
+        }
+        krb5_cc_end_seq_get(kc->ctx, file, &cursor);
+        if (code == KRB5_CC_END)
+            code = 0;
+    }
+    if (princ != NULL)
+        krb5_free_principal(kc->ctx, princ);
+    krb5_cc_close(kc->ctx, file);
+    if (code != 0) {
+        if (copy != NULL)
+            krb5_cc_destroy(kc->ctx, copy);
+        return false;
+    }
+    if (snap->cc != NULL)
+        krb5_cc_destroy(kc->ctx, snap->cc);
+    snap->cc = copy;
+    snap->expires = expires;
+    memcpy(snap->name, name, sizeof(name));
+    return true;
+}
+
+
+/*
+ * Return the name of an up-to-date in-memory copy of the FAST armor cache,
+ * making or refreshing the copy if needed, so that each password login
+ * doesn't read the armor cache file.  The file is checked for changes at most
+ * once a second, and it's copied again if it changed or if the credentials
+ * in the copy are about to expire.  If the file itself is about to expire,
+ * that's logged once as a warning.  Returns NULL if the cache isn't a file or
+ * can't be copied, in which case the caller should use the cache directly.
+ */
+static const char *
+snapshot_armor(struct webauth_context *ctx, struct webauth_krb5 *kc,
+               const char *path)
+{
+    struct wai_krb5_cache *cache = kc->shared;
+    struct armor_snapshot *snap = cache->armor;
+    const char *file;
+    apr_finfo_t finfo;
+    time_t now;
+    bool expiring;
+
+    /* Only FILE caches can be checked for changes. */
+    if (strncmp(path, "FILE:", strlen("FILE:")) == 0)
+        file = path + strlen("FILE:");
+    else if (path[0] == '/' || strchr(path, ':') == NULL)
+        file = path;
+    else
+        return NULL;
+
+    /* We only keep one armor cache, so start over if the path changed. */
+    if (snap == NULL || strcmp(snap->path, path) != 0) {
+        if (snap != NULL && snap->cc != NULL)
+            krb5_cc_destroy(kc->ctx, snap->cc);
+        snap = apr_pcalloc(cache->pool, sizeof(struct armor_snapshot));
+        snap->path = apr_pstrdup(cache->pool, path);
+        cache->armor = snap;
+    }
+
+    /*
+     * Use the current copy unless the file changed or it's expiring, checking
+     * at most once a second even if it's expiring, since otherwise an armor
+     * cache that isn't being renewed would be copied for every login.
+     */
+    now = time(NULL);
+    if (snap->cc != NULL && now == snap->checked)
+        return snap->name;
+    snap->checked = now;
+    expiring = (snap->expires <= now + ARMOR_MIN_LIFE);
+    if (apr_stat(&finfo, file, APR_FINFO_MTIME, ctx->pool) != APR_SUCCESS)
+        return NULL;
+    if (snap->cc != NULL && !expiring && finfo.mtime == snap->mtime)
+        return snap->name;
+    if (!copy_armor(kc, snap))
+        return NULL;
+    snap->mtime = finfo.mtime;
+
+    /* Warn once if the new copy is expiring too, until it's renewed. */
+    if (snap->expires > now + ARMOR_MIN_LIFE)
+        snap->warned = false;
+    else if (!snap->warned) {
+        wai_log_warn(ctx, "FAST armor cache %s expires in less than %d"
+                     " seconds and has not been renewed", path,
+                     ARMOR_MIN_LIFE);
+        snap->warned = true;
+    }
+    return snap->name;
+}
+#endif /* HAVE_KRB5_GET_INIT_CREDS_OPT_SET_FAST_CCACHE_NAME */
+
+
+/*
+ * Close all in-memory copies of keytabs and the FAST armor cache, which have
+ * to be discarded before the Kerberos context used to make them is freed.
+ */
+static void
+close_snapshots(struct wai_krb5_cache *cache)
+{
+    struct keytab_snapshot *snap;
+    int i;
+
+    for (i = 0; i < cache->keytabs->nelts; i++) {
+        snap = APR_ARRAY_IDX(cache->keytabs, i, struct keytab_snapshot *);
+        if (snap->kt != NULL)
+            krb5_kt_close(cache->ctx, snap->kt);
+        snap->kt = NULL;
+    }
+    if (cache->armor != NULL && cache->armor->cc != NULL)
+        krb5_cc_destroy(cache->ctx, cache->armor->cc);
+    cache->armor = NULL;
+}
+
+
 /*
  * Open up a keytab and return a krb5_principal to use with that keytab.  If
  * in_principal is NULL, returned out_principal is the first principal found
@@ -189,14 +527,19 @@ open_keytab(struct webauth_context *ctx, struct webauth_krb5 *kc,
     krb5_kt_cursor cursor;
     krb5_keytab_entry entry;
     krb5_error_code code;
+    const char *name;
     bool cursor_valid = false;
 
     /* Initialize return values in the case of an error. */
     *princ = NULL;
     *keytab = NULL;
 
-    /* Open the keytab file and optionally find its first principal. */
-    code = krb5_kt_resolve(kc->ctx, path, &id);
+    /*
+     * Open the keytab file, or our in-memory copy of it if we have one, and
+     * optionally find its first principal.
+     */
+    name = (kc->shared != NULL) ? snapshot_keytab(ctx, kc, path) : NULL;
+    code = krb5_kt_resolve(kc->ctx, name != NULL ? name : path, &id);
     if (code != 0)
         return error_set(ctx, kc, code, "cannot open keytab %s", path);
     if (principal != NULL) {
@@ -250,40 +593,136 @@ cleanup(void *data)
         krb5_cc_destroy(kc->ctx, kc->cc);
     if (kc->princ != NULL)
         krb5_free_principal(kc->ctx, kc->princ);
-    if (kc->ctx != NULL)
+    if (kc->shared != NULL)
+        kc->shared->refs--;
+    else if (kc->ctx != NULL)
         krb5_free_context(kc->ctx);
     return APR_SUCCESS;
 }
 
 
 /*
- * Create a new webauth_krb5 context.  Any contents of the provided context
- * are overwritten.
- *
- * Every webauth_krb5 context gets its own sub-pool of the WebAuth context
- * pool, which is used for any memory allocated by the WebAuth Kerberos code.
- * We additionally register webauth_krb5_free as a cleanup handler called by
- * APR when the pool is destroyed so that everything is properly freed when
- * the pool is deleted and no explicit free is required.
+ * Free the shared Kerberos library context.  This is registered as a cleanup
+ * on the pool holding the WebAuth context, which runs after the sub-pools of
+ * every webauth_krb5 context using it have been destroyed.
+ */
+static apr_status_t
+cleanup_shared(void *data)
+{
+    struct wai_krb5_cache *cache = data;
+
+    if (cache->ctx != NULL) {
+        close_snapshots(cache);
+        krb5_free_context(cache->ctx);
+    }
+    cache->ctx = NULL;
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Check whether any of the Kerberos configuration files have changed since
+ * the last check, doing nothing if the last check was less than a second
+ * ago.  Records the new modification times and returns true if anything
+ * changed.  A missing file is recorded with a time of 0.
+ */
+static bool
+config_changed(struct webauth_context *ctx, struct wai_krb5_cache *cache)
+{
+    struct config_file *file;
+    apr_finfo_t finfo;
+    apr_time_t mtime;
+    time_t now;
+    int i;
+    bool changed = false;
+
+    now = time(NULL);
+    if (now == cache->checked)
+        return false;
+    cache->checked = now;
+    for (i = 0; i < cache->files->nelts; i++) {
+        file = &APR_ARRAY_IDX(cache->files, i, struct config_file);
+        if (apr_stat(&finfo, file->path, APR_FINFO_MTIME, ctx->pool) == 0)
+            mtime = finfo.mtime;
+        else
+            mtime = 0;
+        if (mtime != file->mtime) {
+            file->mtime = mtime;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+
+/*
+ * Enable reuse of a single Kerberos library context by every webauth_krb5
+ * context created from this WebAuth context.  The shared context itself is
+ * created by the next call to webauth_krb5_new.  Here, we just get the list
+ * of configuration files to watch and their current modification times.
  */
 int
-webauth_krb5_new(struct webauth_context *ctx, struct webauth_krb5 **kc)
+webauth_krb5_reuse_context(struct webauth_context *ctx)
 {
-    apr_pool_t *pool;
+    struct wai_krb5_cache *cache;
+    struct config_file *file;
+    char **files;
+    size_t i;
     krb5_error_code code;
-    apr_status_t acode;
 
-    acode = apr_pool_create(&pool, ctx->pool);
-    if (acode != APR_SUCCESS) {
-        wai_error_set_apr(ctx, WA_ERR_APR, acode, "cannot create new pool");
-        return WA_ERR_APR;
-    }
-    *kc = apr_pcalloc(pool, sizeof(struct webauth_krb5));
-    (*kc)->pool = pool;
-    code = krb5_init_context(&(*kc)->ctx);
+    if (ctx->krb5 != NULL)
+        return WA_ERR_NONE;
+    code = krb5_get_default_config_files(&files);
     if (code != 0)
-        return error_set(ctx, NULL, code, "cannot create Kerberos context");
-    apr_pool_cleanup_register(pool, *kc, cleanup, apr_pool_cleanup_null);
+        return error_set(ctx, NULL, code, "cannot get Kerberos config files");
+    cache = apr_pcalloc(ctx->base, sizeof(struct wai_krb5_cache));
+    cache->pool = ctx->base;
+    cache->files = apr_array_make(ctx->base, 2, sizeof(struct config_file));
+    cache->keytabs = apr_array_make(ctx->base, 1,
+                                    sizeof(struct keytab_snapshot *));
+    for (i = 0; files[i] != NULL; i++) {
+        file = apr_array_push(cache->files);
+        file->path = apr_pstrdup(ctx->base, files[i]);
+        file->mtime = 0;
+    }
+    krb5_free_config_files(files);
+    config_changed(ctx, cache);
+    apr_pool_cleanup_register(ctx->base, cache, cleanup_shared,
+                              apr_pool_cleanup_null);
+    ctx->krb5 = cache;
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Get the shared Kerberos library context for a new webauth_krb5 context,
+ * creating it if necessary.  If the Kerberos configuration has changed, the
+ * old context is replaced once nothing is using it any more, so that the
+ * contexts that are still using it are not disturbed.
+ */
+static int
+shared_context(struct webauth_context *ctx, struct webauth_krb5 *kc)
+{
+    struct wai_krb5_cache *cache = ctx->krb5;
+    krb5_error_code code;
+
+    if (config_changed(ctx, cache))
+        cache->stale = true;
+    if (cache->stale && cache->refs == 0 && cache->ctx != NULL) {
+        close_snapshots(cache);
+        krb5_free_context(cache->ctx);
+        cache->ctx = NULL;
+    }
+    if (cache->ctx == NULL) {
+        code = krb5_init_context(&cache->ctx);
+        if (code != 0)
+            return error_set(ctx, NULL, code,
+                             "cannot create Kerberos context");
+        cache->stale = false;
+    }
+    kc->ctx = cache->ctx;
+    kc->shared = cache;
+    cache->refs++;
     return WA_ERR_NONE;
 }
 
@@ -508,7 +947,11 @@ setup_fast_ccache(struct webauth_context *ctx, struct webauth_krb5 *kc,
     code = krb5_get_init_creds_opt_set_fast_flags(kc->ctx, opts, flags);
     if (code != 0)
         return error_set(ctx, kc, code, "cannot set flags to require FAST");
-    path = kc->fast_armor_path;
+    path = NULL;
+    if (kc->shared != NULL)
+        path = snapshot_armor(ctx, kc, kc->fast_armor_path);
+    if (path == NULL)
+        path = kc->fast_armor_path;
     code = krb5_get_init_creds_opt_set_fast_ccache_name(kc->ctx, opts, path);
     if (code != 0)
         return error_set(ctx, kc, code, "cannot initialize FAST armor");
@@ -687,11 +1130,19 @@ webauth_krb5_import_cred(struct webauth_context *ctx, struct webauth_krb5 *kc,
     if (s != WA_ERR_NONE)
         return s;
 
-    /* If the webauth_krb5 context is not initialized, do that now. */
+    /*
+     * If the webauth_krb5 context is not initialized, do that now.  Remember
+     * a hash of the credential so that we can use the service ticket cache,
+     * if there is one.
+     */
     if (kc->cc == NULL) {
         s = prepare_from_creds(ctx, kc, &creds, cache);
         if (s != WA_ERR_NONE)
             return s;
+        if (ctx->tickets.get != NULL) {
+            SHA256(cred, cred_len, kc->tgt_id);
+            kc->have_tgt_id = true;
+        }
     }
 
     /*
@@ -711,6 +1162,179 @@ webauth_krb5_import_cred(struct webauth_context *ctx, struct webauth_krb5 *kc,
 }
 
 
+/*
+ * Set or clear the callbacks for the service ticket cache.
+ */
+void
+webauth_krb5_set_ticket_cache(struct webauth_context *ctx,
+                              webauth_krb5_ticket_get_func get,
+                              webauth_krb5_ticket_put_func put, void *data)
+{
+    if (get == NULL || put == NULL) {
+        memset(&ctx->tickets, 0, sizeof(ctx->tickets));
+        return;
+    }
+    ctx->tickets.get  = get;
+    ctx->tickets.put  = put;
+    ctx->tickets.data = data;
+}
+
+
+/*
+ * Derive the cache key of a service ticket and the key used to encrypt it in
+ * the cache from the hash of the imported credential and the client and
+ * server principals.  The label keeps the two apart.  Returns false if the
+ * principals can't be unparsed.
+ */
+static bool
+ticket_hash(struct webauth_context *ctx, struct webauth_krb5 *kc,
+            krb5_creds *in, const char *label,
+            unsigned char hash[SHA256_DIGEST_LENGTH])
+{
+    char *client, *server;
+    unsigned char *buffer, *p;
+    size_t length;
+
+    if (krb5_unparse_name(kc->ctx, in->client, &client) != 0)
+        return false;
+    if (krb5_unparse_name(kc->ctx, in->server, &server) != 0) {
+        krb5_free_unparsed_name(kc->ctx, client);
+        return false;
+    }
+    length = strlen(label) + 1 + sizeof(kc->tgt_id) + strlen(client) + 1
+        + strlen(server) + 1;
+    buffer = apr_palloc(ctx->pool, length);
+    p = buffer;
+    memcpy(p, label, strlen(label) + 1);
+    p += strlen(label) + 1;
+    memcpy(p, kc->tgt_id, sizeof(kc->tgt_id));
+    p += sizeof(kc->tgt_id);
+    memcpy(p, client, strlen(client) + 1);
+    p += strlen(client) + 1;
+    memcpy(p, server, strlen(server) + 1);
+    SHA256(buffer, length, hash);
+    krb5_free_unparsed_name(kc->ctx, client);
+    krb5_free_unparsed_name(kc->ctx, server);
+    return true;
+}
+
+
+/*
+ * Get the keyring used to encrypt and decrypt a cached service ticket.
+ * Returns NULL on failure.
+ */
+static struct webauth_keyring *
+ticket_keyring(struct webauth_context *ctx, struct webauth_krb5 *kc,
+               krb5_creds *in)
+{
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    struct webauth_key *key;
+
+    if (!ticket_hash(ctx, kc, in, "webauth ticket key", hash))
+        return NULL;
+    if (webauth_key_create(ctx, WA_KEY_AES, WA_AES_128, hash, &key)
+        != WA_ERR_NONE)
+        return NULL;
+    return webauth_keyring_from_key(ctx, key);
+}
+
+
+/*
+ * Before asking the KDC for a service ticket, look for one in the service
+ * ticket cache and, if there's one with enough life left, store it in our
+ * ticket cache so that krb5_get_credentials finds it there.  Returns true if
+ * a ticket was found.  Any failure just means that we go to the KDC as usual.
+ */
+static bool
+ticket_cache_get(struct webauth_context *ctx, struct webauth_krb5 *kc,
+                 krb5_creds *in)
+{
+    unsigned char id[SHA256_DIGEST_LENGTH];
+    struct webauth_keyring *ring;
+    krb5_creds creds;
+    const void *ticket;
+    void *data;
+    size_t ticket_len, length;
+    bool found = false;
+    int s;
+
+    if (ctx->tickets.get == NULL || !kc->have_tgt_id)
+        return false;
+    if (!ticket_hash(ctx, kc, in, "webauth ticket id", id))
+        return false;
+    if (!ctx->tickets.get(ctx, ctx->tickets.data, id, sizeof(id), &ticket,
+                          &ticket_len))
+        return false;
+    ring = ticket_keyring(ctx, kc, in);
+    if (ring == NULL)
+        return false;
+    s = webauth_token_decrypt(ctx, ticket, ticket_len, &data, &length, ring);
+    if (s != WA_ERR_NONE)
+        return false;
+    if (decode_creds(ctx, kc, data, length, &creds) != WA_ERR_NONE)
+        return false;
+    if (creds.times.endtime > time(NULL) + TICKET_MIN_LIFE)
+        found = (krb5_cc_store_cred(kc->ctx, kc->cc, &creds) == 0);
+    if (creds.client != NULL)
+        krb5_free_principal(kc->ctx, creds.client);
+    if (creds.server != NULL)
+        krb5_free_principal(kc->ctx, creds.server);
+    return found;
+}
+
+
+/*
+ * Offer a service ticket we got from the KDC to the service ticket cache,
+ * encrypted.  Failures are ignored.
+ */
+static void
+ticket_cache_put(struct webauth_context *ctx, struct webauth_krb5 *kc,
+                 krb5_creds *in, krb5_creds *out)
+{
+    unsigned char id[SHA256_DIGEST_LENGTH];
+    struct webauth_keyring *ring;
+    void *data, *ticket;
+    size_t length, ticket_len;
+    time_t expiration;
+
+    if (ctx->tickets.put == NULL || !kc->have_tgt_id)
+        return;
+    if (!ticket_hash(ctx, kc, in, "webauth ticket id", id))
+        return;
+    ring = ticket_keyring(ctx, kc, in);
+    if (ring == NULL)
+        return;
+    if (encode_creds(ctx, kc, out, &data, &length, &expiration)
+        != WA_ERR_NONE)
+        return;
+    if (webauth_token_encrypt(ctx, data, length, &ticket, &ticket_len, ring)
+        != WA_ERR_NONE)
+        return;
+    ctx->tickets.put(ctx, ctx->tickets.data, id, sizeof(id), ticket,
+                     ticket_len, expiration);
+}
+
+
+/*
+ * Get a service ticket, using the service ticket cache if there is one.  Takes
+ * the same arguments as krb5_get_credentials without the flags and returns a
+ * Kerberos status code.
+ */
+static krb5_error_code
+get_credentials(struct webauth_context *ctx, struct webauth_krb5 *kc,
+                krb5_creds *in, krb5_creds **out)
+{
+    krb5_error_code code;
+    bool cached;
+
+    cached = ticket_cache_get(ctx, kc, in);
+    code = krb5_get_credentials(kc->ctx, 0, kc->cc, in, out);
+    if (code == 0 && !cached)
+        ticket_cache_put(ctx, kc, in, *out);
+    return code;
+}
+
+
 /*
  * Export a credential into the encoded form that we put into tokens, used for
  * delegating credentials or storing credentials in cookies.  If server is
@@ -754,7 +1378,10 @@ webauth_krb5_export_cred(struct webauth_context *ctx, struct webauth_krb5 *kc,
             goto done;
         }
     }
-    code = krb5_get_credentials(kc->ctx, 0, kc->cc, &in, &out);
+    if (server == NULL)
+        code = krb5_get_credentials(kc->ctx, 0, kc->cc, &in, &out);
+    else
+        code = get_credentials(ctx, kc, &in, &out);
     if (code != 0) {
         error_set(ctx, kc, code, "cannot get credentials");
         goto done;
@@ -876,6 +1503,29 @@ webauth_krb5_get_cache(struct webauth_context *ctx, struct webauth_krb5 *kc,
 }
 
 
+/*
+ * Close the ticket cache of the context without destroying it, so that it
+ * outlives the context.  Normally the cache is destroyed when the context is
+ * freed.  The context can't be used for anything that needs the cache
+ * afterwards.  Returns WA_ERR_NONE on success, or another error code on
+ * failure.
+ */
+int
+webauth_krb5_keep_cache(struct webauth_context *ctx, struct webauth_krb5 *kc)
+{
+    krb5_error_code code;
+
+    if (kc->cc == NULL)
+        return wai_error_set(ctx, WA_ERR_INVALID_CONTEXT,
+                             "Kerberos context not initialized");
+    code = krb5_cc_close(kc->ctx, kc->cc);
+    kc->cc = NULL;
+    if (code != 0)
+        return error_set(ctx, kc, code, "cannot close cache");
+    return WA_ERR_NONE;
+}
+
+
 /*
  * Create an encoded Kerberos request.  The request is stored in output in
  * newly allocated pool memory and the length is stored in length.
@@ -920,7 +1570,7 @@ webauth_krb5_make_auth_data(struct webauth_context *ctx,
         error_set(ctx, kc, code, "cannot get principal from cache");
         goto done;
     }
-    code = krb5_get_credentials(kc->ctx, 0, kc->cc, &increds, &outcreds);
+    code = get_credentials(ctx, kc, &increds, &outcreds);
     if (code != 0) {
         error_set(ctx, kc, code, "cannot get credentials for %s",
                   server_principal);
@@ -1051,8 +1701,10 @@ webauth_krb5_read_auth_data(struct webauth_context *ctx,
     buf.data = (void *) req;
     buf.length = length;
     code = krb5_rd_req(kc->ctx, &auth, &buf, sprinc, kt, NULL, NULL);
-    if (code != 0)
-        return error_set(ctx, kc, code, "cannot read authenticator");
+    if (code != 0) {
+        error_set(ctx, kc, code, "cannot read authenticator");
+        goto done;
+    }
     code = krb5_auth_con_getauthenticator(kc->ctx, auth, &ka);
     if (code != 0) {
         error_set(ctx, kc, code, "cannot determine client identity");
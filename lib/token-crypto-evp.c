@@ -0,0 +1,312 @@
+/*
+ * OpenSSL EVP token crypto backend.
+ *
+ * This file is *included* (via the preprocessor) in token-crypto.c when
+ * WebAuth is built with the EVP token crypto backend, which is the default
+ * when OpenSSL 3.0 or later is available.  If you make any changes here, you
+ * probably also need to make a corresponding change to
+ * token-crypto-legacy.c.
+ *
+ * The EVP interfaces use AES-NI or other hardware acceleration where it's
+ * available, which the low-level AES interface does not.  EVP cipher and MAC
+ * contexts are expensive to create, so each thread keeps one context for
+ * encryption, one for decryption, and one for the HMAC and reuses them for
+ * every token.  Each context remembers the identifier of the key it was last
+ * initialized with and is only rekeyed when a different key is used;
+ * otherwise, only the IV or the HMAC state is reset.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+/* The all-zero IV. */
+static const unsigned char aes_ivec_zero[AES_BLOCK_SIZE] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/*
+ * Per-thread OpenSSL contexts.  Each *_id member is the identifier of the key
+ * the corresponding context is currently keyed with, or 0 if none.
+ */
+struct evp_state {
+    EVP_CIPHER_CTX *encrypt;
+    EVP_CIPHER_CTX *decrypt;
+    EVP_MAC_CTX *mac;
+    uint64_t encrypt_id;
+    uint64_t decrypt_id;
+    uint64_t mac_id;
+};
+
+/* The algorithm implementations, fetched once on first use. */
+static EVP_CIPHER *evp_aes_128 = NULL;
+static EVP_CIPHER *evp_aes_192 = NULL;
+static EVP_CIPHER *evp_aes_256 = NULL;
+static EVP_MAC *evp_hmac = NULL;
+static bool evp_usable = false;
+
+/* The next key identifier to assign.  0 is reserved to mean no key. */
+static uint64_t evp_next_id = 1;
+
+/*
+ * Thread-local storage for the contexts.  Without thread support, there is
+ * only one set of contexts.
+ */
+#if APR_HAS_THREADS
+static pthread_once_t evp_once = PTHREAD_ONCE_INIT;
+static pthread_key_t evp_state_key;
+static pthread_mutex_t evp_id_mutex = PTHREAD_MUTEX_INITIALIZER;
+#else
+static bool evp_initialized = false;
+static struct evp_state *evp_single_state = NULL;
+#endif
+
+
+/*
+ * Free the per-thread contexts.  Used as the destructor for the thread-local
+ * storage key.
+ */
+static void
+evp_state_free(void *data)
+{
+    struct evp_state *state = data;
+
+    if (state == NULL)
+        return;
+    EVP_CIPHER_CTX_free(state->encrypt);
+    EVP_CIPHER_CTX_free(state->decrypt);
+    EVP_MAC_CTX_free(state->mac);
+    free(state);
+}
+
+
+/*
+ * Fetch the algorithm implementations and set up the thread-local storage.
+ * Called once.  If anything fails, evp_usable remains false and every
+ * operation will fail.
+ */
+static void
+evp_init(void)
+{
+    evp_aes_128 = EVP_CIPHER_fetch(NULL, "AES-128-CBC", NULL);
+    evp_aes_192 = EVP_CIPHER_fetch(NULL, "AES-192-CBC", NULL);
+    evp_aes_256 = EVP_CIPHER_fetch(NULL, "AES-256-CBC", NULL);
+    evp_hmac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+    if (evp_aes_128 == NULL || evp_aes_192 == NULL || evp_aes_256 == NULL)
+        return;
+    if (evp_hmac == NULL)
+        return;
+#if APR_HAS_THREADS
+    if (pthread_key_create(&evp_state_key, evp_state_free) != 0)
+        return;
+#endif
+    evp_usable = true;
+}
+
+
+/*
+ * Return the per-thread contexts, creating them if necessary.  Stores the
+ * state in the provided argument and returns a WebAuth status code.
+ */
+static int
+evp_state(struct webauth_context *ctx, struct evp_state **output)
+{
+    struct evp_state *state;
+    OSSL_PARAM params[2];
+
+#if APR_HAS_THREADS
+    pthread_once(&evp_once, evp_init);
+#else
+    if (!evp_initialized) {
+        evp_init();
+        evp_initialized = true;
+    }
+#endif
+    if (!evp_usable)
+        return openssl_error(ctx, WA_ERR_BAD_KEY,
+                             "cannot load AES or HMAC implementation");
+
+    /* Use the existing state for this thread if there is one. */
+#if APR_HAS_THREADS
+    state = pthread_getspecific(evp_state_key);
+#else
+    state = evp_single_state;
+#endif
+    if (state != NULL) {
+        *output = state;
+        return WA_ERR_NONE;
+    }
+
+    /* Create and store new contexts. */
+    state = calloc(1, sizeof(struct evp_state));
+    if (state == NULL)
+        return wai_error_set_system(ctx, WA_ERR_NO_MEM, errno,
+                                    "cannot allocate crypto contexts");
+    state->encrypt = EVP_CIPHER_CTX_new();
+    state->decrypt = EVP_CIPHER_CTX_new();
+    state->mac = EVP_MAC_CTX_new(evp_hmac);
+    if (state->encrypt == NULL || state->decrypt == NULL || state->mac == NULL)
+        goto fail;
+    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                 (char *) "SHA1", 0);
+    params[1] = OSSL_PARAM_construct_end();
+    if (!EVP_MAC_CTX_set_params(state->mac, params))
+        goto fail;
+#if APR_HAS_THREADS
+    if (pthread_setspecific(evp_state_key, state) != 0)
+        goto fail;
+#else
+    evp_single_state = state;
+#endif
+    *output = state;
+    return WA_ERR_NONE;
+
+fail:
+    evp_state_free(state);
+    return openssl_error(ctx, WA_ERR_NO_MEM, "cannot create crypto contexts");
+}
+
+
+/*
+ * Initialize a cipher context for a new token, rekeying it if it's currently
+ * keyed with a different key.  enc is 1 for encryption and 0 for decryption.
+ * Returns a WebAuth status code.
+ */
+static int
+evp_cipher_init(struct webauth_context *ctx, EVP_CIPHER_CTX *cipher,
+                uint64_t *id, const struct webauth_key *key,
+                const struct webauth_key_cache *cache, int enc)
+{
+    const EVP_CIPHER *type;
+
+    /* If the context already has this key, only reset the IV. */
+    if (*id == cache->id) {
+        if (!EVP_CipherInit_ex2(cipher, NULL, NULL, aes_ivec_zero, enc, NULL))
+            return openssl_error(ctx, WA_ERR_BAD_KEY, "cannot reset IV");
+        return WA_ERR_NONE;
+    }
+
+    /* Otherwise, set the cipher and key. */
+    *id = 0;
+    switch (key->length) {
+    case WA_AES_128: type = evp_aes_128; break;
+    case WA_AES_192: type = evp_aes_192; break;
+    case WA_AES_256: type = evp_aes_256; break;
+    default:
+        return wai_error_set(ctx, WA_ERR_BAD_KEY, "unsupported key size %d",
+                             key->length);
+    }
+    if (!EVP_CipherInit_ex2(cipher, type, key->data, aes_ivec_zero, enc, NULL))
+        return openssl_error(ctx, WA_ERR_BAD_KEY, "cannot set encryption key");
+    EVP_CIPHER_CTX_set_padding(cipher, 0);
+    *id = cache->id;
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Compute the cached crypto state for a key.  All we need is a unique
+ * identifier, but check the key size here so that invalid keys are rejected
+ * before use, with the same error as the legacy backend.
+ */
+static int
+crypto_init(struct webauth_context *ctx, const struct webauth_key *key,
+            struct webauth_key_cache *cache)
+{
+    if (key->length != WA_AES_128 && key->length != WA_AES_192
+        && key->length != WA_AES_256)
+        return wai_error_set(ctx, WA_ERR_BAD_KEY, "cannot set encryption key");
+#if APR_HAS_THREADS
+    pthread_mutex_lock(&evp_id_mutex);
+    cache->id = evp_next_id++;
+    pthread_mutex_unlock(&evp_id_mutex);
+#else
+    cache->id = evp_next_id++;
+#endif
+    return WA_ERR_NONE;
+}
+
+
+/* Encrypt length bytes of data in place. */
+static int
+crypto_encrypt(struct webauth_context *ctx, const struct webauth_key *key,
+               const struct webauth_key_cache *cache, unsigned char *data,
+               size_t length)
+{
+    struct evp_state *state;
+    int s, outlen;
+
+    s = evp_state(ctx, &state);
+    if (s != WA_ERR_NONE)
+        return s;
+    s = evp_cipher_init(ctx, state->encrypt, &state->encrypt_id, key, cache,
+                        1);
+    if (s != WA_ERR_NONE)
+        return s;
+    if (!EVP_EncryptUpdate(state->encrypt, data, &outlen, data, length))
+        return openssl_error(ctx, WA_ERR_CORRUPT, "cannot encrypt token");
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Decrypt length bytes of input into output.  Unlike AES_cbc_encrypt, the
+ * EVP interface won't process a trailing partial block, which only happens
+ * for corrupt tokens.  Zero the corresponding output so that the HMAC check
+ * fails cleanly.
+ */
+static int
+crypto_decrypt(struct webauth_context *ctx, const struct webauth_key *key,
+               const struct webauth_key_cache *cache,
+               const unsigned char *input, unsigned char *output,
+               size_t length)
+{
+    struct evp_state *state;
+    size_t blocks;
+    int s, outlen;
+
+    s = evp_state(ctx, &state);
+    if (s != WA_ERR_NONE)
+        return s;
+    s = evp_cipher_init(ctx, state->decrypt, &state->decrypt_id, key, cache,
+                        0);
+    if (s != WA_ERR_NONE)
+        return s;
+    blocks = length - length % AES_BLOCK_SIZE;
+    if (!EVP_DecryptUpdate(state->decrypt, output, &outlen, input, blocks))
+        return openssl_error(ctx, WA_ERR_CORRUPT, "cannot decrypt token");
+    if (blocks < length)
+        memset(output + blocks, 0, length - blocks);
+    return WA_ERR_NONE;
+}
+
+
+/* Compute the HMAC of the given data, storing the result in hmac. */
+static int
+crypto_hmac(struct webauth_context *ctx, const struct webauth_key *key,
+            const struct webauth_key_cache *cache, const unsigned char *data,
+            size_t length, unsigned char *hmac)
+{
+    struct evp_state *state;
+    size_t outlen;
+    int s, ok;
+
+    s = evp_state(ctx, &state);
+    if (s != WA_ERR_NONE)
+        return s;
+
+    /* Passing a NULL key resets the HMAC state but keeps the current key. */
+    if (state->mac_id == cache->id)
+        ok = EVP_MAC_init(state->mac, NULL, 0, NULL);
+    else {
+        state->mac_id = 0;
+        ok = EVP_MAC_init(state->mac, key->data, key->length, NULL);
+        if (ok)
+            state->mac_id = cache->id;
+    }
+    if (ok)
+        ok = EVP_MAC_update(state->mac, data, length);
+    if (ok)
+        ok = EVP_MAC_final(state->mac, hmac, &outlen, T_HMAC_S);
+    if (!ok)
+        return openssl_error(ctx, WA_ERR_CORRUPT, "cannot compute HMAC");
+    return WA_ERR_NONE;
+}
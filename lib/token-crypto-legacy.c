@@ -0,0 +1,122 @@
+/*
+ * Low-level AES and SHA-1 token crypto backend.
+ *
+ * This file is *included* (via the preprocessor) in token-crypto.c when
+ * WebAuth is built with the legacy token crypto backend, which uses the
+ * OpenSSL AES_cbc_encrypt and SHA-1 interfaces directly.  If you make any
+ * changes here, you probably also need to make a corresponding change to
+ * token-crypto-evp.c.
+ *
+ * The cached state for each key holds the expanded AES key schedules and the
+ * SHA-1 state after absorbing the HMAC inner and outer padded keys, so each
+ * token only costs the CBC pass and finishing the HMAC.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+/*
+ * The all-zero IV.  AES_cbc_encrypt modifies the IV it's given, so this is
+ * copied into a local buffer before each use.
+ */
+static const unsigned char aes_ivec_zero[AES_BLOCK_SIZE] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+
+/*
+ * Compute the cached crypto state for a key.  This expands the AES encryption
+ * and decryption key schedules and runs the HMAC inner and outer padded keys
+ * through SHA-1, saving the intermediate state.  Since the key is never longer
+ * than the SHA-1 block size, it's used directly as the HMAC key.
+ */
+static int
+crypto_init(struct webauth_context *ctx, const struct webauth_key *key,
+            struct webauth_key_cache *cache)
+{
+    unsigned char ipad[SHA_CBLOCK], opad[SHA_CBLOCK];
+    size_t i;
+    int s;
+
+    s = AES_set_encrypt_key(key->data, key->length * 8, &cache->encrypt);
+    if (s != 0)
+        return openssl_error(ctx, WA_ERR_BAD_KEY, "cannot set encryption key");
+    s = AES_set_decrypt_key(key->data, key->length * 8, &cache->decrypt);
+    if (s != 0)
+        return openssl_error(ctx, WA_ERR_BAD_KEY, "cannot set decryption key");
+    memset(ipad, 0x36, sizeof(ipad));
+    memset(opad, 0x5c, sizeof(opad));
+    for (i = 0; i < (size_t) key->length; i++) {
+        ipad[i] ^= key->data[i];
+        opad[i] ^= key->data[i];
+    }
+    SHA1_Init(&cache->hmac_inner);
+    SHA1_Update(&cache->hmac_inner, ipad, sizeof(ipad));
+    SHA1_Init(&cache->hmac_outer);
+    SHA1_Update(&cache->hmac_outer, opad, sizeof(opad));
+    OPENSSL_cleanse(ipad, sizeof(ipad));
+    OPENSSL_cleanse(opad, sizeof(opad));
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Encrypt length bytes of data in place.  AES_cbc_encrypt doesn't return
+ * anything, so this can't fail.
+ */
+static int
+crypto_encrypt(struct webauth_context *ctx UNUSED,
+               const struct webauth_key *key UNUSED,
+               const struct webauth_key_cache *cache, unsigned char *data,
+               size_t length)
+{
+    unsigned char aes_ivec[AES_BLOCK_SIZE];
+
+    memcpy(aes_ivec, aes_ivec_zero, sizeof(aes_ivec));
+    AES_cbc_encrypt(data, data, length, &cache->encrypt, aes_ivec,
+                    AES_ENCRYPT);
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Decrypt length bytes of input into output.  AES_cbc_encrypt doesn't return
+ * anything useful, so this can't fail.
+ */
+static int
+crypto_decrypt(struct webauth_context *ctx UNUSED,
+               const struct webauth_key *key UNUSED,
+               const struct webauth_key_cache *cache,
+               const unsigned char *input, unsigned char *output,
+               size_t length)
+{
+    unsigned char aes_ivec[AES_BLOCK_SIZE];
+
+    memcpy(aes_ivec, aes_ivec_zero, sizeof(aes_ivec));
+    AES_cbc_encrypt(input, output, length, &cache->decrypt, aes_ivec,
+                    AES_DECRYPT);
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Compute the HMAC of the given data, storing the result in hmac.  This
+ * produces the same result as HMAC with EVP_sha1 and the key but only has to
+ * process the data and the inner digest.
+ */
+static int
+crypto_hmac(struct webauth_context *ctx UNUSED,
+            const struct webauth_key *key UNUSED,
+            const struct webauth_key_cache *cache, const unsigned char *data,
+            size_t length, unsigned char *hmac)
+{
+    SHA_CTX sha;
+    unsigned char inner[SHA_DIGEST_LENGTH];
+
+    sha = cache->hmac_inner;
+    SHA1_Update(&sha, data, length);
+    SHA1_Final(inner, &sha);
+    sha = cache->hmac_outer;
+    SHA1_Update(&sha, inner, sizeof(inner));
+    SHA1_Final(hmac, &sha);
+    return WA_ERR_NONE;
+}
@@ -21,12 +21,19 @@
 #include <apr_pools.h>
 #include <netinet/in.h>
 #include <openssl/aes.h>
+#include <openssl/crypto.h>
 #include <openssl/err.h>
-#include <openssl/evp.h>
-#include <openssl/hmac.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
 #include <time.h>
+#if HAVE_TOKEN_CRYPTO_EVP
+# include <openssl/core_names.h>
+# include <openssl/evp.h>
+# include <openssl/params.h>
+#endif
+#if APR_HAS_THREADS
+# include <pthread.h>
+#endif
 
 #include <lib/internal.h>
 #include <util/macros.h>
@@ -34,16 +41,6 @@
 #include <webauth/keys.h>
 #include <webauth/tokens.h>
 
-/*
- * An IV to pass to the AES encryption function.  Since the first block of any
- * token is a random nonce, this is uninteresting and therefore always set to
- * all zeroes.  The random nonce will randomize the rest of the CBC mode
- * encryption.
- */
-static unsigned char aes_ivec[AES_BLOCK_SIZE] = {
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-};
-
 /*
  * Define some macros for offsets (_O) and sizes (_S) in tokens.  The token
  * form is:
@@ -61,6 +58,58 @@ static unsigned char aes_ivec[AES_BLOCK_SIZE] = {
 #define T_HMAC_O  (T_NONCE_O + T_NONCE_S)
 #define T_ATTR_O  (T_HMAC_O  + T_HMAC_S)
 
+/* wai_encode_token reserves space for the header and padding. */
+#if T_ATTR_O != WA_TOKEN_HEADER_SIZE || AES_BLOCK_SIZE != WA_TOKEN_PADDING_MAX
+# error "WA_TOKEN_HEADER_SIZE or WA_TOKEN_PADDING_MAX is wrong"
+#endif
+
+/*
+ * The number of keys to try for decryption that we have room for on the
+ * stack.  Larger keyrings with no limit on decryption attempts allocate pool
+ * memory for the list of keys to try.
+ */
+#define DECRYPT_KEYS 16
+
+/*
+ * Cached crypto state for a key.  The contents depend on the token crypto
+ * backend chosen at configure time.  The legacy backend holds the expanded
+ * AES key schedules and the SHA-1 state after absorbing the HMAC inner and
+ * outer padded keys, so that encrypting or decrypting a token only requires
+ * the CBC pass and finishing the HMAC.  The EVP backend keeps its cipher and
+ * MAC contexts per thread and only needs a unique identifier for the key so
+ * that it can tell when those contexts have to be rekeyed.
+ */
+#if HAVE_TOKEN_CRYPTO_EVP
+struct webauth_key_cache {
+    uint64_t id;                /* Unique identifier for this key */
+};
+#else
+struct webauth_key_cache {
+    AES_KEY encrypt;            /* Expanded AES encryption key schedule */
+    AES_KEY decrypt;            /* Expanded AES decryption key schedule */
+    SHA_CTX hmac_inner;         /* SHA-1 state after the key XOR ipad */
+    SHA_CTX hmac_outer;         /* SHA-1 state after the key XOR opad */
+};
+#endif
+
+/*
+ * The crypto state for a key as kept by a keyring.  Keyrings compute the
+ * state for each of their keys when they're built and keep it private to the
+ * library, so struct webauth_key and struct webauth_keyring are unchanged for
+ * callers.  The state also records the key it was computed for and a copy of
+ * that key's material, and is only used while the key still has that
+ * material, so keys whose data or length was changed after they were added
+ * get the correct state.  Everything is wiped when the state is replaced or
+ * its pool is cleared.
+ */
+struct wai_key_state {
+    apr_pool_t *pool;                   /* Pool holding this struct */
+    const struct webauth_key *key;      /* Key the state was computed for */
+    size_t length;                      /* Length of the key material */
+    unsigned char data[WA_AES_256];     /* Copy of the key material */
+    struct webauth_key_cache cache;     /* Crypto state for that key */
+};
+
 
 /*
  * Set the internal error for an OpenSSL error.  Takes the WebAuth context to
@@ -125,20 +174,136 @@ encoded_length(size_t alen, size_t *plen)
 
 
 /*
- * A wrapper around webauth_token_create_with_key that first finds the best
- * key from the given keyring and then encodes with that key, returning the
- * results in the same way that webauth_token_create_with_key does.
+ * The implementation of the underlying cipher and MAC is chosen at configure
+ * time and *included* here, so that its functions can remain static.  Each
+ * backend provides the following functions, all of which take the key and
+ * its cached state and return a WebAuth status code:
+ *
+ *     crypto_init      Compute the cached state for a key
+ *     crypto_encrypt   AES-CBC encrypt data in place with an all-zero IV
+ *     crypto_decrypt   AES-CBC decrypt input into output with an all-zero IV
+ *     crypto_hmac      HMAC-SHA1 of data, storing T_HMAC_S bytes
+ *
+ * The IV is uninteresting since the first block of every token is a random
+ * nonce, which randomizes the rest of the CBC mode encryption.  All backends
+ * must produce byte-identical tokens.
+ */
+#if HAVE_TOKEN_CRYPTO_EVP
+# include "token-crypto-evp.c"
+#else
+# include "token-crypto-legacy.c"
+#endif
+
+
+/*
+ * Wipe the crypto state for a key.  This is registered as a cleanup on the
+ * pool the state is allocated from.
+ */
+static apr_status_t
+cleanse_state(void *data)
+{
+    OPENSSL_cleanse(data, sizeof(struct wai_key_state));
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Compute the crypto state for a key, allocated from the context pool, for a
+ * keyring to keep.  Returns NULL for keys that can't be used, leaving it to
+ * encryption or decryption with that key to report the error.
+ */
+struct wai_key_state *
+wai_key_state_new(struct webauth_context *ctx, const struct webauth_key *key)
+{
+    struct wai_key_state *state;
+
+    if (key->length != WA_AES_128 && key->length != WA_AES_192
+        && key->length != WA_AES_256)
+        return NULL;
+    state = apr_pcalloc(ctx->pool, sizeof(struct wai_key_state));
+    apr_pool_cleanup_register(ctx->pool, state, cleanse_state,
+                              apr_pool_cleanup_null);
+    state->pool = ctx->pool;
+    if (crypto_init(ctx, key, &state->cache) != WA_ERR_NONE) {
+        apr_pool_cleanup_run(ctx->pool, state, cleanse_state);
+        return NULL;
+    }
+    state->key = key;
+    state->length = key->length;
+    memcpy(state->data, key->data, key->length);
+    return state;
+}
+
+
+/*
+ * Return true if the crypto state was computed for this key with its current
+ * key material.
+ */
+bool
+wai_key_state_valid(const struct wai_key_state *state,
+                    const struct webauth_key *key)
+{
+    if (state->key != key || state->length != (size_t) key->length)
+        return false;
+    return CRYPTO_memcmp(state->data, key->data, state->length) == 0;
+}
+
+
+/*
+ * Wipe the crypto state for a key that its keyring no longer needs.  The
+ * memory itself is freed with its pool.
+ */
+void
+wai_key_state_free(struct wai_key_state *state)
+{
+    apr_pool_cleanup_run(state->pool, state, cleanse_state);
+}
+
+
+/*
+ * Find the crypto state for a key from the given keyring.  If the keyring has
+ * valid state for that key, point cache at it.  Otherwise, compute the state
+ * into scratch and point cache at that, in which case the caller should wipe
+ * scratch when done.  Returns a WebAuth status code.
+ */
+static int
+key_state(struct webauth_context *ctx, const struct webauth_keyring *ring,
+          const struct webauth_key *key, struct webauth_key_cache *scratch,
+          const struct webauth_key_cache **cache)
+{
+    const struct wai_key_state *state;
+    int s;
+
+    state = wai_keyring_state(ring, key);
+    if (state != NULL && wai_key_state_valid(state, key)) {
+        *cache = &state->cache;
+        return WA_ERR_NONE;
+    }
+    s = crypto_init(ctx, key, scratch);
+    if (s != WA_ERR_NONE)
+        return s;
+    *cache = scratch;
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Encrypt attributes in place with the best key from the given keyring.  The
+ * attributes must be preceded by T_ATTR_O bytes and followed by
+ * AES_BLOCK_SIZE bytes of space, into which we write the header and padding.
+ * Stores the start of the token and its length in output and output_len.
  */
 int
-webauth_token_encrypt(struct webauth_context *ctx, const void *input,
-                      size_t len, void **output, size_t *output_len,
-                      const struct webauth_keyring *ring)
+wai_token_encrypt(struct webauth_context *ctx, void *input, size_t len,
+                  void **output, size_t *output_len,
+                  const struct webauth_keyring *ring)
 {
     const struct webauth_key *key;
+    const struct webauth_key_cache *cache;
+    struct webauth_key_cache scratch;
     size_t elen, plen, i;
     int s;
-    unsigned char *result, *p, *hmac;
-    AES_KEY aes_key;
+    unsigned char *result, *p;
     uint32_t hint;
 
     /* Clear our output paramters in case of error. */
@@ -150,16 +315,14 @@ webauth_token_encrypt(struct webauth_context *ctx, const void *input,
     if (s != WA_ERR_NONE)
         return s;
 
-    /* Create our encryption key. */
-    s = AES_set_encrypt_key(key->data, key->length * 8, &aes_key);
-    if (s != 0) {
-        s = WA_ERR_BAD_KEY;
-        return openssl_error(ctx, s, "cannot set encryption key");
-    }
+    /* Get the expanded encryption key and HMAC state. */
+    s = key_state(ctx, ring, key, &scratch, &cache);
+    if (s != WA_ERR_NONE)
+        return s;
 
     /* {key-hint}{nonce}{hmac}{attr}{padding} */
     elen = encoded_length(len, &plen);
-    result = apr_palloc(ctx->pool, elen);
+    result = (unsigned char *) input - T_ATTR_O;
     p = result;
 
     /* {key-hint} */
@@ -170,17 +333,14 @@ webauth_token_encrypt(struct webauth_context *ctx, const void *input,
     /* {nonce} */
     s = RAND_pseudo_bytes(p, T_NONCE_S);
     if (s < 0) {
+        OPENSSL_cleanse(&scratch, sizeof(scratch));
         s = WA_ERR_RAND_FAILURE;
         return openssl_error(ctx, s, "cannot generate random nonce");
     }
     p += T_NONCE_S;
 
-    /* Leave room for HMAC, which we'll add later. */
-    p += T_HMAC_S;
-
-    /* {attr} */
-    memcpy(p, input, len);
-    p += len;
+    /* Leave room for HMAC, which we'll add later, and skip the attributes. */
+    p += T_HMAC_S + len;
 
     /* {padding} */
     for (i = 0; i < plen; i++)
@@ -190,18 +350,16 @@ webauth_token_encrypt(struct webauth_context *ctx, const void *input,
      * Calculate the HMAC over the data and padding.  We should use something
      * better than this for the HMAC key.
      */
-    hmac = HMAC(EVP_sha1(), key->data, key->length,
-                result + T_ATTR_O, len + plen,         /* data, len */
-                result + T_HMAC_O, NULL);              /* hmac, len */
-    if (hmac == NULL)
-        return openssl_error(ctx, WA_ERR_CORRUPT, "cannot compute HMAC");
-
-    /*
-     * Now AES-encrypt in place everything but the time at the front.
-     * AES_cbc_encrypt doesn't return anything.
-     */
-    AES_cbc_encrypt(result + T_NONCE_O, result + T_NONCE_O, elen - T_HINT_S,
-                    &aes_key, aes_ivec, AES_ENCRYPT);
+    s = crypto_hmac(ctx, key, cache, result + T_ATTR_O, len + plen,
+                    result + T_HMAC_O);
+
+    /* Now AES-encrypt in place everything but the time at the front. */
+    if (s == WA_ERR_NONE)
+        s = crypto_encrypt(ctx, key, cache, result + T_NONCE_O,
+                           elen - T_HINT_S);
+    OPENSSL_cleanse(&scratch, sizeof(scratch));
+    if (s != WA_ERR_NONE)
+        return s;
 
     /* All done.  Return the result. */
     *output = result;
@@ -211,148 +369,307 @@ webauth_token_encrypt(struct webauth_context *ctx, const void *input,
 
 
 /*
- * Given a token and its length, decrypt it into the provided output buffer
- * with the length stored in output_len.  The output buffer must be at least
- * as large as the input length.  Uses the provided decryption key.
+ * A wrapper around wai_token_encrypt for arbitrary input that copies the
+ * input into newly allocated memory with room for the header and padding,
+ * returning the results in the same way.
+ */
+int
+webauth_token_encrypt(struct webauth_context *ctx, const void *input,
+                      size_t len, void **output, size_t *output_len,
+                      const struct webauth_keyring *ring)
+{
+    unsigned char *buffer;
+
+    buffer = apr_palloc(ctx->pool, T_ATTR_O + len + AES_BLOCK_SIZE);
+    memcpy(buffer + T_ATTR_O, input, len);
+    return wai_token_encrypt(ctx, buffer + T_ATTR_O, len, output, output_len,
+                             ring);
+}
+
+
+/*
+ * Given a token and its length, decrypt it into the provided buffer and store
+ * a pointer to the decrypted attributes within that buffer in output and
+ * their length in output_len.  The buffer must be at least as large as the
+ * input length.  Uses the provided decryption key from the given keyring.
  *
  * Returns a WA_ERR code.
  */
 static int
 decrypt_token(struct webauth_context *ctx, const unsigned char *input,
-              size_t length, unsigned char *output, size_t *output_len,
+              size_t length, unsigned char *buffer, void **output,
+              size_t *output_len, const struct webauth_keyring *ring,
               const struct webauth_key *key)
 {
     unsigned char computed_hmac[T_HMAC_S];
     size_t needed, plen, i;
     int s;
-    unsigned char *hmac;
-    AES_KEY aes_key;
+    const struct webauth_key_cache *cache;
+    struct webauth_key_cache scratch;
 
     /* Basic sanity check. */
     needed = T_HINT_S + T_NONCE_S + T_HMAC_S;
     if (length < needed + needed % AES_BLOCK_SIZE)
         return wai_error_set(ctx, WA_ERR_CORRUPT, "token too short");
 
-    /* Create our decryption key. */
-    s = AES_set_decrypt_key(key->data, key->length * 8, &aes_key);
-    if (s != 0)
-        return openssl_error(ctx, WA_ERR_BAD_KEY, "cannot set encryption key");
+    /* Get the expanded decryption key and HMAC state. */
+    s = key_state(ctx, ring, key, &scratch, &cache);
+    if (s != WA_ERR_NONE)
+        return s;
 
     /*
      * Decrypt everything except the time at the front.  We intentionally skip
-     * the same number of bytes at the start of the output buffer as we skip
-     * at the start of the input buffer to make the offsets line up and be
-     * less annoying.
+     * the same number of bytes at the start of the buffer as we skip at the
+     * start of the input to make the offsets line up and be less annoying.
      *
-     * AES_cbc_encrypt doesn't return anything useful.
-     */
-    AES_cbc_encrypt(input + T_NONCE_O, output + T_NONCE_O, length - T_HINT_S,
-                    &aes_key, aes_ivec, AES_DECRYPT);
-
-    /*
-     * We now need to compute the HMAC over data and padding to see if
+     * We then need to compute the HMAC over data and padding to see if
      * decryption succeeded.
      */
-    hmac = HMAC(EVP_sha1(), key->data, key->length, output + T_ATTR_O,
-                length - T_ATTR_O, computed_hmac, NULL);
-    if (hmac == NULL)
-        return openssl_error(ctx, WA_ERR_CORRUPT, "cannot compute HMAC");
-    if (memcmp(output + T_HMAC_O, computed_hmac, T_HMAC_S) != 0)
+    s = crypto_decrypt(ctx, key, cache, input + T_NONCE_O, buffer + T_NONCE_O,
+                       length - T_HINT_S);
+    if (s == WA_ERR_NONE)
+        s = crypto_hmac(ctx, key, cache, buffer + T_ATTR_O, length - T_ATTR_O,
+                        computed_hmac);
+    OPENSSL_cleanse(&scratch, sizeof(scratch));
+    if (s != WA_ERR_NONE)
+        return s;
+    if (memcmp(buffer + T_HMAC_O, computed_hmac, T_HMAC_S) != 0)
         return wai_error_set(ctx, WA_ERR_BAD_HMAC, NULL);
 
     /* Check padding length and data validity. */
-    plen = output[length - 1];
+    plen = buffer[length - 1];
     if (plen > AES_BLOCK_SIZE || plen > length)
         return wai_error_set(ctx, WA_ERR_CORRUPT, "token padding corrupt");
     for (i = length - plen; i < length - 1; i++)
-        if (output[i] != plen)
+        if (buffer[i] != plen)
             return wai_error_set(ctx, WA_ERR_CORRUPT, "token padding corrupt");
 
     /*
-     * Shift the interersting data up to the start of the output buffer, store
-     * the decoded length and return.
+     * Point the output at the interesting data where it sits rather than
+     * shifting it to the start of the buffer.
      */
+    *output = buffer + T_ATTR_O;
     *output_len = length - T_ATTR_O - plen;
-    memmove(output, output + T_ATTR_O, *output_len);
     return WA_ERR_NONE;
 }
 
 
 /*
- * Decrypts a token into new pool-allocated memory, given the token as input
- * and its length as input_len, and stores the results in output and
- * output_len.  Takes a keyring to use for decryption.  Returns a WA_ERR code.
+ * Decrypts a token into a caller-provided buffer, which must be at least
+ * input_len bytes long and must not overlap the input.  Stores a pointer to
+ * the decrypted data, which will point somewhere inside that buffer, in
+ * output and its length in output_len.  Takes a keyring to use for
+ * decryption.  Returns a WA_ERR code.
  */
 int
-webauth_token_decrypt(struct webauth_context *ctx, const void *input,
-                      size_t input_len, void **output, size_t *output_len,
-                      const struct webauth_keyring *ring)
+wai_token_decrypt(struct webauth_context *ctx, const void *input,
+                  size_t input_len, void *buffer, void **output,
+                  size_t *output_len, const struct webauth_keyring *ring)
 {
-    size_t dlen, i;
+    const struct webauth_key *stack[DECRYPT_KEYS];
+    const struct webauth_key **keys;
+    size_t max, count, i;
+    uint32_t hint;
     int s;
-    const struct webauth_key *key;
-    const unsigned char *inbuf = input;
-    unsigned char *outbuf;
-    const struct webauth_keyring_entry *entry;
 
     /* Clear our output parameters in case of an error. */
     *output = NULL;
     *output_len = 0;
+    ctx->decrypt_trials = 0;
 
     /* Sanity-check our keyring. */
     if (ring->entries->nelts == 0)
         return wai_error_set(ctx, WA_ERR_BAD_KEY, "empty keyring");
 
     /*
-     * Create a buffer to hold the decrypted output.  We don't need to include
-     * the hint in this buffer, but keeping the same offsets in the input and
-     * output buffer during decryption makes the code much easier to read.
+     * Get the keys to try, in order.  The first is the best key for the hint,
+     * which is the time the token was created.  If that fails, try the other
+     * keys nearest to it, up to the configured limit.
+     */
+    max = ring->entries->nelts;
+    if (ctx->decrypt_limit > 0 && ctx->decrypt_limit < max)
+        max = ctx->decrypt_limit;
+    if (max <= DECRYPT_KEYS)
+        keys = stack;
+    else
+        keys = apr_palloc(ctx->pool, max * sizeof(const struct webauth_key *));
+    hint = 0;
+    if (input_len >= T_HINT_S) {
+        memcpy(&hint, input, T_HINT_S);
+        hint = ntohl(hint);
+    }
+    count = wai_keyring_decrypt_keys(ring, hint, keys, max);
+
+    /*
+     * Try each key in turn, stopping at anything other than an HMAC failure.
+     * Decryption never modifies the input, so a failed attempt leaves nothing
+     * to clean up.
+     */
+    s = WA_ERR_BAD_HMAC;
+    for (i = 0; i < count; i++) {
+        ctx->decrypt_trials++;
+        s = decrypt_token(ctx, input, input_len, buffer, output, output_len,
+                          ring, keys[i]);
+        if (s != WA_ERR_BAD_HMAC)
+            break;
+    }
+    return s;
+}
+
+
+/*
+ * Decrypts several tokens with the same keyring.  Each token gets the same
+ * treatment as from wai_token_decrypt, one token at a time; the only work
+ * shared between tokens is the list of keys to try, which is computed once
+ * per distinct key hint.  The expanded key and HMAC state comes from the
+ * keyring as it does for a single token, so there is nothing else to share.
+ * Every token is first tried with its best key, and only the tokens whose
+ * HMAC check fails then go on to try the rest of their keys.
+ *
+ * Tokens whose status is already an error are skipped.  Returns WA_ERR_NONE
+ * if every token decrypted successfully and otherwise the status of the first
+ * one that didn't, with the context error set to its message.
+ */
+int
+wai_token_decrypt_batch(struct webauth_context *ctx,
+                        struct wai_token_decrypt *tokens, size_t count,
+                        const struct webauth_keyring *ring)
+{
+    const struct webauth_key ***keys;
+    size_t *nkeys;
+    size_t max, i, j;
+    uint32_t *hints;
+    struct wai_token_decrypt *token;
+    int s;
+
+    /* Allocate the per-token key lists and hints. */
+    keys = apr_pcalloc(ctx->pool, count * sizeof(*keys));
+    nkeys = apr_pcalloc(ctx->pool, count * sizeof(size_t));
+    hints = apr_pcalloc(ctx->pool, count * sizeof(uint32_t));
+    max = ring->entries->nelts;
+    if (ctx->decrypt_limit > 0 && ctx->decrypt_limit < max)
+        max = ctx->decrypt_limit;
+
+    /*
+     * Get the keys to try for each token, reusing the list of an earlier
+     * token with the same hint.
      */
-    dlen = input_len;
-    outbuf = apr_palloc(ctx->pool, dlen);
+    for (i = 0; i < count; i++) {
+        token = &tokens[i];
+        token->output = NULL;
+        token->output_len = 0;
+        token->trials = 0;
+        if (token->status != WA_ERR_NONE)
+            continue;
+        if (max == 0) {
+            token->status = wai_error_set(ctx, WA_ERR_BAD_KEY,
+                                          "empty keyring");
+            token->error = webauth_error_message(ctx, token->status);
+            continue;
+        }
+        if (token->input_len >= T_HINT_S) {
+            memcpy(&hints[i], token->input, T_HINT_S);
+            hints[i] = ntohl(hints[i]);
+        }
+        for (j = 0; j < i; j++)
+            if (keys[j] != NULL && hints[j] == hints[i])
+                break;
+        if (j < i) {
+            keys[i] = keys[j];
+            nkeys[i] = nkeys[j];
+        } else {
+            keys[i] = apr_palloc(ctx->pool, max * sizeof(**keys));
+            nkeys[i] = wai_keyring_decrypt_keys(ring, hints[i], keys[i], max);
+        }
+    }
 
     /*
-     * Find the decryption key.  If there's only one entry in the keyring,
-     * this is easy: we use that key.  Otherwise, we try the hinted key.
-     * Failing that, we try all keys.
+     * Try each token with its best key, then try the remaining keys for each
+     * token whose HMAC check failed, stopping at anything other than an HMAC
+     * failure.
      */
-    if (ring->entries->nelts == 1) {
-        entry = &APR_ARRAY_IDX(ring->entries, 0, struct webauth_keyring_entry);
-        key = entry->key;
-        s = decrypt_token(ctx, inbuf, input_len, outbuf, &dlen, key);
-    } else {
-        uint32_t hint_buf;
-        time_t h;
-
-        /* First, try the hint. */
-        memcpy(&hint_buf, inbuf, sizeof(hint_buf));
-        h = ntohl(hint_buf);
-        s = webauth_keyring_best_key(ctx, ring, WA_KEY_DECRYPT, h, &key);
-        if (s == WA_ERR_NONE)
-            s = decrypt_token(ctx, inbuf, input_len, outbuf, &dlen, key);
-        else
-            s = WA_ERR_BAD_HMAC;
-
-        /*
-         * Now, as long as we didn't decode successfully, try each key in the
-         * keyring in turn.  If the input is dirty, we have to replace the
-         * input with our temporary buffer and try again.
-         */
-        if (s == WA_ERR_BAD_HMAC)
-            for (i = 0; i < (size_t) ring->entries->nelts; i++) {
-                entry = &APR_ARRAY_IDX(ring->entries, i,
-                                       struct webauth_keyring_entry);
-                if (entry->key == key)
-                    continue;
-                s = decrypt_token(ctx, inbuf, input_len, outbuf, &dlen,
-                                  entry->key);
-                if (s != WA_ERR_BAD_HMAC)
-                    break;
-            }
+    for (i = 0; i < count; i++) {
+        token = &tokens[i];
+        if (keys[i] == NULL)
+            continue;
+        token->trials = 1;
+        token->status = decrypt_token(ctx, token->input, token->input_len,
+                                      token->buffer, &token->output,
+                                      &token->output_len, ring, keys[i][0]);
+        if (token->status != WA_ERR_NONE && token->status != WA_ERR_BAD_HMAC)
+            token->error = webauth_error_message(ctx, token->status);
+    }
+    for (i = 0; i < count; i++) {
+        token = &tokens[i];
+        if (keys[i] == NULL || token->status != WA_ERR_BAD_HMAC)
+            continue;
+        for (j = 1; j < nkeys[i]; j++) {
+            token->trials++;
+            token->status = decrypt_token(ctx, token->input, token->input_len,
+                                          token->buffer, &token->output,
+                                          &token->output_len, ring,
+                                          keys[i][j]);
+            if (token->status != WA_ERR_BAD_HMAC)
+                break;
+        }
+        if (token->status != WA_ERR_NONE)
+            token->error = webauth_error_message(ctx, token->status);
     }
-    if (s == WA_ERR_NONE) {
-        *output = outbuf;
-        *output_len = dlen;
+
+    /* Report the total trials and the first failure, if any. */
+    ctx->decrypt_trials = 0;
+    s = WA_ERR_NONE;
+    for (i = 0; i < count; i++) {
+        ctx->decrypt_trials += tokens[i].trials;
+        if (s == WA_ERR_NONE && tokens[i].status != WA_ERR_NONE) {
+            s = tokens[i].status;
+            ctx->status = s;
+            ctx->error = tokens[i].error;
+        }
     }
     return s;
 }
+
+
+/*
+ * Decrypts a token into new pool-allocated memory, given the token as input
+ * and its length as input_len, and stores the results in output and
+ * output_len.  Takes a keyring to use for decryption.  Returns a WA_ERR code.
+ */
+int
+webauth_token_decrypt(struct webauth_context *ctx, const void *input,
+                      size_t input_len, void **output, size_t *output_len,
+                      const struct webauth_keyring *ring)
+{
+    void *buffer;
+
+    /*
+     * Create a buffer to hold the decrypted output.  We don't need to include
+     * the hint in this buffer, but keeping the same offsets in the input and
+     * output buffer during decryption makes the code much easier to read.
+     */
+    buffer = apr_palloc(ctx->pool, input_len);
+    return wai_token_decrypt(ctx, input, input_len, buffer, output,
+                             output_len, ring);
+}
+
+
+/*
+ * Set the maximum number of keys to try when decrypting a token.  0 means no
+ * limit.
+ */
+void
+webauth_token_decrypt_limit(struct webauth_context *ctx, unsigned long limit)
+{
+    ctx->decrypt_limit = limit;
+}
+
+
+/*
+ * Return the number of keys tried while decrypting the most recent token.
+ */
+unsigned long
+webauth_token_decrypt_trials(const struct webauth_context *ctx)
+{
+    return ctx->decrypt_trials;
+}
@@ -15,7 +15,6 @@
 #include <portable/apr.h>
 #include <portable/system.h>
 
-#include <apr_base64.h>
 #include <apr_lib.h>
 #include <apr_uri.h>
 #include <time.h>
@@ -572,28 +571,72 @@ check_token(struct webauth_context *ctx, const struct webauth_token *token,
 
 
 /*
- * Decode an arbitrary raw token (one that is not base64-encoded).  Takes the
- * context, the expected token type (which may be WA_TOKEN_ANY), the token,
- * its length, and the keyring to decrypt it, and stores the newly-allocated
- * generic token struct in the decoded argument.  On error, decoded is set to
- * NULL and an error code is returned.
+ * Decode decrypted token attributes in place into the provided token struct
+ * and check that the token is of the expected type and internally consistent.
+ * Takes the context, the expected token type (which may be WA_TOKEN_ANY), the
+ * attributes and their length, and the token struct, and returns a WebAuth
+ * status code.  Once the type is known to be correct, type_string is updated
+ * to its name for error reporting; the caller adds the error context.
  */
-int
-webauth_token_decode_raw(struct webauth_context *ctx,
-                         enum webauth_token_type type, const void *token,
-                         size_t length, const struct webauth_keyring *ring,
-                         struct webauth_token **decoded)
+static int
+decode_attrs(struct webauth_context *ctx, enum webauth_token_type type,
+             void *attrs, size_t alen, struct webauth_token *out,
+             const char **type_string)
+{
+    int s;
+
+    /* Decode the attributes in place. */
+    s = wai_decode_token(ctx, attrs, alen, out);
+    if (s != WA_ERR_NONE)
+        return s;
+
+    /* Check the token type to see if it's what we expect. */
+    if (type != WA_TOKEN_ANY && type != out->type)
+        return wai_error_set(ctx, WA_ERR_CORRUPT, "wrong token type %s",
+                             webauth_token_type_string(out->type));
+    *type_string = webauth_token_type_string(out->type);
+
+    /* Check the token data for consistency. */
+    return check_token(ctx, out, DECODE);
+}
+
+
+/*
+ * Add context to a token decoding error, given the name of the token type or
+ * NULL if it's not known.
+ */
+static void
+decode_context(struct webauth_context *ctx, const char *type_string)
+{
+    if (type_string == NULL)
+        wai_error_context(ctx, "decoding token");
+    else
+        wai_error_context(ctx, "decoding %s token", type_string);
+}
+
+
+/*
+ * Decode a raw token into the provided token struct, using buffer as space
+ * for the decrypted attributes.  buffer must be at least length bytes long
+ * and must live as long as the decoded token, since the strings and data in
+ * the token point into it.  Takes the context, the expected token type
+ * (which may be WA_TOKEN_ANY), the token, its length, and the keyring to
+ * decrypt it, and returns a WebAuth status code.
+ *
+ * This is shared by webauth_token_decode and webauth_token_decode_raw, which
+ * allocate the token struct and buffer in one piece of pool memory.
+ */
+static int
+decode_raw(struct webauth_context *ctx, enum webauth_token_type type,
+           const void *token, size_t length,
+           const struct webauth_keyring *ring, struct webauth_token *out,
+           void *buffer)
 {
     void *attrs;
     size_t alen;
     const char *type_string = NULL;
-    struct webauth_token *out;
     int s;
 
-    /* Allocate some space to store the decoded token. */
-    *decoded = NULL;
-    out = apr_palloc(ctx->pool, sizeof(struct webauth_token));
-
     /* Do some initial sanity checking. */
     type_string = webauth_token_type_string(type);
     if (type_string == NULL && type != WA_TOKEN_ANY) {
@@ -602,39 +645,43 @@ webauth_token_decode_raw(struct webauth_context *ctx,
         goto fail;
     }
 
-    /* Decrypt the token. */
-    s = webauth_token_decrypt(ctx, token, length, &attrs, &alen, ring);
+    /* Decrypt and decode the token. */
+    s = wai_token_decrypt(ctx, token, length, buffer, &attrs, &alen, ring);
     if (s != WA_ERR_NONE)
         goto fail;
-
-    /* Decode the attributes. */
-    s = wai_decode_token(ctx, attrs, alen, out);
+    s = decode_attrs(ctx, type, attrs, alen, out, &type_string);
     if (s != WA_ERR_NONE)
         goto fail;
+    return WA_ERR_NONE;
 
-    /* Check the token type to see if it's what we expect. */
-    if (type != WA_TOKEN_ANY && type != out->type) {
-        s = WA_ERR_CORRUPT;
-        wai_error_set(ctx, s, "wrong token type %s",
-                      webauth_token_type_string(out->type));
-        goto fail;
-    }
-    type_string = webauth_token_type_string(out->type);
+fail:
+    decode_context(ctx, type_string);
+    return s;
+}
 
-    /* Check the token data for consistency. */
-    s = check_token(ctx, out, DECODE);
-    if (s != WA_ERR_NONE)
-        goto fail;
 
-    /* Success. */
-    *decoded = out;
-    return WA_ERR_NONE;
+/*
+ * Decode an arbitrary raw token (one that is not base64-encoded).  Takes the
+ * context, the expected token type (which may be WA_TOKEN_ANY), the token,
+ * its length, and the keyring to decrypt it, and stores the newly-allocated
+ * generic token struct in the decoded argument.  On error, decoded is set to
+ * NULL and an error code is returned.
+ */
+int
+webauth_token_decode_raw(struct webauth_context *ctx,
+                         enum webauth_token_type type, const void *token,
+                         size_t length, const struct webauth_keyring *ring,
+                         struct webauth_token **decoded)
+{
+    struct webauth_token *out;
+    int s;
 
-fail:
-    if (type_string == NULL)
-        wai_error_context(ctx, "decoding token");
-    else
-        wai_error_context(ctx, "decoding %s token", type_string);
+    /* Allocate the token struct with room for the decrypted data after it. */
+    *decoded = NULL;
+    out = apr_palloc(ctx->pool, sizeof(struct webauth_token) + length);
+    s = decode_raw(ctx, type, token, length, ring, out, out + 1);
+    if (s == WA_ERR_NONE)
+        *decoded = out;
     return s;
 }
 
@@ -652,15 +699,135 @@ webauth_token_decode(struct webauth_context *ctx,
                      const struct webauth_keyring *ring,
                      struct webauth_token **decoded)
 {
-    size_t length;
-    void *input;
+    size_t length, size;
+    struct webauth_token *out;
+    char *input, *buffer;
+    int s;
 
+    *decoded = NULL;
     if (token == NULL)
         return wai_error_set(ctx, WA_ERR_INVALID, "token is NULL");
-    length = apr_base64_decode_len(token);
-    input = apr_palloc(ctx->pool, length);
-    length = apr_base64_decode(input, token);
-    return webauth_token_decode_raw(ctx, type, input, length, ring, decoded);
+
+    /*
+     * Allocate the token struct, the base64-decoded token, and the buffer for
+     * the decrypted data in one piece of pool memory.  The decoded length is
+     * never more than the estimate, so it's safe to use for both.
+     */
+    length = strlen(token);
+    size = wai_base64_decoded_length(length);
+    out = apr_palloc(ctx->pool, sizeof(struct webauth_token) + size * 2);
+    input = (char *) (out + 1);
+    buffer = input + size;
+    length = wai_base64_decode(token, length, input);
+    s = decode_raw(ctx, type, input, length, ring, out, buffer);
+    if (s == WA_ERR_NONE)
+        *decoded = out;
+    return s;
+}
+
+
+/*
+ * Decode several base64-encoded tokens with the same keyring.  All of the
+ * token structs, the base64-decoded tokens, and the buffers for decryption
+ * are allocated in one piece of pool memory, and decryption is done as a
+ * batch so that the tokens share the key search and cipher setup.  Each
+ * token's result is stored in its element of the array.  Returns WA_ERR_NONE
+ * if every token was decoded and otherwise the status of the first that
+ * wasn't, with the context error set to its message.
+ */
+int
+webauth_token_decode_batch(struct webauth_context *ctx,
+                           struct webauth_token_batch *tokens, size_t count,
+                           const struct webauth_keyring *ring)
+{
+    struct wai_token_decrypt *crypt;
+    struct webauth_token *out;
+    const char *type_string;
+    size_t i, length, size, total;
+    char *p;
+    int s;
+
+    if (count == 0)
+        return WA_ERR_NONE;
+
+    /*
+     * Allocate the token structs as an array followed by the space for each
+     * token's base64-decoded form and decrypted data.
+     */
+    total = count * sizeof(struct webauth_token);
+    for (i = 0; i < count; i++)
+        if (tokens[i].token != NULL) {
+            size = wai_base64_decoded_length(strlen(tokens[i].token));
+            total += size * 2;
+        }
+    out = apr_palloc(ctx->pool, total);
+    p = (char *) (out + count);
+    crypt = apr_pcalloc(ctx->pool, count * sizeof(struct wai_token_decrypt));
+
+    /* Base64-decode the tokens and set up the batch for decryption. */
+    for (i = 0; i < count; i++) {
+        tokens[i].decoded = NULL;
+        tokens[i].error = NULL;
+        tokens[i].trials = 0;
+        type_string = webauth_token_type_string(tokens[i].type);
+        if (tokens[i].token == NULL)
+            crypt[i].status = wai_error_set(ctx, WA_ERR_INVALID,
+                                            "token is NULL");
+        else if (type_string == NULL && tokens[i].type != WA_TOKEN_ANY) {
+            crypt[i].status = wai_error_set(ctx, WA_ERR_INVALID,
+                                            "unknown token type %d",
+                                            tokens[i].type);
+            decode_context(ctx, NULL);
+        }
+        if (crypt[i].status != WA_ERR_NONE) {
+            crypt[i].error = webauth_error_message(ctx, crypt[i].status);
+            continue;
+        }
+        length = strlen(tokens[i].token);
+        size = wai_base64_decoded_length(length);
+        crypt[i].input = p;
+        crypt[i].buffer = p + size;
+        crypt[i].input_len = wai_base64_decode(tokens[i].token, length, p);
+        p += size * 2;
+    }
+
+    /* Decrypt all of the tokens and then decode each one. */
+    wai_token_decrypt_batch(ctx, crypt, count, ring);
+    s = WA_ERR_NONE;
+    for (i = 0; i < count; i++) {
+        tokens[i].trials = crypt[i].trials;
+        tokens[i].status = crypt[i].status;
+        tokens[i].error = crypt[i].error;
+        if (crypt[i].input != NULL) {
+            type_string = webauth_token_type_string(tokens[i].type);
+            if (tokens[i].status == WA_ERR_NONE)
+                tokens[i].status = decode_attrs(ctx, tokens[i].type,
+                                                crypt[i].output,
+                                                crypt[i].output_len, &out[i],
+                                                &type_string);
+            else {
+                ctx->status = crypt[i].status;
+                ctx->error = crypt[i].error;
+            }
+            if (tokens[i].status == WA_ERR_NONE)
+                tokens[i].decoded = &out[i];
+            else {
+                decode_context(ctx, type_string);
+                tokens[i].error = webauth_error_message(ctx, tokens[i].status);
+            }
+        }
+        if (s == WA_ERR_NONE && tokens[i].status != WA_ERR_NONE)
+            s = tokens[i].status;
+    }
+
+    /* Leave the context error set to the first failure. */
+    for (i = 0; i < count; i++)
+        if (tokens[i].status != WA_ERR_NONE) {
+            ctx->status = tokens[i].status;
+            ctx->error = tokens[i].error;
+            break;
+        }
+    return s;
 }
 
 
@@ -697,11 +864,14 @@ webauth_token_encode_raw(struct webauth_context *ctx,
     if (s != WA_ERR_NONE)
         goto fail;
 
-    /* Encode and encrypt the token. */
+    /*
+     * Encode and encrypt the token.  The encoded attributes have room for
+     * the token header and padding, so they're encrypted in place.
+     */
     s = wai_encode_token(ctx, data, &attrs, &alen);
     if (s != WA_ERR_NONE)
         goto fail;
-    s = webauth_token_encrypt(ctx, attrs, alen, &output, length, ring);
+    s = wai_token_encrypt(ctx, attrs, alen, &output, length, ring);
     if (s != WA_ERR_NONE)
         goto fail;
     *token = output;
@@ -739,8 +909,8 @@ webauth_token_encode(struct webauth_context *ctx,
     s = webauth_token_encode_raw(ctx, data, ring, &raw, &length);
     if (s != WA_ERR_NONE)
         return s;
-    btoken = apr_palloc(ctx->pool, apr_base64_encode_len(length));
-    apr_base64_encode(btoken, raw, length);
+    btoken = apr_palloc(ctx->pool, wai_base64_encoded_length(length) + 1);
+    wai_base64_encode(raw, length, btoken);
     *token = btoken;
     return WA_ERR_NONE;
 }
@@ -0,0 +1,456 @@
+/*
+ * Cache of user information service results.
+ *
+ * The WebKDC calls the user information service for every request token,
+ * even when the same user is following a burst of single sign-on redirects
+ * to several applications within a few seconds.  This cache keeps successful
+ * results for a short time so that those calls can be answered locally.
+ *
+ * Results are keyed by everything the user information service is told: the
+ * user, the remote IP address, the random multifactor flag, the URL, and the
+ * current authentication factors.  The URL can't be left out, since the
+ * service may restrict access to particular sites, but only its origin (the
+ * scheme, host, and port) is used so that requests for different pages of
+ * the same site share a result.  Each result is copied
+ * into a pool of its own, so that it can be freed when it expires or is
+ * replaced, and copied again into the caller's pool when it's used.
+ *
+ * A result can tell the WebKDC to invalidate webkdc-factor tokens created
+ * before some time, which usually means that the user has just changed their
+ * authentication devices.  When that happens, all cached results for that
+ * user are dropped so that the following calls go to the service.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+#include <portable/system.h>
+
+#include <apr_hash.h>
+#include <apr_lib.h>
+#include <apr_thread_mutex.h>
+#include <apr_uri.h>
+
+#include <lib/internal.h>
+#include <webauth/basic.h>
+#include <webauth/factors.h>
+#include <webauth/webkdc.h>
+#include <util/macros.h>
+
+/*
+ * A cached result.  ctx is a WebAuth context used only for its pool, which
+ * holds the entry and everything it points to.  The context itself is
+ * allocated from its base pool, a child of the pool of the cache, so that is
+ * the pool to destroy to free the entry.
+ */
+struct entry {
+    struct webauth_context *ctx;
+    const char *key;
+    const char *user;
+    time_t expires;
+    struct webauth_user_info *info;
+};
+
+/*
+ * The cache.  The pool holds the hash table and the pools of the entries.
+ * Everything is protected by the mutex if there is one.  refs counts the
+ * context that created the cache and the contexts configured to use it.
+ */
+struct webauth_user_cache {
+    apr_pool_t *pool;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    unsigned long refs;
+    apr_hash_t *entries;                /* Key to struct entry. */
+    unsigned long size;                 /* Maximum number of entries. */
+    unsigned long ttl;                  /* Lifetime of an entry. */
+    struct webauth_user_cache_stats stats;
+};
+
+
+/*
+ * Lock or unlock a cache.
+ */
+static void
+lock_cache(struct webauth_user_cache *cache UNUSED)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#endif
+}
+
+static void
+unlock_cache(struct webauth_user_cache *cache UNUSED)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+}
+
+
+/*
+ * Take or drop a reference to a cache.  As with connection pools, every
+ * context configured to use the cache holds a reference until its own pool
+ * is cleared, and the cache is freed when the last reference is dropped.
+ */
+void
+wai_user_cache_hold(struct webauth_user_cache *cache)
+{
+    lock_cache(cache);
+    cache->refs++;
+    unlock_cache(cache);
+}
+
+void
+wai_user_cache_release(struct webauth_user_cache *cache)
+{
+    bool last;
+
+    lock_cache(cache);
+    last = (--cache->refs == 0);
+    unlock_cache(cache);
+    if (last)
+        apr_pool_destroy(cache->pool);
+}
+
+
+/*
+ * Drop the reference of the context that created the cache when the pool of
+ * that context is cleared.  This is registered as a cleanup on that pool.
+ */
+static apr_status_t
+cleanup_cache(void *data)
+{
+    wai_user_cache_release(data);
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Create a new cache.  The cache is used by many threads at once, so it gets
+ * its own root pool, which is freed once the pool of the context and of every
+ * context configured to use it have been cleared.
+ */
+int
+webauth_user_cache_new(struct webauth_context *ctx, unsigned long size,
+                       unsigned long ttl, struct webauth_user_cache **result)
+{
+    struct webauth_user_cache *cache;
+    apr_pool_t *pool;
+    apr_status_t code;
+
+    *result = NULL;
+    code = apr_pool_create(&pool, NULL);
+    if (code != APR_SUCCESS)
+        return wai_error_set_apr(ctx, WA_ERR_APR, code, "cannot create pool");
+    cache = apr_pcalloc(pool, sizeof(struct webauth_user_cache));
+    cache->pool    = pool;
+    cache->refs    = 1;
+    cache->entries = apr_hash_make(pool);
+    cache->size    = size;
+    cache->ttl     = ttl;
+#if APR_HAS_THREADS
+    code = apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                   pool);
+    if (code != APR_SUCCESS) {
+        apr_pool_destroy(pool);
+        return wai_error_set_apr(ctx, WA_ERR_APR, code,
+                                 "cannot create mutex");
+    }
+#endif
+    apr_pool_cleanup_register(ctx->pool, cache, cleanup_cache,
+                              apr_pool_cleanup_null);
+    *result = cache;
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Return the statistics for a cache.
+ */
+void
+webauth_user_cache_stats(struct webauth_user_cache *cache,
+                         struct webauth_user_cache_stats *stats)
+{
+    lock_cache(cache);
+    *stats = cache->stats;
+    stats->entries = apr_hash_count(cache->entries);
+    unlock_cache(cache);
+}
+
+
+/*
+ * Append a possibly NULL string to a key.  Each string is preceded by its
+ * length so that the key is unambiguous, and NULL is represented by a
+ * character that can't start a length.
+ */
+static void
+key_append(struct wai_buffer *key, const char *string)
+{
+    if (string == NULL)
+        wai_buffer_append(key, "-", 1);
+    else
+        wai_buffer_append_sprintf(key, "%lu:%s",
+                                  (unsigned long) strlen(string), string);
+}
+
+
+/*
+ * Reduce a URL to its origin, the lowercased scheme and host and the port,
+ * which is filled in from the scheme if not given.  A URL that can't be
+ * parsed into those parts is returned as-is.
+ */
+static const char *
+url_origin(struct webauth_context *ctx, const char *url)
+{
+    apr_uri_t uri;
+    apr_port_t port;
+    char *origin, *p;
+
+    if (url == NULL)
+        return NULL;
+    memset(&uri, 0, sizeof(uri));
+    if (apr_uri_parse(ctx->pool, url, &uri) != APR_SUCCESS)
+        return url;
+    if (uri.scheme == NULL || uri.hostname == NULL)
+        return url;
+    port = uri.port;
+    if (uri.port_str == NULL || uri.port_str[0] == '\0')
+        port = apr_uri_port_of_scheme(uri.scheme);
+    origin = apr_psprintf(ctx->pool, "%s://%s:%u", uri.scheme, uri.hostname,
+                          (unsigned int) port);
+    for (p = origin; *p != '\0'; p++)
+        *p = apr_tolower(*p);
+    return origin;
+}
+
+
+/*
+ * Build the key for the arguments of a user information call, using only the
+ * origin of the URL.
+ */
+static const char *
+make_key(struct webauth_context *ctx, const char *user, const char *ip,
+         int random_mf, const char *url, const char *factors)
+{
+    struct wai_buffer *key;
+
+    key = wai_buffer_new(ctx->pool);
+    key_append(key, user);
+    key_append(key, ip);
+    wai_buffer_append(key, random_mf ? "r" : "n", 1);
+    key_append(key, url_origin(ctx, url));
+    key_append(key, factors);
+    wai_buffer_append(key, "", 1);
+    return key->data;
+}
+
+
+/*
+ * Copy a possibly NULL set of factors into the pool of a context.  Going
+ * through the string form also copies the names of unknown factors.
+ */
+static const struct webauth_factors *
+copy_factors(struct webauth_context *ctx,
+             const struct webauth_factors *factors)
+{
+    if (factors == NULL)
+        return NULL;
+    return webauth_factors_parse(ctx, webauth_factors_string(ctx, factors));
+}
+
+
+/*
+ * Copy a user information result and everything it points to into the pool
+ * of a context.
+ */
+static struct webauth_user_info *
+copy_info(struct webauth_context *ctx, const struct webauth_user_info *info)
+{
+    struct webauth_user_info *copy;
+    apr_array_header_t *array;
+    const struct webauth_login *login;
+    struct webauth_login *login_copy;
+    const struct webauth_device *device;
+    struct webauth_device *device_copy;
+    int i;
+
+    copy = apr_pmemdup(ctx->pool, info, sizeof(struct webauth_user_info));
+    copy->factors        = copy_factors(ctx, info->factors);
+    copy->additional     = copy_factors(ctx, info->additional);
+    copy->required       = copy_factors(ctx, info->required);
+    copy->default_device = apr_pstrdup(ctx->pool, info->default_device);
+    copy->default_factor = apr_pstrdup(ctx->pool, info->default_factor);
+    copy->error          = apr_pstrdup(ctx->pool, info->error);
+    copy->user_message   = apr_pstrdup(ctx->pool, info->user_message);
+    copy->login_state    = apr_pstrdup(ctx->pool, info->login_state);
+    if (info->logins != NULL) {
+        array = apr_array_copy(ctx->pool, info->logins);
+        for (i = 0; i < array->nelts; i++) {
+            login = &APR_ARRAY_IDX(info->logins, i, struct webauth_login);
+            login_copy = &APR_ARRAY_IDX(array, i, struct webauth_login);
+            login_copy->ip       = apr_pstrdup(ctx->pool, login->ip);
+            login_copy->hostname = apr_pstrdup(ctx->pool, login->hostname);
+        }
+        copy->logins = array;
+    }
+    if (info->devices != NULL) {
+        array = apr_array_copy(ctx->pool, info->devices);
+        for (i = 0; i < array->nelts; i++) {
+            device = &APR_ARRAY_IDX(info->devices, i, struct webauth_device);
+            device_copy = &APR_ARRAY_IDX(array, i, struct webauth_device);
+            device_copy->name    = apr_pstrdup(ctx->pool, device->name);
+            device_copy->id      = apr_pstrdup(ctx->pool, device->id);
+            device_copy->factors = copy_factors(ctx, device->factors);
+        }
+        copy->devices = array;
+    }
+    return copy;
+}
+
+
+/*
+ * Remove an entry from the cache and free it.  Must be called with the cache
+ * locked.
+ */
+static void
+remove_entry(struct webauth_user_cache *cache, struct entry *entry)
+{
+    apr_hash_set(cache->entries, entry->key, APR_HASH_KEY_STRING, NULL);
+    apr_pool_destroy(entry->ctx->base);
+}
+
+
+/*
+ * Make room for a new entry by removing the expired ones and, if that's not
+ * enough, the one that expires first.  Must be called with the cache locked.
+ */
+static void
+make_room(struct webauth_user_cache *cache, time_t now)
+{
+    apr_hash_index_t *hi;
+    void *value;
+    struct entry *entry, *oldest = NULL;
+
+    for (hi = apr_hash_first(NULL, cache->entries); hi != NULL;
+         hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &value);
+        entry = value;
+        if (entry->expires <= now)
+            remove_entry(cache, entry);
+        else if (oldest == NULL || entry->expires < oldest->expires)
+            oldest = entry;
+    }
+    if (apr_hash_count(cache->entries) >= cache->size && oldest != NULL)
+        remove_entry(cache, oldest);
+}
+
+
+/*
+ * Look for a cached result for the arguments of a user information call.  If
+ * there is one that hasn't expired, copy it into the pool of the context,
+ * store it in info, and return true.  Otherwise, return false.
+ */
+bool
+wai_user_cache_get(struct webauth_context *ctx, const char *user,
+                   const char *ip, int random_mf, const char *url,
+                   const char *factors, struct webauth_user_info **info)
+{
+    struct webauth_user_cache *cache = ctx->user->cache;
+    struct entry *entry;
+    const char *key;
+
+    if (cache == NULL)
+        return false;
+    key = make_key(ctx, user, ip, random_mf, url, factors);
+    lock_cache(cache);
+    entry = apr_hash_get(cache->entries, key, APR_HASH_KEY_STRING);
+    if (entry != NULL && entry->expires <= time(NULL)) {
+        remove_entry(cache, entry);
+        entry = NULL;
+    }
+    if (entry == NULL) {
+        cache->stats.misses++;
+        unlock_cache(cache);
+        return false;
+    }
+    *info = copy_info(ctx, entry->info);
+    cache->stats.hits++;
+    unlock_cache(cache);
+    return true;
+}
+
+
+/*
+ * Store the result of a user information call in the cache, replacing any
+ * result already cached for the same arguments.  Failures are ignored, since
+ * the cache is only an optimization.
+ */
+void
+wai_user_cache_put(struct webauth_context *ctx, const char *user,
+                   const char *ip, int random_mf, const char *url,
+                   const char *factors, const struct webauth_user_info *info)
+{
+    struct webauth_user_cache *cache = ctx->user->cache;
+    struct webauth_context *ectx;
+    struct entry *entry, *old;
+    const char *key;
+    time_t now;
+
+    if (cache == NULL || cache->size == 0 || cache->ttl == 0)
+        return;
+    key = make_key(ctx, user, ip, random_mf, url, factors);
+    now = time(NULL);
+    lock_cache(cache);
+    if (webauth_context_init_apr(&ectx, cache->pool) != WA_ERR_NONE) {
+        unlock_cache(cache);
+        return;
+    }
+    entry = apr_pcalloc(ectx->pool, sizeof(struct entry));
+    entry->ctx     = ectx;
+    entry->key     = apr_pstrdup(ectx->pool, key);
+    entry->user    = apr_pstrdup(ectx->pool, user);
+    entry->expires = now + cache->ttl;
+    entry->info    = copy_info(ectx, info);
+    old = apr_hash_get(cache->entries, key, APR_HASH_KEY_STRING);
+    if (old != NULL)
+        remove_entry(cache, old);
+    else if (apr_hash_count(cache->entries) >= cache->size)
+        make_room(cache, now);
+    apr_hash_set(cache->entries, entry->key, APR_HASH_KEY_STRING, entry);
+    cache->stats.stores++;
+    unlock_cache(cache);
+}
+
+
+/*
+ * Drop all cached results for a user.  This is called when a result has
+ * invalidated webkdc-factor tokens, so that the next calls for that user get
+ * a fresh answer from the user information service.
+ */
+void
+wai_user_cache_flush(struct webauth_context *ctx, const char *user)
+{
+    struct webauth_user_cache *cache;
+    apr_hash_index_t *hi;
+    void *value;
+    struct entry *entry;
+
+    if (ctx->user == NULL || ctx->user->cache == NULL)
+        return;
+    cache = ctx->user->cache;
+    lock_cache(cache);
+    for (hi = apr_hash_first(NULL, cache->entries); hi != NULL;
+         hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &value);
+        entry = value;
+        if (strcmp(entry->user, user) == 0) {
+            remove_entry(cache, entry);
+            cache->stats.flushed++;
+        }
+    }
+    unlock_cache(cache);
+}
@@ -4,6 +4,19 @@
  * Implements generic support for making a remctl call to the user information
  * service and returning the reply in a buffer.
  *
+ * Normally, each call opens a new connection with new credentials obtained
+ * from the keytab and closes it afterwards.  If the configuration includes a
+ * connection pool, connections are instead returned to the pool after a
+ * successful call and reused by later calls, so that a call only costs one
+ * request and response instead of an AS-REQ and a GSS-API handshake as well.
+ * The pool keeps the keytab credentials to open new connections and gets new
+ * ones shortly before they expire.  Idle connections that are too old or
+ * whose credentials have expired are closed instead of reused.  If sending
+ * the command on a reused connection fails, which is what happens when the
+ * server has closed the connection, it's retried once on a new connection.
+ * Once the command has been sent, it's never retried, since the server may
+ * already have acted on it.
+ *
  * Written by Russ Allbery <eagle@eyrie.org>
  * Copyright 2011, 2012, 2013, 2014
  *     The Board of Trustees of the Leland Stanford Junior University
@@ -13,8 +26,10 @@
 
 #include <config.h>
 #include <portable/apr.h>
+#include <portable/stdbool.h>
 #include <portable/system.h>
 
+#include <apr_thread_mutex.h>
 #include <errno.h>
 #ifdef HAVE_REMCTL
 # include <remctl.h>
@@ -36,6 +51,9 @@
 # define remctl_set_timeout(r, t) /* empty */
 #endif
 
+/* Get new pool credentials when the old ones have less than this left. */
+#define CREDS_MIN_LIFE (5 * 60)
+
 
 #ifndef HAVE_REMCTL
 
@@ -50,61 +68,148 @@ wai_user_remctl(struct webauth_context *ctx, const char **command UNUSED,
                          "not built with remctl support");
 }
 
-#else /* HAVE_REMCTL */
 
 /*
- * Issue a remctl command to the user information service.  Takes the
- * argv-style vector of the command to execute and a timeout (which may be 0
- * to use no timeout), and stores the resulting output in the provided
- * argument.  On any error, including remote failure to execute the command,
- * sets the WebAuth error and returns a status code.
+ * Stub out the pool creation to return an error as well.
  */
 int
-wai_user_remctl(struct webauth_context *ctx, const char **command,
-                struct wai_buffer *output)
+webauth_user_pool_new(struct webauth_context *ctx, unsigned long size UNUSED,
+                      unsigned long timeout UNUSED,
+                      struct webauth_user_pool **pool)
 {
-    struct remctl *r = NULL;
-    struct remctl_output *out;
-    size_t offset;
-    struct wai_buffer *errors, *buffer;
-    struct webauth_user_config *c = ctx->user;
-    struct webauth_krb5 *kc = NULL;
+    *pool = NULL;
+    return wai_error_set(ctx, WA_ERR_UNIMPLEMENTED,
+                         "not built with remctl support");
+}
+
+
+/*
+ * There can't be a pool, but report empty statistics anyway.
+ */
+void
+webauth_user_pool_stats(struct webauth_user_pool *pool UNUSED,
+                        struct webauth_user_pool_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+
+/*
+ * There can't be a pool, so there's nothing to hold or release.
+ */
+void
+wai_user_pool_hold(struct webauth_user_pool *pool UNUSED)
+{
+}
+
+void
+wai_user_pool_release(struct webauth_user_pool *pool UNUSED)
+{
+}
+
+#else /* HAVE_REMCTL */
+
+/*
+ * Kerberos credentials obtained from the keytab for opening connections.
+ * Each set has its own pool and WebAuth context, used only to own the
+ * Kerberos context.  refs counts the connections being opened with them, so
+ * that credentials that have been replaced are only freed once nothing is
+ * using their ticket cache.
+ */
+struct pool_creds {
+    apr_pool_t *pool;
+    struct webauth_krb5 *kc;
     char *cache;
+    time_t expires;
+    unsigned long refs;
+    bool stale;
+};
+
+/* An idle connection and when it was returned to the pool. */
+struct pool_conn {
+    struct remctl *r;
+    time_t used;
+    time_t expires;             /* When its credentials expire. */
+};
+
+/*
+ * A pool of connections.  Everything is protected by the mutex if there is
+ * one.  The connections and credentials are for the configuration identified
+ * by key, allocated from key_pool.  If a call arrives with a different
+ * configuration, everything is thrown away and the pool starts over.  refs
+ * counts the context that created the pool and the contexts configured to use
+ * it.  The renewal mutex is held while getting new credentials from the
+ * keytab, so that only one thread does that at a time without holding up the
+ * threads that can use idle connections.
+ */
+struct webauth_user_pool {
+    apr_pool_t *pool;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+    apr_thread_mutex_t *renewal;
+#endif
+    unsigned long refs;
+    apr_pool_t *key_pool;
+    const char *key;
+    struct pool_creds *creds;           /* Current credentials or NULL. */
+    struct pool_conn *idle;             /* Stack of idle connections. */
+    unsigned long count;                /* Number of idle connections. */
+    unsigned long size;                 /* Maximum idle connections. */
+    unsigned long timeout;              /* Maximum idle time. */
+    struct webauth_user_pool_stats stats;
+};
+
+
+/*
+ * Set the WebAuth error from the remctl error, distinguishing timeouts from
+ * other failures, and return the status code.
+ */
+static int
+remctl_failure(struct webauth_context *ctx, struct remctl *r,
+               const char *message)
+{
     int s;
 
-    /* Initialize the remctl context. */
+    if (strstr(remctl_error(r), "timed out") != NULL)
+        s = WA_ERR_REMOTE_TIMEOUT;
+    else
+        s = WA_ERR_REMOTE_FAILURE;
+    return wai_error_set(ctx, s, "%s", message);
+}
+
+
+/*
+ * Create a remctl object and open a connection with the credentials in the
+ * given ticket cache.
+ *
+ * This changes the global GSS-API state to point to our ticket cache.
+ * Unfortunately, the GSS-API doesn't currently provide any way to avoid this.
+ * When there is some way, it will be implemented in remctl.
+ *
+ * If remctl_set_ccache fails or doesn't exist, we fall back on just whacking
+ * the global KRB5CCNAME variable.
+ */
+static int
+open_remctl(struct webauth_context *ctx, const char *cache,
+            struct remctl **result)
+{
+    struct remctl *r;
+    struct webauth_user_config *c = ctx->user;
+    int s;
+
+    *result = NULL;
     r = remctl_new();
     if (r == NULL) {
         s = WA_ERR_NO_MEM;
         return wai_error_set_system(ctx, s, errno, "initializing remctl");
     }
-
-    /*
-     * Obtain authentication credentials from the configured keytab and
-     * principal.
-     *
-     * This changes the global GSS-API state to point to our ticket cache.
-     * Unfortunately, the GSS-API doesn't currently provide any way to avoid
-     * this.  When there is some way, it will be implemented in remctl.
-     *
-     * If remctl_set_ccache fails or doesn't exist, we fall back on just
-     * whacking the global KRB5CCNAME variable.
-     */
-    s = webauth_krb5_new(ctx, &kc);
-    if (s != WA_ERR_NONE)
-        goto fail;
-    s = webauth_krb5_init_via_keytab(ctx, kc, c->keytab, c->principal, NULL);
-    if (s != WA_ERR_NONE)
-        goto fail;
-    s = webauth_krb5_get_cache(ctx, kc, &cache);
-    if (s != WA_ERR_NONE)
-        goto fail;
     if (!remctl_set_ccache(r, cache)) {
         if (setenv("KRB5CCNAME", cache, 1) < 0) {
             s = WA_ERR_NO_MEM;
             wai_error_set_system(ctx, s, errno,
                                  "setting KRB5CCNAME for remctl");
-            goto fail;
+            remctl_close(r);
+            return s;
         }
     }
 
@@ -112,23 +217,37 @@ wai_user_remctl(struct webauth_context *ctx, const char **command,
     if (c->timeout > 0)
         remctl_set_timeout(r, c->timeout);
 
-    /* Set up and execute the command. */
+    /* Open the connection. */
     if (!remctl_open(r, c->host, c->port, c->identity)) {
-        if (strstr(remctl_error(r), "timed out") != NULL)
-            s = WA_ERR_REMOTE_TIMEOUT;
-        else
-            s = WA_ERR_REMOTE_FAILURE;
-        wai_error_set(ctx, s, "%s", remctl_error(r));
-        goto fail;
-    }
-    if (!remctl_command(r, command)) {
-        if (strstr(remctl_error(r), "timed out") != NULL)
-            s = WA_ERR_REMOTE_TIMEOUT;
-        else
-            s = WA_ERR_REMOTE_FAILURE;
-        wai_error_set(ctx, s, "%s", remctl_error(r));
-        goto fail;
+        s = remctl_failure(ctx, r, remctl_error(r));
+        remctl_close(r);
+        return s;
     }
+    *result = r;
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Run a command on an open remctl connection, storing the output in the
+ * provided buffer.  Sets sent to true once the command has been sent, so that
+ * the caller can tell whether a failure happened before the server could have
+ * seen the command.  On any error, including remote failure to execute the
+ * command, sets the WebAuth error and returns a status code.  The connection
+ * can only be reused if this succeeds.
+ */
+static int
+run_remctl(struct webauth_context *ctx, struct remctl *r,
+           const char **command, struct wai_buffer *output, bool *sent)
+{
+    struct remctl_output *out;
+    struct wai_buffer *errors, *buffer;
+    size_t offset;
+
+    *sent = false;
+    if (!remctl_command(r, command))
+        return remctl_failure(ctx, r, remctl_error(r));
+    *sent = true;
 
     /*
      * Retrieve the results and accumulate output in the output buffer.
@@ -138,27 +257,16 @@ wai_user_remctl(struct webauth_context *ctx, const char **command,
     errors = wai_buffer_new(ctx->pool);
     do {
         out = remctl_output(r);
-        if (out == NULL) {
-            if (strstr(remctl_error(r), "timed out") != NULL)
-                s = WA_ERR_REMOTE_TIMEOUT;
-            else
-                s = WA_ERR_REMOTE_FAILURE;
-            wai_error_set(ctx, s, "%s", remctl_error(r));
-            goto fail;
-        }
+        if (out == NULL)
+            return remctl_failure(ctx, r, remctl_error(r));
         switch (out->type) {
         case REMCTL_OUT_OUTPUT:
             buffer = (out->stream == 1) ? output : errors;
             wai_buffer_append(buffer, out->data, out->length);
             break;
         case REMCTL_OUT_ERROR:
-            if (strstr(remctl_error(r), "timed out") != NULL)
-                s = WA_ERR_REMOTE_TIMEOUT;
-            else
-                s = WA_ERR_REMOTE_FAILURE;
             wai_buffer_set(errors, out->data, out->length);
-            wai_error_set(ctx, s, "%s", errors->data);
-            goto fail;
+            return remctl_failure(ctx, r, errors->data);
         case REMCTL_OUT_STATUS:
             if (out->status != 0) {
                 if (errors->data == NULL)
@@ -167,25 +275,514 @@ wai_user_remctl(struct webauth_context *ctx, const char **command,
                                               out->status);
                 if (wai_buffer_find_string(errors, "\n", 0, &offset))
                     errors->data[offset] = '\0';
-                if (strstr(remctl_error(r), "timed out") != NULL)
-                    s = WA_ERR_REMOTE_TIMEOUT;
-                else
-                    s = WA_ERR_REMOTE_FAILURE;
-                wai_error_set(ctx, s, "%s", errors->data);
-                goto fail;
+                return remctl_failure(ctx, r, errors->data);
             }
         case REMCTL_OUT_DONE:
         default:
             break;
         }
     } while (out->type == REMCTL_OUT_OUTPUT);
-    remctl_close(r);
-    r = NULL;
     return WA_ERR_NONE;
+}
 
-fail:
+
+/*
+ * Lock or unlock a pool.
+ */
+static void
+lock_pool(struct webauth_user_pool *pool UNUSED)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(pool->mutex);
+#endif
+}
+
+static void
+unlock_pool(struct webauth_user_pool *pool UNUSED)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(pool->mutex);
+#endif
+}
+
+
+/*
+ * Lock or unlock the renewal mutex of a pool.  The pool itself must not be
+ * locked when taking the renewal mutex.
+ */
+static void
+lock_renewal(struct webauth_user_pool *pool UNUSED)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(pool->renewal);
+#endif
+}
+
+static void
+unlock_renewal(struct webauth_user_pool *pool UNUSED)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(pool->renewal);
+#endif
+}
+
+
+/*
+ * Close all idle connections in a pool.  Must be called with the pool
+ * locked.
+ */
+static void
+close_idle(struct webauth_user_pool *pool)
+{
+    while (pool->count > 0)
+        remctl_close(pool->idle[--pool->count].r);
+}
+
+
+/*
+ * Stop using the current credentials of a pool, freeing them now if nothing
+ * is using them or else once the last connection being opened with them is
+ * open.  Must be called with the pool locked.
+ */
+static void
+retire_creds(struct webauth_user_pool *pool)
+{
+    struct pool_creds *creds = pool->creds;
+
+    if (creds == NULL)
+        return;
+    pool->creds = NULL;
+    if (creds->refs == 0)
+        apr_pool_destroy(creds->pool);
+    else
+        creds->stale = true;
+}
+
+
+/*
+ * Take or drop a reference to a pool.  Besides the context that created it,
+ * every context configured to use the pool holds a reference until its own
+ * pool is cleared, so that a context that outlives the creator, such as that
+ * of an abandoned background job, can still use it.  When the last reference
+ * is dropped, the idle connections are closed and everything is freed.
+ */
+void
+wai_user_pool_hold(struct webauth_user_pool *pool)
+{
+    lock_pool(pool);
+    pool->refs++;
+    unlock_pool(pool);
+}
+
+void
+wai_user_pool_release(struct webauth_user_pool *pool)
+{
+    bool last;
+
+    lock_pool(pool);
+    last = (--pool->refs == 0);
+    if (last)
+        close_idle(pool);
+    unlock_pool(pool);
+    if (last)
+        apr_pool_destroy(pool->pool);
+}
+
+
+/*
+ * Drop the reference of the context that created the connection pool when
+ * the pool of that context is cleared.  This is registered as a cleanup on
+ * that pool.
+ */
+static apr_status_t
+cleanup_pool(void *data)
+{
+    wai_user_pool_release(data);
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Create a new pool of connections, which keeps at most size idle connections
+ * and closes connections that have been idle for longer than timeout seconds.
+ * The connection pool is used by many threads at once, so it gets its own
+ * root pool, which is freed along with the idle connections once the pool of
+ * the context and of every context configured to use it have been cleared.
+ */
+int
+webauth_user_pool_new(struct webauth_context *ctx, unsigned long size,
+                      unsigned long timeout, struct webauth_user_pool **result)
+{
+    struct webauth_user_pool *pool;
+    apr_pool_t *p;
+    apr_status_t code;
+
+    *result = NULL;
+    code = apr_pool_create(&p, NULL);
+    if (code != APR_SUCCESS)
+        return wai_error_set_apr(ctx, WA_ERR_APR, code, "cannot create pool");
+    pool = apr_pcalloc(p, sizeof(struct webauth_user_pool));
+    pool->pool    = p;
+    pool->refs    = 1;
+    pool->size    = size;
+    pool->timeout = timeout;
+    if (size > 0)
+        pool->idle = apr_pcalloc(p, size * sizeof(struct pool_conn));
+#if APR_HAS_THREADS
+    code = apr_thread_mutex_create(&pool->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (code == APR_SUCCESS)
+        code = apr_thread_mutex_create(&pool->renewal,
+                                       APR_THREAD_MUTEX_DEFAULT, p);
+    if (code != APR_SUCCESS) {
+        apr_pool_destroy(p);
+        return wai_error_set_apr(ctx, WA_ERR_APR, code,
+                                 "cannot create mutex");
+    }
+#endif
+    code = apr_pool_create(&pool->key_pool, p);
+    if (code != APR_SUCCESS) {
+        apr_pool_destroy(p);
+        return wai_error_set_apr(ctx, WA_ERR_APR, code, "cannot create pool");
+    }
+    apr_pool_cleanup_register(ctx->pool, pool, cleanup_pool,
+                              apr_pool_cleanup_null);
+    *result = pool;
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Return the statistics for a pool.
+ */
+void
+webauth_user_pool_stats(struct webauth_user_pool *pool,
+                        struct webauth_user_pool_stats *stats)
+{
+    lock_pool(pool);
+    *stats = pool->stats;
+    stats->idle = pool->count;
+    unlock_pool(pool);
+}
+
+
+/*
+ * Build the key identifying the configuration of a call, which determines
+ * what connections and credentials it can use.
+ */
+static const char *
+pool_key(struct webauth_context *ctx)
+{
+    struct webauth_user_config *c = ctx->user;
+
+    return apr_psprintf(ctx->pool, "%s %hu %s %s %s", c->host, c->port,
+                        c->identity == NULL ? "" : c->identity, c->keytab,
+                        c->principal == NULL ? "" : c->principal);
+}
+
+
+/*
+ * Make sure the pool is for the configuration with the given key, starting
+ * over if it isn't.  Must be called with the pool locked.
+ */
+static void
+check_key(struct webauth_user_pool *pool, const char *key)
+{
+    if (pool->key != NULL && strcmp(pool->key, key) == 0)
+        return;
+    close_idle(pool);
+    retire_creds(pool);
+    apr_pool_clear(pool->key_pool);
+    pool->key = apr_pstrdup(pool->key_pool, key);
+}
+
+
+/*
+ * Take the most recently used idle connection from the pool that is still
+ * usable, closing any that are too old.  Returns NULL if there are none.
+ */
+static struct remctl *
+get_conn(struct webauth_user_pool *pool, const char *key, time_t *expires)
+{
+    struct pool_conn *conn;
+    struct remctl *r = NULL;
+    time_t now;
+
+    now = time(NULL);
+    lock_pool(pool);
+    check_key(pool, key);
+    while (pool->count > 0) {
+        conn = &pool->idle[--pool->count];
+        if (conn->used + (time_t) pool->timeout < now
+            || conn->expires <= now) {
+            remctl_close(conn->r);
+            pool->stats.expired++;
+            continue;
+        }
+        r = conn->r;
+        *expires = conn->expires;
+        pool->stats.reused++;
+        break;
+    }
+    unlock_pool(pool);
+    return r;
+}
+
+
+/*
+ * Return a connection to the pool after a successful call, or close it if
+ * the pool is full or the configuration has changed.
+ */
+static void
+put_conn(struct webauth_user_pool *pool, const char *key, struct remctl *r,
+         time_t expires)
+{
+    struct pool_conn *conn;
+
+    lock_pool(pool);
+    if (pool->count < pool->size && strcmp(pool->key, key) == 0) {
+        conn = &pool->idle[pool->count++];
+        conn->r       = r;
+        conn->used    = time(NULL);
+        conn->expires = expires;
+        r = NULL;
+    }
+    unlock_pool(pool);
     if (r != NULL)
         remctl_close(r);
+}
+
+
+/*
+ * Take a reference to the current credentials of the pool if they aren't
+ * about to expire, and return them, or return NULL.  Must be called with the
+ * pool locked.
+ */
+static struct pool_creds *
+current_creds(struct webauth_user_pool *pool, const char *key)
+{
+    struct pool_creds *creds;
+
+    check_key(pool, key);
+    creds = pool->creds;
+    if (creds == NULL || creds->expires - CREDS_MIN_LIFE <= time(NULL))
+        return NULL;
+    creds->refs++;
+    return creds;
+}
+
+
+/*
+ * Get the credentials of the pool for opening a new connection, obtaining new
+ * ones from the keytab if there are none or they're about to expire.  Errors
+ * are reported in the caller's context.  The credentials must be released
+ * with release_creds once the connection is open.
+ *
+ * Only one thread at a time gets new credentials, holding the renewal mutex,
+ * since every thread that needs a new connection would otherwise do the same.
+ * The others wait for it and then use its credentials.  The pool itself is
+ * only locked to look at and replace the credentials, so the AS exchange
+ * doesn't hold up calls that can use an idle connection.
+ */
+static int
+get_creds(struct webauth_context *ctx, struct webauth_user_pool *pool,
+          const char *key, struct pool_creds **result)
+{
+    struct webauth_user_config *c = ctx->user;
+    struct webauth_context *cctx;
+    struct pool_creds *creds;
+    apr_pool_t *p;
+    apr_status_t code;
+    void *tgt;
+    size_t length;
+    int s;
+
+    /* Use the current credentials if they're still good. */
+    lock_pool(pool);
+    *result = current_creds(pool, key);
+    unlock_pool(pool);
+    if (*result != NULL)
+        return WA_ERR_NONE;
+
+    /* Another thread may have renewed them while we waited. */
+    lock_renewal(pool);
+    lock_pool(pool);
+    *result = current_creds(pool, key);
+    if (*result != NULL) {
+        unlock_pool(pool);
+        unlock_renewal(pool);
+        return WA_ERR_NONE;
+    }
+    code = apr_pool_create(&p, pool->pool);
+    unlock_pool(pool);
+    if (code != APR_SUCCESS) {
+        unlock_renewal(pool);
+        return wai_error_set_apr(ctx, WA_ERR_APR, code, "cannot create pool");
+    }
+
+    /* Obtain new credentials without holding the pool lock. */
+    creds = apr_pcalloc(p, sizeof(struct pool_creds));
+    creds->pool = p;
+    s = webauth_context_init_apr(&cctx, p);
+    if (s != WA_ERR_NONE) {
+        wai_error_set(ctx, s, "cannot create credential context");
+        goto fail;
+    }
+    s = webauth_krb5_new(cctx, &creds->kc);
+    if (s != WA_ERR_NONE) {
+        wai_error_set(ctx, s, "%s", webauth_error_message(cctx, s));
+        goto fail;
+    }
+    s = webauth_krb5_init_via_keytab(ctx, creds->kc, c->keytab, c->principal,
+                                     NULL);
+    if (s != WA_ERR_NONE)
+        goto fail;
+    s = webauth_krb5_get_cache(ctx, creds->kc, &creds->cache);
+    if (s != WA_ERR_NONE)
+        goto fail;
+    s = webauth_krb5_export_cred(ctx, creds->kc, NULL, &tgt, &length,
+                                 &creds->expires);
+    if (s != WA_ERR_NONE)
+        goto fail;
+
+    /*
+     * Swap in the new credentials, unless the configuration of the pool
+     * changed in the meantime, in which case only this call uses them.
+     */
+    lock_pool(pool);
+    if (strcmp(pool->key, key) == 0) {
+        retire_creds(pool);
+        pool->creds = creds;
+        pool->stats.renewed++;
+    } else
+        creds->stale = true;
+    creds->refs++;
+    *result = creds;
+    unlock_pool(pool);
+    unlock_renewal(pool);
+    return WA_ERR_NONE;
+
+fail:
+    lock_pool(pool);
+    apr_pool_destroy(p);
+    unlock_pool(pool);
+    unlock_renewal(pool);
+    return s;
+}
+
+
+/*
+ * Release credentials obtained with get_creds, freeing them if they have been
+ * replaced and this was the last user.
+ */
+static void
+release_creds(struct webauth_user_pool *pool, struct pool_creds *creds)
+{
+    lock_pool(pool);
+    if (--creds->refs == 0 && creds->stale)
+        apr_pool_destroy(creds->pool);
+    unlock_pool(pool);
+}
+
+
+/*
+ * Issue a remctl command using a connection from the pool, retrying once on a
+ * new connection if sending the command on a reused one fails.
+ */
+static int
+pool_remctl(struct webauth_context *ctx, const char **command,
+            struct wai_buffer *output)
+{
+    struct webauth_user_pool *pool = ctx->user->pool;
+    struct pool_creds *creds;
+    struct remctl *r;
+    const char *key;
+    time_t expires = 0;
+    bool sent;
+    int s;
+
+    /* Try an idle connection first. */
+    key = pool_key(ctx);
+    r = get_conn(pool, key, &expires);
+    if (r != NULL) {
+        remctl_set_timeout(r, ctx->user->timeout);
+        s = run_remctl(ctx, r, command, output, &sent);
+        if (s == WA_ERR_NONE) {
+            put_conn(pool, key, r, expires);
+            return s;
+        }
+        remctl_close(r);
+        if (sent || s != WA_ERR_REMOTE_FAILURE)
+            return s;
+        wai_log_info(ctx, "retrying user information call on a new"
+                     " connection after: %s", webauth_error_message(ctx, s));
+        lock_pool(pool);
+        pool->stats.retried++;
+        unlock_pool(pool);
+    }
+
+    /* Open a new connection. */
+    s = get_creds(ctx, pool, key, &creds);
+    if (s != WA_ERR_NONE)
+        return s;
+    s = open_remctl(ctx, creds->cache, &r);
+    expires = creds->expires;
+    release_creds(pool, creds);
+    if (s != WA_ERR_NONE)
+        return s;
+    lock_pool(pool);
+    pool->stats.created++;
+    unlock_pool(pool);
+    s = run_remctl(ctx, r, command, output, &sent);
+    if (s == WA_ERR_NONE)
+        put_conn(pool, key, r, expires);
+    else
+        remctl_close(r);
+    return s;
+}
+
+
+/*
+ * Issue a remctl command to the user information service.  Takes the
+ * argv-style vector of the command to execute and a timeout (which may be 0
+ * to use no timeout), and stores the resulting output in the provided
+ * argument.  On any error, including remote failure to execute the command,
+ * sets the WebAuth error and returns a status code.
+ */
+int
+wai_user_remctl(struct webauth_context *ctx, const char **command,
+                struct wai_buffer *output)
+{
+    struct remctl *r;
+    struct webauth_user_config *c = ctx->user;
+    struct webauth_krb5 *kc = NULL;
+    char *cache;
+    bool sent;
+    int s;
+
+    /* Use the connection pool if there is one. */
+    if (c->pool != NULL)
+        return pool_remctl(ctx, command, output);
+
+    /*
+     * Obtain authentication credentials from the configured keytab and
+     * principal and open a connection.
+     */
+    s = webauth_krb5_new(ctx, &kc);
+    if (s != WA_ERR_NONE)
+        return s;
+    s = webauth_krb5_init_via_keytab(ctx, kc, c->keytab, c->principal, NULL);
+    if (s != WA_ERR_NONE)
+        return s;
+    s = webauth_krb5_get_cache(ctx, kc, &cache);
+    if (s != WA_ERR_NONE)
+        return s;
+    s = open_remctl(ctx, cache, &r);
+    if (s != WA_ERR_NONE)
+        return s;
+
+    /* Execute the command. */
+    s = run_remctl(ctx, r, command, output, &sent);
+    remctl_close(r);
     return s;
 }
 
@@ -39,6 +39,26 @@ pstrdup_null(apr_pool_t *pool, const char *string)
 }
 
 
+/*
+ * Drop the references of a context to a shared connection pool or result
+ * cache when its pool is cleared.  These are registered as cleanups on that
+ * pool.
+ */
+static apr_status_t
+release_pool(void *data)
+{
+    wai_user_pool_release(data);
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+release_cache(void *data)
+{
+    wai_user_cache_release(data);
+    return APR_SUCCESS;
+}
+
+
 /*
  * Configure how to access the user information service.  Takes the method,
  * the host, an optional port (may be 0 to use the default for that method),
@@ -92,6 +112,23 @@ webauth_user_config(struct webauth_context *ctx,
     ctx->user->timeout        = user->timeout;
     ctx->user->ignore_failure = user->ignore_failure;
     ctx->user->json           = user->json;
+    ctx->user->pool           = user->pool;
+    ctx->user->cache          = user->cache;
+
+    /*
+     * Hold the shared connection pool and result cache, if any, until this
+     * context is freed, in case it outlives the context that created them.
+     */
+    if (user->pool != NULL) {
+        wai_user_pool_hold(user->pool);
+        apr_pool_cleanup_register(ctx->pool, user->pool, release_pool,
+                                  apr_pool_cleanup_null);
+    }
+    if (user->cache != NULL) {
+        wai_user_cache_hold(user->cache);
+        apr_pool_cleanup_register(ctx->pool, user->cache, release_cache,
+                                  apr_pool_cleanup_null);
+    }
 
 done:
     return s;
@@ -153,6 +190,10 @@ check_config(struct webauth_context *ctx)
  * sets the info parameter to NULL, unless ignore_failure is set.  If
  * ignore_failure was set and the failure was due to failure to contact the
  * remote service, it instead returns an empty information struct.
+ *
+ * If the configuration has a result cache, an unexpired cached result for the
+ * same arguments is returned instead of calling the service, and successful
+ * results are added to the cache.
  */
 int
 webauth_user_info(struct webauth_context *ctx, const char *user,
@@ -169,6 +210,10 @@ webauth_user_info(struct webauth_context *ctx, const char *user,
     if (s != WA_ERR_NONE)
         return s;
 
+    /* Use a cached result if there is one. */
+    if (wai_user_cache_get(ctx, user, ip, random_mf, url, factors, info))
+        return WA_ERR_NONE;
+
     /* Call the appropriate implementation for JSON or XML. */
     if (ctx->user->json)
         s = wai_user_info_json(ctx, user, ip, random_mf, url, factors, info);
@@ -181,12 +226,15 @@ webauth_user_info(struct webauth_context *ctx, const char *user,
 
     /*
      * If the call succeeded and random_multifactor was set, say that the
-     * random multifactor check passed.  If the call failed but we were told
-     * to ignore failures, create a fake return struct.
+     * random multifactor check passed, and then cache the result.  If the
+     * call failed but we were told to ignore failures, create a fake return
+     * struct, which isn't cached.
      */
-    if (s == WA_ERR_NONE && random_mf)
-        (*info)->random_multifactor = true;
-    else if (s == WA_ERR_REMOTE_FAILURE && ctx->user->ignore_failure) {
+    if (s == WA_ERR_NONE) {
+        if (random_mf)
+            (*info)->random_multifactor = true;
+        wai_user_cache_put(ctx, user, ip, random_mf, url, factors, *info);
+    } else if (s == WA_ERR_REMOTE_FAILURE && ctx->user->ignore_failure) {
         wai_log_error(ctx, WA_LOG_WARN, s, "user information service failure");
         s = WA_ERR_NONE;
         *info = apr_pcalloc(ctx->pool, sizeof(struct webauth_user_info));
@@ -61,6 +61,8 @@ webauth_webkdc_config(struct webauth_context *ctx,
     webkdc->principal        = pstrdup_null(ctx->pool, conf->principal);
     webkdc->proxy_lifetime   = conf->proxy_lifetime;
     webkdc->login_time_limit = conf->login_time_limit;
+    webkdc->login_deadline   = conf->login_deadline;
+    webkdc->speculative_userinfo = conf->speculative_userinfo;
     webkdc->fast_armor_path  = pstrdup_null(ctx->pool, conf->fast_armor_path);
     webkdc->local_realms     = apr_array_copy(ctx->pool, conf->local_realms);
     webkdc->permitted_realms
@@ -36,6 +36,29 @@
  */
 static const unsigned long DEFAULT_OTP_LIFETIME = 60 * 60 * 10;
 
+/*
+ * The arguments to and results of calls to the user information service made
+ * in background jobs.  These are allocated from the context of the job so
+ * that they stay valid if the job is abandoned.
+ */
+struct wai_user_info_call {
+    const char *subject;
+    const char *ip;
+    bool random_mf;
+    const char *url;
+    const char *factors;
+    struct webauth_user_info *info;
+};
+struct user_validate_call {
+    const char *username;
+    const char *ip;
+    const char *otp;
+    const char *otp_type;
+    const char *device_id;
+    const char *login_state;
+    struct webauth_user_validate *validate;
+};
+
 
 /*
  * Helper function to build an array of webauth_token pointers based on the
@@ -303,36 +326,24 @@ parse_request(struct webauth_context *ctx,
 
 
 /*
- * Attempt an OTP authentication, which is a user authentication validatation
- * via the user information service.
- *
- * On success, generate a new webkdc-proxy token based on that information and
+ * Given the result of the user information service validation call for an
+ * OTP login, generate a new webkdc-proxy token based on that information and
  * store it in the wkproxies state and note that we had a successful login.
  * If the validate call returned persistent factors, also create a
  * webkdc-factor token and store that in the wkfactors state.
  */
 static int
-do_login_otp(struct webauth_context *ctx,
-             struct wai_webkdc_login_state *state,
-             struct webauth_token_login *login)
+finish_login_otp(struct webauth_context *ctx,
+                 struct wai_webkdc_login_state *state,
+                 struct webauth_token_login *login,
+                 struct webauth_user_validate *validate)
 {
     struct webauth_token *wkfactor, *wkproxy;
     struct webauth_token_webkdc_factor *wft;
     struct webauth_token_webkdc_proxy *wpt;
-    struct webauth_user_validate *validate;
     time_t max_expiration;
     int s;
 
-    /* Do the remote validation call. */
-    if (ctx->user == NULL)
-        return wai_error_set(ctx, WA_PEC_LOGIN_FAILED, "OTP not configured");
-    s = webauth_user_validate(ctx, login->username, state->remote_ip,
-                              login->otp, login->otp_type,
-                              login->device_id, state->login_state_in,
-                              &validate);
-    if (s != WA_ERR_NONE)
-        return s;
-
     /*
      * If validation failed, set the login error code and return.  If we have
      * a user message or login state, use WA_PEC_LOGIN_REJECTED instead so that
@@ -403,6 +414,32 @@ do_login_otp(struct webauth_context *ctx,
 }
 
 
+/*
+ * Attempt an OTP authentication, which is a user authentication validatation
+ * via the user information service, and process the result with
+ * finish_login_otp.
+ */
+static int
+do_login_otp(struct webauth_context *ctx,
+             struct wai_webkdc_login_state *state,
+             struct webauth_token_login *login)
+{
+    struct webauth_user_validate *validate;
+    int s;
+
+    /* Do the remote validation call. */
+    if (ctx->user == NULL)
+        return wai_error_set(ctx, WA_PEC_LOGIN_FAILED, "OTP not configured");
+    s = webauth_user_validate(ctx, login->username, state->remote_ip,
+                              login->otp, login->otp_type,
+                              login->device_id, state->login_state_in,
+                              &validate);
+    if (s != WA_ERR_NONE)
+        return s;
+    return finish_login_otp(ctx, state, login, validate);
+}
+
+
 /*
  * Check that the realm of the authenticated principal is in the list of
  * permitted realms, or that the list of realms is empty.  Returns a WebAuth
@@ -624,19 +661,175 @@ done:
 }
 
 
+/*
+ * The body of a background job for an OTP validation call.
+ */
+static int
+run_user_validate(struct webauth_context *ctx, void *data)
+{
+    struct user_validate_call *call = data;
+
+    return webauth_user_validate(ctx, call->username, call->ip, call->otp,
+                                 call->otp_type, call->device_id,
+                                 call->login_state, &call->validate);
+}
+
+
+/*
+ * Start the user information service validation call for an OTP login in a
+ * background job.  Returns the job and the call, which will hold the result.
+ */
+static int
+start_login_otp(struct webauth_context *ctx,
+                struct wai_webkdc_login_state *state,
+                struct webauth_token_login *login, struct wai_job **job,
+                struct user_validate_call **call)
+{
+    struct webauth_context *jctx;
+    apr_pool_t *pool;
+    int s;
+
+    s = wai_job_create(ctx, job);
+    if (s != WA_ERR_NONE)
+        return s;
+    wai_log_trace(ctx, "validating OTP for %s in the background",
+                  login->username);
+    jctx = wai_job_context(*job);
+    pool = jctx->pool;
+    *call = apr_pcalloc(pool, sizeof(struct user_validate_call));
+    (*call)->username    = apr_pstrdup(pool, login->username);
+    (*call)->ip          = apr_pstrdup(pool, state->remote_ip);
+    (*call)->otp         = apr_pstrdup(pool, login->otp);
+    (*call)->otp_type    = apr_pstrdup(pool, login->otp_type);
+    (*call)->device_id   = apr_pstrdup(pool, login->device_id);
+    (*call)->login_state = apr_pstrdup(pool, state->login_state_in);
+    wai_job_start(*job, run_user_validate, *call);
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Process the login credentials as do_logins does, but make the validation
+ * call for each OTP login in a background job while the password logins that
+ * come after it are done, so that a multifactor login takes about as long as
+ * the slowest of those calls rather than their sum.  An OTP validation call
+ * is only made once every password login before it has succeeded, so the user
+ * information service never sees an OTP for a login that would have stopped
+ * at a bad password.  The results are then processed in the order of the
+ * login tokens, so the outcome is the same as for do_logins, except that
+ * password logins after an OTP login are done even if its validation fails.
+ * Validation calls that don't finish by the login deadline fail with
+ * WA_PEC_LOGIN_TIMEOUT.
+ */
+static int
+do_logins_concurrent(struct webauth_context *ctx,
+                     struct wai_webkdc_login_state *state)
+{
+    struct webauth_token *token, **wkproxies, **popped;
+    struct webauth_token_login *login;
+    struct user_validate_call **calls;
+    struct wai_job **jobs;
+    const char *error = NULL;
+    bool did_login;
+    int i, n, failed, s;
+    int status = WA_ERR_NONE;
+
+    n = state->logins->nelts;
+    jobs = apr_pcalloc(ctx->pool, n * sizeof(struct wai_job *));
+    calls = apr_pcalloc(ctx->pool, n * sizeof(struct user_validate_call *));
+    wkproxies = apr_pcalloc(ctx->pool, n * sizeof(struct webauth_token *));
+
+    /*
+     * Go through the logins in order, starting the OTP validation calls and
+     * doing the password logins.  Set aside the webkdc-proxy tokens the
+     * password logins create so that they can be added to the login state in
+     * order, and stop at the first failure.
+     */
+    did_login = state->did_login;
+    failed = n;
+    for (i = 0; i < n; i++) {
+        token = APR_ARRAY_IDX(state->logins, i, struct webauth_token *);
+        login = &token->token.login;
+        if (login->otp != NULL)
+            s = start_login_otp(ctx, state, login, &jobs[i], &calls[i]);
+        else {
+            s = do_login_krb(ctx, state, login);
+            if (s == WA_ERR_NONE) {
+                popped = apr_array_pop(state->wkproxies);
+                wkproxies[i] = *popped;
+            }
+        }
+        if (s != WA_ERR_NONE) {
+            failed = i;
+            status = s;
+            error  = ctx->error;
+            break;
+        }
+    }
+    state->did_login = did_login;
+
+    /*
+     * Process the results in order, stopping at the first failure.  An OTP
+     * login before the one that failed may have failed first.
+     */
+    for (i = 0; i < n; i++) {
+        token = APR_ARRAY_IDX(state->logins, i, struct webauth_token *);
+        login = &token->token.login;
+        if (i == failed) {
+            ctx->error  = error;
+            ctx->status = status;
+            s = status;
+        } else if (login->otp == NULL) {
+            APR_ARRAY_PUSH(state->wkproxies, struct webauth_token *)
+                = wkproxies[i];
+            state->did_login = true;
+            continue;
+        } else {
+            s = wai_job_wait(ctx, jobs[i], state->deadline);
+            if (s == WA_ERR_REMOTE_TIMEOUT)
+                s = wai_error_change(ctx, s, WA_PEC_LOGIN_TIMEOUT);
+            if (s == WA_ERR_NONE)
+                s = finish_login_otp(ctx, state, login, calls[i]->validate);
+        }
+        if (s != WA_ERR_NONE) {
+            state->login_subject = login->username;
+            return s;
+        }
+    }
+    return WA_ERR_NONE;
+}
+
+
 /*
  * Process the login credentials.  We either process a password login or an
  * OTP login depending on the contents of the login tokens.  If any logins are
  * unsuccessful, we abort further processing with an error.  The resulting
  * webkdc-proxy or webkdc-factor tokens are added to the login state.  If
  * there are any successful logins, we also set the did_login state.
+ *
+ * If a login deadline is configured and an OTP login comes before a password
+ * login, so that its validation call can overlap with the password login,
+ * hand off to do_logins_concurrent.  That's the only case with anything to
+ * overlap here.  A lone password or OTP login, which is what WebLogin
+ * normally sends, is done directly, and only start_user_info can overlap
+ * anything with it.
  */
 static int
 do_logins(struct webauth_context *ctx, struct wai_webkdc_login_state *state)
 {
     struct webauth_token *token;
+    bool otp = false;
     int i, s;
 
+    if (state->deadline > 0 && ctx->user != NULL) {
+        for (i = 0; i < state->logins->nelts; i++) {
+            token = APR_ARRAY_IDX(state->logins, i, struct webauth_token *);
+            if (token->token.login.otp != NULL)
+                otp = true;
+            else if (otp)
+                return do_logins_concurrent(ctx, state);
+        }
+    }
     for (i = 0; i < state->logins->nelts; i++) {
         token = APR_ARRAY_IDX(state->logins, i, struct webauth_token *);
         if (token->token.login.otp != NULL)
@@ -843,10 +1036,10 @@ invalidate_webkdc_factors(struct webauth_context *ctx,
 
 
 /*
- * Given the login request token, the remote IP address, the current
- * webkdc-proxy token, and the current list of webkdc-factor tokens, call the
- * user information service and store the results in the provided
- * webauth_user_info struct.  Returns a WebAuth status code.
+ * Given the login request token, the remote IP address, a webkdc-proxy
+ * token, and the current list of webkdc-factor tokens, work out the arguments
+ * for the user information service call and store them in the provided
+ * struct.
  *
  * We have to do a bunch of factor math to figure out whether we need to
  * request random multifactor and to construct the current authentication
@@ -854,17 +1047,16 @@ invalidate_webkdc_factors(struct webauth_context *ctx,
  * an initial "i" indicates they're for the initial factors and an initial "s"
  * indicates that they're for the session factors.
  */
-static int
-get_user_info(struct webauth_context *ctx,
-              struct wai_webkdc_login_state *state,
-              struct webauth_user_info **info)
+static void
+user_info_args(struct webauth_context *ctx,
+               struct wai_webkdc_login_state *state,
+               const struct webauth_token *wkproxy,
+               struct wai_user_info_call *call)
 {
     const struct webauth_token_webkdc_proxy *wkp;
     struct webauth_factors *ifactors, *iwkfactors, *sfactors, *swkfactors;
     struct webauth_factors *random, *extra;
     bool randmf = false;
-    const char *factors;
-    int s;
 
     /* Parse the request factors. */
     ifactors = webauth_factors_parse(ctx, state->request->initial_factors);
@@ -874,7 +1066,7 @@ get_user_info(struct webauth_context *ctx,
     random = webauth_factors_parse(ctx, WA_FA_RANDOM_MULTIFACTOR);
 
     /* Parse the factors from the webkdc-proxy token. */
-    wkp = &state->wkproxy->token.webkdc_proxy;
+    wkp = &wkproxy->token.webkdc_proxy;
     iwkfactors = webauth_factors_parse(ctx, wkp->initial_factors);
     swkfactors = webauth_factors_parse(ctx, wkp->session_factors);
 
@@ -898,10 +1090,189 @@ get_user_info(struct webauth_context *ctx,
         if (!webauth_factors_satisfies(ctx, swkfactors, random))
             randmf = true;
 
-    /* Call the user information service. */
-    factors = webauth_factors_string(ctx, iwkfactors);
-    s = webauth_user_info(ctx, wkp->subject, state->remote_ip, randmf,
-                          state->request->return_url, factors, info);
+    /* Store the arguments. */
+    call->subject   = wkp->subject;
+    call->ip        = state->remote_ip;
+    call->random_mf = randmf;
+    call->url       = state->request->return_url;
+    call->factors   = webauth_factors_string(ctx, iwkfactors);
+    call->info      = NULL;
+}
+
+
+/*
+ * The body of a background job for a user information service call.
+ */
+static int
+run_user_info(struct webauth_context *ctx, void *data)
+{
+    struct wai_user_info_call *call = data;
+
+    return webauth_user_info(ctx, call->subject, call->ip, call->random_mf,
+                             call->url, call->factors, &call->info);
+}
+
+
+/*
+ * If speculative user information calls are enabled and all the login tokens
+ * in the request are password logins for the same user, start the user
+ * information service call in a background job before doing the logins, so
+ * that it overlaps with the Kerberos authentication.
+ *
+ * The arguments of that call depend on the webkdc-proxy token that results
+ * from the login, so we predict it, assuming that the login will succeed and
+ * that the authenticated subject will be the username.  get_user_info only
+ * uses the result if the arguments it computes match.  Any failure here just
+ * means the call will be made afterwards as usual.  Since the call is made
+ * before the password is checked, the user information service sees calls
+ * for failed logins too, which is why this is a separate option.
+ */
+static void
+start_user_info(struct webauth_context *ctx,
+                struct wai_webkdc_login_state *state)
+{
+    struct webauth_token *token, *wkproxy;
+    struct webauth_token_login *login;
+    struct webauth_token_webkdc_proxy *wpt;
+    struct wai_log_callback info;
+    struct wai_user_info_call args, *call;
+    struct webauth_context *jctx;
+    struct wai_job *job;
+    apr_array_header_t *wkproxies;
+    const char *username = NULL;
+    const char *error;
+    apr_pool_t *pool;
+    int i, s, status;
+
+    /* Check whether the logins are ones we can predict. */
+    if (state->deadline == 0 || ctx->user == NULL)
+        return;
+    if (!ctx->webkdc->speculative_userinfo)
+        return;
+    for (i = 0; i < state->logins->nelts; i++) {
+        token = APR_ARRAY_IDX(state->logins, i, struct webauth_token *);
+        login = &token->token.login;
+        if (login->otp != NULL || strchr(login->username, '@') != NULL)
+            return;
+        if (username != NULL && strcmp(username, login->username) != 0)
+            return;
+        username = login->username;
+    }
+    if (username == NULL)
+        return;
+
+    /* Build the webkdc-proxy token that do_login_krb should create. */
+    token = apr_pcalloc(ctx->pool, sizeof(struct webauth_token));
+    token->type = WA_TOKEN_WEBKDC_PROXY;
+    wpt = &token->token.webkdc_proxy;
+    wpt->subject         = username;
+    wpt->proxy_type      = "krb5";
+    wpt->proxy_subject   = "WEBKDC:krb5:";
+    wpt->initial_factors = WA_FA_PASSWORD;
+    wpt->session_factors = WA_FA_PASSWORD;
+    wpt->creation        = time(NULL);
+    wpt->expiration      = wpt->creation + 60 * 60;
+
+    /*
+     * Merge it with the webkdc-proxy tokens from the request the way
+     * merge_webkdc_proxies will.  This is only a prediction, so suppress the
+     * informational messages and any error.
+     */
+    wkproxies = apr_array_copy(ctx->pool, state->wkproxies);
+    APR_ARRAY_PUSH(wkproxies, struct webauth_token *) = token;
+    info   = ctx->info;
+    error  = ctx->error;
+    status = ctx->status;
+    memset(&ctx->info, 0, sizeof(ctx->info));
+    s = wai_token_merge_webkdc_proxy(ctx, wkproxies,
+                                     ctx->webkdc->login_time_limit, &wkproxy);
+    ctx->info   = info;
+    ctx->error  = error;
+    ctx->status = status;
+    if (s != WA_ERR_NONE || wkproxy == NULL)
+        return;
+
+    /* Start the call with a copy of the arguments in the job's context. */
+    user_info_args(ctx, state, wkproxy, &args);
+    s = wai_job_create(ctx, &job);
+    if (s != WA_ERR_NONE) {
+        wai_log_error(ctx, WA_LOG_WARN, s, "cannot start user information"
+                      " call in the background");
+        return;
+    }
+    wai_log_trace(ctx, "calling user information service for %s in the"
+                  " background", args.subject);
+    jctx = wai_job_context(job);
+    pool = jctx->pool;
+    call = apr_pcalloc(pool, sizeof(struct wai_user_info_call));
+    call->subject   = apr_pstrdup(pool, args.subject);
+    call->ip        = apr_pstrdup(pool, args.ip);
+    call->random_mf = args.random_mf;
+    call->url       = apr_pstrdup(pool, args.url);
+    call->factors   = apr_pstrdup(pool, args.factors);
+    wai_job_start(job, run_user_info, call);
+    state->info_job  = job;
+    state->info_call = call;
+}
+
+
+/*
+ * Compare two possibly NULL strings for equality.
+ */
+static bool
+string_equal(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+
+/*
+ * Given the login request token, the remote IP address, the current
+ * webkdc-proxy token, and the current list of webkdc-factor tokens, call the
+ * user information service and store the results in the provided
+ * webauth_user_info struct.  Returns a WebAuth status code.
+ *
+ * If start_user_info already started the call with the same arguments, wait
+ * for that call to finish, but not past the login deadline.  A call that
+ * misses the deadline is treated like any other failure to contact the user
+ * information service.
+ */
+static int
+get_user_info(struct webauth_context *ctx,
+              struct wai_webkdc_login_state *state,
+              struct webauth_user_info **info)
+{
+    struct wai_user_info_call args, *call;
+    struct wai_job *job;
+    int s;
+
+    /* Use the result of the background call if its arguments were right. */
+    user_info_args(ctx, state, state->wkproxy, &args);
+    job  = state->info_job;
+    call = state->info_call;
+    state->info_job  = NULL;
+    state->info_call = NULL;
+    if (job != NULL && call->random_mf == args.random_mf
+        && string_equal(call->subject, args.subject)
+        && string_equal(call->factors, args.factors)) {
+        s = wai_job_wait(ctx, job, state->deadline);
+        *info = call->info;
+        if (s == WA_ERR_REMOTE_TIMEOUT) {
+            s = wai_error_change(ctx, s, WA_ERR_REMOTE_FAILURE);
+            if (ctx->user->ignore_failure) {
+                wai_log_error(ctx, WA_LOG_WARN, s,
+                              "user information service failure");
+                s = WA_ERR_NONE;
+                *info = apr_pcalloc(ctx->pool,
+                                    sizeof(struct webauth_user_info));
+            }
+        }
+    } else {
+        s = webauth_user_info(ctx, args.subject, args.ip, args.random_mf,
+                              args.url, args.factors, info);
+    }
 
     /*
      * If the user information service succeeded but returned an error, treat
@@ -950,9 +1321,12 @@ add_user_info(struct webauth_context *ctx,
      * any webkdc-factor tokens that were created before that time.  Then,
      * redo the user information service call if any webkdc-factor tokens were
      * invalidated, since we may now have different authentication factors.
+     * The user's devices have probably changed, so first drop any cached
+     * results for the user, which forces that call to go to the service.
      */
     valid_threshold = (*info)->valid_threshold;
     if (invalidate_webkdc_factors(ctx, state->wkfactors, valid_threshold)) {
+        wai_user_cache_flush(ctx, state->wkproxy->token.webkdc_proxy.subject);
         s = get_user_info(ctx, state, info);
         if (s != WA_ERR_NONE)
             return s;
@@ -1690,6 +2064,18 @@ webauth_webkdc_login(struct webauth_context *ctx,
     if (s != WA_ERR_NONE)
         goto done;
 
+    /*
+     * If a login deadline is configured, calls to remote services that don't
+     * depend on each other may be made at the same time, waiting for them no
+     * longer than the deadline.  If speculative user information calls are
+     * enabled, start the user information service call early if we can
+     * predict its arguments.
+     */
+    if (ctx->webkdc->login_deadline > 0) {
+        state.deadline = time(NULL) + ctx->webkdc->login_deadline;
+        start_user_info(ctx, &state);
+    }
+
     /*
      * Process any login tokens.  This may result in more webkdc-proxy or
      * webkdc-factor tokens.  If there are any valid login tokens, this will
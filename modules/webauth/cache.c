@@ -0,0 +1,370 @@
+/*
+ * Cache of decoded app tokens for the WebAuth Apache module.
+ *
+ * Browsers send the same app token cookie with every request for a protected
+ * page and for each of its images, style sheets, and scripts, and decrypting
+ * and decoding that cookie is most of the per-request work the module does.
+ * This cache maps app token cookies to their decoded contents so that repeat
+ * requests skip the cryptography entirely.
+ *
+ * There is one cache per virtual host in each Apache child process.  It holds
+ * at most a configured number of entries and evicts the least recently used
+ * entry to make room for a new one.  Each entry is kept until the earlier of
+ * the expiration of the token and the configured time to live, and the whole
+ * cache is discarded when the keyring changes.  Entries are individually
+ * malloc'd, since they have to be freed on eviction, and each is a single
+ * block holding the cookie and a copy of the token's strings.
+ *
+ * Entries are found by a hash of the cookie but matched against the full
+ * cookie value, so a hash collision can never return someone else's token.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/apache.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+
+#include <openssl/crypto.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <modules/webauth/mod_webauth.h>
+#include <webauth/basic.h>
+#include <webauth/tokens.h>
+
+/*
+ * A cached app token.  The cookie and the data pointed to by token follow
+ * the struct in the same allocation, with the cookie first.
+ */
+struct entry {
+    struct entry *next;                 /* Next entry in the hash chain. */
+    struct entry *newer;                /* LRU list, toward most recent. */
+    struct entry *older;                /* LRU list, toward least recent. */
+    apr_uint32_t hash;
+    size_t cookie_len;
+    time_t expires;                     /* When to stop using this entry. */
+    size_t data_len;                    /* Length of cookie and token data. */
+    struct webauth_token_app token;
+};
+
+/* The cache itself. */
+struct mwa_app_cache {
+    apr_thread_mutex_t *mutex;
+    struct entry **buckets;
+    size_t nbuckets;                    /* Always a power of two. */
+    struct entry *newest;
+    struct entry *oldest;
+    unsigned long size;                 /* Maximum number of entries. */
+    unsigned long ttl;                  /* Maximum lifetime of an entry. */
+    unsigned long generation;           /* Keyring generation of entries. */
+    struct mwa_app_cache_stats stats;
+};
+
+
+/*
+ * Hash a cookie value with FNV-1a, which is fast and good enough for choosing
+ * a bucket since the full cookie is always compared afterwards.
+ */
+static apr_uint32_t
+hash_cookie(const char *cookie, size_t length)
+{
+    apr_uint32_t hash = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char) cookie[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+
+/*
+ * Return the space needed for the strings and session key of an app token.
+ */
+static size_t
+token_data_length(const struct webauth_token_app *app)
+{
+    size_t length = app->session_key_len;
+
+    if (app->subject != NULL)
+        length += strlen(app->subject) + 1;
+    if (app->authz_subject != NULL)
+        length += strlen(app->authz_subject) + 1;
+    if (app->initial_factors != NULL)
+        length += strlen(app->initial_factors) + 1;
+    if (app->session_factors != NULL)
+        length += strlen(app->session_factors) + 1;
+    return length;
+}
+
+
+/*
+ * Copy a string, if not NULL, to the buffer at *p, advance *p past it, and
+ * return the copy.
+ */
+static const char *
+copy_string(char **p, const char *string)
+{
+    char *copy = *p;
+    size_t length;
+
+    if (string == NULL)
+        return NULL;
+    length = strlen(string) + 1;
+    memcpy(copy, string, length);
+    *p += length;
+    return copy;
+}
+
+
+/*
+ * Copy an app token into dest, copying its strings and session key into
+ * buffer, which must have room for token_data_length bytes.
+ */
+static void
+copy_token(struct webauth_token_app *dest, const struct webauth_token_app *src,
+           char *buffer)
+{
+    *dest = *src;
+    if (src->session_key != NULL) {
+        memcpy(buffer, src->session_key, src->session_key_len);
+        dest->session_key = buffer;
+        buffer += src->session_key_len;
+    }
+    dest->subject         = copy_string(&buffer, src->subject);
+    dest->authz_subject   = copy_string(&buffer, src->authz_subject);
+    dest->initial_factors = copy_string(&buffer, src->initial_factors);
+    dest->session_factors = copy_string(&buffer, src->session_factors);
+}
+
+
+/*
+ * Unlink an entry from its hash chain and the LRU list and free it, first
+ * clearing it since its data includes the token's session key.
+ */
+static void
+remove_entry(struct mwa_app_cache *cache, struct entry *entry)
+{
+    struct entry **chain;
+
+    chain = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+    while (*chain != entry)
+        chain = &(*chain)->next;
+    *chain = entry->next;
+    if (entry->newer == NULL)
+        cache->newest = entry->older;
+    else
+        entry->newer->older = entry->older;
+    if (entry->older == NULL)
+        cache->oldest = entry->newer;
+    else
+        entry->older->newer = entry->newer;
+    cache->stats.entries--;
+    OPENSSL_cleanse(entry, sizeof(struct entry) + entry->data_len);
+    free(entry);
+}
+
+
+/*
+ * Remove all entries from the cache.
+ */
+static void
+flush_cache(struct mwa_app_cache *cache)
+{
+    while (cache->oldest != NULL)
+        remove_entry(cache, cache->oldest);
+}
+
+
+/*
+ * Pool cleanup that frees the cache entries when the pool the cache was
+ * created in is destroyed.
+ */
+static apr_status_t
+cleanup_cache(void *data)
+{
+    flush_cache(data);
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Discard the cache contents if they were decoded with an older keyring,
+ * since the keys that validated them may since have been removed.  Must be
+ * called with the mutex held.
+ */
+static void
+check_generation(struct mwa_app_cache *cache, unsigned long generation)
+{
+    if (cache->generation == generation)
+        return;
+    flush_cache(cache);
+    cache->generation = generation;
+}
+
+
+/*
+ * Create a new app token cache holding at most size entries, each for at most
+ * ttl seconds.  The cache is freed when the pool is destroyed.
+ */
+struct mwa_app_cache *
+mwa_app_cache_create(apr_pool_t *pool, unsigned long size, unsigned long ttl)
+{
+    struct mwa_app_cache *cache;
+
+    cache = apr_pcalloc(pool, sizeof(struct mwa_app_cache));
+    cache->size = size;
+    cache->ttl = ttl;
+    cache->nbuckets = 16;
+    while (cache->nbuckets < size)
+        cache->nbuckets *= 2;
+    cache->buckets = apr_pcalloc(pool, cache->nbuckets * sizeof(void *));
+    apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+    apr_pool_cleanup_register(pool, cache, cleanup_cache,
+                              apr_pool_cleanup_null);
+    return cache;
+}
+
+
+/*
+ * Look up an app token cookie, after URL unescaping, in the cache.  If found
+ * and still valid, return a copy of the decoded token allocated from the
+ * pool.  Otherwise, return NULL.  generation is the current keyring
+ * generation, used to discard the cache after the keyring changes.
+ */
+struct webauth_token *
+mwa_app_cache_get(struct mwa_app_cache *cache, const char *cookie,
+                  unsigned long generation, apr_pool_t *pool)
+{
+    struct entry *entry;
+    struct webauth_token *token = NULL;
+    apr_uint32_t hash;
+    size_t length;
+    time_t now;
+
+    length = strlen(cookie);
+    hash = hash_cookie(cookie, length);
+    now = time(NULL);
+    apr_thread_mutex_lock(cache->mutex);
+    check_generation(cache, generation);
+    entry = cache->buckets[hash & (cache->nbuckets - 1)];
+    for (; entry != NULL; entry = entry->next)
+        if (entry->hash == hash && entry->cookie_len == length
+            && memcmp(entry + 1, cookie, length) == 0)
+            break;
+    if (entry != NULL && entry->expires <= now) {
+        remove_entry(cache, entry);
+        entry = NULL;
+    }
+    if (entry == NULL) {
+        cache->stats.misses++;
+        apr_thread_mutex_unlock(cache->mutex);
+        return NULL;
+    }
+
+    /* Move the entry to the front of the LRU list. */
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+        if (entry->older == NULL)
+            cache->oldest = entry->newer;
+        else
+            entry->older->newer = entry->newer;
+        entry->older = cache->newest;
+        entry->newer = NULL;
+        cache->newest->newer = entry;
+        cache->newest = entry;
+    }
+
+    /* Copy the token out while we still hold the lock. */
+    length = entry->data_len - entry->cookie_len;
+    token = apr_palloc(pool, sizeof(struct webauth_token) + length);
+    token->type = WA_TOKEN_APP;
+    copy_token(&token->token.app, &entry->token, (char *) (token + 1));
+    cache->stats.hits++;
+    apr_thread_mutex_unlock(cache->mutex);
+    return token;
+}
+
+
+/*
+ * Store a successfully decoded app token in the cache under its cookie value,
+ * after URL unescaping, evicting the least recently used entry if the cache
+ * is full.
+ */
+void
+mwa_app_cache_put(struct mwa_app_cache *cache, const char *cookie,
+                  unsigned long generation,
+                  const struct webauth_token_app *app)
+{
+    struct entry *entry, **chain;
+    size_t length, data_len;
+    apr_uint32_t hash;
+    time_t now, expires;
+
+    now = time(NULL);
+    expires = now + cache->ttl;
+    if (app->expiration < expires)
+        expires = app->expiration;
+    if (expires <= now)
+        return;
+
+    /* Build the new entry before taking the lock. */
+    length = strlen(cookie);
+    hash = hash_cookie(cookie, length);
+    data_len = length + token_data_length(app);
+    entry = malloc(sizeof(struct entry) + data_len);
+    if (entry == NULL)
+        return;
+    entry->hash = hash;
+    entry->cookie_len = length;
+    entry->expires = expires;
+    entry->data_len = data_len;
+    memcpy(entry + 1, cookie, length);
+    copy_token(&entry->token, app, (char *) (entry + 1) + length);
+
+    apr_thread_mutex_lock(cache->mutex);
+    check_generation(cache, generation);
+
+    /* Replace any existing entry for the same cookie. */
+    chain = &cache->buckets[hash & (cache->nbuckets - 1)];
+    for (; *chain != NULL; chain = &(*chain)->next)
+        if ((*chain)->hash == hash && (*chain)->cookie_len == length
+            && memcmp(*chain + 1, cookie, length) == 0) {
+            remove_entry(cache, *chain);
+            break;
+        }
+    if (cache->stats.entries >= cache->size && cache->oldest != NULL) {
+        remove_entry(cache, cache->oldest);
+        cache->stats.evictions++;
+    }
+
+    /* Add the new entry to its chain and the front of the LRU list. */
+    chain = &cache->buckets[hash & (cache->nbuckets - 1)];
+    entry->next = *chain;
+    *chain = entry;
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest == NULL)
+        cache->oldest = entry;
+    else
+        cache->newest->newer = entry;
+    cache->newest = entry;
+    cache->stats.entries++;
+    apr_thread_mutex_unlock(cache->mutex);
+}
+
+
+/*
+ * Return the current statistics for the cache in stats.
+ */
+void
+mwa_app_cache_stats(struct mwa_app_cache *cache,
+                    struct mwa_app_cache_stats *stats)
+{
+    apr_thread_mutex_lock(cache->mutex);
+    *stats = cache->stats;
+    apr_thread_mutex_unlock(cache->mutex);
+}
@@ -46,11 +46,15 @@ APLOG_USE_MODULE(webauth);
     DIRN(name, desc)                            \
     static const type DF_ ## name = def;
 
+DIRD(AppTokenCacheSize,  "maximum number of cached app tokens", int, 0)
+DIRD(AppTokenCacheTTL,   "maximum lifetime of cached app tokens", int, 300)
 DIRN(AppTokenLifetime,   "lifetime of app tokens")
 DIRN(AuthType,           "additional AuthType alias")
 DIRN(CookiePath,         "path scope for WebAuth cookies")
 DIRN(Cred,               "credential to obtain")
 DIRN(CredCacheDir,       "path to the credential cache directory")
+DIRD(CredCacheReuse,     "whether to share caches for identical credentials",
+     bool, false)
 DIRN(Debug,              "whether to log debug messages")
 DIRN(DoLogout,           "whether to destroy all WebAuth cookies")
 DIRN(DontCache,          "whether to set Expires to the current date")
@@ -61,6 +65,7 @@ DIRD(HttpOnly,           "whether to set HttpOnly for cookies", bool, true)
 DIRN(InactiveExpire,     "duration of inactivity before an app token expires")
 DIRN(Keyring,            "path to the keyring file")
 DIRD(KeyringAutoUpdate,  "whether to automatically update keyring", bool, true)
+DIRD(KeyringDecryptLimit, "maximum keys to try to decrypt a token", int, 0)
 DIRD(KeyringKeyLifetime, "lifetime of keys we create", int, 60 * 60 * 24 * 30)
 DIRN(Keytab,             "path to the Kerberos keytab file")
 DIRN(LastUseUpdateInterval, "how often to update last-used time in app token")
@@ -81,6 +86,8 @@ DIRD(StripURL,           "whether to strip tokens in internal URL", bool, true)
 DIRD(SubjectAuthType,    "requested subject authenticator", char *, "webkdc")
 DIRD(TokenMaxTTL,        "maximum lifetime of recent tokens", int, 300)
 DIRN(TrustAuthzIdentity, "whether to trust asserted authorization identities")
+DIRD(WebKdcPoolSize,     "maximum idle WebKDC connections to keep", int, 4)
+DIRD(WebKdcPoolTimeout,  "how long to keep idle WebKDC connections", int, 60)
 DIRN(WebKdcPrincipal,    "WebKDC Kerberos principal name")
 DIRD(WebKdcSSLCertCheck, "whether to check the WebKDC certificate", bool, true)
 DIRN(WebKdcSSLCertFile,  "file containing the WebKDC's certificate")
@@ -113,11 +120,14 @@ enum {
     SE_Life,
     SE_ReturnURL,
 #endif
+    E_AppTokenCacheSize,
+    E_AppTokenCacheTTL,
     E_AppTokenLifetime,
     E_AuthType,
     E_CookiePath,
     E_Cred,
     E_CredCacheDir,
+    E_CredCacheReuse,
     E_Debug,
     E_DoLogout,
     E_DontCache,
@@ -128,6 +138,7 @@ enum {
     E_InactiveExpire,
     E_Keyring,
     E_KeyringAutoUpdate,
+    E_KeyringDecryptLimit,
     E_KeyringKeyLifetime,
     E_Keytab,
     E_LastUseUpdateInterval,
@@ -150,6 +161,8 @@ enum {
     E_TrustAuthzIdentity,
     E_UseCreds,
     E_VarPrefix,
+    E_WebKdcPoolSize,
+    E_WebKdcPoolTimeout,
     E_WebKdcPrincipal,
     E_WebKdcSSLCertCheck,
     E_WebKdcSSLCertFile,
@@ -205,15 +218,21 @@ mwa_server_config_create(apr_pool_t *pool, server_rec *s UNUSED)
     struct server_config *sconf;
 
     sconf = apr_pcalloc(pool, sizeof(struct server_config));
+    sconf->app_cache_size       = DF_AppTokenCacheSize;
+    sconf->app_cache_ttl        = DF_AppTokenCacheTTL;
+    sconf->cred_cache_reuse     = DF_CredCacheReuse;
     sconf->extra_redirect       = DF_ExtraRedirect;
     sconf->httponly             = DF_HttpOnly;
     sconf->keyring_auto_update  = DF_KeyringAutoUpdate;
+    sconf->keyring_decrypt_limit = DF_KeyringDecryptLimit;
     sconf->keyring_key_lifetime = DF_KeyringKeyLifetime;
     sconf->require_ssl          = DF_RequireSSL;
     sconf->subject_auth_type    = DF_SubjectAuthType;
     sconf->strip_url            = DF_StripURL;
     sconf->token_max_ttl        = DF_TokenMaxTTL;
     sconf->webkdc_cert_check    = DF_WebKdcSSLCertCheck;
+    sconf->webkdc_pool_size     = DF_WebKdcPoolSize;
+    sconf->webkdc_pool_timeout  = DF_WebKdcPoolTimeout;
     return sconf;
 }
 
@@ -250,12 +269,16 @@ mwa_server_config_merge(apr_pool_t *pool, void *basev, void *overv)
     bconf = basev;
     oconf = overv;
 
+    MERGE_SET(app_cache_size);
+    MERGE_SET(app_cache_ttl);
     MERGE_PTR(auth_type);
     MERGE_PTR(cred_cache_dir);
+    MERGE_SET(cred_cache_reuse);
     MERGE_SET(debug);
     MERGE_SET(extra_redirect);
     MERGE_SET(httponly);
     MERGE_SET(keyring_auto_update);
+    MERGE_SET(keyring_decrypt_limit);
     MERGE_SET(keyring_key_lifetime);
     MERGE_PTR(keyring_path);
     MERGE_PTR(keytab_path);
@@ -270,6 +293,8 @@ mwa_server_config_merge(apr_pool_t *pool, void *basev, void *overv)
     MERGE_SET(trust_authz_identity);
     MERGE_SET(webkdc_cert_check);
     MERGE_PTR(webkdc_cert_file);
+    MERGE_SET(webkdc_pool_size);
+    MERGE_SET(webkdc_pool_timeout);
     MERGE_PTR(webkdc_principal);
     MERGE_PTR(webkdc_url);
     MERGE_SET(token_max_ttl);
@@ -389,6 +414,18 @@ mwa_config_init(server_rec *server, struct server_config *bconf UNUSED,
     /* Initialize the mutex. */
     if (sconf->mutex == NULL)
         apr_thread_mutex_create(&sconf->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    mwa_keyring_init(sconf, p);
+
+    /* Create the app token cache if one was configured. */
+    if (sconf->app_cache == NULL && sconf->app_cache_size > 0)
+        sconf->app_cache = mwa_app_cache_create(p, sconf->app_cache_size,
+                                                sconf->app_cache_ttl);
+
+    /* Create the pool of idle connections to the WebKDC. */
+    if (sconf->webkdc_pool == NULL)
+        sconf->webkdc_pool =
+            mwa_webkdc_pool_create(server, p, sconf->webkdc_pool_size,
+                                   sconf->webkdc_pool_timeout);
 
     /* Unlink any existing service token cache so that we'll get a new one. */
     if (unlink(sconf->st_cache_path) < 0 && errno != ENOENT)
@@ -471,11 +508,22 @@ cfg_str(cmd_parms *cmd, void *mconf, const char *arg)
 
     switch (directive) {
     /* Server scope only. */
+    case E_AppTokenCacheSize:
+        err = parse_number(cmd, arg, &sconf->app_cache_size);
+        if (err == NULL)
+            sconf->app_cache_size_set = true;
+        break;
+    case E_AppTokenCacheTTL:
+        err = parse_interval(cmd, arg, &sconf->app_cache_ttl);
+        if (err == NULL)
+            sconf->app_cache_ttl_set = true;
+        break;
     case E_AuthType:
         sconf->auth_type = apr_pstrdup(cmd->pool, arg);
         break;
     case E_CredCacheDir:
-        if (strncmp(arg, "KEYRING:", 8) == 0)
+        if (strncmp(arg, "KEYRING:", 8) == 0
+            || strcmp(arg, "MEMORY:") == 0)
             sconf->cred_cache_dir = apr_pstrdup(cmd->pool, arg);
         else
             sconf->cred_cache_dir = ap_server_root_relative(cmd->pool, arg);
@@ -483,6 +531,11 @@ cfg_str(cmd_parms *cmd, void *mconf, const char *arg)
     case E_Keyring:
         sconf->keyring_path = ap_server_root_relative(cmd->pool, arg);
         break;
+    case E_KeyringDecryptLimit:
+        err = parse_number(cmd, arg, &sconf->keyring_decrypt_limit);
+        if (err == NULL)
+            sconf->keyring_decrypt_limit_set = true;
+        break;
     case E_KeyringKeyLifetime:
         err = parse_interval(cmd, arg, &sconf->keyring_key_lifetime);
         if (err == NULL)
@@ -513,6 +566,16 @@ cfg_str(cmd_parms *cmd, void *mconf, const char *arg)
         if (err == NULL)
             sconf->token_max_ttl_set = true;
         break;
+    case E_WebKdcPoolSize:
+        err = parse_number(cmd, arg, &sconf->webkdc_pool_size);
+        if (err == NULL)
+            sconf->webkdc_pool_size_set = true;
+        break;
+    case E_WebKdcPoolTimeout:
+        err = parse_interval(cmd, arg, &sconf->webkdc_pool_timeout);
+        if (err == NULL)
+            sconf->webkdc_pool_timeout_set = true;
+        break;
     case E_WebKdcPrincipal:
         sconf->webkdc_principal = apr_pstrdup(cmd->pool, arg);
         break;
@@ -657,6 +720,10 @@ cfg_flag(cmd_parms *cmd, void *mconf, int flag)
 
     switch (directive) {
     /* Server scope only. */
+    case E_CredCacheReuse:
+        sconf->cred_cache_reuse = flag;
+        sconf->cred_cache_reuse_set = true;
+        break;
     case E_Debug:
         sconf->debug = flag;
         sconf->debug_set = true;
@@ -770,12 +837,16 @@ cfg_flag(cmd_parms *cmd, void *mconf, int flag)
 #define RSRC_ORAUTH (OR_AUTHCFG | RSRC_CONF)
 
 const command_rec webauth_cmds[] = {
+    DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   AppTokenCacheSize),
+    DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   AppTokenCacheTTL),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   AuthType),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   CredCacheDir),
+    DIRECTIVE(AP_INIT_FLAG,    cfg_flag,  RSRC_CONF,   CredCacheReuse),
     DIRECTIVE(AP_INIT_FLAG,    cfg_flag,  RSRC_CONF,   Debug),
     DIRECTIVE(AP_INIT_FLAG,    cfg_flag,  RSRC_CONF,   HttpOnly),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   Keyring),
     DIRECTIVE(AP_INIT_FLAG,    cfg_flag,  RSRC_CONF,   KeyringAutoUpdate),
+    DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   KeyringDecryptLimit),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   KeyringKeyLifetime),
     DIRECTIVE(AP_INIT_TAKE12,  cfg_str12, RSRC_CONF,   Keytab),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   LoginURL),
@@ -786,6 +857,8 @@ const command_rec webauth_cmds[] = {
     DIRECTIVE(AP_INIT_FLAG,    cfg_flag,  RSRC_CONF,   StripURL),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   SubjectAuthType),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   TokenMaxTTL),
+    DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   WebKdcPoolSize),
+    DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   WebKdcPoolTimeout),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   WebKdcPrincipal),
     DIRECTIVE(AP_INIT_FLAG,    cfg_flag,  RSRC_CONF,   WebKdcSSLCertCheck),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   WebKdcSSLCertFile),
@@ -0,0 +1,329 @@
+/*
+ * Keyring management for the WebAuth Apache module.
+ *
+ * Nearly every request needs the keyring for its virtual host, so getting it
+ * must not serialize the worker threads.  Each keyring is loaded into a
+ * snapshot with its own pool, and the current snapshot is published through
+ * a pointer in the server configuration that is only ever read and replaced
+ * atomically.  Requests take a reference to the current snapshot without
+ * locking and drop it when the request is finished.  While reading the
+ * pointer and taking the reference, a request is counted in the readers
+ * field of the server configuration.
+ *
+ * Every KEYRING_CHECK_INTERVAL seconds, one request checks whether the
+ * keyring file's modification time or inode has changed, if it can do so
+ * without waiting for the lock.  If so, that request loads the new keyring
+ * and publishes it in place of the old snapshot while other requests carry on
+ * with whichever snapshot they already have.  A replaced snapshot is freed
+ * once no request holds a reference to it, but only when the reader count is
+ * zero, since otherwise a request may have read the old pointer and not yet
+ * taken its reference.  Nothing new can read a snapshot once it has been
+ * replaced, so a reader count of zero after the replacement means every
+ * request that saw it has already counted its reference.
+ *
+ * The lock is only waited for when there is no keyring at all, which is only
+ * true until the first successful load.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/apache.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+
+#include <apr_atomic.h>
+#include <time.h>
+
+#include <modules/webauth/mod_webauth.h>
+#include <webauth/basic.h>
+#include <webauth/keys.h>
+
+APLOG_USE_MODULE(webauth);
+
+/* The published keyring pointer, as the type the APR atomics want. */
+#define KEYRING_PTR(sconf) ((volatile void **) &(sconf)->keyring)
+
+
+/*
+ * Return the current keyring snapshot without taking a reference, or NULL if
+ * no keyring has been loaded yet.
+ */
+static struct mwa_keyring *
+current_keyring(struct server_config *sconf)
+{
+    return apr_atomic_casptr(KEYRING_PTR(sconf), NULL, NULL);
+}
+
+
+/*
+ * Get the modification time and inode of the keyring file.  Returns false if
+ * the file couldn't be examined.
+ */
+static bool
+stat_keyring(struct server_config *sconf, apr_finfo_t *finfo,
+             apr_pool_t *pool)
+{
+    apr_status_t status;
+
+    status = apr_stat(finfo, sconf->keyring_path,
+                      APR_FINFO_MTIME | APR_FINFO_INODE, pool);
+    return status == APR_SUCCESS || status == APR_INCOMPLETE;
+}
+
+
+/*
+ * Load the keyring, updating it first if configured to do so, into a new
+ * snapshot with its own pool.  Returns the snapshot or NULL on failure, after
+ * logging the error.  Must be called with the keyring mutex held.
+ */
+static struct mwa_keyring *
+load_keyring(server_rec *server, struct server_config *sconf)
+{
+    struct mwa_keyring *keyring;
+    struct webauth_context *ctx;
+    enum webauth_kau_status kau_status;
+    apr_pool_t *pool;
+    apr_finfo_t finfo;
+    int status, update_status;
+    bool found;
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server,
+                     "mod_webauth: cannot create pool for keyring %s",
+                     sconf->keyring_path);
+        return NULL;
+    }
+    keyring = apr_pcalloc(pool, sizeof(struct mwa_keyring));
+    keyring->pool = pool;
+    status = webauth_context_init_apr(&ctx, pool);
+    if (status != WA_ERR_NONE) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server,
+                     "mod_webauth: cannot create context for keyring: %s",
+                     webauth_error_message(NULL, status));
+        apr_pool_destroy(pool);
+        return NULL;
+    }
+
+    /*
+     * Note the file's identity before reading it, so that a change made
+     * while we're reading is seen at the next check, but again after an
+     * update of our own so that it isn't.
+     */
+    found = stat_keyring(sconf, &finfo, pool);
+    status = webauth_keyring_auto_update(ctx, sconf->keyring_path,
+                 sconf->keyring_auto_update,
+                 sconf->keyring_auto_update ? sconf->keyring_key_lifetime : 0,
+                 &keyring->ring, &kau_status, &update_status);
+    if (status != WA_ERR_NONE)
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server,
+                     "mod_webauth: opening keyring %s failed: %s",
+                     sconf->keyring_path,
+                     webauth_error_message(ctx, status));
+    if (kau_status == WA_KAU_UPDATE && update_status != WA_ERR_NONE)
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server,
+                     "mod_webauth: updating keyring %s failed: %s",
+                     sconf->keyring_path,
+                     webauth_error_message(ctx, update_status));
+    if (sconf->debug) {
+        const char *msg;
+
+        if (kau_status == WA_KAU_NONE)
+            msg = "opened";
+        else if (kau_status == WA_KAU_CREATE)
+            msg = "create";
+        else if (kau_status == WA_KAU_UPDATE)
+            msg = "updated";
+        else
+            msg = "<unknown>";
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
+                     "mod_webauth: %s key ring: %s", msg, sconf->keyring_path);
+    }
+    if (status != WA_ERR_NONE || keyring->ring == NULL) {
+        apr_pool_destroy(pool);
+        return NULL;
+    }
+    if (kau_status != WA_KAU_NONE)
+        found = stat_keyring(sconf, &finfo, pool);
+    if (found) {
+        keyring->mtime = finfo.mtime;
+        keyring->inode = finfo.inode;
+    }
+    keyring->generation = ++sconf->keyring_generation;
+    return keyring;
+}
+
+
+/*
+ * Free the replaced snapshots that are no longer in use.  Does nothing if a
+ * request is between reading the keyring pointer and taking its reference.
+ * Must be called with the keyring mutex held.
+ */
+static void
+free_retired(struct server_config *sconf)
+{
+    struct mwa_keyring **prev, *keyring;
+
+    if (apr_atomic_read32(&sconf->keyring_readers) != 0)
+        return;
+    prev = &sconf->keyring_retired;
+    while (*prev != NULL) {
+        keyring = *prev;
+        if (apr_atomic_read32(&keyring->refs) == 0) {
+            *prev = keyring->next;
+            apr_pool_destroy(keyring->pool);
+        } else {
+            prev = &keyring->next;
+        }
+    }
+}
+
+
+/*
+ * Check whether the keyring file has changed and, if so, load and publish
+ * the new keyring.  Only one thread does this at a time, and only once per
+ * KEYRING_CHECK_INTERVAL.  Other threads return immediately.
+ */
+static void
+check_keyring(server_rec *server, struct server_config *sconf)
+{
+    struct mwa_keyring *keyring, *old;
+    apr_finfo_t finfo;
+    apr_pool_t *pool;
+    time_t now;
+
+    now = time(NULL);
+    if ((apr_uint32_t) now - apr_atomic_read32(&sconf->keyring_checked)
+        < KEYRING_CHECK_INTERVAL)
+        return;
+    if (apr_thread_mutex_trylock(sconf->keyring_mutex) != APR_SUCCESS)
+        return;
+    if ((apr_uint32_t) now - apr_atomic_read32(&sconf->keyring_checked)
+        < KEYRING_CHECK_INTERVAL) {
+        apr_thread_mutex_unlock(sconf->keyring_mutex);
+        return;
+    }
+    apr_atomic_set32(&sconf->keyring_checked, (apr_uint32_t) now);
+    free_retired(sconf);
+
+    /* See if the file has changed, using a scratch pool for apr_stat. */
+    old = current_keyring(sconf);
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        apr_thread_mutex_unlock(sconf->keyring_mutex);
+        return;
+    }
+    if (!stat_keyring(sconf, &finfo, pool)
+        || (finfo.mtime == old->mtime && finfo.inode == old->inode)) {
+        apr_pool_destroy(pool);
+        apr_thread_mutex_unlock(sconf->keyring_mutex);
+        return;
+    }
+    apr_pool_destroy(pool);
+
+    /* Load and publish the new keyring, keeping the old one on failure. */
+    keyring = load_keyring(server, sconf);
+    if (keyring != NULL) {
+        apr_atomic_xchgptr(KEYRING_PTR(sconf), keyring);
+        old->next = sconf->keyring_retired;
+        sconf->keyring_retired = old;
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, server,
+                     "mod_webauth: reloaded changed keyring %s",
+                     sconf->keyring_path);
+    }
+    apr_thread_mutex_unlock(sconf->keyring_mutex);
+}
+
+
+/*
+ * Get a reference to the current keyring snapshot for a virtual host,
+ * loading the keyring if this is the first time it's needed and reloading it
+ * if the file has changed.  Returns NULL if no keyring could be loaded.  The
+ * reference must be released with mwa_keyring_release.
+ */
+struct mwa_keyring *
+mwa_keyring_acquire(server_rec *server, struct server_config *sconf)
+{
+    struct mwa_keyring *keyring;
+
+    /*
+     * If there's no keyring yet, load one under the mutex.  Nothing is freed
+     * without the mutex, so the reference can be taken directly.
+     */
+    if (current_keyring(sconf) == NULL) {
+        apr_thread_mutex_lock(sconf->keyring_mutex);
+        keyring = current_keyring(sconf);
+        if (keyring == NULL) {
+            keyring = load_keyring(server, sconf);
+            if (keyring != NULL) {
+                apr_atomic_set32(&sconf->keyring_checked,
+                                 (apr_uint32_t) time(NULL));
+                apr_atomic_xchgptr(KEYRING_PTR(sconf), keyring);
+            }
+        }
+        if (keyring != NULL)
+            apr_atomic_inc32(&keyring->refs);
+        apr_thread_mutex_unlock(sconf->keyring_mutex);
+        return keyring;
+    }
+
+    /*
+     * Otherwise, take a reference to the current snapshot, counting
+     * ourselves as a reader until we have it so that the snapshot can't be
+     * freed between reading the pointer and taking the reference.
+     */
+    check_keyring(server, sconf);
+    apr_atomic_inc32(&sconf->keyring_readers);
+    keyring = current_keyring(sconf);
+    apr_atomic_inc32(&keyring->refs);
+    apr_atomic_dec32(&sconf->keyring_readers);
+    return keyring;
+}
+
+
+/*
+ * Release a reference to a keyring snapshot obtained from
+ * mwa_keyring_acquire.
+ */
+void
+mwa_keyring_release(struct mwa_keyring *keyring)
+{
+    apr_atomic_dec32(&keyring->refs);
+}
+
+
+/*
+ * Pool cleanup that frees all keyring snapshots for a virtual host when its
+ * configuration is discarded.
+ */
+static apr_status_t
+cleanup_keyrings(void *data)
+{
+    struct server_config *sconf = data;
+    struct mwa_keyring *keyring;
+
+    keyring = apr_atomic_xchgptr(KEYRING_PTR(sconf), NULL);
+    if (keyring != NULL)
+        apr_pool_destroy(keyring->pool);
+    while (sconf->keyring_retired != NULL) {
+        keyring = sconf->keyring_retired;
+        sconf->keyring_retired = keyring->next;
+        apr_pool_destroy(keyring->pool);
+    }
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Set up keyring management for a virtual host.  Called from mwa_config_init
+ * with the configuration pool.
+ */
+void
+mwa_keyring_init(struct server_config *sconf, apr_pool_t *pool)
+{
+    if (sconf->keyring_mutex != NULL)
+        return;
+    apr_thread_mutex_create(&sconf->keyring_mutex, APR_THREAD_MUTEX_DEFAULT,
+                            pool);
+    apr_pool_cleanup_register(pool, sconf, cleanup_keyrings,
+                              apr_pool_cleanup_null);
+}
@@ -13,10 +13,18 @@
 #include <portable/apr.h>
 #include <portable/stdbool.h>
 
+#include <apr_atomic.h>
 #include <apr_base64.h>
+#include <apr_sha1.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #ifdef HAVE_LIBKEYUTILS
 # include <keyutils.h>
 #endif
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <modules/webauth/mod_webauth.h>
@@ -92,13 +100,14 @@ krb5_validate_sad(MWA_REQ_CTXT *rc, const void *sad, size_t sad_len)
 }
 
 
-static int
-krb5_prepare_file_creds(MWA_REQ_CTXT *rc, apr_array_header_t *creds)
+/*
+ * Create an empty temporary file in the credential cache directory to use as
+ * a ticket cache.  Returns its path or NULL on failure, after logging the
+ * error.
+ */
+static char *
+make_temp_cache(MWA_REQ_CTXT *rc, const char *mwa_func)
 {
-    const char *mwa_func="krb5_prepare_file_creds";
-    struct webauth_krb5 *kc;
-    size_t i;
-    int status;
     char *temp_cred_file;
     apr_file_t *fp;
     apr_int32_t flags;
@@ -113,7 +122,7 @@ krb5_prepare_file_creds(MWA_REQ_CTXT *rc, apr_array_header_t *creds)
         mwa_log_apr_error(rc->r->server, astatus, mwa_func,
                           "apr_filepath_merge", rc->sconf->cred_cache_dir,
                           "temp.krb5.XXXXX");
-        return 0;
+        return NULL;
     }
 
     flags = (APR_FOPEN_CREATE | APR_FOPEN_READ | APR_FOPEN_WRITE
@@ -122,25 +131,41 @@ krb5_prepare_file_creds(MWA_REQ_CTXT *rc, apr_array_header_t *creds)
     if (astatus != APR_SUCCESS) {
         mwa_log_apr_error(rc->r->server, astatus, mwa_func,
                           "apr_file_mktemp", temp_cred_file, NULL);
-        return 0;
+        return NULL;
     }
 
-    /* we close it here, and register a pool cleanup handler */
+    /*
+     * We close it here.  The ticket cache is destroyed with the Kerberos
+     * context, which is freed with the request pool.
+     */
     astatus = apr_file_close(fp);
     if (astatus != APR_SUCCESS) {
         mwa_log_apr_error(rc->r->server, astatus, mwa_func,
                           "apr_file_close", temp_cred_file, NULL);
-        return 0;
+        return NULL;
     }
 
     if (rc->sconf->debug)
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
                      "mod_webauth: %s: temp_cred_file mktemp(%s)",
                      mwa_func, temp_cred_file);
+    return temp_cred_file;
+}
 
-    kc = get_webauth_krb5_ctxt(rc->ctx, rc->r->server, mwa_func);
-    if (kc == NULL)
-        return 0;
+
+/*
+ * Import all of the krb5 credentials into the given ticket cache, or into a
+ * memory cache if cache is NULL.  Returns false if any of them couldn't be
+ * imported, after logging the error.
+ */
+static bool
+import_creds(MWA_REQ_CTXT *rc, struct webauth_krb5 *kc,
+             apr_array_header_t *creds, const char *cache,
+             const char *mwa_func)
+{
+    size_t i;
+    int status;
+    bool okay = true;
 
     for (i = 0; i < (size_t) creds->nelts; i++) {
         struct webauth_token_cred *cred;
@@ -152,13 +177,33 @@ krb5_prepare_file_creds(MWA_REQ_CTXT *rc, apr_array_header_t *creds)
                              "mod_webauth: %s: prepare (%s) for (%s)",
                              mwa_func, cred->service, cred->subject);
             status = webauth_krb5_import_cred(rc->ctx, kc, cred->data,
-                                              cred->data_len, temp_cred_file);
-            if (status != WA_ERR_NONE)
+                                              cred->data_len, cache);
+            if (status != WA_ERR_NONE) {
                 log_webauth_error(rc->ctx, rc->r->server,
                                   status, mwa_func,
                                   "webauth_krb5_import_cred", NULL);
+                okay = false;
+            }
         }
     }
+    return okay;
+}
+
+
+static int
+krb5_prepare_file_creds(MWA_REQ_CTXT *rc, apr_array_header_t *creds)
+{
+    const char *mwa_func="krb5_prepare_file_creds";
+    struct webauth_krb5 *kc;
+    char *temp_cred_file;
+
+    temp_cred_file = make_temp_cache(rc, mwa_func);
+    if (temp_cred_file == NULL)
+        return 0;
+    kc = get_webauth_krb5_ctxt(rc->ctx, rc->r->server, mwa_func);
+    if (kc == NULL)
+        return 0;
+    import_creds(rc, kc, creds, temp_cred_file, mwa_func);
 
     /* set environment variable */
     apr_table_setn(rc->r->subprocess_env, ENV_KRB5CCNAME, temp_cred_file);
@@ -166,6 +211,344 @@ krb5_prepare_file_creds(MWA_REQ_CTXT *rc, apr_array_header_t *creds)
 }
 
 
+/*
+ * Put the credentials into a Kerberos memory cache, which never touches the
+ * disk and is destroyed at the end of the request.  This is only useful to
+ * code running inside the Apache process, such as mod_perl or mod_php
+ * applications, since the cache isn't visible to other processes.
+ */
+static int
+krb5_prepare_memory_creds(MWA_REQ_CTXT *rc, apr_array_header_t *creds)
+{
+    const char *mwa_func = "krb5_prepare_memory_creds";
+    struct webauth_krb5 *kc;
+    char *cache;
+    int status;
+
+    kc = get_webauth_krb5_ctxt(rc->ctx, rc->r->server, mwa_func);
+    if (kc == NULL)
+        return 0;
+    import_creds(rc, kc, creds, NULL, mwa_func);
+    status = webauth_krb5_get_cache(rc->ctx, kc, &cache);
+    if (status != WA_ERR_NONE) {
+        log_webauth_error(rc->ctx, rc->r->server, status, mwa_func,
+                          "webauth_krb5_get_cache", NULL);
+        return 0;
+    }
+    if (rc->sconf->debug)
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
+                     "mod_webauth: %s: using memory cache %s", mwa_func,
+                     cache);
+    apr_table_setn(rc->r->subprocess_env, ENV_KRB5CCNAME, cache);
+    return 1;
+}
+
+
+/*
+ * Determine the path of the shared ticket cache for a set of credentials,
+ * which is named after the SHA-1 hash of the encoded krb5 credentials, and
+ * store the earliest expiration time of those credentials in expiration.
+ * Returns NULL if there are no krb5 credentials or on error.
+ */
+static char *
+shared_cache_path(MWA_REQ_CTXT *rc, apr_array_header_t *creds,
+                  time_t *expiration, const char *mwa_func)
+{
+    static const char hex[] = "0123456789abcdef";
+    apr_sha1_ctx_t sha;
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    char name[sizeof("webauth_") + APR_SHA1_DIGESTSIZE * 2];
+    char *path, *p;
+    apr_uint32_t length;
+    apr_status_t astatus;
+    size_t i;
+
+    *expiration = 0;
+    apr_sha1_init(&sha);
+    for (i = 0; i < (size_t) creds->nelts; i++) {
+        struct webauth_token_cred *cred;
+
+        cred = APR_ARRAY_IDX(creds, i, struct webauth_token_cred *);
+        if (strcmp(cred->type, "krb5") != 0)
+            continue;
+        length = cred->data_len;
+        apr_sha1_update_binary(&sha, (void *) &length, sizeof(length));
+        apr_sha1_update_binary(&sha, cred->data, cred->data_len);
+        if (*expiration == 0 || cred->expiration < *expiration)
+            *expiration = cred->expiration;
+    }
+    if (*expiration == 0)
+        return NULL;
+    apr_sha1_final(digest, &sha);
+
+    strcpy(name, "webauth_");
+    p = name + strlen(name);
+    for (i = 0; i < APR_SHA1_DIGESTSIZE; i++) {
+        *p++ = hex[digest[i] >> 4];
+        *p++ = hex[digest[i] & 0xf];
+    }
+    *p = '\0';
+    astatus = apr_filepath_merge(&path, rc->sconf->cred_cache_dir, name, 0,
+                                 rc->r->pool);
+    if (astatus != APR_SUCCESS) {
+        mwa_log_apr_error(rc->r->server, astatus, mwa_func,
+                          "apr_filepath_merge", rc->sconf->cred_cache_dir,
+                          name);
+        return NULL;
+    }
+    return path;
+}
+
+
+/*
+ * Pool cleanup that removes the temporary name of a shared ticket cache,
+ * which by then has either been linked into place or is only used by the
+ * request.
+ */
+static apr_status_t
+remove_cache(void *data)
+{
+    unlink(data);
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Returns true if the result of lstat on a shared ticket cache shows a file
+ * that this server could have written: a regular file, not a symlink, owned
+ * by the user the server runs as and accessible only to that user.  Anything
+ * else in the cache directory may have been put there by someone else and is
+ * neither used nor removed.
+ */
+static bool
+shared_cache_owned(const struct stat *st)
+{
+    return (S_ISREG(st->st_mode) && st->st_uid == geteuid()
+            && (st->st_mode & 07777) == 0600);
+}
+
+
+/*
+ * Create the empty temporary file in which to build a shared ticket cache,
+ * named after the shared cache with the process ID and a serial number
+ * added.  The file is created exclusively, without following symlinks, and
+ * with mode 0600 whatever the umask, since requests only reuse a shared cache
+ * with that mode.  Returns the path or NULL on error.
+ */
+static char *
+make_shared_temp_cache(MWA_REQ_CTXT *rc, const char *path,
+                       const char *mwa_func)
+{
+    static volatile apr_uint32_t serial = 0;
+    char *temp;
+    int fd;
+
+    temp = apr_psprintf(rc->r->pool, "%s.%lu.%lu", path,
+                        (unsigned long) getpid(),
+                        (unsigned long) apr_atomic_inc32(&serial));
+    fd = open(temp, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+                     "mod_webauth: %s: cannot create %s: %s", mwa_func, temp,
+                     strerror(errno));
+        return NULL;
+    }
+    if (fchmod(fd, 0600) < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+                     "mod_webauth: %s: cannot chmod %s: %s", mwa_func, temp,
+                     strerror(errno));
+        close(fd);
+        unlink(temp);
+        return NULL;
+    }
+    close(fd);
+    return temp;
+}
+
+
+/*
+ * Remove the shared ticket caches whose credentials have expired.  Each
+ * shared cache has its modification time set to the expiration of its
+ * credentials when it is created, so this only has to look at the file and
+ * not read the credentials.  Only the files that shared_cache_path could
+ * have named are considered.  This is run by requests that create a new
+ * shared cache, at most once every SHARED_SWEEP_INTERVAL seconds in each
+ * process.
+ */
+#define SHARED_SWEEP_INTERVAL 60
+
+static void
+sweep_shared_caches(MWA_REQ_CTXT *rc, const char *mwa_func)
+{
+    static volatile apr_uint32_t swept = 0;
+    const char *dirname = rc->sconf->cred_cache_dir;
+    apr_uint32_t last;
+    struct dirent *entry;
+    struct stat st;
+    char *path;
+    DIR *dir;
+    time_t now;
+
+    now = time(NULL);
+    last = apr_atomic_read32(&swept);
+    if ((apr_uint32_t) now - last < SHARED_SWEEP_INTERVAL)
+        return;
+    if (apr_atomic_cas32(&swept, (apr_uint32_t) now, last) != last)
+        return;
+
+    dir = opendir(dirname);
+    if (dir == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+                     "mod_webauth: %s: cannot open %s: %s", mwa_func,
+                     dirname, strerror(errno));
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "webauth_", strlen("webauth_")) != 0)
+            continue;
+        if (strlen(entry->d_name)
+            != strlen("webauth_") + APR_SHA1_DIGESTSIZE * 2)
+            continue;
+        path = apr_pstrcat(rc->r->pool, dirname, "/", entry->d_name,
+                           (char *) 0);
+        if (lstat(path, &st) < 0 || !shared_cache_owned(&st))
+            continue;
+        if (st.st_mtime > now)
+            continue;
+        if (unlink(path) < 0 && errno != ENOENT)
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+                         "mod_webauth: %s: cannot remove %s: %s", mwa_func,
+                         path, strerror(errno));
+        else if (rc->sconf->debug)
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
+                         "mod_webauth: %s: removed expired cache %s",
+                         mwa_func, path);
+    }
+    closedir(dir);
+}
+
+
+/*
+ * Put the credentials into a ticket cache shared by every request with the
+ * identical set of credentials, which is normally every request in the same
+ * WebAuth session.  The first such request writes the cache to a temporary
+ * file and links it into place, and later requests use it as-is until the
+ * credentials expire.  A request that finds a cache whose credentials have
+ * expired removes it, and requests that create a new cache periodically
+ * remove any other expired caches, so caches for sessions that never return
+ * don't accumulate.
+ */
+static int
+krb5_prepare_shared_creds(MWA_REQ_CTXT *rc, apr_array_header_t *creds)
+{
+    const char *mwa_func = "krb5_prepare_shared_creds";
+    struct webauth_krb5 *kc;
+    char *path, *temp_cred_file;
+    time_t expiration;
+    struct timeval times[2];
+    struct stat st;
+    int status;
+
+    path = shared_cache_path(rc, creds, &expiration, mwa_func);
+    if (path == NULL)
+        return krb5_prepare_file_creds(rc, creds);
+
+    /*
+     * Check for an existing cache.  Use it if it's ours and the credentials
+     * are still good, and remove it if it's ours and they've expired.
+     * Expired credentials, and any cache we didn't write, get a cache for
+     * this request only.
+     */
+    if (lstat(path, &st) == 0) {
+        if (!shared_cache_owned(&st)) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, rc->r->server,
+                         "mod_webauth: %s: ignoring cache %s with wrong"
+                         " type, owner, or mode", mwa_func, path);
+            return krb5_prepare_file_creds(rc, creds);
+        }
+        if (expiration > time(NULL)) {
+            if (rc->sconf->debug)
+                ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
+                             "mod_webauth: %s: reusing cache %s", mwa_func,
+                             path);
+            apr_table_setn(rc->r->subprocess_env, ENV_KRB5CCNAME, path);
+            return 1;
+        }
+        if (unlink(path) < 0 && errno != ENOENT)
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+                         "mod_webauth: %s: cannot remove %s: %s", mwa_func,
+                         path, strerror(errno));
+        else if (rc->sconf->debug)
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
+                         "mod_webauth: %s: removed expired cache %s",
+                         mwa_func, path);
+        return krb5_prepare_file_creds(rc, creds);
+    } else if (errno != ENOENT) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+                     "mod_webauth: %s: cannot stat %s: %s", mwa_func, path,
+                     strerror(errno));
+        return krb5_prepare_file_creds(rc, creds);
+    }
+    if (expiration <= time(NULL))
+        return krb5_prepare_file_creds(rc, creds);
+    sweep_shared_caches(rc, mwa_func);
+
+    /*
+     * Otherwise, build it in a temporary file.  If anything goes wrong, use
+     * the temporary file for this request only and remove it at the end of
+     * the request.
+     */
+    temp_cred_file = make_shared_temp_cache(rc, path, mwa_func);
+    if (temp_cred_file == NULL)
+        return krb5_prepare_file_creds(rc, creds);
+    apr_pool_cleanup_register(rc->r->pool, temp_cred_file, remove_cache,
+                              apr_pool_cleanup_null);
+    kc = get_webauth_krb5_ctxt(rc->ctx, rc->r->server, mwa_func);
+    if (kc == NULL)
+        return 0;
+    apr_table_setn(rc->r->subprocess_env, ENV_KRB5CCNAME, temp_cred_file);
+    if (!import_creds(rc, kc, creds, temp_cred_file, mwa_func))
+        return 1;
+    status = webauth_krb5_keep_cache(rc->ctx, kc);
+    if (status != WA_ERR_NONE) {
+        log_webauth_error(rc->ctx, rc->r->server, status, mwa_func,
+                          "webauth_krb5_keep_cache", NULL);
+        return 1;
+    }
+
+    /*
+     * Record the expiration as the modification time for the sweep, and then
+     * publish the cache with link.  Like open with O_EXCL, link fails if
+     * anything, even a dangling symlink, already has the name, so an
+     * existing file is never replaced or followed, and a concurrent request
+     * sees either no cache or a complete one.  If another request won the
+     * race, this request just uses its own copy.  The temporary name is
+     * removed at the end of the request either way.
+     */
+    times[0].tv_sec = expiration;
+    times[0].tv_usec = 0;
+    times[1] = times[0];
+    if (utimes(temp_cred_file, times) < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+                     "mod_webauth: %s: cannot set times on %s: %s", mwa_func,
+                     temp_cred_file, strerror(errno));
+        return 1;
+    }
+    if (link(temp_cred_file, path) < 0) {
+        if (errno != EEXIST)
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+                         "mod_webauth: %s: cannot link %s to %s: %s",
+                         mwa_func, temp_cred_file, path, strerror(errno));
+        return 1;
+    }
+    if (rc->sconf->debug)
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
+                     "mod_webauth: %s: created cache %s", mwa_func, path);
+    apr_table_setn(rc->r->subprocess_env, ENV_KRB5CCNAME, path);
+    return 1;
+}
+
+
 #ifdef HAVE_LIBKEYUTILS
 static int
 krb5_prepare_keyring_creds(MWA_REQ_CTXT *rc, apr_array_header_t *creds)
@@ -272,6 +655,10 @@ krb5_prepare_creds(MWA_REQ_CTXT *rc, apr_array_header_t *creds)
     if (strncmp(rc->sconf->cred_cache_dir, "KEYRING:", 8) == 0)
         return krb5_prepare_keyring_creds(rc, creds);
 #endif
+    if (strcmp(rc->sconf->cred_cache_dir, "MEMORY:") == 0)
+        return krb5_prepare_memory_creds(rc, creds);
+    if (rc->sconf->cred_cache_reuse)
+        return krb5_prepare_shared_creds(rc, creds);
     return krb5_prepare_file_creds(rc, creds);
 }
 
@@ -29,25 +29,35 @@ APLOG_USE_MODULE(webauth);
 #endif
 
 
+/*
+ * Pool cleanup that releases the request's reference to the keyring.
+ */
+static apr_status_t
+release_keyring(void *data)
+{
+    mwa_keyring_release(data);
+    return APR_SUCCESS;
+}
+
+
 /*
  * Called at any entry point where we may be doing WebAuth operations that
- * need a keyring.  Do lazy initialization of the in-memory keyring from the
- * disk file and store it in the virtual host context.  Returns true if the
- * keyring could be loaded correctly and false otherwise.
+ * need a keyring.  Get a reference to the current keyring for the virtual
+ * host, loading it from disk if necessary, and keep it for the rest of the
+ * request so that a keyring reloaded partway through doesn't affect it.
+ * Returns true if the keyring could be loaded correctly and false otherwise.
  */
 static bool
 ensure_keyring_loaded(MWA_REQ_CTXT *rc)
 {
-    int s;
-
-    apr_thread_mutex_lock(rc->sconf->mutex);
-    if (rc->sconf->ring != NULL) {
-        apr_thread_mutex_unlock(rc->sconf->mutex);
+    if (rc->keyring != NULL)
         return true;
-    }
-    s = mwa_cache_keyring(rc->r->server, rc->sconf);
-    apr_thread_mutex_unlock(rc->sconf->mutex);
-    return (s == WA_ERR_NONE && rc->sconf->ring != NULL);
+    rc->keyring = mwa_keyring_acquire(rc->r->server, rc->sconf);
+    if (rc->keyring == NULL)
+        return false;
+    apr_pool_cleanup_register(rc->r->pool, rc->keyring, release_keyring,
+                              apr_pool_cleanup_null);
+    return true;
 }
 
 
@@ -468,6 +478,12 @@ mod_webauth_cleanup(void *data)
         /* service_token is currently never set in the parent,
          * add it here in case we change caching strategy.
          */
+        while (tconf->service_token_retired != NULL) {
+            MWA_SERVICE_TOKEN *retired = tconf->service_token_retired;
+
+            tconf->service_token_retired = retired->next;
+            apr_pool_destroy(retired->pool);
+        }
         if (tconf->service_token) {
             apr_pool_destroy(tconf->service_token->pool);
             tconf->service_token = NULL;
@@ -519,6 +535,17 @@ mod_webauth_init(apr_pool_t *pconf, apr_pool_t *plog UNUSED,
 }
 
 
+/*
+ * Called in each child process after it starts.  Starts renewing service
+ * tokens in the background.
+ */
+static void
+mod_webauth_child_init(apr_pool_t *pchild, server_rec *s)
+{
+    mwa_service_token_init(s, pchild);
+}
+
+
 /*
  * Called when a new request is created.  Initialize our per-request data
  * structure and store it in the request.
@@ -685,11 +712,19 @@ handler_hook(request_rec *r)
     ap_rputs("<dt><strong>Current Configuration (server directives only):</strong></dt>\n", r);
 
 
+    dd_dir_str("WebAuthAppTokenCacheSize",
+               apr_psprintf(r->pool, "%lu", sconf->app_cache_size), r);
+    dd_dir_str("WebAuthAppTokenCacheTTL",
+               apr_psprintf(r->pool, "%lus", sconf->app_cache_ttl), r);
     dd_dir_str("WebAuthAuthType", sconf->auth_type, r);
     dd_dir_str("WebAuthCredCacheDir", sconf->cred_cache_dir, r);
+    dd_dir_str("WebAuthCredCacheReuse", sconf->cred_cache_reuse ? "on" : "off",
+               r);
     dd_dir_str("WebAuthDebug", sconf->debug ? "on" : "off", r);
     dd_dir_str("WebAuthKeyRing", sconf->keyring_path, r);
     dd_dir_str("WebAuthKeyRingAutoUpdate", sconf->keyring_auto_update ? "on" : "off", r);
+    dd_dir_str("WebAuthKeyringDecryptLimit",
+               apr_psprintf(r->pool, "%lu", sconf->keyring_decrypt_limit), r);
     dd_dir_str("WebAuthKeyRingKeyLifetime",
                apr_psprintf(r->pool, "%lus", sconf->keyring_key_lifetime), r);
     if (sconf->keytab_principal == NULL) {
@@ -710,6 +745,10 @@ handler_hook(request_rec *r)
     }
     dd_dir_str("WebAuthTokenMaxTTL",
                apr_psprintf(r->pool, "%lus", sconf->token_max_ttl), r);
+    dd_dir_str("WebAuthWebKdcPoolSize",
+               apr_psprintf(r->pool, "%lu", sconf->webkdc_pool_size), r);
+    dd_dir_str("WebAuthWebKdcPoolTimeout",
+               apr_psprintf(r->pool, "%lus", sconf->webkdc_pool_timeout), r);
     dd_dir_str("WebAuthWebKdcPrincipal", sconf->webkdc_principal, r);
     dd_dir_str("WebAuthWebKdcSSLCertFile", sconf->webkdc_cert_file, r);
     dd_dir_str("WebAuthWebKdcSSLCertCheck",
@@ -724,18 +763,22 @@ handler_hook(request_rec *r)
            status_check_access(sconf->keyring_path, APR_FOPEN_READ, r), r);
     ap_rputs("<dt><strong>Keyring info:</strong></dt>\n", r);
 
-    if (sconf->ring == NULL) {
+    if (rc->keyring == NULL) {
         ap_rputs("<dd>"
                  "keyring is NULL. This usually indicates a permissions "
                  "problem with the keyring file."
                  "</dd>", r);
     } else {
         int i;
+        struct webauth_keyring *ring = rc->keyring->ring;
         struct webauth_keyring_entry *entry;
 
-        dd_dir_int("num_entries", sconf->ring->entries->nelts, r);
-        for (i = 0; i < sconf->ring->entries->nelts; i++) {
-            entry = &APR_ARRAY_IDX(sconf->ring->entries, i,
+        dd_dir_str("generation",
+                   apr_psprintf(r->pool, "%lu", rc->keyring->generation), r);
+        dd_dir_time("file modified", apr_time_sec(rc->keyring->mtime), r);
+        dd_dir_int("num_entries", ring->entries->nelts, r);
+        for (i = 0; i < ring->entries->nelts; i++) {
+            entry = &APR_ARRAY_IDX(ring->entries, i,
                                    struct webauth_keyring_entry);
             dd_dir_time(apr_psprintf(r->pool, "entry %d creation time", i),
                         entry->creation, r);
@@ -747,6 +790,37 @@ handler_hook(request_rec *r)
     ap_rputs("</dl>", r);
     ap_rputs("<hr/>", r);
 
+    if (sconf->app_cache != NULL) {
+        struct mwa_app_cache_stats stats;
+
+        mwa_app_cache_stats(sconf->app_cache, &stats);
+        ap_rputs("<dl>", r);
+        ap_rputs("<dt><strong>App token cache (this process):</strong></dt>\n",
+                 r);
+        dd_dir_str("hits", apr_psprintf(r->pool, "%lu", stats.hits), r);
+        dd_dir_str("misses", apr_psprintf(r->pool, "%lu", stats.misses), r);
+        dd_dir_str("evictions",
+                   apr_psprintf(r->pool, "%lu", stats.evictions), r);
+        dd_dir_str("entries", apr_psprintf(r->pool, "%lu", stats.entries), r);
+        ap_rputs("</dl>", r);
+        ap_rputs("<hr/>", r);
+    }
+
+    if (sconf->webkdc_pool != NULL) {
+        struct mwa_webkdc_pool_stats stats;
+
+        mwa_webkdc_pool_stats(sconf->webkdc_pool, &stats);
+        ap_rputs("<dl>", r);
+        ap_rputs("<dt><strong>WebKDC connections (this process):</strong>"
+                 "</dt>\n", r);
+        dd_dir_str("created", apr_psprintf(r->pool, "%lu", stats.created), r);
+        dd_dir_str("reused", apr_psprintf(r->pool, "%lu", stats.reused), r);
+        dd_dir_str("expired", apr_psprintf(r->pool, "%lu", stats.expired), r);
+        dd_dir_str("idle", apr_psprintf(r->pool, "%lu", stats.idle), r);
+        ap_rputs("</dl>", r);
+        ap_rputs("<hr/>", r);
+    }
+
     ap_rputs("<dl>", r);
 
     dt_str("Keytab read check",
@@ -772,6 +846,8 @@ handler_hook(request_rec *r)
         dd_dir_time("created", st->created, r);
         dd_dir_time("expires", st->expires, r);
         dd_dir_time("next_renewal_attempt", st->next_renewal_attempt, r);
+        dd_dir_time("next_renewal (this process)", sconf->service_token_renew,
+                    r);
         if (st->last_renewal_attempt != 0)
             dd_dir_time("last_renewal_attempt", st->last_renewal_attempt, r);
     }
@@ -867,7 +943,7 @@ make_proxy_cookie(const char *proxy_type,
     pt->session_factors = apr_pstrdup(rc->r->pool, session_factors);
     pt->loa = loa;
     pt->expiration = expiration_time;
-    status = webauth_token_encode(rc->ctx, data, rc->sconf->ring, &token);
+    status = webauth_token_encode(rc->ctx, data, rc->keyring->ring, &token);
     if (status != WA_ERR_NONE) {
         mwa_log_webauth_error(rc, status, mwa_func,
                               "webauth_token_encode_proxy", subject);
@@ -895,7 +971,7 @@ make_cred_cookie(struct webauth_token_cred *ct, MWA_REQ_CTXT *rc)
         return 0;
     data.type = WA_TOKEN_CRED;
     data.token.cred = *ct;
-    status = webauth_token_encode(rc->ctx, &data, rc->sconf->ring, &token);
+    status = webauth_token_encode(rc->ctx, &data, rc->keyring->ring, &token);
     if (status != WA_ERR_NONE) {
         mwa_log_webauth_error(rc, status, mwa_func,
                               "webauth_token_encode_cred", ct->subject);
@@ -952,7 +1028,7 @@ make_app_cookie(const char *subject,
     app->loa = loa;
     app->creation = creation_time;
     app->expiration = expiration_time;
-    status = webauth_token_encode(rc->ctx, data, rc->sconf->ring, &token);
+    status = webauth_token_encode(rc->ctx, data, rc->keyring->ring, &token);
     if (status != WA_ERR_NONE) {
         mwa_log_webauth_error(rc, status, mwa_func,
                               "webauth_token_encode_app", subject);
@@ -1016,31 +1092,223 @@ app_token_maint(MWA_REQ_CTXT *rc)
 
 
 /*
- * parse an app-token, store in rc->at.
+ * Return a note about the number of keys tried while decrypting the most
+ * recent token, for error messages, or NULL if only one key was tried.  A
+ * large number here usually means forged or very stale cookies.
+ */
+static const char *
+decrypt_trials(MWA_REQ_CTXT *rc)
+{
+    unsigned long trials;
+
+    trials = webauth_token_decrypt_trials(rc->ctx);
+    if (trials <= 1)
+        return NULL;
+    return apr_psprintf(rc->r->pool, "(tried %lu keys)", trials);
+}
+
+
+/*
+ * Add the named cookie to a batch of tokens to decode, if the request has it
+ * and it isn't already in the batch.  names holds the cookie name for each
+ * element of batch.
+ */
+static void
+add_cookie_token(MWA_REQ_CTXT *rc, apr_array_header_t *batch,
+                 apr_array_header_t *names, const char *cname,
+                 enum webauth_token_type type)
+{
+    struct webauth_token_batch *token;
+    char *cval;
+    int i;
+
+    for (i = 0; i < names->nelts; i++)
+        if (strcmp(APR_ARRAY_IDX(names, i, const char *), cname) == 0)
+            return;
+    cval = find_cookie(rc, cname);
+    if (cval == NULL || cval[0] == '\0')
+        return;
+    ap_unescape_url(cval);
+    token = apr_array_push(batch);
+    memset(token, 0, sizeof(*token));
+    token->type = type;
+    token->token = cval;
+    APR_ARRAY_PUSH(names, const char *) = cname;
+}
+
+
+/*
+ * Look for the app token cookie in the app token cache, if there is one.  On
+ * a hit, store the cached token in rc->cookie_tokens for decode_cookie and
+ * return true.  Otherwise, return false and leave the cookie to be decoded.
+ */
+static bool
+find_cached_app_token(MWA_REQ_CTXT *rc)
+{
+    struct webauth_token_batch *result;
+    struct webauth_token *token;
+    const char *cname = app_cookie_name();
+    char *cval;
+
+    if (rc->sconf->app_cache == NULL)
+        return false;
+    cval = find_cookie(rc, cname);
+    if (cval == NULL || cval[0] == '\0')
+        return false;
+    ap_unescape_url(cval);
+    token = mwa_app_cache_get(rc->sconf->app_cache, cval,
+                              rc->keyring->generation, rc->r->pool);
+    if (token == NULL)
+        return false;
+    result = apr_pcalloc(rc->r->pool, sizeof(struct webauth_token_batch));
+    result->type = WA_TOKEN_APP;
+    result->token = cval;
+    result->decoded = token;
+    result->status = WA_ERR_NONE;
+    if (rc->cookie_tokens == NULL)
+        rc->cookie_tokens = apr_hash_make(rc->r->pool);
+    apr_hash_set(rc->cookie_tokens, cname, APR_HASH_KEY_STRING, result);
+    return true;
+}
+
+
+/*
+ * Store a newly decoded app token in the app token cache, if there is one.
+ */
+static void
+cache_app_token(MWA_REQ_CTXT *rc, const char *cval,
+                const struct webauth_token *token)
+{
+    if (rc->sconf->app_cache == NULL)
+        return;
+    mwa_app_cache_put(rc->sconf->app_cache, cval, rc->keyring->generation,
+                      &token->token.app);
+}
+
+
+/*
+ * Decode the app and cred cookies this request will use in a single batch,
+ * which shares the key search and decryption setup between them, and store
+ * the results in rc->cookie_tokens by cookie name for decode_cookie.  This is
+ * only worthwhile if the request has more than one such cookie.  An app
+ * token found in the app token cache is used from there instead.  Proxy
+ * cookies are only needed if a cred cookie is missing or invalid, so they're
+ * still decoded on demand.
+ */
+static void
+decode_cookies(MWA_REQ_CTXT *rc)
+{
+    apr_array_header_t *batch, *names;
+    struct webauth_token_batch *tokens;
+    MWA_WACRED *cred;
+    const char *cname;
+    int i;
+
+    if (apr_table_get(rc->r->headers_in, "Cookie") == NULL)
+        return;
+    if (!ensure_keyring_loaded(rc))
+        return;
+    batch = apr_array_make(rc->r->pool, 4, sizeof(struct webauth_token_batch));
+    names = apr_array_make(rc->r->pool, 4, sizeof(const char *));
+    if (rc->at == NULL && !find_cached_app_token(rc))
+        add_cookie_token(rc, batch, names, app_cookie_name(), WA_TOKEN_APP);
+    if (rc->dconf->use_creds && rc->dconf->creds != NULL)
+        for (i = 0; i < rc->dconf->creds->nelts; i++) {
+            cred = &APR_ARRAY_IDX(rc->dconf->creds, i, MWA_WACRED);
+            if (cred->service == NULL)
+                continue;
+            cname = cred_cookie_name(cred->type, cred->service, rc);
+            add_cookie_token(rc, batch, names, cname, WA_TOKEN_CRED);
+        }
+    if (batch->nelts < 2)
+        return;
+
+    /* Decode the batch and index the results by cookie name. */
+    tokens = (struct webauth_token_batch *) batch->elts;
+    webauth_token_decode_batch(rc->ctx, tokens, batch->nelts,
+                               rc->keyring->ring);
+    if (rc->cookie_tokens == NULL)
+        rc->cookie_tokens = apr_hash_make(rc->r->pool);
+    for (i = 0; i < batch->nelts; i++) {
+        cname = APR_ARRAY_IDX(names, i, const char *);
+        apr_hash_set(rc->cookie_tokens, cname, APR_HASH_KEY_STRING,
+                     &tokens[i]);
+        if (tokens[i].type == WA_TOKEN_APP && tokens[i].status == WA_ERR_NONE)
+            cache_app_token(rc, tokens[i].token, tokens[i].decoded);
+    }
+}
+
+
+/*
+ * Decode the token in a cookie, using the result from decode_cookies if the
+ * cookie was decoded there and otherwise decoding it now.  Takes the cookie
+ * name and value, the expected token type, and the calling function for
+ * error reporting.  Stores the decoded token in token and returns a WebAuth
+ * status.  Errors are logged here except for expired app tokens, which the
+ * caller reports.
+ */
+static int
+decode_cookie(MWA_REQ_CTXT *rc, const char *cname, char *cval,
+              enum webauth_token_type type, const char *mwa_func,
+              struct webauth_token **token)
+{
+    struct webauth_token_batch *result = NULL;
+    const char *trials = NULL;
+    int status;
+
+    if (rc->cookie_tokens != NULL)
+        result = apr_hash_get(rc->cookie_tokens, cname, APR_HASH_KEY_STRING);
+    if (result == NULL) {
+        if (!ensure_keyring_loaded(rc))
+            return WA_ERR_BAD_KEY;
+        ap_unescape_url(cval);
+        status = webauth_token_decode(rc->ctx, type, cval, rc->keyring->ring,
+                                      token);
+        if (status == WA_ERR_NONE && type == WA_TOKEN_APP)
+            cache_app_token(rc, cval, *token);
+        if (status == WA_ERR_TOKEN_EXPIRED && type == WA_TOKEN_APP)
+            return status;
+        if (status != WA_ERR_NONE)
+            mwa_log_webauth_error(rc, status, mwa_func,
+                                  "webauth_token_decode", decrypt_trials(rc));
+        return status;
+    }
+    *token = result->decoded;
+    status = result->status;
+    if (status == WA_ERR_TOKEN_EXPIRED && type == WA_TOKEN_APP)
+        return status;
+    if (status != WA_ERR_NONE) {
+        if (result->trials > 1)
+            trials = apr_psprintf(rc->r->pool, " (tried %lu keys)",
+                                  result->trials);
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+                     "mod_webauth: %s: webauth_token_decode_batch%s failed:"
+                     " %s", mwa_func, trials == NULL ? "" : trials,
+                     result->error);
+    }
+    return status;
+}
+
+
+/*
+ * parse an app-token from the named cookie, store in rc->at.
  * return 0 on failure, 1 on success
  */
 static int
-parse_app_token(char *token, MWA_REQ_CTXT *rc)
+parse_app_token(const char *cname, char *token, MWA_REQ_CTXT *rc)
 {
     const char *mwa_func = "parse_app_token";
     int status;
     struct webauth_token *app;
 
-    if (!ensure_keyring_loaded(rc))
-        return 0;
-    ap_unescape_url(token);
-    status = webauth_token_decode(rc->ctx, WA_TOKEN_APP, token,
-                                  rc->sconf->ring, &app);
+    status = decode_cookie(rc, cname, token, WA_TOKEN_APP, mwa_func, &app);
     if (status == WA_ERR_TOKEN_EXPIRED) {
         ap_log_error(APLOG_MARK, APLOG_INFO, 0, rc->r->server,
                      "mod_webauth: user credentials (from %s cookie) have"
                      " expired", app_cookie_name());
         return 0;
-    } else if (status != WA_ERR_NONE) {
-        mwa_log_webauth_error(rc, status, mwa_func, "webauth_token_decode",
-                              NULL);
+    } else if (status != WA_ERR_NONE)
         return 0;
-    }
     rc->at = &app->token.app;
 
     /*
@@ -1069,7 +1337,7 @@ parse_app_token_cookie(MWA_REQ_CTXT *rc)
     if (cval == NULL || cval[0] == '\0')
         return 0;
 
-    if (!parse_app_token(cval, rc)) {
+    if (!parse_app_token(cname, cval, rc)) {
         /* we coudn't use the cookie, lets set it up to be nuked */
         fixup_setcookie(rc, cname, "", rc->dconf->cookie_path);
         return 0;
@@ -1098,10 +1366,10 @@ parse_proxy_token(char *token, MWA_REQ_CTXT *rc)
         return 0;
     ap_unescape_url(token);
     status = webauth_token_decode(rc->ctx, WA_TOKEN_PROXY, token,
-                                  rc->sconf->ring, &pt);
+                                  rc->keyring->ring, &pt);
     if (status != WA_ERR_NONE) {
         mwa_log_webauth_error(rc, status, mwa_func, "webauth_token_decode",
-                              NULL);
+                              decrypt_trials(rc));
         return NULL;
     }
     return &pt->token.proxy;
@@ -1154,10 +1422,10 @@ get_session_key(char *token, MWA_REQ_CTXT *rc)
     if (!ensure_keyring_loaded(rc))
         return NULL;
     status = webauth_token_decode(rc->ctx, WA_TOKEN_APP, token,
-                                  rc->sconf->ring, &data);
+                                  rc->keyring->ring, &data);
     if (status != WA_ERR_NONE) {
         mwa_log_webauth_error(rc, status, mwa_func, "webauth_token_decode",
-                              NULL);
+                              decrypt_trials(rc));
         return NULL;
     }
     app = &data->token.app;
@@ -1671,16 +1939,17 @@ parse_cred_token_cookie(MWA_REQ_CTXT *rc, MWA_WACRED *cred)
     char *cval;
     char *cname = cred_cookie_name(cred->type, cred->service, rc);
     struct webauth_token_cred *ct;
+    struct webauth_token *data;
     const char *mwa_func = "parse_cred_token_cookie";
 
-    if (!ensure_keyring_loaded(rc))
-        return NULL;
-
     cval = find_cookie(rc, cname);
     if (cval == NULL)
         return 0;
 
-    ct =  mwa_parse_cred_token(cval, rc->sconf->ring, NULL, rc);
+    ct = NULL;
+    if (decode_cookie(rc, cname, cval, WA_TOKEN_CRED, mwa_func,
+                      &data) == WA_ERR_NONE)
+        ct = &data->token.cred;
 
     if (ct == NULL) {
         /* we coudn't use the cookie, lets set it up to be nuked */
@@ -1919,6 +2188,9 @@ gather_tokens(MWA_REQ_CTXT *rc)
     if (code != OK)
         return code;
 
+    /* Decode any cookies we'll need together. */
+    decode_cookies(rc);
+
     if (rc->at == NULL) {
         /* not in URL, check cookie. If we have a bad/expired token in the
          cookie, parse_app_token_cookie will set it up to be expired. */
@@ -2050,6 +2322,7 @@ mod_webauth_check_access(request_rec *r)
                      webauth_error_message(NULL, status));
         return DECLINED;
     }
+    webauth_token_decrypt_limit(rc->ctx, rc->sconf->keyring_decrypt_limit);
 
     /* If we can't load the keyring, return a fatal error. */
     if (!ensure_keyring_loaded(rc))
@@ -2420,6 +2693,7 @@ register_hooks(apr_pool_t *p UNUSED)
     static const char * const mods[]={ "mod_access.c", "mod_auth.c", NULL };
 
     ap_hook_post_config(mod_webauth_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(mod_webauth_child_init, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_create_request(mod_webauth_create_request, NULL, NULL,
                            APR_HOOK_MIDDLE);
 
@@ -14,6 +14,8 @@
 #include <config-mod.h>
 #include <portable/stdbool.h>
 
+#include <apr_hash.h>           /* apr_hash_t */
+#include <apr_file_info.h>      /* apr_ino_t */
 #include <apr_pools.h>          /* apr_pool_t */
 #include <apr_tables.h>         /* apr_array_header_t */
 #include <httpd.h>              /* server_rec and request_rec */
@@ -35,6 +37,25 @@ extern const command_rec webauth_cmds[];
  */
 #define START_RENEWAL_ATTEMPT_PERCENT (0.90)
 
+/*
+ * most random delay, in seconds, added to the renewal time of a service token
+ * in each process, so that processes sharing a service token cache don't all
+ * ask the WebKDC for a new token at once
+ */
+#define TOKEN_RENEWAL_JITTER 300
+
+/* longest, in seconds, the service token renewal thread sleeps at a time */
+#define TOKEN_RENEWAL_CHECK 60
+
+/*
+ * media type of the compact encoding of WebKDC protocol messages, which
+ * mod_webkdc accepts as an alternative to text/xml (see docs/protocol.xml)
+ */
+#define MWA_COMPACT_TYPE "application/x-webauth-compact"
+
+/* how often, in seconds, to check whether the keyring file has changed */
+#define KEYRING_CHECK_INTERVAL 5
+
 /* where to look in URL for returned tokens */
 #define WEBAUTHR_MAGIC "?WEBAUTHR="
 #define WEBAUTHR_MAGIC_LEN (sizeof(WEBAUTHR_MAGIC) - 1)
@@ -63,7 +84,7 @@ extern const command_rec webauth_cmds[];
 /* a service token and associated data, all memory (including key)
  * is allocated from a pool
  */
-typedef struct {
+typedef struct mwa_service_token {
     apr_pool_t *pool; /* pool this token belongs to */
     struct webauth_key key;
     time_t expires;
@@ -73,20 +94,42 @@ typedef struct {
     time_t last_renewal_attempt; /* time we last tried to renew */
     const void *app_state; /* used as "as" attribute in request tokens */
     size_t app_state_len;
+
+    /* Only used for the published token of a virtual host. */
+    struct mwa_service_token *next;     /* Next retired token. */
 } MWA_SERVICE_TOKEN;
 
+/*
+ * A snapshot of a virtual host's keyring.  The current snapshot is published
+ * in the server configuration and requests hold references to it, so it's
+ * replaced rather than modified when the keyring changes.  See keyring.c.
+ */
+struct mwa_keyring {
+    struct webauth_keyring *ring;
+    unsigned long generation;           /* Incremented for each new load. */
+    apr_time_t mtime;                   /* Keyring file when loaded. */
+    apr_ino_t inode;
+    apr_pool_t *pool;                   /* Pool holding this snapshot. */
+    volatile apr_uint32_t refs;         /* Requests using this snapshot. */
+    struct mwa_keyring *next;           /* Next replaced snapshot. */
+};
+
 /*
  * Server configuration.  For parameters where there's no obvious designated
  * value for when the directive hasn't been set, there's a corresponding _set
  * variable that holds whether that directive is set in a particular scope.
  */
 struct server_config {
+    unsigned long app_cache_size;
+    unsigned long app_cache_ttl;
     const char *auth_type;
     const char *cred_cache_dir;
+    bool cred_cache_reuse;
     bool debug;
     bool extra_redirect;
     bool httponly;
     bool keyring_auto_update;
+    unsigned long keyring_decrypt_limit;
     unsigned long keyring_key_lifetime;
     const char *keyring_path;
     const char *keytab_path;
@@ -102,14 +145,20 @@ struct server_config {
     bool trust_authz_identity;
     bool webkdc_cert_check;
     const char *webkdc_cert_file;
+    unsigned long webkdc_pool_size;
+    unsigned long webkdc_pool_timeout;
     const char *webkdc_principal;
     const char *webkdc_url;
 
     /* Only used during configuration merging. */
+    bool app_cache_size_set;
+    bool app_cache_ttl_set;
+    bool cred_cache_reuse_set;
     bool debug_set;
     bool extra_redirect_set;
     bool httponly_set;
     bool keyring_auto_update_set;
+    bool keyring_decrypt_limit_set;
     bool keyring_key_lifetime_set;
     bool require_ssl_set;
     bool ssl_redirect_set;
@@ -119,6 +168,8 @@ struct server_config {
     bool token_max_ttl_set;
     bool trust_authz_identity_set;
     bool webkdc_cert_check_set;
+    bool webkdc_pool_size_set;
+    bool webkdc_pool_timeout_set;
 
     /*
      * These aren't part of the Apache configuration, but they are loaded as
@@ -126,11 +177,25 @@ struct server_config {
      * to be reset when the module is reloaded, so we store them here.
      */
     struct webauth_context *ctx;
-    struct webauth_keyring *ring;
-    MWA_SERVICE_TOKEN *service_token;
+    struct mwa_keyring *keyring;        /* Only accessed atomically. */
+    struct mwa_keyring *keyring_retired;
+    unsigned long keyring_generation;
+    volatile apr_uint32_t keyring_checked;
+    volatile apr_uint32_t keyring_readers; /* Taking a keyring reference. */
+    struct mwa_app_cache *app_cache;
+    struct mwa_webkdc_pool *webkdc_pool;
+    volatile apr_uint32_t webkdc_compact; /* WebKDC sent a compact reply. */
+    MWA_SERVICE_TOKEN *service_token;   /* Only accessed atomically. */
+    MWA_SERVICE_TOKEN *service_token_retired;
+    volatile apr_uint32_t service_token_readers; /* Copying the token. */
+    time_t service_token_renew;         /* When this process renews it. */
+    unsigned int service_token_seed;    /* For jittering renewal times. */
 
     /* Mutex to hold when modifying the server configuration. */
     apr_thread_mutex_t *mutex;
+
+    /* Mutex to hold when loading or replacing the keyring. */
+    apr_thread_mutex_t *keyring_mutex;
 };
 
 /* The same, but for the directory configuration. */
@@ -173,6 +238,22 @@ struct dir_config {
     bool use_creds_set;
 };
 
+/* Statistics for the app token cache, which are per-process. */
+struct mwa_app_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long entries;
+};
+
+/* Statistics for the pool of WebKDC connections, which are per-process. */
+struct mwa_webkdc_pool_stats {
+    unsigned long created;              /* New connections made. */
+    unsigned long reused;               /* Idle connections reused. */
+    unsigned long expired;              /* Idle connections timed out. */
+    unsigned long idle;                 /* Currently idle connections. */
+};
+
 /* a cred, used to keep track of WebAuthCred directives. */
 typedef struct {
     char *type;
@@ -185,10 +266,12 @@ typedef struct {
     struct server_config *sconf;
     struct dir_config *dconf;
     struct webauth_context *ctx;
+    struct mwa_keyring *keyring; /* set by ensure_keyring_loaded */
     struct webauth_token_app *at;
     char *needed_proxy_type; /* set if we are redirecting for a proxy-token */
     struct webauth_token_proxy *pt; /* proxy-token that came from URL */
     apr_array_header_t *cred_tokens; /* cred token(s) */
+    apr_hash_t *cookie_tokens; /* batch-decoded cookies, by cookie name */
 } MWA_REQ_CTXT;
 
 /* used to append a bunch of data together */
@@ -223,6 +306,29 @@ typedef struct {
 } MWA_CRED_INTERFACE;
 
 
+/* cache.c */
+
+/* Create an app token cache with a maximum size and time to live. */
+struct mwa_app_cache *mwa_app_cache_create(apr_pool_t *, unsigned long size,
+                                           unsigned long ttl);
+
+/*
+ * Look up or store a decoded app token by its URL-unescaped cookie value.
+ * The current keyring generation is passed so that the cache is discarded
+ * when the keyring changes.  Lookups return a copy allocated from the pool.
+ */
+struct webauth_token *mwa_app_cache_get(struct mwa_app_cache *,
+                                        const char *cookie,
+                                        unsigned long generation,
+                                        apr_pool_t *);
+void mwa_app_cache_put(struct mwa_app_cache *, const char *cookie,
+                       unsigned long generation,
+                       const struct webauth_token_app *);
+
+/* Return the cache statistics. */
+void mwa_app_cache_stats(struct mwa_app_cache *, struct mwa_app_cache_stats *);
+
+
 /* config.c */
 
 /* Create a new server or directory configuration, used in the module hooks. */
@@ -244,6 +350,9 @@ mwa_get_service_token(server_rec *server,
                       struct server_config *sconf, apr_pool_t *pool,
                       int local_cache_only);
 
+/* Start renewing service tokens in the background (child_init hook). */
+void mwa_service_token_init(server_rec *, apr_pool_t *);
+
 
 int
 mwa_get_creds_from_webkdc(MWA_REQ_CTXT *rc,
@@ -251,6 +360,17 @@ mwa_get_creds_from_webkdc(MWA_REQ_CTXT *rc,
                           apr_array_header_t *needed_creds,
                           apr_array_header_t **acquired_creds);
 
+/*
+ * Create a pool that keeps up to size idle connections to the WebKDC for at
+ * most timeout seconds each, and return its statistics.  Creation returns
+ * NULL after logging an error if the pool can't be used.
+ */
+struct mwa_webkdc_pool *mwa_webkdc_pool_create(server_rec *, apr_pool_t *,
+                                               unsigned long size,
+                                               unsigned long timeout);
+void mwa_webkdc_pool_stats(struct mwa_webkdc_pool *,
+                           struct mwa_webkdc_pool_stats *);
+
 /* util.c */
 
 /*
@@ -293,12 +413,6 @@ void
 mwa_log_webauth_error(MWA_REQ_CTXT *rc, int status, const char *mwa_func,
                       const char *func, const char *extra);
 
-/*
- * this should only be called in the ensure_keyring_loaded routine
- */
-int
-mwa_cache_keyring(server_rec *serv, struct server_config *sconf);
-
 /*
  * get all cookies that start with webauth_
  */
@@ -334,6 +448,20 @@ MWA_CRED_INTERFACE *
 mwa_find_cred_interface(server_rec *server,
                         const char *type);
 
+/* keyring.c */
+
+/* Set up keyring handling for a server (called from mwa_config_init). */
+void mwa_keyring_init(struct server_config *, apr_pool_t *);
+
+/*
+ * Get and release a reference to the current keyring for a server, loading
+ * or reloading it as needed.  Acquiring returns NULL if there is no usable
+ * keyring.
+ */
+struct mwa_keyring *mwa_keyring_acquire(server_rec *, struct server_config *);
+void mwa_keyring_release(struct mwa_keyring *);
+
+
 /* krb5.c */
 extern MWA_CRED_INTERFACE *mwa_krb5_cred_interface;
 
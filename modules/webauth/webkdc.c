@@ -13,11 +13,17 @@
 #include <portable/apr.h>
 #include <portable/stdbool.h>
 
+#include <apr_atomic.h>
 #include <apr_base64.h>
+#include <apr_thread_cond.h>
 #include <apr_xml.h>
 #include <curl/curl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <modules/webauth/mod_webauth.h>
+#include <util/macros.h>
 #include <webauth/basic.h>
 #include <webauth/keys.h>
 #include <webauth/tokens.h>
@@ -30,6 +36,25 @@ APLOG_USE_MODULE(webauth);
 # define CURLOPT_WRITEDATA CURLOPT_FILE
 #endif
 
+/*
+ * A pool of idle cURL handles for queries to the WebKDC.  cURL keeps the
+ * connection of a handle open after a query, along with its DNS and TLS
+ * session caches, so reusing a handle lets the next query skip the TCP and
+ * TLS handshakes.  There is one pool per virtual host in each Apache child
+ * process.  The most recently used handle is always reused first, and a
+ * handle that has been idle for longer than the timeout is closed instead,
+ * since the WebKDC has probably closed its end by then.
+ */
+struct mwa_webkdc_pool {
+    apr_thread_mutex_t *mutex;
+    CURL **idle;                        /* Stack of idle handles. */
+    time_t *used;                       /* When each was returned. */
+    unsigned long count;                /* Number of idle handles. */
+    unsigned long size;                 /* Maximum idle handles. */
+    unsigned long timeout;              /* Maximum idle time. */
+    struct mwa_webkdc_pool_stats stats;
+};
+
 
 /*
  * make a copy of the service token into the given pool
@@ -229,25 +254,314 @@ post_gather(char *in_data, size_t size, size_t nmemb, void *string)
 
 
 /*
- * post some xml to the webkdc and return response
+ * A request to the WebKDC being built, either as XML or in the compact
+ * encoding described in docs/protocol.xml.  The functions below hide the
+ * difference from the code building requests and escape text and attribute
+ * values as needed for XML.
+ */
+struct message {
+    MWA_STRING string;
+    bool compact;
+    bool tag_open;              /* XML start tag still needs its >. */
+};
+
+
+/*
+ * Start a new message.  It's built in the compact encoding once the WebKDC
+ * has shown that it understands it by sending a compact reply.
+ */
+static void
+message_init(struct message *message, struct server_config *sconf,
+             apr_pool_t *pool)
+{
+    init_string(&message->string, pool);
+    message->compact = apr_atomic_read32(&sconf->webkdc_compact) != 0;
+    message->tag_open = false;
+}
+
+
+/*
+ * Append a compact record type followed by a length, which is one byte for
+ * names and four bytes in network byte order for values.  A type of '\0'
+ * appends only the length.
+ */
+static void
+message_header(struct message *message, char type, size_t length,
+               bool is_name)
+{
+    char header[5];
+    size_t used = 0;
+
+    if (type != '\0')
+        header[used++] = type;
+    if (is_name)
+        header[used++] = (char) length;
+    else {
+        header[used++] = (char) ((length >> 24) & 0xff);
+        header[used++] = (char) ((length >> 16) & 0xff);
+        header[used++] = (char) ((length >> 8) & 0xff);
+        header[used++] = (char) (length & 0xff);
+    }
+    append_string(&message->string, header, used);
+}
+
+
+/*
+ * Finish an XML start tag if one is still open.
+ */
+static void
+message_close_tag(struct message *message)
+{
+    if (message->tag_open) {
+        append_string(&message->string, ">", 1);
+        message->tag_open = false;
+    }
+}
+
+
+/*
+ * Start an element.  Its attributes, if any, must be added next.
+ */
+static void
+message_start(struct message *message, const char *name)
+{
+    size_t length = strlen(name);
+
+    if (message->compact)
+        message_header(message, 'S', length, true);
+    else {
+        message_close_tag(message);
+        append_string(&message->string, "<", 1);
+        message->tag_open = true;
+    }
+    append_string(&message->string, name, length);
+}
+
+
+/*
+ * Add an attribute to the element just started.
+ */
+static void
+message_attr(struct message *message, const char *name, const char *value)
+{
+    apr_pool_t *pool = message->string.pool;
+    size_t length;
+
+    if (message->compact) {
+        length = strlen(name);
+        message_header(message, 'A', length, true);
+        append_string(&message->string, name, length);
+        length = strlen(value);
+        message_header(message, '\0', length, false);
+        if (length > 0)
+            append_string(&message->string, value, length);
+    } else {
+        append_string(&message->string, " ", 1);
+        append_string(&message->string, name, 0);
+        append_string(&message->string, "=\"", 2);
+        value = apr_xml_quote_string(pool, value, true);
+        if (value[0] != '\0')
+            append_string(&message->string, value, 0);
+        append_string(&message->string, "\"", 1);
+    }
+}
+
+
+/*
+ * Add text to the current element.
+ */
+static void
+message_text(struct message *message, const char *text)
+{
+    size_t length = strlen(text);
+
+    if (length == 0)
+        return;
+    if (message->compact) {
+        message_header(message, 'T', length, false);
+        append_string(&message->string, text, length);
+    } else {
+        message_close_tag(message);
+        text = apr_xml_quote_string(message->string.pool, text, false);
+        append_string(&message->string, text, 0);
+    }
+}
+
+
+/*
+ * End the current element, whose name is needed for XML.
+ */
+static void
+message_end(struct message *message, const char *name)
+{
+    if (message->compact)
+        append_string(&message->string, "E", 1);
+    else if (message->tag_open) {
+        append_string(&message->string, "/>", 2);
+        message->tag_open = false;
+    } else {
+        append_string(&message->string, "</", 2);
+        append_string(&message->string, name, 0);
+        append_string(&message->string, ">", 1);
+    }
+}
+
+
+/*
+ * Add an element containing only text.
+ */
+static void
+message_element(struct message *message, const char *name, const char *text)
+{
+    message_start(message, name);
+    message_text(message, text);
+    message_end(message, name);
+}
+
+
+/*
+ * Pool cleanup that closes the idle WebKDC connections when the pool the
+ * connection pool was created in is destroyed.
+ */
+static apr_status_t
+cleanup_webkdc_pool(void *data)
+{
+    struct mwa_webkdc_pool *pool = data;
+
+    while (pool->count > 0)
+        curl_easy_cleanup(pool->idle[--pool->count]);
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Create a new pool of WebKDC connections that keeps at most size idle
+ * connections, each for at most timeout seconds.  The connections are closed
+ * when the pool is destroyed.  Returns NULL if the pool's mutex couldn't be
+ * created, in which case every query uses a new connection.
+ */
+struct mwa_webkdc_pool *
+mwa_webkdc_pool_create(server_rec *s, apr_pool_t *p, unsigned long size,
+                       unsigned long timeout)
+{
+    struct mwa_webkdc_pool *pool;
+    apr_status_t status;
+
+    pool = apr_pcalloc(p, sizeof(struct mwa_webkdc_pool));
+    pool->size = size;
+    pool->timeout = timeout;
+    if (size > 0) {
+        pool->idle = apr_pcalloc(p, size * sizeof(CURL *));
+        pool->used = apr_pcalloc(p, size * sizeof(time_t));
+    }
+    status = apr_thread_mutex_create(&pool->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                     p);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "mod_webauth: cannot create WebKDC connection pool,"
+                     " not reusing connections");
+        return NULL;
+    }
+    apr_pool_cleanup_register(p, pool, cleanup_webkdc_pool,
+                              apr_pool_cleanup_null);
+    return pool;
+}
+
+
+/*
+ * Get a cURL handle for a WebKDC query, reusing the most recently returned
+ * idle handle if it hasn't timed out.  Reused handles have all their options
+ * reset but keep their connection.  Without a pool, always creates a new
+ * handle.  Returns NULL if a new handle couldn't be created.
+ */
+static CURL *
+webkdc_pool_get(struct mwa_webkdc_pool *pool)
+{
+    CURL *curl = NULL;
+    time_t now;
+
+    if (pool == NULL)
+        return curl_easy_init();
+    now = time(NULL);
+    apr_thread_mutex_lock(pool->mutex);
+    while (curl == NULL && pool->count > 0) {
+        pool->count--;
+        curl = pool->idle[pool->count];
+        if ((unsigned long) (now - pool->used[pool->count]) > pool->timeout) {
+            curl_easy_cleanup(curl);
+            curl = NULL;
+            pool->stats.expired++;
+        }
+    }
+    if (curl != NULL)
+        pool->stats.reused++;
+    else
+        pool->stats.created++;
+    apr_thread_mutex_unlock(pool->mutex);
+
+    if (curl != NULL)
+        curl_easy_reset(curl);
+    else
+        curl = curl_easy_init();
+    return curl;
+}
+
+
+/*
+ * Return a cURL handle to the pool after a WebKDC query, or close it if the
+ * query failed, the pool is already full, or there is no pool.
+ */
+static void
+webkdc_pool_put(struct mwa_webkdc_pool *pool, CURL *curl, bool okay)
+{
+    if (okay && pool != NULL) {
+        apr_thread_mutex_lock(pool->mutex);
+        if (pool->count < pool->size) {
+            pool->idle[pool->count] = curl;
+            pool->used[pool->count] = time(NULL);
+            pool->count++;
+            curl = NULL;
+        }
+        apr_thread_mutex_unlock(pool->mutex);
+    }
+    if (curl != NULL)
+        curl_easy_cleanup(curl);
+}
+
+
+/*
+ * Return the current statistics for the pool in stats.
+ */
+void
+mwa_webkdc_pool_stats(struct mwa_webkdc_pool *pool,
+                      struct mwa_webkdc_pool_stats *stats)
+{
+    apr_thread_mutex_lock(pool->mutex);
+    *stats = pool->stats;
+    stats->idle = pool->count;
+    apr_thread_mutex_unlock(pool->mutex);
+}
+
+
+/*
+ * post a request to the webkdc and return response, storing its length in
+ * length and whether it's in the compact encoding in compact
  *
  * FIXME: need to think about retry/timeout policy
  */
 static char *
-post_to_webkdc(char *post_data, size_t post_data_len,
+post_to_webkdc(struct message *request,
                server_rec *server, struct server_config *sconf,
-               apr_pool_t *pool)
+               apr_pool_t *pool, size_t *length, bool *compact)
 {
     CURL *curl;
     CURLcode code;
     char curl_error_buff[CURL_ERROR_SIZE+1];
     struct curl_slist *headers = NULL;
     MWA_STRING string;
+    char *content_type = NULL;
 
-    if (post_data_len == 0)
-        post_data_len = strlen(post_data);
-
-    curl = curl_easy_init();
+    curl = webkdc_pool_get(sconf->webkdc_pool);
 
     if (curl == NULL) {
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, server,
@@ -282,13 +596,19 @@ post_to_webkdc(char *post_data, size_t post_data_len,
     /* don't pre-allocate in case our write function never gets called */
     init_string(&string, pool);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &string);
-    headers = curl_slist_append(headers, "Content-Type: text/xml");
+    if (request->compact)
+        headers = curl_slist_append(headers,
+                                    "Content-Type: " MWA_COMPACT_TYPE);
+    else
+        headers = curl_slist_append(headers, "Content-Type: text/xml");
+    headers = curl_slist_append(headers,
+                                "Accept: " MWA_COMPACT_TYPE ", text/xml");
 
     /* data to post */
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_data);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request->string.data);
 
     /* set the size of the postfields data */
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, post_data_len);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, request->string.size);
 
     /* pass our list of custom made headers */
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
@@ -297,18 +617,37 @@ post_to_webkdc(char *post_data, size_t post_data_len,
     code = curl_easy_perform(curl); /* post away! */
 
     curl_slist_free_all(headers); /* free the header list */
+    if (code == CURLE_OK)
+        curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type);
+    *compact = (content_type != NULL
+                && strncmp(content_type, MWA_COMPACT_TYPE,
+                           strlen(MWA_COMPACT_TYPE)) == 0);
 
+    /*
+     * The handle still points at our error buffer, header list, and output
+     * string, but all of those are reset before it's used again.  Don't keep
+     * the connection after an error, since it may be in a bad state.
+     */
+    webkdc_pool_put(sconf->webkdc_pool, curl, code == CURLE_OK);
     if (code != CURLE_OK) {
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, server,
                      "mod_webauth: curl_easy_perform: error(%d): %s",
                      code, curl_error_buff);
         return NULL;
     }
+
+    /*
+     * Send later requests in whichever encoding the WebKDC used for its
+     * reply.  If the WebKDC no longer understands compact requests, its
+     * error reply won't be compact, and we'll go back to XML.
+     */
+    apr_atomic_set32(&sconf->webkdc_compact, *compact ? 1 : 0);
+
     /* null-terminate return data */
     if (string.data) {
         string.data[string.size] = '\0';
     }
-    curl_easy_cleanup(curl);
+    *length = string.size;
     return string.data;
 }
 
@@ -334,6 +673,199 @@ get_elem_text(apr_pool_t *pool, apr_xml_elem *e, const char *def)
 }
 
 
+/*
+ * Read a four-byte length in network byte order from a compact response,
+ * advancing *p, and check that there are at least that many bytes left
+ * before end.  Returns false if the response is too short.
+ */
+static bool
+read_length(const unsigned char **p, const unsigned char *end,
+            size_t *length)
+{
+    const unsigned char *q = *p;
+
+    if (end - q < 4)
+        return false;
+    *length = ((size_t) q[0] << 24) | ((size_t) q[1] << 16)
+        | ((size_t) q[2] << 8) | (size_t) q[3];
+    *p = q + 4;
+    return *length <= (size_t) (end - *p);
+}
+
+
+/*
+ * Decode a response in the compact encoding into the same tree that
+ * apr_xml_parser would build, so that the same code can handle both.  Returns
+ * the root element, or NULL if the response is malformed.
+ */
+static apr_xml_elem *
+decode_compact(apr_pool_t *pool, const char *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    const unsigned char *end = p + size;
+    apr_xml_elem *root = NULL, *current = NULL, *elem;
+    apr_xml_attr *attr;
+    apr_text *text;
+    apr_text_header *header;
+    size_t length;
+    bool attrs_ok = false;
+    unsigned char type;
+
+    while (p < end) {
+        type = *p++;
+        if (type == 'S' || type == 'A') {
+            if (p == end)
+                return NULL;
+            length = *p++;
+            if (length == 0 || length > (size_t) (end - p))
+                return NULL;
+        }
+        switch (type) {
+        case 'S':
+            if (root != NULL && current == NULL)
+                return NULL;
+            elem = apr_pcalloc(pool, sizeof(apr_xml_elem));
+            elem->name = apr_pstrmemdup(pool, (const char *) p, length);
+            elem->ns = APR_XML_NS_NONE;
+            elem->parent = current;
+            if (current == NULL)
+                root = elem;
+            else {
+                if (current->last_child == NULL)
+                    current->first_child = elem;
+                else
+                    current->last_child->next = elem;
+                current->last_child = elem;
+            }
+            current = elem;
+            attrs_ok = true;
+            p += length;
+            break;
+        case 'A':
+            if (!attrs_ok)
+                return NULL;
+            attr = apr_pcalloc(pool, sizeof(apr_xml_attr));
+            attr->name = apr_pstrmemdup(pool, (const char *) p, length);
+            attr->ns = APR_XML_NS_NONE;
+            p += length;
+            if (!read_length(&p, end, &length))
+                return NULL;
+            attr->value = apr_pstrmemdup(pool, (const char *) p, length);
+            attr->next = current->attr;
+            current->attr = attr;
+            p += length;
+            break;
+        case 'T':
+            if (current == NULL || !read_length(&p, end, &length))
+                return NULL;
+            text = apr_palloc(pool, sizeof(apr_text));
+            text->text = apr_pstrmemdup(pool, (const char *) p, length);
+            text->next = NULL;
+            if (current->last_child == NULL)
+                header = &current->first_cdata;
+            else
+                header = &current->last_child->following_cdata;
+            if (header->last == NULL)
+                header->first = text;
+            else
+                header->last->next = text;
+            header->last = text;
+            attrs_ok = false;
+            p += length;
+            break;
+        case 'E':
+            if (current == NULL)
+                return NULL;
+            current = current->parent;
+            attrs_ok = false;
+            break;
+        default:
+            return NULL;
+        }
+    }
+    return (current == NULL) ? root : NULL;
+}
+
+
+/*
+ * Send a request to the WebKDC and parse its response, in whichever encoding
+ * the WebKDC used.  Returns the root element of the response, or NULL on
+ * failure after logging the error.
+ */
+static apr_xml_elem *
+query_webkdc(struct message *request, const char *mwa_func,
+             server_rec *server, struct server_config *sconf,
+             apr_pool_t *pool)
+{
+    apr_xml_parser *xp;
+    apr_xml_doc *xd;
+    apr_xml_elem *root;
+    apr_status_t astatus;
+    char *response;
+    size_t length;
+    bool compact;
+
+    if (sconf->debug) {
+        if (request->compact)
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
+                         "mod_webauth: compact request (%lu bytes)",
+                         (unsigned long) request->string.size);
+        else
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
+                         "mod_webauth: xml_request(%s)",
+                         request->string.data);
+    }
+
+    response = post_to_webkdc(request, server, sconf, pool, &length,
+                              &compact);
+    if (response == NULL)
+        return NULL;
+
+    if (compact) {
+        if (sconf->debug)
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
+                         "mod_webauth: compact response (%lu bytes)",
+                         (unsigned long) length);
+        root = decode_compact(pool, response, length);
+        if (root == NULL)
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, server,
+                         "mod_webauth: %s: invalid compact response",
+                         mwa_func);
+        return root;
+    }
+
+    if (sconf->debug)
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
+                     "mod_webauth: xml_response(%s)", response);
+
+    xp = apr_xml_parser_create(pool);
+    if (xp == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server,
+                     "mod_webauth: %s: apr_xml_parser_create failed",
+                     mwa_func);
+        return NULL;
+    }
+
+    astatus = apr_xml_parser_feed(xp, response, length);
+    if (astatus == APR_SUCCESS) {
+        astatus = apr_xml_parser_done(xp, &xd);
+    }
+
+    if (astatus != APR_SUCCESS) {
+        char errbuff[1024];
+
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server,
+                     "mod_webauth: %s: "
+                     "apr_xml_parser_{feed,done} failed: %s (%d)",
+                     mwa_func,
+                     apr_xml_parser_geterror(xp, errbuff, sizeof(errbuff)),
+                     astatus);
+        return NULL;
+    }
+    return xd->root;
+}
+
+
 /*
  * parse and log errorResponse from WebKDC
  */
@@ -368,21 +900,19 @@ log_error_response(apr_xml_elem *e,
 
 
 static MWA_SERVICE_TOKEN *
-parse_service_token_response(apr_xml_doc *xd,
+parse_service_token_response(apr_xml_elem *e,
                              server_rec *server,
                              apr_pool_t *pool,
                              time_t curr)
 {
     MWA_SERVICE_TOKEN *st;
-    apr_xml_elem *e, *sib;
+    apr_xml_elem *sib;
     size_t bskey_len;
     char *bskey;
     time_t first_renewal_attempt, expiration;
     static const char *mwa_func = "parse_service_token_response";
     const char *expires, *session_key, *token_data;
 
-    e = xd->root;
-
     if (strcmp(e->name, "errorResponse") == 0) {
         log_error_response(e, mwa_func, server, pool);
         return NULL;
@@ -476,12 +1006,10 @@ request_service_token(struct webauth_context *ctx, server_rec *server,
                       apr_pool_t *pool,
                       time_t curr)
 {
-    apr_xml_parser *xp;
-    apr_xml_doc *xd;
-    char *xml_request, *xml_response;
+    struct message request;
+    apr_xml_elem *root;
     const char *bk5_req;
     static const char *mwa_func = "request_service_token";
-    apr_status_t astatus;
     MWA_CRED_INTERFACE *mci;
 
     /* FIXME: this is currently hardcoded to krb5, but should be a directive */
@@ -494,55 +1022,24 @@ request_service_token(struct webauth_context *ctx, server_rec *server,
     if (bk5_req == NULL)
         return NULL;
 
-    xml_request = apr_pstrcat(pool,
-                              "<getTokensRequest>"
-                              "<requesterCredential type='krb5'>",
-                              bk5_req,
-                              "</requesterCredential>"
-                              "<tokens><token type='service'/></tokens>"
-                              "</getTokensRequest>",
-                              NULL);
-
-    if (sconf->debug) {
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
-                     "mod_webauth: xml_request(%s)", xml_request);
-    }
-
-    xml_response = post_to_webkdc(xml_request, 0, server, sconf, pool);
-
-    if (xml_response == NULL)
-        return 0;
-
-    if (sconf->debug) {
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
-                     "mod_webauth: xml_response(%s)", xml_response);
-    }
-
-    xp = apr_xml_parser_create(pool);
-    if (xp == NULL) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server,
-                     "mod_webauth: %s: apr_xml_parser_create failed",
-                     mwa_func);
-        return 0;
-    }
-
-    astatus = apr_xml_parser_feed(xp, xml_response, strlen(xml_response));
-    if (astatus == APR_SUCCESS) {
-        astatus = apr_xml_parser_done(xp, &xd);
-    }
-
-    if (astatus != APR_SUCCESS) {
-        char errbuff[1024];
-        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server,
-                     "mod_webauth: %s: "
-                     "apr_xml_parser_{feed,done} failed: %s (%d)",
-                     mwa_func,
-                     apr_xml_parser_geterror(xp, errbuff, sizeof(errbuff)),
-                     astatus);
-        return 0;
-    }
+    message_init(&request, sconf, pool);
+    message_start(&request, "getTokensRequest");
+    message_start(&request, "requesterCredential");
+    message_attr(&request, "type", "krb5");
+    message_text(&request, bk5_req);
+    message_end(&request, "requesterCredential");
+    message_start(&request, "tokens");
+    message_start(&request, "token");
+    message_attr(&request, "type", "service");
+    message_end(&request, "token");
+    message_end(&request, "tokens");
+    message_end(&request, "getTokensRequest");
+
+    root = query_webkdc(&request, mwa_func, server, sconf, pool);
+    if (root == NULL)
+        return NULL;
 
-    return parse_service_token_response(xd, server, pool, curr);
+    return parse_service_token_response(root, server, pool, curr);
 }
 
 
@@ -554,11 +1051,13 @@ set_app_state(struct webauth_context *ctx, server_rec *server,
               struct server_config *sconf, MWA_SERVICE_TOKEN *token)
 {
     struct webauth_token app;
+    struct mwa_keyring *keyring;
     int status;
     const void *as;
     size_t length;
 
-    if (sconf->ring == NULL) {
+    keyring = mwa_keyring_acquire(server, sconf);
+    if (keyring == NULL) {
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, server, "mod_webauth: cannot"
                      " create application state: no keyring available");
         return;
@@ -570,7 +1069,9 @@ set_app_state(struct webauth_context *ctx, server_rec *server,
     app.token.app.session_key = token->key.data;
     app.token.app.session_key_len = token->key.length;
     app.token.app.expiration = token->expires;
-    status = webauth_token_encode_raw(ctx, &app, sconf->ring, &as, &length);
+    status = webauth_token_encode_raw(ctx, &app, keyring->ring, &as,
+                                      &length);
+    mwa_keyring_release(keyring);
     if (status != WA_ERR_NONE)
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, server,
                      "mod_webauth: cannot encode state token: %s",
@@ -584,67 +1085,163 @@ set_app_state(struct webauth_context *ctx, server_rec *server,
 
 
 /*
- * create a pool for the service token and copy the new
- * token into it. If the old_service_token is set, then destroy
- * its pool.
+ * Service tokens.
+ *
+ * Every request that talks to the WebKDC needs the service token for its
+ * virtual host, so getting it must neither serialize the worker threads nor
+ * make a request wait for the WebKDC while there is still a usable token.
+ * The current token is published through a pointer in the server
+ * configuration that is only read and replaced atomically, as with the
+ * keyring, and requests copy it without locking.
+ *
+ * Tokens are renewed ahead of expiration by a background thread in each child
+ * process, which replaces the published token while requests carry on with
+ * the old one.  Without thread support, the first request to notice that a
+ * renewal is due does it instead, if no other request already is.  Only when
+ * there is no usable token at all do requests wait, and then only one of them
+ * gets a token while the rest wait for it.
+ *
+ * Each process adds a random delay to the renewal time of each token so that
+ * processes sharing a service token cache don't all ask the WebKDC for a new
+ * token at once.  The first one to renew writes the new token to the cache,
+ * and the others find it there when their turn comes.
+ */
+
+/* The published service token pointer, as the type the APR atomics want. */
+#define SERVICE_TOKEN_PTR(sconf) ((volatile void **) &(sconf)->service_token)
+
+/*
+ * Whether the background renewal thread is running in this process.  Read by
+ * requests and set by the thread's startup and shutdown, so only accessed
+ * with the APR atomics.
+ */
+static volatile apr_uint32_t renewer_running = 0;
+
+
+/*
+ * Return the published service token without taking a reference, or NULL if
+ * there isn't one yet.
+ */
+static MWA_SERVICE_TOKEN *
+current_service_token(struct server_config *sconf)
+{
+    return apr_atomic_casptr(SERVICE_TOKEN_PTR(sconf), NULL, NULL);
+}
+
+
+/*
+ * Return a copy of the published service token allocated from pool, or NULL
+ * if there is none or it has expired.  We're counted as a reader from before
+ * reading the pointer until the copy is done, so that a concurrent renewal
+ * can't free the token out from under us.
+ */
+static MWA_SERVICE_TOKEN *
+copy_current_service_token(struct server_config *sconf, apr_pool_t *pool,
+                           time_t now)
+{
+    MWA_SERVICE_TOKEN *token, *copy = NULL;
+
+    apr_atomic_inc32(&sconf->service_token_readers);
+    token = current_service_token(sconf);
+    if (token != NULL && token->expires > now)
+        copy = copy_service_token(pool, token);
+    apr_atomic_dec32(&sconf->service_token_readers);
+    return copy;
+}
+
+
+/*
+ * Free the replaced service tokens unless a request is copying the published
+ * token.  A request that starts copying after the token was replaced can
+ * only see the new one, so once there are no readers, nothing can be using
+ * a replaced token.  Must be called with sconf->mutex held.
+ */
+static void
+free_retired_tokens(struct server_config *sconf)
+{
+    MWA_SERVICE_TOKEN *token;
+
+    if (apr_atomic_read32(&sconf->service_token_readers) != 0)
+        return;
+    while (sconf->service_token_retired != NULL) {
+        token = sconf->service_token_retired;
+        sconf->service_token_retired = token->next;
+        apr_pool_destroy(token->pool);
+    }
+}
+
+
+/*
+ * Return when this process should try to renew a token: the given time plus
+ * a random delay of at most TOKEN_RENEWAL_JITTER seconds, but no more than
+ * half the time remaining until limit.
+ */
+static time_t
+jitter_renewal(struct server_config *sconf, time_t when, time_t limit)
+{
+    unsigned long window = TOKEN_RENEWAL_JITTER;
+
+    if (limit <= when)
+        return when;
+    if ((unsigned long) (limit - when) / 2 < window)
+        window = (unsigned long) (limit - when) / 2;
+    if (window == 0)
+        return when;
+    return when + rand_r(&sconf->service_token_seed) % (window + 1);
+}
+
+
+/*
+ * Copy a service token into its own pool, publish it in place of the current
+ * one, and schedule its renewal.  The old token is retired and freed once no
+ * request is copying the published token.  Must be called with sconf->mutex
+ * held.
  */
 static void
 set_service_token(MWA_SERVICE_TOKEN *new_token,
                   struct server_config *sconf)
 {
+    MWA_SERVICE_TOKEN *token, *old;
     apr_pool_t *p;
 
-    if (sconf->service_token)
-        apr_pool_destroy(sconf->service_token->pool);
     apr_pool_create(&p, NULL);
-    sconf->service_token = copy_service_token(p, new_token);
+    token = copy_service_token(p, new_token);
+    old = apr_atomic_xchgptr(SERVICE_TOKEN_PTR(sconf), token);
+    if (old != NULL) {
+        old->next = sconf->service_token_retired;
+        sconf->service_token_retired = old;
+    }
+    free_retired_tokens(sconf);
+    sconf->service_token_renew =
+        jitter_renewal(sconf, token->next_renewal_attempt, token->expires);
     if (sconf->debug) {
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, NULL,
-                     "mod_webauth: setting service token");
+                     "mod_webauth: setting service token, renewal at %lu",
+                     (unsigned long) sconf->service_token_renew);
     }
-
 }
 
 
 /*
- * this function returns a service-token to use.
- *
- * it looks in memory first, then the service token cache, then makes
- * a request if all else fails.
- *
- * it also does housekeeping on the service token, such as attempting
- * to request a new one while the current one is still active but nearing
- * expiration.
- *
+ * Get a new service token, from the service token cache if another process
+ * has already renewed it and otherwise, unless local_cache_only is set, from
+ * the WebKDC, and publish it.  Returns the new token allocated from pool, or
+ * NULL on failure.  If we couldn't get a new token, the current one, if any,
+ * is kept and another attempt is scheduled after TOKEN_RETRY_INTERVAL.  Must
+ * be called with sconf->mutex held.
  */
-MWA_SERVICE_TOKEN *
-mwa_get_service_token(server_rec *server, struct server_config *sconf,
-                      apr_pool_t *pool, int local_cache_only)
+static MWA_SERVICE_TOKEN *
+renew_service_token(server_rec *server, struct server_config *sconf,
+                    apr_pool_t *pool, bool local_cache_only)
 {
     struct webauth_context *ctx;
-    MWA_SERVICE_TOKEN *token;
+    MWA_SERVICE_TOKEN *token, *current;
     time_t curr = time(NULL);
-    static const char *mwa_func = "mwa_get_service_token";
-
-    apr_thread_mutex_lock(sconf->mutex); /****** LOCKING! ************/
+    static const char *mwa_func = "renew_service_token";
 
     /* FIXME: Eventually this should be passed around everywhere. */
     webauth_context_init_apr(&ctx, pool);
 
-    if (sconf->service_token != NULL) {
-        /* return the current one, unless we should attempt a renewal */
-        if (sconf->service_token->next_renewal_attempt > curr) {
-            token = copy_service_token(pool, sconf->service_token);
-            if (sconf->debug) {
-                ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
-                             "mod_webauth: %s: using cached service token",
-                             mwa_func);
-            }
-            goto done;
-        }
-        /* else lets force a re-read, and maybe force a re-request */
-    }
-
     /* check file first to see if there is a (newer) token */
     token = read_service_token_cache(server, sconf, pool);
 
@@ -665,17 +1262,17 @@ mwa_get_service_token(server_rec *server, struct server_config *sconf,
             set_app_state(ctx, server, sconf, token);
             /* copy into its own pool for future use */
             set_service_token(token, sconf);
-            goto done;
+            return token;
         }
     }
 
     /* still no token, or we are renewing our current one */
     if (local_cache_only)
-        goto done;
+        return (token != NULL && token->expires > curr) ? token : NULL;
 
     token = request_service_token(ctx, server, sconf, pool, curr);
 
-    if (token == NULL ) {
+    if (token == NULL) {
 
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, server,
                      "mod_webauth: %s: couldn't get new service "
@@ -683,15 +1280,17 @@ mwa_get_service_token(server_rec *server, struct server_config *sconf,
                      mwa_func);
 
         /* couldn't get a new one, lets update renewal_attempt times
-         * if we have a current token.
+         * if we have a current token and keep using it.
          */
-        if (sconf->service_token != NULL) {
-
-            /* update {last,next}_renewal_attempt */
-            sconf->service_token->last_renewal_attempt = curr;
-            sconf->service_token->next_renewal_attempt =
-                curr+TOKEN_RETRY_INTERVAL;
-            write_service_token_cache(server, sconf, sconf->service_token);
+        current = current_service_token(sconf);
+        if (current != NULL) {
+            token = copy_service_token(pool, current);
+            token->last_renewal_attempt = curr;
+            token->next_renewal_attempt = curr + TOKEN_RETRY_INTERVAL;
+            write_service_token_cache(server, sconf, token);
+            set_service_token(token, sconf);
+            if (token->expires <= curr)
+                token = NULL;
         }
     } else {
 
@@ -705,10 +1304,59 @@ mwa_get_service_token(server_rec *server, struct server_config *sconf,
         write_service_token_cache(server, sconf, token);
         set_app_state(ctx, server, sconf, token);
         set_service_token(token, sconf);
-        goto done;
+    }
+    return token;
+}
+
+
+/*
+ * this function returns a service-token to use.
+ *
+ * it returns the current token without locking if there is one that hasn't
+ * expired.  otherwise it looks in the service token cache and then makes a
+ * request, with only one request per virtual host doing so at a time.
+ *
+ * renewing the current token while it is still usable is normally left to
+ * the renewal thread, but is done here, by at most one request at a time,
+ * if there is no renewal thread.
+ */
+MWA_SERVICE_TOKEN *
+mwa_get_service_token(server_rec *server, struct server_config *sconf,
+                      apr_pool_t *pool, int local_cache_only)
+{
+    MWA_SERVICE_TOKEN *token;
+    apr_pool_t *p;
+    time_t curr = time(NULL);
+    static const char *mwa_func = "mwa_get_service_token";
+
+    token = copy_current_service_token(sconf, pool, curr);
+    if (token != NULL) {
+        if (sconf->debug) {
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
+                         "mod_webauth: %s: using cached service token",
+                         mwa_func);
+        }
+        if (!apr_atomic_read32(&renewer_running) && !local_cache_only
+            && sconf->service_token_renew <= curr
+            && apr_thread_mutex_trylock(sconf->mutex) == APR_SUCCESS) {
+            if (sconf->service_token_renew <= curr) {
+                apr_pool_create(&p, pool);
+                renew_service_token(server, sconf, p, false);
+                apr_pool_destroy(p);
+            }
+            apr_thread_mutex_unlock(sconf->mutex);
+        }
+        return token;
     }
 
-done:
+    /*
+     * No usable token.  Get one under the mutex, after checking whether
+     * another request got one while we were waiting for it.
+     */
+    apr_thread_mutex_lock(sconf->mutex); /****** LOCKING! ************/
+    token = copy_current_service_token(sconf, pool, curr);
+    if (token == NULL)
+        token = renew_service_token(server, sconf, pool, local_cache_only);
     apr_thread_mutex_unlock(sconf->mutex); /****** UNLOCKING! ************/
 
     if (token == NULL && !local_cache_only) {
@@ -720,6 +1368,144 @@ done:
 }
 
 
+#if APR_HAS_THREADS
+
+/*
+ * The renewal thread and what it waits on.  renewer_stopping is set with the
+ * mutex held, so that the thread can't miss the signal between checking it
+ * and waiting, but is also read without the mutex while renewing, so it is
+ * only accessed with the APR atomics.
+ */
+static apr_thread_t *renewer = NULL;
+static apr_thread_mutex_t *renewer_mutex = NULL;
+static apr_thread_cond_t *renewer_cond = NULL;
+static volatile apr_uint32_t renewer_stopping = 0;
+
+
+/*
+ * The body of the renewal thread.  Sleeps until the next service token of any
+ * virtual host is due for renewal, or for at most TOKEN_RENEWAL_CHECK
+ * seconds, and renews whichever tokens are due.  Virtual hosts without a
+ * token are left to the first request that needs one.
+ *
+ * renewer_mutex is only held while waiting, never across the call to the
+ * WebKDC, so stop_renewer can always take it at once.  The stop flag is
+ * checked before each virtual host, so a stop waits for at most the one
+ * renewal in progress.
+ */
+static void * APR_THREAD_FUNC
+renewal_thread(apr_thread_t *thread, void *data)
+{
+    server_rec *s = data;
+    server_rec *t;
+    struct server_config *sconf;
+    apr_pool_t *pool;
+    time_t now, wake;
+
+    apr_pool_create(&pool, NULL);
+    while (!apr_atomic_read32(&renewer_stopping)) {
+        now = time(NULL);
+        wake = now + TOKEN_RENEWAL_CHECK;
+        for (t = s; t != NULL; t = t->next) {
+            sconf = ap_get_module_config(t->module_config, &webauth_module);
+            if (current_service_token(sconf) != NULL
+                && sconf->service_token_renew < wake)
+                wake = sconf->service_token_renew;
+        }
+        if (wake > now) {
+            apr_thread_mutex_lock(renewer_mutex);
+            if (!apr_atomic_read32(&renewer_stopping))
+                apr_thread_cond_timedwait(renewer_cond, renewer_mutex,
+                                          apr_time_from_sec(wake - now));
+            apr_thread_mutex_unlock(renewer_mutex);
+        }
+        now = time(NULL);
+        for (t = s; t != NULL; t = t->next) {
+            if (apr_atomic_read32(&renewer_stopping))
+                break;
+            sconf = ap_get_module_config(t->module_config, &webauth_module);
+            apr_thread_mutex_lock(sconf->mutex);
+            free_retired_tokens(sconf);
+            if (current_service_token(sconf) != NULL
+                && sconf->service_token_renew <= now) {
+                renew_service_token(t, sconf, pool, false);
+                apr_pool_clear(pool);
+            }
+            apr_thread_mutex_unlock(sconf->mutex);
+        }
+    }
+    apr_pool_destroy(pool);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+
+/*
+ * Pool cleanup that stops the renewal thread and waits for it to exit.
+ * Registered as a pre-cleanup so that it runs before the mutex and condition
+ * variable are destroyed.  The thread never holds the mutex across a WebKDC
+ * call, so this wakes it up right away if it's sleeping and otherwise waits
+ * only for a renewal already in progress.
+ */
+static apr_status_t
+stop_renewer(void *data UNUSED)
+{
+    apr_status_t status;
+
+    apr_thread_mutex_lock(renewer_mutex);
+    apr_atomic_set32(&renewer_stopping, 1);
+    apr_thread_cond_signal(renewer_cond);
+    apr_thread_mutex_unlock(renewer_mutex);
+    apr_thread_join(&status, renewer);
+    renewer = NULL;
+    apr_atomic_set32(&renewer_running, 0);
+    return APR_SUCCESS;
+}
+
+#endif /* APR_HAS_THREADS */
+
+
+/*
+ * Set up service token renewal in a child process: seed the renewal jitter
+ * differently in each process and start the renewal thread if we can.  If
+ * the thread can't be started, requests renew the tokens themselves.
+ */
+void
+mwa_service_token_init(server_rec *s, apr_pool_t *pool)
+{
+    server_rec *t;
+    struct server_config *sconf;
+    unsigned int seed;
+#if APR_HAS_THREADS
+    apr_status_t status;
+#endif
+
+    seed = (unsigned int) getpid() ^ (unsigned int) time(NULL);
+    for (t = s; t != NULL; t = t->next) {
+        sconf = ap_get_module_config(t->module_config, &webauth_module);
+        sconf->service_token_seed = seed++;
+    }
+
+#if APR_HAS_THREADS
+    apr_atomic_set32(&renewer_stopping, 0);
+    status = apr_thread_mutex_create(&renewer_mutex, APR_THREAD_MUTEX_DEFAULT,
+                                     pool);
+    if (status == APR_SUCCESS)
+        status = apr_thread_cond_create(&renewer_cond, pool);
+    if (status == APR_SUCCESS)
+        status = apr_thread_create(&renewer, NULL, renewal_thread, s, pool);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "mod_webauth: cannot start service token renewal"
+                     " thread, renewing in requests instead");
+        return;
+    }
+    apr_atomic_set32(&renewer_running, 1);
+    apr_pool_pre_cleanup_register(pool, NULL, stop_renewer);
+#endif
+}
+
+
 static const char *
 make_request_token(MWA_REQ_CTXT *rc, MWA_SERVICE_TOKEN *st, const char *cmd)
 {
@@ -744,18 +1530,16 @@ make_request_token(MWA_REQ_CTXT *rc, MWA_SERVICE_TOKEN *st, const char *cmd)
 
 
 static int
-parse_get_creds_response(apr_xml_doc *xd,
+parse_get_creds_response(apr_xml_elem *e,
                          MWA_REQ_CTXT *rc,
                          MWA_SERVICE_TOKEN *st,
                          apr_array_header_t **acquired_creds)
 {
-    apr_xml_elem *e, *tokens, *token;
+    apr_xml_elem *tokens, *token;
     static const char *mwa_func = "parse_service_token_response";
     char *token_data;
     struct webauth_token_cred *ct;
 
-    e = xd->root;
-
     if (strcmp(e->name, "errorResponse") == 0) {
         log_error_response(e, mwa_func, rc->r->server, rc->r->pool);
         return 0;
@@ -835,14 +1619,12 @@ mwa_get_creds_from_webkdc(MWA_REQ_CTXT *rc,
                           apr_array_header_t *needed_creds,
                           apr_array_header_t **acquired_creds)
 {
-    apr_xml_parser *xp;
-    apr_xml_doc *xd;
-    char *xml_request, *xml_response, *b64_pt;
+    struct message request;
+    apr_xml_elem *root;
+    char *b64_pt;
     size_t i;
     static const char *mwa_func = "mwa_get_creds_from_webkdc";
-    apr_status_t astatus;
     MWA_SERVICE_TOKEN *st;
-    MWA_STRING cred_tokens;
     const char *request_token;
 
     /* get service token first */
@@ -856,99 +1638,49 @@ mwa_get_creds_from_webkdc(MWA_REQ_CTXT *rc,
     if (request_token == NULL)
         return 0;
 
-    /* now build up all the cred tokens we need */
-    init_string(&cred_tokens, rc->r->pool);
-
-    for (i = 0; i < (size_t) needed_creds->nelts; i++) {
-        MWA_WACRED *cred;
-        char *id = apr_psprintf(rc->r->pool, "%lu", (unsigned long) i);
-
-        cred = &APR_ARRAY_IDX(needed_creds, i, MWA_WACRED);
-        append_string(&cred_tokens,
-                      apr_pstrcat(rc->r->pool,
-                                  "<token type='cred' id='",id,"'>",
-                                  "<credentialType>",
-                                  apr_xml_quote_string(rc->r->pool,
-                                                       cred->type, 0),
-                                  "</credentialType>",
-                                  "<serverPrincipal>",
-                                  apr_xml_quote_string(rc->r->pool,
-                                                       cred->service, 0),
-                                  "</serverPrincipal>",
-                                  "</token>",
-                                  NULL),
-                      0);
-    }
-
     /* base64 encode the webkdc-proxy-token */
     b64_pt = apr_palloc(rc->r->pool,
                         apr_base64_encode_len(pt->webkdc_proxy_len));
     apr_base64_encode(b64_pt, pt->webkdc_proxy, pt->webkdc_proxy_len);
 
     /* build the actual request */
-    xml_request = apr_pstrcat(rc->r->pool,
-                              "<getTokensRequest>"
-                              "<requesterCredential type='service'>",
-                              st->token, /* b64'd, don't need to quote */
-                              "</requesterCredential>"
-                              "<subjectCredential type='proxy'>",
-                              "<proxyToken>",
-                              b64_pt, /* b64'd, don't need to quote */
-                              "</proxyToken>",
-                              "</subjectCredential>",
-                              "<requestToken>",
-                              request_token,
-                              "</requestToken>",
-                              "<tokens>",
-                              cred_tokens.data,
-                              "</tokens>"
-                              "</getTokensRequest>",
-                              NULL);
-
-    if (rc->sconf->debug)
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
-                     "mod_webauth: xml_request(%s)", xml_request);
-
-
-    xml_response = post_to_webkdc(xml_request, 0,
-                                  rc->r->server, rc->sconf, rc->r->pool);
-
-    if (xml_response == NULL)
-        return 0;
-
-    if (rc->sconf->debug)
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
-                     "mod_webauth: xml_response(%s)", xml_response);
-
-
-    xp = apr_xml_parser_create(rc->r->pool);
-    if (xp == NULL) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
-                     "mod_webauth: %s: apr_xml_parser_create failed",
-                     mwa_func);
-        return 0;
-    }
+    message_init(&request, rc->sconf, rc->r->pool);
+    message_start(&request, "getTokensRequest");
+    message_start(&request, "requesterCredential");
+    message_attr(&request, "type", "service");
+    message_text(&request, st->token);
+    message_end(&request, "requesterCredential");
+    message_start(&request, "subjectCredential");
+    message_attr(&request, "type", "proxy");
+    message_element(&request, "proxyToken", b64_pt);
+    message_end(&request, "subjectCredential");
+    message_element(&request, "requestToken", request_token);
+
+    /* now add all the cred tokens we need */
+    message_start(&request, "tokens");
+    for (i = 0; i < (size_t) needed_creds->nelts; i++) {
+        MWA_WACRED *cred;
+        char *id = apr_psprintf(rc->r->pool, "%lu", (unsigned long) i);
 
-    astatus = apr_xml_parser_feed(xp, xml_response, strlen(xml_response));
-    if (astatus == APR_SUCCESS) {
-        astatus = apr_xml_parser_done(xp, &xd);
+        cred = &APR_ARRAY_IDX(needed_creds, i, MWA_WACRED);
+        message_start(&request, "token");
+        message_attr(&request, "type", "cred");
+        message_attr(&request, "id", id);
+        message_element(&request, "credentialType", cred->type);
+        message_element(&request, "serverPrincipal", cred->service);
+        message_end(&request, "token");
     }
+    message_end(&request, "tokens");
+    message_end(&request, "getTokensRequest");
 
-    if (astatus != APR_SUCCESS) {
-        char errbuff[1024];
-
-        ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
-                     "mod_webauth: %s: "
-                     "apr_xml_parser_{feed,done} failed: %s (%d)",
-                     mwa_func,
-                     apr_xml_parser_geterror(xp, errbuff, sizeof(errbuff)),
-                     astatus);
+    root = query_webkdc(&request, mwa_func, rc->r->server, rc->sconf,
+                        rc->r->pool);
+    if (root == NULL)
         return 0;
-    }
 
     if (rc->sconf->debug)
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
-                     "mod_webauth: xml doc root(%s)", xd->root->name);
+                     "mod_webauth: xml doc root(%s)", root->name);
 
-    return parse_get_creds_response(xd, rc, st, acquired_creds);
+    return parse_get_creds_response(root, rc, st, acquired_creds);
 }
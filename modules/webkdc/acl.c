@@ -1,6 +1,27 @@
 /*
  * Token ACL file handling for the Apache WebKDC module.
  *
+ * The token ACL is checked at least once for every request to the WebKDC, so
+ * it is compiled when loaded into a form that can be checked without locking
+ * and without walking every entry.  Entries are grouped into sets of subjects
+ * by what they grant: id tokens, proxy tokens of a given type, or a
+ * particular credential of a given type.  Within each set, literal subjects
+ * are kept in a hash table and wildcard subjects are compiled together into a
+ * DFA over the bytes of the subject (see glob.c), so a lookup is one hash
+ * probe plus at most one pass over the subject no matter how many wildcard
+ * entries there are.  Subject strings are interned while loading, so each
+ * distinct subject is stored once however many sets it appears in.
+ *
+ * The compiled ACL is published through a pointer that is only ever read and
+ * replaced atomically.  Each request takes a reference to the current ACL the
+ * first time it needs it and drops it when the request is finished.  A
+ * thread in each child checks the file every few seconds and, when it has
+ * changed, loads and compiles the new ACL off the request path and replaces
+ * the published ACL only if the new one loaded without errors.  The old one
+ * is freed once no request holds a reference to it and no request is between
+ * reading the published pointer and taking its reference, which is tracked
+ * with a count of such readers.
+ *
  * Written by Roland Schemers
  * Copyright 2002, 2003, 2006, 2009, 2012, 2013
  *     The Board of Trustees of the Leland Stanford Junior University
@@ -11,69 +32,247 @@
 #include <config-mod.h>
 #include <portable/apache.h>
 #include <portable/apr.h>
+#include <portable/stdbool.h>
 
+#include <apr_atomic.h>
 #include <apr_hash.h>
 
 #include <modules/webkdc/mod_webkdc.h>
+#include <util/macros.h>
 
 APLOG_USE_MODULE(webkdc);
 
+/* How often the reloader thread checks the ACL file, in seconds. */
+#define ACL_CHECK_INTERVAL 5
+
+/* A set of subjects, some of which may be wildcard patterns. */
+struct acl_set {
+    apr_hash_t *exact;                  /* Literal subjects. */
+    apr_hash_t *wild;                   /* Wildcard subjects while loading. */
+    struct mwk_glob_set *globs;         /* Wildcard subjects once compiled. */
+};
 
 /*
- * used to hold the result of reading the acl file
- *
- * keys/values are of the form:
- *  id;{subject} => int*, int set to 1
- *  cred;{proxy-type};{subject} => apr_array_header_t*, array of creds
- *
+ * A compiled token ACL.  proxy maps proxy token types to the set of subjects
+ * allowed to get them.  cred maps credential types to a hash from credential
+ * names to the set of subjects allowed to get them.
  */
-typedef struct {
-    apr_pool_t *pool;         /* pool to allocate new keys/values from */
-    apr_hash_t *wild_entries; /* entries with a wildcard */
-    apr_hash_t *entries;      /* entries without a wildcard */
+typedef struct mwk_acl {
+    apr_pool_t *pool;                   /* Pool holding the whole ACL. */
+    apr_time_t mtime;                   /* Modification time of the file. */
+    volatile apr_uint32_t refs;         /* Requests using this ACL. */
+    struct mwk_acl *next;               /* Next replaced ACL. */
+    unsigned long generation;           /* Sequence number of this load. */
+    apr_time_t loaded;                  /* When this ACL was loaded. */
+    struct acl_set id;
+    apr_hash_t *proxy;
+    apr_hash_t *cred;
 } MWK_ACL;
 
+/*
+ * The published ACL, if any, which is read and replaced atomically, and the
+ * number of requests between reading it and taking a reference to it, which
+ * is only changed atomically.  The rest is protected by acl_mutex: the
+ * replaced ACLs that haven't been freed yet, the number of ACLs loaded so
+ * far, when the file was last checked, the modification time of the last
+ * file that failed to load, and the state of the reloader thread.
+ */
+static volatile void *current = NULL;
+static volatile apr_uint32_t acl_readers = 0;
+static MWK_ACL *retired = NULL;
+static unsigned long acl_generation = 0;
+static apr_time_t acl_checked = 0;
+static apr_time_t acl_failed = 0;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *acl_mutex = NULL;
+static apr_thread_t *acl_reloader = NULL;
+static apr_thread_cond_t *acl_cond = NULL;
+static bool acl_stopping = false;
+#endif
+
+
+/*
+ * Lock or unlock the ACL mutex.  These are stubbed out if we don't have
+ * threads.
+ */
+static void
+lock_acl(void)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(acl_mutex);
+#endif
+}
+
+static void
+unlock_acl(void)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(acl_mutex);
+#endif
+}
+
+
+/*
+ * Return the published ACL without taking a reference, or NULL if none has
+ * been loaded yet.
+ */
+static MWK_ACL *
+current_acl(void)
+{
+    return apr_atomic_casptr(&current, NULL, NULL);
+}
+
+
+/*
+ * Initialize a subject set.
+ */
+static void
+set_init(struct acl_set *set, apr_pool_t *pool)
+{
+    set->exact = apr_hash_make(pool);
+    set->wild = apr_hash_make(pool);
+}
+
+
+/*
+ * Create a new subject set.
+ */
+static struct acl_set *
+set_make(apr_pool_t *pool)
+{
+    struct acl_set *set;
+
+    set = apr_pcalloc(pool, sizeof(struct acl_set));
+    set_init(set, pool);
+    return set;
+}
+
+
+/*
+ * Add an interned subject to a subject set.
+ */
+static void
+set_add(struct acl_set *set, const char *subject)
+{
+    apr_hash_t *hash;
+
+    hash = ap_is_matchexp(subject) ? set->wild : set->exact;
+    apr_hash_set(hash, subject, APR_HASH_KEY_STRING, subject);
+}
+
+
+/*
+ * Compile the wildcard subjects of a subject set, if any, into a pattern
+ * set.  If its DFA would be too large, log a warning; the patterns will then
+ * be matched one at a time.
+ */
+static void
+set_compile(server_rec *s, struct config *sconf, struct acl_set *set,
+            apr_pool_t *pool, apr_pool_t *scratch)
+{
+    apr_array_header_t *patterns;
+    apr_hash_index_t *hi;
+    const void *key;
+
+    patterns = apr_array_make(pool, apr_hash_count(set->wild),
+                              sizeof(const char *));
+    for (hi = apr_hash_first(scratch, set->wild); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, &key, NULL, NULL);
+        APR_ARRAY_PUSH(patterns, const char *) = key;
+    }
+    set->wild = NULL;
+    if (patterns->nelts == 0)
+        return;
+    set->globs = mwk_glob_compile(pool, scratch, patterns,
+                                  MWK_GLOB_MAX_CELLS);
+    if (set->globs->dfa == NULL)
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                     "mod_webkdc: get_acl: %d wildcard entries in %s are too"
+                     " complex to compile, matching them individually",
+                     patterns->nelts, sconf->token_acl_path);
+}
+
+
+/*
+ * Return whether a subject is in a subject set.  set may be NULL, in which
+ * case the subject is not in it.
+ */
+static bool
+set_match(const struct acl_set *set, const char *subject)
+{
+    if (set == NULL)
+        return false;
+    if (apr_hash_get(set->exact, subject, APR_HASH_KEY_STRING) != NULL)
+        return true;
+    if (set->globs != NULL)
+        return mwk_glob_match(set->globs, subject);
+    return false;
+}
+
+
+/*
+ * Return the single copy of a string in the ACL, adding it if necessary.
+ */
+static const char *
+intern(MWK_ACL *acl, apr_hash_t *strings, const char *string)
+{
+    const char *copy;
+
+    copy = apr_hash_get(strings, string, APR_HASH_KEY_STRING);
+    if (copy == NULL) {
+        copy = apr_pstrdup(acl->pool, string);
+        apr_hash_set(strings, copy, APR_HASH_KEY_STRING, copy);
+    }
+    return copy;
+}
+
+
+/*
+ * Add an entry from the ACL file to the ACL being loaded.  strings holds the
+ * interned strings and sets collects every subject set created, so that they
+ * can be compiled once the whole file has been read.
+ */
 static int
-add_entry(MWK_REQ_CTXT *rc,
-          MWK_ACL *acl,
+add_entry(MWK_ACL *acl,
+          apr_hash_t *strings,
+          apr_array_header_t *sets,
           const char *subject,
           const char *entry_type,
           const char *proxy_type,
           const char *cred)
 {
-    apr_hash_t *hash;
-
-    hash = ap_is_matchexp(subject) ? acl->wild_entries : acl->entries;
+    struct acl_set *set;
+    apr_hash_t *creds;
 
+    subject = intern(acl, strings, subject);
     if (strcmp(entry_type, "id") == 0) {
-        char *key = apr_pstrcat(rc->r->pool, "id;", subject, NULL);
-        void *p = apr_hash_get(hash, key, APR_HASH_KEY_STRING);
-        if (p == NULL) {
-            apr_hash_set(hash,
-                         apr_pstrdup(acl->pool, key),
-                         APR_HASH_KEY_STRING,
-                         apr_pstrdup(acl->pool, "1"));
-        }
+        set_add(&acl->id, subject);
         return 1;
     } else if (strcmp(entry_type, "cred") == 0) {
-        char *key = apr_pstrcat(rc->r->pool,
-                                "cred;",
-                                proxy_type,
-                                ";",
-                                subject, NULL);
-        apr_array_header_t *a =
-            apr_hash_get(hash, key, APR_HASH_KEY_STRING);
-        if (a == NULL) {
-            char **c;
-            a = apr_array_make(acl->pool, 5, sizeof(char*));
-            c = apr_array_push(a);
-            *c = (char*)apr_pstrdup(acl->pool, cred);
-            apr_hash_set(hash, apr_pstrdup(acl->pool, key),
-                         APR_HASH_KEY_STRING, a);
-        } else {
-            char **c = apr_array_push(a);
-            *c = (char*)apr_pstrdup(acl->pool, cred);
+        proxy_type = intern(acl, strings, proxy_type);
+        cred = intern(acl, strings, cred);
+
+        /* Getting any credential of a type also allows a proxy token. */
+        set = apr_hash_get(acl->proxy, proxy_type, APR_HASH_KEY_STRING);
+        if (set == NULL) {
+            set = set_make(acl->pool);
+            apr_hash_set(acl->proxy, proxy_type, APR_HASH_KEY_STRING, set);
+            APR_ARRAY_PUSH(sets, struct acl_set *) = set;
+        }
+        set_add(set, subject);
+
+        creds = apr_hash_get(acl->cred, proxy_type, APR_HASH_KEY_STRING);
+        if (creds == NULL) {
+            creds = apr_hash_make(acl->pool);
+            apr_hash_set(acl->cred, proxy_type, APR_HASH_KEY_STRING, creds);
+        }
+        set = apr_hash_get(creds, cred, APR_HASH_KEY_STRING);
+        if (set == NULL) {
+            set = set_make(acl->pool);
+            apr_hash_set(creds, cred, APR_HASH_KEY_STRING, set);
+            APR_ARRAY_PUSH(sets, struct acl_set *) = set;
         }
+        set_add(set, subject);
         return 1;
     } else {
         return 0;
@@ -82,14 +281,14 @@ add_entry(MWK_REQ_CTXT *rc,
 
 
 static void
-log_apr_error(MWK_REQ_CTXT *rc,
+log_apr_error(server_rec *s,
              apr_status_t astatus,
              const char *mwk_func,
              const char *ap_func,
              const char *path)
 {
     char errbuff[512];
-    ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+    ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
                  "mod_webkdc: %s: %s (%s): %s (%d)",
                  mwk_func,
                  ap_func,
@@ -98,81 +297,70 @@ log_apr_error(MWK_REQ_CTXT *rc,
                  astatus);
 }
 
+
 /*
- * returns the cached ACL after checking to make its up to date.
- * returns NULL on error.
- *
- * Should only be called while holding the MWK_MUTEX_ACL mutex.
- *
+ * Read and compile the ACL file, which had modification time mtime when we
+ * decided to load it, logging to the given server and using pool for
+ * temporary allocations.  reload says whether there's already an ACL
+ * loaded, which only affects the log messages.  Returns the new ACL or NULL
+ * on error.  The new ACL has a pool of its own and nothing shared is
+ * touched, so this doesn't need the ACL mutex.
  */
 static MWK_ACL *
-get_acl(MWK_REQ_CTXT *rc)
+load_acl(server_rec *s, struct config *sconf, apr_pool_t *pool,
+         apr_time_t mtime, bool reload)
 {
-    static MWK_ACL *acl = NULL;
-    static apr_time_t acl_mtime = 0;
     MWK_ACL *new_acl;
     const char *mwk_func="get_acl";
     apr_status_t astatus;
     apr_file_t *acl_file;
-    apr_pool_t *acl_pool;
-    int lineno, error;
+    apr_pool_t *acl_pool, *scratch;
+    apr_hash_t *strings;
+    apr_array_header_t *sets;
+    int lineno, error, i;
     char line[1024];
-    struct apr_finfo_t finfo;
     apr_int32_t flags;
 
-    if (acl != NULL) {
-        /* FIXME: stat and free current acl if out-of-date */
-        astatus = apr_stat(&finfo, rc->sconf->token_acl_path,
-                           APR_FINFO_MTIME, rc->r->pool);
-
-        if (astatus != APR_SUCCESS) {
-            log_apr_error(rc, astatus, mwk_func, "apr_file_open",
-                          rc->sconf->token_acl_path);
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
-                         "mod_webkdc: %s: couldn't stat acl file(%s), "
-                         "using previously cached acl",
-                         mwk_func, rc->sconf->token_acl_path);
-            return acl;
-        }
-        /* no change, return current acl */
-        if (finfo.mtime == acl_mtime)
-            return acl;
-    }
-
-    if (rc->sconf->debug) {
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
+    if (sconf->debug) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
                      "mod_webkdc: %s: %sloading acl file: %s",
                      mwk_func,
-                     acl == NULL ? "" : "re",
-                     rc->sconf->token_acl_path);
+                     reload ? "re" : "",
+                     sconf->token_acl_path);
     }
 
     /* open ACL file */
     flags = APR_FOPEN_READ | APR_FOPEN_BUFFERED | APR_FOPEN_NOCLEANUP;
-    astatus = apr_file_open(&acl_file, rc->sconf->token_acl_path, flags,
-                            APR_FPROT_OS_DEFAULT, rc->r->pool);
+    astatus = apr_file_open(&acl_file, sconf->token_acl_path, flags,
+                            APR_FPROT_OS_DEFAULT, pool);
 
     if (astatus != APR_SUCCESS) {
-        log_apr_error(rc, astatus, mwk_func, "apr_file_open",
-                      rc->sconf->token_acl_path);
-        if (acl != NULL) {
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+        log_apr_error(s, astatus, mwk_func, "apr_file_open",
+                      sconf->token_acl_path);
+        if (reload) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
                          "mod_webkdc: %s: couldn't open new acl file, "
                          "using previously cached acl",
                          mwk_func);
         } else {
-            ap_log_error(APLOG_MARK, APLOG_EMERG, 0, rc->r->server,
+            ap_log_error(APLOG_MARK, APLOG_EMERG, 0, s,
                          "mod_webkdc: %s: couldn't open acl file: %s",
-                         mwk_func, rc->sconf->token_acl_path);
+                         mwk_func, sconf->token_acl_path);
         }
-        return acl;
+        return NULL;
     }
 
     apr_pool_create(&acl_pool, NULL);
+    apr_pool_create(&scratch, pool);
     new_acl = (MWK_ACL*) apr_pcalloc(acl_pool, sizeof(MWK_ACL));
     new_acl->pool = acl_pool;
-    new_acl->wild_entries = apr_hash_make(new_acl->pool);
-    new_acl->entries = apr_hash_make(new_acl->pool);
+    new_acl->mtime = mtime;
+    set_init(&new_acl->id, acl_pool);
+    new_acl->proxy = apr_hash_make(acl_pool);
+    new_acl->cred = apr_hash_make(acl_pool);
+    strings = apr_hash_make(scratch);
+    sets = apr_array_make(scratch, 16, sizeof(struct acl_set *));
+    APR_ARRAY_PUSH(sets, struct acl_set *) = &new_acl->id;
 
     error = 1;
 
@@ -185,22 +373,12 @@ get_acl(MWK_REQ_CTXT *rc)
 
         lineno++;
 
-#if 0
-        if (rc->sconf->debug) {
-            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
-                         "mod_webkdc: %s: read line: [%s] "
-                         "file %s, line %d", mwk_func,
-                         line,
-                         rc->sconf->token_acl_path, lineno);
-        }
-#endif
-
         /* make sure line ends with a \n, if not it was truncated  */
         if (line[strlen(line)-1] != '\n') {
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
                          "mod_webkdc: %s: line too long, file %s, line %d",
                          mwk_func,
-                         rc->sconf->token_acl_path, lineno);
+                         sconf->token_acl_path, lineno);
             goto done;
         }
 
@@ -217,10 +395,10 @@ get_acl(MWK_REQ_CTXT *rc)
         type = apr_strtok(NULL, " \t\n", &last);
 
         if (type == NULL) {
-                ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
                              "mod_webkdc: %s: missing acl type "
                              "in file %s, line %d", mwk_func,
-                             rc->sconf->token_acl_path, lineno);
+                             sconf->token_acl_path, lineno);
                 goto done;
         }
 
@@ -230,46 +408,47 @@ get_acl(MWK_REQ_CTXT *rc)
 
             if (proxy_type == NULL ||
                 strcmp(proxy_type, "krb5") != 0) {
-                ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
                              "mod_webkdc: %s: invalid proxy type(%s) "
                              "in file %s, line %d", mwk_func,
                              proxy_type ? proxy_type : "null",
-                             rc->sconf->token_acl_path, lineno);
+                             sconf->token_acl_path, lineno);
                 goto done;
             }
 
             cred = apr_strtok(NULL, " \t\n", &last);
 
             if (cred == NULL) {
-                ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
                              "mod_webkdc: %s: missing cred "
                              "in file %s, line %d", mwk_func,
-                             rc->sconf->token_acl_path, lineno);
+                             sconf->token_acl_path, lineno);
                 goto done;
             }
 
-            if (rc->sconf->debug) {
-                ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
+            if (sconf->debug) {
+                ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
                              "mod_webkdc: %s: adding cred access: %s %s %s",
                              mwk_func, subject, proxy_type, cred);
             }
 
-            add_entry(rc, new_acl, subject, type, proxy_type, cred);
+            add_entry(new_acl, strings, sets, subject, type, proxy_type,
+                      cred);
 
         } else if (strcmp(type, "id") == 0) {
-            if (rc->sconf->debug) {
-                ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
+            if (sconf->debug) {
+                ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
                              "mod_webkdc: %s: adding id access: %s",
                              mwk_func, subject);
             }
 
-            add_entry(rc, new_acl, subject, type, NULL, NULL);
+            add_entry(new_acl, strings, sets, subject, type, NULL, NULL);
 
         } else {
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
                          "mod_webkdc: %s: unknown acl type(%s) "
                          "in file %s, line %d", mwk_func,
-                         type, rc->sconf->token_acl_path, lineno);
+                         type, sconf->token_acl_path, lineno);
             goto done;
         }
     }
@@ -277,43 +456,366 @@ get_acl(MWK_REQ_CTXT *rc)
     if (astatus == APR_EOF) {
         error = 0;
     } else {
-        log_apr_error(rc, astatus, mwk_func, "apr_file_gets",
-                      rc->sconf->token_acl_path);
+        log_apr_error(s, astatus, mwk_func, "apr_file_gets",
+                      sconf->token_acl_path);
         goto done;
     }
 
+    /* compile the wildcard entries of each subject set */
+    for (i = 0; i < sets->nelts; i++)
+        set_compile(s, sconf, APR_ARRAY_IDX(sets, i, struct acl_set *),
+                    acl_pool, scratch);
+
  done:
 
     apr_file_close(acl_file);
+    apr_pool_destroy(scratch);
 
-    /* if we had any errors, destroy new_acl, re-use old one if
-       it was set */
+    /* if we had any errors, destroy new_acl */
     if (error) {
         apr_pool_destroy(new_acl->pool);
         new_acl = NULL;
-        if (acl != NULL) {
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+        if (reload) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
                          "mod_webkdc: %s: couldn't load new acl file, "
                          "using previously cached acl",
                          mwk_func);
         }
-    } else {
-        /* free existing acl, set new one */
-        if (acl != NULL)
-            apr_pool_destroy(acl->pool);
-        acl = new_acl;
+    } else if (sconf->debug) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                     "mod_webkdc: %s: acl file loaded ok: %s",
+                     mwk_func,
+                     sconf->token_acl_path);
+    }
 
-        if (rc->sconf->debug) {
-            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
-                         "mod_webkdc: %s: acl file loaded ok: %s",
-                         mwk_func,
-                         rc->sconf->token_acl_path);
+    return new_acl;
+}
+
+
+/*
+ * Free the replaced ACLs that are no longer in use.  Nothing is freed while
+ * a request is between reading the published pointer and taking its
+ * reference, since it may have read a replaced ACL.  Once that count is
+ * zero, every request that saw a replaced ACL has counted its reference, and
+ * no new request can see it.
+ *
+ * Should only be called while holding the ACL mutex.
+ */
+static void
+free_retired(void)
+{
+    MWK_ACL **prev, *acl;
+
+    if (apr_atomic_read32(&acl_readers) != 0)
+        return;
+    prev = &retired;
+    while (*prev != NULL) {
+        acl = *prev;
+        if (apr_atomic_read32(&acl->refs) == 0) {
+            *prev = acl->next;
+            apr_pool_destroy(acl->pool);
+        } else {
+            prev = &acl->next;
         }
     }
+}
+
+
+/*
+ * Check whether the ACL file has changed since acl, the published ACL or NULL
+ * if there is none, was loaded and, if so or if there is no ACL yet, load and
+ * compile it.  Returns the new ACL, or NULL if the file hasn't changed or the
+ * new ACL failed to load, which is logged.  failed holds the modification
+ * time of the last file that failed to load and is updated, so that the
+ * errors for a bad file are logged once rather than at every check.  pool is
+ * used for temporary allocations.
+ *
+ * This touches no shared state, so it doesn't need the ACL mutex.  acl can
+ * only be retired by the caller, or when it is NULL, so it stays valid.
+ */
+static MWK_ACL *
+load_changed_acl(server_rec *s, struct config *sconf, MWK_ACL *acl,
+                 apr_time_t *failed, apr_pool_t *pool)
+{
+    MWK_ACL *new_acl;
+    const char *mwk_func="get_acl";
+    apr_status_t astatus;
+    apr_finfo_t finfo;
+
+    astatus = apr_stat(&finfo, sconf->token_acl_path, APR_FINFO_MTIME, pool);
+    if (astatus != APR_SUCCESS && acl != NULL) {
+        log_apr_error(s, astatus, mwk_func, "apr_stat",
+                      sconf->token_acl_path);
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "mod_webkdc: %s: couldn't stat acl file(%s), "
+                     "using previously cached acl",
+                     mwk_func, sconf->token_acl_path);
+        return NULL;
+    }
+    if (acl != NULL && finfo.mtime == acl->mtime)
+        return NULL;
+    if (acl != NULL && finfo.mtime == *failed)
+        return NULL;
+    new_acl = load_acl(s, sconf, pool,
+                       astatus == APR_SUCCESS ? finfo.mtime : 0, acl != NULL);
+    if (new_acl == NULL && acl != NULL)
+        *failed = finfo.mtime;
+    return new_acl;
+}
+
+
+/*
+ * Publish a newly loaded ACL in place of old, the ACL that was published when
+ * the load started, and retire old.  If a different ACL has been published
+ * since, which can only happen if there was none and a request loaded one,
+ * the new ACL is discarded instead, since the published one is as recent.
+ *
+ * Should only be called while holding the ACL mutex.
+ */
+static void
+publish_acl(server_rec *s, struct config *sconf, MWK_ACL *old,
+            MWK_ACL *new_acl)
+{
+    if (current_acl() != old) {
+        apr_pool_destroy(new_acl->pool);
+        return;
+    }
+    new_acl->generation = ++acl_generation;
+    new_acl->loaded = apr_time_now();
+    apr_atomic_xchgptr(&current, new_acl);
+    if (old != NULL) {
+        old->next = retired;
+        retired = old;
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s,
+                     "mod_webkdc: reloaded changed acl file %s",
+                     sconf->token_acl_path);
+    }
+}
 
+
+/*
+ * Check whether the ACL file has changed since the published ACL was loaded
+ * and, if so or if there is no ACL yet, load it and publish the result.  A
+ * new ACL that fails to load is logged and the old one is kept.  pool is
+ * used for temporary allocations.  This is used at startup and by requests;
+ * the reloader thread does the same without holding the mutex while loading.
+ *
+ * Should only be called while holding the ACL mutex.
+ */
+static void
+check_acl(server_rec *s, struct config *sconf, apr_pool_t *pool)
+{
+    MWK_ACL *acl, *new_acl;
+
+    acl_checked = apr_time_now();
+    free_retired();
+    acl = current_acl();
+    new_acl = load_changed_acl(s, sconf, acl, &acl_failed, pool);
+    if (new_acl != NULL)
+        publish_acl(s, sconf, acl, new_acl);
+}
+
+
+/*
+ * Pool cleanup that releases a request's reference to an ACL.
+ */
+static apr_status_t
+release_acl(void *data)
+{
+    MWK_ACL *acl = data;
+
+    apr_atomic_dec32(&acl->refs);
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Returns the ACL to use for this request, or NULL if no ACL could be
+ * loaded.  The request takes a reference to the published ACL the first
+ * time it needs it and keeps it until it's finished, so all checks for the
+ * same request see the same ACL.
+ *
+ * Changes to the ACL file are picked up by the reloader thread, so requests
+ * normally neither look at the file nor lock anything.  Only when there is no
+ * ACL at all, because it couldn't be loaded at startup, does a request try to
+ * load it.  Without threads, requests also check for changes, at most once
+ * per ACL_CHECK_INTERVAL.
+ */
+static MWK_ACL *
+get_acl(MWK_REQ_CTXT *rc)
+{
+    MWK_ACL *acl;
+
+    if (rc->acl != NULL)
+        return rc->acl;
+
+#if !APR_HAS_THREADS
+    if (apr_time_now() - acl_checked >= apr_time_from_sec(ACL_CHECK_INTERVAL))
+        check_acl(rc->r->server, rc->sconf, rc->r->pool);
+#endif
+
+    /*
+     * If there's no ACL, try to load it under the mutex.  Nothing is freed
+     * without the mutex, so the reference can be taken directly.
+     */
+    if (current_acl() == NULL) {
+        lock_acl();
+        if (current_acl() == NULL)
+            check_acl(rc->r->server, rc->sconf, rc->r->pool);
+        acl = current_acl();
+        if (acl != NULL)
+            apr_atomic_inc32(&acl->refs);
+        unlock_acl();
+        if (acl == NULL)
+            return NULL;
+    } else {
+        /*
+         * Otherwise, take a reference to the published ACL, counted as a
+         * reader until we have it so that it can't be freed in between.
+         */
+        apr_atomic_inc32(&acl_readers);
+        acl = current_acl();
+        apr_atomic_inc32(&acl->refs);
+        apr_atomic_dec32(&acl_readers);
+    }
+    apr_pool_cleanup_register(rc->r->pool, acl, release_acl,
+                              apr_pool_cleanup_null);
+    rc->acl = acl;
     return acl;
 }
 
+
+#if APR_HAS_THREADS
+
+/*
+ * The reloader thread.  Wakes up every ACL_CHECK_INTERVAL seconds, or when
+ * told to stop, and reloads the ACL if the file has changed.  The ACL mutex
+ * is held while waiting and for the bookkeeping before and after a load, but
+ * not while the file is read and compiled, so a request that needs the mutex
+ * (or the status page) never waits for a reload.
+ */
+static void * APR_THREAD_FUNC
+reload_thread(apr_thread_t *thread, void *data)
+{
+    server_rec *s = data;
+    struct config *sconf;
+    apr_pool_t *pool;
+    MWK_ACL *acl, *new_acl;
+    apr_time_t failed;
+
+    sconf = ap_get_module_config(s->module_config, &webkdc_module);
+    apr_pool_create(&pool, NULL);
+    apr_thread_mutex_lock(acl_mutex);
+    while (!acl_stopping) {
+        apr_thread_cond_timedwait(acl_cond, acl_mutex,
+                                  apr_time_from_sec(ACL_CHECK_INTERVAL));
+        if (acl_stopping)
+            break;
+        acl_checked = apr_time_now();
+        free_retired();
+        acl = current_acl();
+        failed = acl_failed;
+        apr_thread_mutex_unlock(acl_mutex);
+
+        /* Load and compile any new ACL without the mutex. */
+        new_acl = load_changed_acl(s, sconf, acl, &failed, pool);
+        apr_pool_clear(pool);
+
+        /* Take the mutex again to record the result and publish. */
+        apr_thread_mutex_lock(acl_mutex);
+        acl_failed = failed;
+        if (new_acl != NULL)
+            publish_acl(s, sconf, acl, new_acl);
+    }
+    apr_thread_mutex_unlock(acl_mutex);
+    apr_pool_destroy(pool);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+
+/*
+ * Pool cleanup that stops the reloader thread and waits for it to exit.  This
+ * is registered as a pre-cleanup so that it runs before the thread's pool, a
+ * subpool of the child pool, is destroyed.
+ */
+static apr_status_t
+stop_reloader(void *data UNUSED)
+{
+    apr_status_t status;
+
+    apr_thread_mutex_lock(acl_mutex);
+    acl_stopping = true;
+    apr_thread_cond_signal(acl_cond);
+    apr_thread_mutex_unlock(acl_mutex);
+    apr_thread_join(&status, acl_reloader);
+    acl_reloader = NULL;
+    return APR_SUCCESS;
+}
+
+#endif /* APR_HAS_THREADS */
+
+
+/*
+ * Called once per child to load the token ACL for the first time and start
+ * the thread that reloads it when it changes.  The ACL is per-process and
+ * comes from the WebKdcTokenAcl setting of the main server.
+ */
+void
+mwk_acl_init(server_rec *s, apr_pool_t *pool)
+{
+    struct config *sconf;
+    apr_pool_t *temp;
+#if APR_HAS_THREADS
+    apr_status_t astatus;
+    char errbuff[512];
+
+    apr_thread_mutex_create(&acl_mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+    apr_thread_cond_create(&acl_cond, pool);
+#endif
+
+    sconf = ap_get_module_config(s->module_config, &webkdc_module);
+    apr_pool_create(&temp, pool);
+    check_acl(s, sconf, temp);
+    apr_pool_destroy(temp);
+
+#if APR_HAS_THREADS
+    astatus = apr_thread_create(&acl_reloader, NULL, reload_thread, s, pool);
+    if (astatus != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "mod_webkdc: mwk_acl_init: apr_thread_create: %s (%d), "
+                     "changes to %s will not be noticed",
+                     apr_strerror(astatus, errbuff, sizeof(errbuff)-1),
+                     astatus, sconf->token_acl_path);
+        return;
+    }
+    apr_pool_pre_cleanup_register(pool, NULL, stop_reloader);
+#endif
+}
+
+
+/*
+ * Fill in information about the current ACL for the status page.  Returns
+ * false if no ACL has been loaded.
+ */
+bool
+mwk_acl_info(struct mwk_acl_info *info)
+{
+    MWK_ACL *acl;
+
+    memset(info, 0, sizeof(*info));
+    lock_acl();
+    acl = current_acl();
+    if (acl != NULL) {
+        info->generation = acl->generation;
+        info->loaded = acl->loaded;
+        info->mtime = acl->mtime;
+    }
+    info->checked = acl_checked;
+    unlock_acl();
+    return acl != NULL;
+}
+
 int
 mwk_has_service_access(MWK_REQ_CTXT *rc,
                       const char *subject)
@@ -326,45 +828,11 @@ int
 mwk_has_id_access(MWK_REQ_CTXT *rc,
                   const char *subject)
 {
-    char *key = apr_pstrcat(rc->r->pool, "id;", subject, NULL);
-    apr_hash_index_t *hi;
-    void *p;
     int allowed;
     MWK_ACL *acl;
 
-    allowed = 0;
-
-    mwk_lock_mutex(rc, MWK_MUTEX_TOKENACL); /****** LOCKING! ************/
-
     acl = get_acl(rc);
-    if (acl == NULL)
-        goto done;
-
-    /* check non-wild first */
-    p = apr_hash_get(acl->entries, key, APR_HASH_KEY_STRING);
-    if (p != NULL) {
-        allowed = 1;
-        goto done;
-    }
-
-    /* enumerate through all the wild entries */
-    for (hi = apr_hash_first(rc->r->pool, acl->wild_entries); hi;
-         hi = apr_hash_next(hi)) {
-        const void *vhkey;
-        const char *hkey;
-
-        apr_hash_this(hi, &vhkey, NULL, &p);
-        hkey = vhkey;
-        if (strncmp(hkey, "id;", 3) == 0) {
-            if (ap_strcmp_match(subject, hkey+3) == 0) {
-                allowed = 1;
-                goto done;
-            }
-        }
-    }
-
- done:
-    mwk_unlock_mutex(rc, MWK_MUTEX_TOKENACL); /****** UNLOCKING! ************/
+    allowed = (acl != NULL && set_match(&acl->id, subject));
 
     if (rc->sconf->debug) {
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
@@ -380,51 +848,17 @@ mwk_has_proxy_access(MWK_REQ_CTXT *rc,
                      const char *subject,
                      const char *proxy_type)
 {
-    apr_hash_index_t *hi;
-    void *p;
-    char *prefix, *key;
-    int plen, allowed;
+    struct acl_set *set;
+    int allowed;
     MWK_ACL *acl;
 
     allowed = 0;
-
-    mwk_lock_mutex(rc, MWK_MUTEX_TOKENACL); /****** LOCKING! ************/
-
     acl = get_acl(rc);
-    if (acl == NULL)
-        goto done;
-
-    prefix = apr_pstrcat(rc->r->pool, "cred;", proxy_type, ";", NULL);
-    key = apr_pstrcat(rc->r->pool, prefix, subject, NULL);
-
-    /* check non-wild first */
-    p = apr_hash_get(acl->entries, key, APR_HASH_KEY_STRING);
-    if (p != NULL) {
-        allowed = 1;
-        goto done;
-    }
-
-    plen = strlen(prefix);
-
-    /* enumerate through all the wild entries */
-    for (hi = apr_hash_first(rc->r->pool, acl->wild_entries); hi;
-         hi = apr_hash_next(hi)) {
-        const void *vhkey;
-        const char *hkey;
-
-        apr_hash_this(hi, &vhkey, NULL, &p);
-        hkey = vhkey;
-        if (strncmp(hkey, prefix, plen) == 0) {
-            if (ap_strcmp_match(subject, hkey+plen) == 0) {
-                allowed = 1;
-                goto done;
-            }
-        }
+    if (acl != NULL) {
+        set = apr_hash_get(acl->proxy, proxy_type, APR_HASH_KEY_STRING);
+        allowed = set_match(set, subject);
     }
 
- done:
-    mwk_unlock_mutex(rc, MWK_MUTEX_TOKENACL); /****** UNLOCKING! ************/
-
     if (rc->sconf->debug) {
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
                      "mod_webkdc: mwk_has_proxy_access: %s, %s => %d",
@@ -440,63 +874,21 @@ mwk_has_cred_access(MWK_REQ_CTXT *rc,
                     const char *cred_type,
                     const char *cred)
 {
-    apr_hash_index_t *hi;
-    void *va;
-    apr_array_header_t *a;
-    char *prefix, *key;
-    int plen, i, allowed;
+    apr_hash_t *creds;
+    struct acl_set *set;
+    int allowed;
     MWK_ACL *acl;
 
     allowed = 0;
-
-    mwk_lock_mutex(rc, MWK_MUTEX_TOKENACL); /****** LOCKING! ************/
-
     acl = get_acl(rc);
-    if (acl == NULL)
-        goto done;
-
-    prefix = apr_pstrcat(rc->r->pool, "cred;", cred_type, ";", NULL);
-    key = apr_pstrcat(rc->r->pool, prefix, subject, NULL);
-
-    /* check non-wild first */
-    a = apr_hash_get(acl->entries, key, APR_HASH_KEY_STRING);
-    if (a != NULL) {
-        char **p = (char**)a->elts;
-        for (i=0; i < a->nelts; i++) {
-            if (strcmp(p[i], cred) == 0) {
-                allowed = 1;
-                goto done;
-            }
-        }
-    }
-
-    plen = strlen(prefix);
-
-    /* enumerate through all the wild entries */
-    for (hi = apr_hash_first(rc->r->pool, acl->wild_entries); hi;
-         hi = apr_hash_next(hi)) {
-        const void *vhkey;
-        const char *hkey;
-
-        apr_hash_this(hi, &vhkey, NULL, &va);
-        hkey = vhkey;
-        a = va;
-        if (strncmp(hkey, prefix, plen) == 0) {
-            if (ap_strcmp_match(subject, hkey + plen) == 0) {
-                char **p = (char **) a->elts;
-                for (i = 0; i < a->nelts; i++) {
-                    if (strcmp(p[i], cred) == 0) {
-                        allowed = 1;
-                        goto done;
-                    }
-                }
-            }
+    if (acl != NULL) {
+        creds = apr_hash_get(acl->cred, cred_type, APR_HASH_KEY_STRING);
+        if (creds != NULL) {
+            set = apr_hash_get(creds, cred, APR_HASH_KEY_STRING);
+            allowed = set_match(set, subject);
         }
     }
 
- done:
-    mwk_unlock_mutex(rc, MWK_MUTEX_TOKENACL); /****** UNLOCKING! ************/
-
     if (rc->sconf->debug) {
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
                      "mod_webkdc: mwk_has_cred_access: %s, %s, %s => %d",
@@ -18,6 +18,8 @@
 #include <portable/apache.h>
 #include <portable/apr.h>
 
+#include <errno.h>
+
 #include <modules/webkdc/mod_webkdc.h>
 #include <util/macros.h>
 #include <webauth/basic.h>
@@ -54,15 +56,23 @@ DIRD(KeyringAutoUpdate,   "whether to automatically update keyring", bool, true)
 DIRD(KeyringKeyLifetime,  "lifetime of keys we create", int, 60 * 60 * 24 * 30)
 DIRN(Keytab,              "path to the Kerberos keytab file")
 DIRN(LocalRealms,         "realms to strip, \"none\", or \"local\"")
+DIRD(LoginDeadline,       "time limit for concurrent login calls", int, 0)
 DIRD(LoginTimeLimit,      "time limit for completing login", int, 60 * 5)
 DIRN(PermittedRealms,     "list of realms permitted for authentication")
 DIRN(ProxyTokenLifetime,  "lifetime of webkdc-proxy tokens")
 DIRN(ServiceTokenLifetime,"lifetime of webkdc-service tokens")
+DIRD(TicketCacheShared,   "whether to share the ticket cache", bool, false)
+DIRD(TicketCacheSize,     "number of service tickets to cache", int, 0)
 DIRN(TokenAcl,            "path to the token ACL file")
 DIRD(TokenMaxTTL,         "max lifetime of recent tokens", int, 60 * 5)
+DIRD(UserInfoCacheSize,   "number of user information results kept", int, 1024)
+DIRD(UserInfoCacheTTL,    "how long to cache user information results", int, 0)
 DIRN(UserInfoIgnoreFail,  "ignore failure to get user information")
 DIRN(UserInfoJSON,        "whether to use JSON protocol for user information")
+DIRD(UserInfoPoolSize,    "idle user information connections to keep", int, 0)
+DIRD(UserInfoPoolTimeout, "idle time before closing a connection", int, 30)
 DIRN(UserInfoPrincipal,   "authentication identity of the information service")
+DIRD(UserInfoSpeculative, "start user info calls before logins", bool, false)
 DIRD(UserInfoTimeout,     "timeout for user information queries", int, 30)
 DIRN(UserInfoURL,         "URL to user information service")
 
@@ -76,15 +86,23 @@ enum {
     E_KeyringKeyLifetime,
     E_Keytab,
     E_LocalRealms,
+    E_LoginDeadline,
     E_LoginTimeLimit,
     E_PermittedRealms,
     E_ProxyTokenLifetime,
     E_ServiceTokenLifetime,
+    E_TicketCacheShared,
+    E_TicketCacheSize,
     E_TokenAcl,
     E_TokenMaxTTL,
+    E_UserInfoCacheSize,
+    E_UserInfoCacheTTL,
     E_UserInfoIgnoreFail,
     E_UserInfoJSON,
+    E_UserInfoPoolSize,
+    E_UserInfoPoolTimeout,
     E_UserInfoPrincipal,
+    E_UserInfoSpeculative,
     E_UserInfoTimeout,
     E_UserInfoURL
 };
@@ -140,9 +158,17 @@ webkdc_config_create(apr_pool_t *pool, server_rec *s UNUSED)
     sconf = apr_pcalloc(pool, sizeof(struct config));
     sconf->keyring_auto_update = DF_KeyringAutoUpdate;
     sconf->key_lifetime        = DF_KeyringKeyLifetime;
+    sconf->login_deadline      = DF_LoginDeadline;
     sconf->login_time_limit    = DF_LoginTimeLimit;
+    sconf->ticket_cache_shared = DF_TicketCacheShared;
+    sconf->ticket_cache_size   = DF_TicketCacheSize;
     sconf->token_max_ttl       = DF_TokenMaxTTL;
     sconf->userinfo_timeout    = DF_UserInfoTimeout;
+    sconf->userinfo_pool_size  = DF_UserInfoPoolSize;
+    sconf->userinfo_cache_size = DF_UserInfoCacheSize;
+    sconf->userinfo_cache_ttl  = DF_UserInfoCacheTTL;
+    sconf->userinfo_pool_idle  = DF_UserInfoPoolTimeout;
+    sconf->userinfo_speculative = DF_UserInfoSpeculative;
     sconf->local_realms        = apr_array_make(pool, 0, sizeof(const char *));
     sconf->permitted_realms    = apr_array_make(pool, 0, sizeof(const char *));
     sconf->kerberos_factors    = apr_array_make(pool, 0, sizeof(const char *));
@@ -178,12 +204,20 @@ webkdc_config_merge(apr_pool_t *pool, void *basev, void *overv)
     MERGE_SET(userinfo_timeout);
     MERGE_SET(userinfo_json);
     MERGE_SET(userinfo_ignore_fail);
+    MERGE_SET(userinfo_pool_size);
+    MERGE_SET(userinfo_pool_idle);
+    MERGE_SET(userinfo_cache_size);
+    MERGE_SET(userinfo_cache_ttl);
+    MERGE_SET(userinfo_speculative);
     MERGE_SET(debug);
     MERGE_SET(keyring_auto_update);
     MERGE_SET(key_lifetime);
+    MERGE_SET(login_deadline);
     MERGE_SET(login_time_limit);
     MERGE_SET(proxy_lifetime);
     MERGE_INT(service_lifetime);
+    MERGE_SET(ticket_cache_shared);
+    MERGE_SET(ticket_cache_size);
     MERGE_SET(token_max_ttl);
     MERGE_ARRAY(permitted_realms);
     MERGE_ARRAY(kerberos_factors);
@@ -273,6 +307,26 @@ parse_interval(cmd_parms *cmd, const char *arg, unsigned long *value)
 }
 
 
+/*
+ * Utility function for parsing a number.  Returns an error string or NULL
+ * on success.
+ */
+static const char *
+parse_number(cmd_parms *cmd, const char *arg, unsigned long *value)
+{
+    long result;
+    char *end;
+
+    errno = 0;
+    result = strtol(arg, &end, 10);
+    if (result < 0 || *end != '\0' || errno != 0)
+        return apr_psprintf(cmd->pool, "Invalid number \"%s\" for %s", arg,
+                            cmd->directive->directive);
+    *value = result;
+    return NULL;
+}
+
+
 /*
  * Utility function for parsing a user information service URL.  This also
  * does validation of the URL and the protocol to ensure that it represents a
@@ -358,6 +412,11 @@ cfg_str(cmd_parms *cmd, void *mconf UNUSED, const char *arg)
         realm = apr_array_push(sconf->local_realms);
         *realm = apr_pstrdup(cmd->pool, arg);
         break;
+    case E_LoginDeadline:
+        err = parse_interval(cmd, arg, &sconf->login_deadline);
+        if (err == NULL)
+            sconf->login_deadline_set = true;
+        break;
     case E_LoginTimeLimit:
         err = parse_interval(cmd, arg, &sconf->login_time_limit);
         if (err == NULL)
@@ -375,6 +434,11 @@ cfg_str(cmd_parms *cmd, void *mconf UNUSED, const char *arg)
     case E_ServiceTokenLifetime:
         err = parse_interval(cmd, arg, &sconf->service_lifetime);
         break;
+    case E_TicketCacheSize:
+        err = parse_number(cmd, arg, &sconf->ticket_cache_size);
+        if (err == NULL)
+            sconf->ticket_cache_size_set = true;
+        break;
     case E_TokenAcl:
         sconf->token_acl_path = ap_server_root_relative(cmd->pool, arg);
         break;
@@ -396,6 +460,26 @@ cfg_str(cmd_parms *cmd, void *mconf UNUSED, const char *arg)
         if (err == NULL)
             sconf->userinfo_timeout_set = true;
         break;
+    case E_UserInfoCacheSize:
+        err = parse_number(cmd, arg, &sconf->userinfo_cache_size);
+        if (err == NULL)
+            sconf->userinfo_cache_size_set = true;
+        break;
+    case E_UserInfoCacheTTL:
+        err = parse_interval(cmd, arg, &sconf->userinfo_cache_ttl);
+        if (err == NULL)
+            sconf->userinfo_cache_ttl_set = true;
+        break;
+    case E_UserInfoPoolSize:
+        err = parse_number(cmd, arg, &sconf->userinfo_pool_size);
+        if (err == NULL)
+            sconf->userinfo_pool_size_set = true;
+        break;
+    case E_UserInfoPoolTimeout:
+        err = parse_interval(cmd, arg, &sconf->userinfo_pool_idle);
+        if (err == NULL)
+            sconf->userinfo_pool_idle_set = true;
+        break;
     case E_KerberosFactors:
         factor = apr_array_push(sconf->kerberos_factors);
         *factor = apr_pstrdup(cmd->pool, arg);
@@ -458,6 +542,10 @@ cfg_flag(cmd_parms *cmd, void *mconfig UNUSED, int flag)
         sconf->userinfo_json = flag;
         sconf->userinfo_json_set = true;
         break;
+    case E_UserInfoSpeculative:
+        sconf->userinfo_speculative = flag;
+        sconf->userinfo_speculative_set = true;
+        break;
     case E_Debug:
         sconf->debug = flag;
         sconf->debug_set = 1;
@@ -466,6 +554,10 @@ cfg_flag(cmd_parms *cmd, void *mconfig UNUSED, int flag)
         sconf->keyring_auto_update = flag;
         sconf->keyring_auto_update_set = true;
         break;
+    case E_TicketCacheShared:
+        sconf->ticket_cache_shared = flag;
+        sconf->ticket_cache_shared_set = true;
+        break;
     default:
         err = unknown_error(cmd, directive, "cfg_flag");
         break;
@@ -492,15 +584,23 @@ const command_rec webkdc_cmds[] = {
     DIRECTIVE(AP_INIT_FLAG,    cfg_flag,  KeyringAutoUpdate),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   KeyringKeyLifetime),
     DIRECTIVE(AP_INIT_ITERATE, cfg_str,   LocalRealms),
+    DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   LoginDeadline),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   LoginTimeLimit),
     DIRECTIVE(AP_INIT_ITERATE, cfg_str,   PermittedRealms),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   ProxyTokenLifetime),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   ServiceTokenLifetime),
+    DIRECTIVE(AP_INIT_FLAG,    cfg_flag,  TicketCacheShared),
+    DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   TicketCacheSize),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   TokenAcl),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   TokenMaxTTL),
+    DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   UserInfoCacheSize),
+    DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   UserInfoCacheTTL),
     DIRECTIVE(AP_INIT_FLAG,    cfg_flag,  UserInfoIgnoreFail),
     DIRECTIVE(AP_INIT_FLAG,    cfg_flag,  UserInfoJSON),
+    DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   UserInfoPoolSize),
+    DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   UserInfoPoolTimeout),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   UserInfoPrincipal),
+    DIRECTIVE(AP_INIT_FLAG,    cfg_flag,  UserInfoSpeculative),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   UserInfoTimeout),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   UserInfoURL),
     { NULL, { NULL }, NULL, OR_NONE, RAW_ARGS, NULL }
@@ -0,0 +1,275 @@
+/*
+ * Wildcard pattern sets for the token ACL.
+ *
+ * The token ACL may have many wildcard subjects granting the same thing, and
+ * trying each in turn with ap_strcmp_match on every request gets slow as the
+ * ACL grows.  Instead, all of the patterns in a set are compiled together
+ * into a DFA over the bytes of the subject, so matching is one pass over the
+ * subject no matter how many patterns there are.  Some patterns can need a
+ * DFA exponential in their length, so if the DFA would be larger than a
+ * given limit, the set falls back on matching each pattern in turn.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/apache.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+
+#include <apr_hash.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include <modules/webkdc/mod_webkdc.h>
+
+/* Transition target meaning that no pattern can match any more. */
+#define DFA_DEAD UINT_MAX
+
+/*
+ * A DFA matching any of a set of wildcard patterns.  Bytes that appear
+ * literally in some pattern each get their own class, and all other bytes
+ * share class 0.  State 0 is the start state, and next is indexed by state
+ * times nclasses plus class.
+ */
+struct mwk_glob_dfa {
+    unsigned char classes[256];
+    unsigned int nclasses;
+    unsigned int nstates;
+    unsigned int *next;
+    unsigned char *accept;
+};
+
+/* State for the construction of a DFA from a set of patterns. */
+struct dfa_build {
+    apr_pool_t *pool;                   /* Scratch pool. */
+    const unsigned char *chars;         /* All patterns, nul-separated. */
+    unsigned int *mark;                 /* Last stamp for each position. */
+    unsigned int stamp;
+    unsigned int *set;                  /* Position set being built. */
+    size_t nset;
+    apr_hash_t *ids;                    /* Position sets to state numbers. */
+    apr_array_header_t *states;         /* States as position sets. */
+};
+
+/* A DFA state during construction. */
+struct dfa_state {
+    unsigned int *positions;
+    size_t count;
+};
+
+
+/*
+ * Add a pattern position to the position set being built, along with the
+ * positions after any stars that follow it, since a star may match nothing.
+ */
+static void
+dfa_add(struct dfa_build *build, size_t position)
+{
+    for (;;) {
+        if (build->mark[position] != build->stamp) {
+            build->mark[position] = build->stamp;
+            build->set[build->nset++] = position;
+        }
+        if (build->chars[position] != '*')
+            break;
+        position++;
+    }
+}
+
+
+/*
+ * Comparison function for sorting a position set.
+ */
+static int
+compare_positions(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *) a;
+    unsigned int y = *(const unsigned int *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Return the state number for the position set that was just built, adding
+ * a new state if that set hasn't been seen before.
+ */
+static unsigned int
+dfa_intern(struct dfa_build *build)
+{
+    struct dfa_state *state;
+    unsigned int *id;
+    size_t length;
+
+    if (build->nset == 0)
+        return DFA_DEAD;
+    qsort(build->set, build->nset, sizeof(unsigned int), compare_positions);
+    length = build->nset * sizeof(unsigned int);
+    id = apr_hash_get(build->ids, build->set, length);
+    if (id != NULL)
+        return *id;
+    state = apr_array_push(build->states);
+    state->positions = apr_pmemdup(build->pool, build->set, length);
+    state->count = build->nset;
+    id = apr_palloc(build->pool, sizeof(unsigned int));
+    *id = build->states->nelts - 1;
+    apr_hash_set(build->ids, state->positions, length, id);
+    return *id;
+}
+
+
+/*
+ * Compile an array of wildcard patterns into a DFA that accepts exactly the
+ * strings matched by any of them according to ap_strcmp_match: * matches
+ * any sequence of characters, ? matches any one character, and everything
+ * else matches only itself.  The DFA is allocated from pool and scratch
+ * space from scratch.  Returns NULL if the DFA would have more than
+ * max_cells transitions.
+ *
+ * This is the usual subset construction.  A position is an index into the
+ * concatenation of the patterns with their nul terminators, where a nul
+ * position means the pattern has fully matched.
+ */
+static struct mwk_glob_dfa *
+compile_dfa(apr_pool_t *pool, apr_pool_t *scratch,
+            const apr_array_header_t *patterns, size_t max_cells)
+{
+    struct mwk_glob_dfa *dfa;
+    struct dfa_build build;
+    struct dfa_state state;
+    apr_array_header_t *next, *accept;
+    unsigned char rep[256], *chars, c;
+    size_t npos, length, max_states, i, s;
+    unsigned int cls;
+
+    /* Concatenate the patterns and assign byte classes. */
+    npos = 0;
+    for (i = 0; i < (size_t) patterns->nelts; i++)
+        npos += strlen(APR_ARRAY_IDX(patterns, i, const char *)) + 1;
+    chars = apr_palloc(scratch, npos);
+    dfa = apr_pcalloc(pool, sizeof(struct mwk_glob_dfa));
+    dfa->nclasses = 1;
+    rep[0] = '*';
+    npos = 0;
+    for (i = 0; i < (size_t) patterns->nelts; i++) {
+        const char *pattern = APR_ARRAY_IDX(patterns, i, const char *);
+
+        length = strlen(pattern) + 1;
+        memcpy(chars + npos, pattern, length);
+        npos += length;
+    }
+    for (i = 0; i < npos; i++) {
+        c = chars[i];
+        if (c == '\0' || c == '*' || c == '?' || dfa->classes[c] != 0)
+            continue;
+        dfa->classes[c] = dfa->nclasses;
+        rep[dfa->nclasses++] = c;
+    }
+    max_states = max_cells / dfa->nclasses;
+
+    /* Set up the construction state and the start state. */
+    memset(&build, 0, sizeof(build));
+    build.pool = scratch;
+    build.chars = chars;
+    build.mark = apr_pcalloc(scratch, npos * sizeof(unsigned int));
+    build.set = apr_palloc(scratch, npos * sizeof(unsigned int));
+    build.ids = apr_hash_make(scratch);
+    build.states = apr_array_make(scratch, 64, sizeof(struct dfa_state));
+    next = apr_array_make(scratch, 64 * dfa->nclasses, sizeof(unsigned int));
+    accept = apr_array_make(scratch, 64, sizeof(unsigned char));
+    build.stamp = 1;
+    for (i = 0; i < npos; i++)
+        if (i == 0 || chars[i - 1] == '\0')
+            dfa_add(&build, i);
+    dfa_intern(&build);
+
+    /* Work through the states, which adds new ones as they're found. */
+    for (s = 0; s < (size_t) build.states->nelts; s++) {
+        state = APR_ARRAY_IDX(build.states, s, struct dfa_state);
+        APR_ARRAY_PUSH(accept, unsigned char) = 0;
+        for (i = 0; i < state.count; i++)
+            if (chars[state.positions[i]] == '\0')
+                APR_ARRAY_IDX(accept, s, unsigned char) = 1;
+        for (cls = 0; cls < dfa->nclasses; cls++) {
+            build.stamp++;
+            build.nset = 0;
+            for (i = 0; i < state.count; i++) {
+                c = chars[state.positions[i]];
+                if (c == '*')
+                    dfa_add(&build, state.positions[i]);
+                else if (c == '?' || (c != '\0' && c == rep[cls]))
+                    dfa_add(&build, state.positions[i] + 1);
+            }
+            APR_ARRAY_PUSH(next, unsigned int) = dfa_intern(&build);
+            if ((size_t) build.states->nelts > max_states)
+                return NULL;
+        }
+    }
+
+    /* Copy the tables out of the scratch pool. */
+    dfa->nstates = build.states->nelts;
+    dfa->next = apr_pmemdup(pool, next->elts,
+                            next->nelts * sizeof(unsigned int));
+    dfa->accept = apr_pmemdup(pool, accept->elts, accept->nelts);
+    return dfa;
+}
+
+
+/*
+ * Run a DFA over a subject and return whether any of its patterns match.
+ */
+static bool
+dfa_match(const struct mwk_glob_dfa *dfa, const char *subject)
+{
+    const unsigned char *p;
+    unsigned int state = 0;
+
+    for (p = (const unsigned char *) subject; *p != '\0'; p++) {
+        state = dfa->next[state * dfa->nclasses + dfa->classes[*p]];
+        if (state == DFA_DEAD)
+            return false;
+    }
+    return dfa->accept[state];
+}
+
+
+/*
+ * Compile an array of wildcard patterns into a pattern set allocated from
+ * pool, using scratch for temporary space.  The patterns themselves are not
+ * copied.  If there are no patterns or the DFA would have more than
+ * max_cells transitions, the set has no DFA and its patterns will be matched
+ * one at a time.
+ */
+struct mwk_glob_set *
+mwk_glob_compile(apr_pool_t *pool, apr_pool_t *scratch,
+                 const apr_array_header_t *patterns, size_t max_cells)
+{
+    struct mwk_glob_set *set;
+
+    set = apr_pcalloc(pool, sizeof(struct mwk_glob_set));
+    set->patterns = patterns;
+    if (patterns->nelts > 0)
+        set->dfa = compile_dfa(pool, scratch, patterns, max_cells);
+    return set;
+}
+
+
+/*
+ * Return whether a subject matches any of the patterns in a set.
+ */
+bool
+mwk_glob_match(const struct mwk_glob_set *set, const char *subject)
+{
+    const char *pattern;
+    int i;
+
+    if (set->dfa != NULL)
+        return dfa_match(set->dfa, subject);
+    for (i = 0; i < set->patterns->nelts; i++) {
+        pattern = APR_ARRAY_IDX(set->patterns, i, const char *);
+        if (ap_strcmp_match(subject, pattern) == 0)
+            return true;
+    }
+    return false;
+}
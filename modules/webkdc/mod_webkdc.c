@@ -93,6 +93,84 @@ log_escape(MWK_REQ_CTXT *rc, const char *msg)
     return q;
 }
 
+/*
+ * The functions below write the response, either as XML or in the compact
+ * encoding, so that the handlers don't need to know which the client asked
+ * for.  The encoding is done by the writer in xml.c.
+ */
+
+/*
+ * Write callback for the response writer, passing output to Apache.
+ */
+static void
+write_response(void *data, const char *output, size_t length)
+{
+    ap_rwrite(output, length, data);
+}
+
+
+/*
+ * Start an element.  Its attributes, if any, must be written next.
+ */
+static void
+out_start(MWK_REQ_CTXT *rc, const char *name)
+{
+    mwk_xml_start(&rc->out, name);
+}
+
+
+/*
+ * Add an attribute to the element just started.
+ */
+static void
+out_attr(MWK_REQ_CTXT *rc, const char *name, const char *value)
+{
+    mwk_xml_attr(&rc->out, name, value);
+}
+
+
+/*
+ * Add text to the current element.
+ */
+static void
+out_text(MWK_REQ_CTXT *rc, const char *text)
+{
+    mwk_xml_text(&rc->out, text);
+}
+
+
+/*
+ * End the current element, whose name is needed for XML.
+ */
+static void
+out_end(MWK_REQ_CTXT *rc, const char *name)
+{
+    mwk_xml_end(&rc->out, name);
+}
+
+
+/*
+ * Write an element containing only text.
+ */
+static void
+out_element(MWK_REQ_CTXT *rc, const char *name, const char *text)
+{
+    out_start(rc, name);
+    out_text(rc, text);
+    out_end(rc, name);
+}
+
+
+/*
+ * Write an element containing only a number.
+ */
+static void
+out_number(MWK_REQ_CTXT *rc, const char *name, unsigned long number)
+{
+    out_element(rc, name, apr_psprintf(rc->r->pool, "%lu", number));
+}
+
+
 /*
  * generate <errorResponse> message from error stored in rc
  */
@@ -111,13 +189,10 @@ generate_errorResponse(MWK_REQ_CTXT *rc)
         rc->error_message ="<this shouldn't be happening!>";
     }
 
-    ap_rvputs(rc->r,
-              "<errorResponse><errorCode>",
-              ec_buff,
-              "</errorCode><errorMessage>",
-              apr_xml_quote_string(rc->r->pool, rc->error_message, 0),
-              "</errorMessage></errorResponse>",
-              NULL);
+    out_start(rc, "errorResponse");
+    out_element(rc, "errorCode", ec_buff);
+    out_element(rc, "errorMessage", rc->error_message);
+    out_end(rc, "errorResponse");
     ap_rflush(rc->r);
 
     if (rc->need_to_log) {
@@ -160,7 +235,8 @@ unknown_element(MWK_REQ_CTXT *rc,
 
 /*
  * concat all the text pieces together and return data, or
- * NULL if an error occurred.
+ * NULL if an error occurred.  The request parser always produces a single
+ * piece, allocated from the request pool, which is returned as is.
  */
 static char *
 get_elem_text(MWK_REQ_CTXT *rc, apr_xml_elem *e, const char *mwk_func)
@@ -168,7 +244,11 @@ get_elem_text(MWK_REQ_CTXT *rc, apr_xml_elem *e, const char *mwk_func)
     MWK_STRING string;
     mwk_init_string(&string, rc->r->pool);
 
-    if (e->first_cdata.first &&
+    if (e->first_cdata.first != NULL
+        && e->first_cdata.first->next == NULL
+        && e->first_cdata.first->text != NULL)
+        string.data = (char *) e->first_cdata.first->text;
+    else if (e->first_cdata.first &&
         e->first_cdata.first->text) {
         apr_text *t;
          for (t = e->first_cdata.first; t != NULL; t = t->next) {
@@ -1169,31 +1249,22 @@ handle_getTokensRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
     }
 
     /* if we got here, we made it! */
-    ap_rvputs(rc->r, "<getTokensResponse><tokens>", NULL);
+    out_start(rc, "getTokensResponse");
+    out_start(rc, "tokens");
 
     for (i = 0; i < num_tokens; i++) {
         if (i==0)
             *subject_out = (char*)rtokens[0].subject;
 
-        if (rtokens[i].id != NULL) {
-            ap_rprintf(rc->r, "<token id=\"%s\">",
-                        apr_xml_quote_string(rc->r->pool, rtokens[i].id, 1));
-        } else {
-            ap_rvputs(rc->r, "<token>", NULL);
-        }
-        /* don't have to quote these, since they are base64'd data
-           or numeric strings */
-        ap_rvputs(rc->r,"<tokenData>", rtokens[i].token_data,
-                  "</tokenData>", NULL);
-        if (rtokens[i].session_key) {
-            ap_rvputs(rc->r,"<sessionKey>", rtokens[i].session_key,
-                  "</sessionKey>", NULL);
-        }
-        if (rtokens[i].expires) {
-            ap_rvputs(rc->r,"<expires>", rtokens[i].expires,
-                      "</expires>", NULL);
-        }
-        ap_rvputs(rc->r, "</token>", NULL);
+        out_start(rc, "token");
+        if (rtokens[i].id != NULL)
+            out_attr(rc, "id", rtokens[i].id);
+        out_element(rc, "tokenData", rtokens[i].token_data);
+        if (rtokens[i].session_key)
+            out_element(rc, "sessionKey", rtokens[i].session_key);
+        if (rtokens[i].expires)
+            out_element(rc, "expires", rtokens[i].expires);
+        out_end(rc, "token");
 
 
         ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, rc->r->server,
@@ -1204,7 +1275,8 @@ handle_getTokensRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
                      rtokens[i].subject,
                      rtokens[i].info);
     }
-    ap_rvputs(rc->r, "</tokens></getTokensResponse>", NULL);
+    out_end(rc, "tokens");
+    out_end(rc, "getTokensResponse");
     ap_rflush(rc->r);
 
     return MWK_OK;
@@ -1480,8 +1552,8 @@ parse_requestInfo(MWK_REQ_CTXT *rc, apr_xml_elem *e,
 
 
 /*
- * Given the request context, an XML tag, and an array of const char *, print
- * out the contents of the array as a series of that XML element.  If the
+ * Given the request context, an element name, and an array of const char *,
+ * print out the contents of the array as a series of that element.  If the
  * array is NULL, prints out nothing.
  */
 static void
@@ -1489,16 +1561,12 @@ print_xml_array(MWK_REQ_CTXT *rc, const char *tag,
                 const apr_array_header_t *array)
 {
     int i;
-    const char *string;
 
     if (array == NULL)
         return;
 
-    for (i = 0; i < array->nelts; i++) {
-        string = APR_ARRAY_IDX(array, i, const char *);
-        string = apr_xml_quote_string(rc->r->pool, string, false);
-        ap_rprintf(rc->r, "<%s>%s</%s>", tag, string, tag);
-    }
+    for (i = 0; i < array->nelts; i++)
+        out_element(rc, tag, APR_ARRAY_IDX(array, i, const char *));
 }
 
 
@@ -1636,20 +1704,17 @@ handle_requestTokenRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
                                  webauth_error_message(rc->ctx, status),
                                  mwk_func, true);
 
-    /* Send the XML response. */
-    ap_rvputs(rc->r, "<requestTokenResponse>", NULL);
+    /* Send the response. */
+    out_start(rc, "requestTokenResponse");
 
     if (status != WA_ERR_NONE) {
-        ap_rprintf(rc->r, "<loginErrorCode>%d</loginErrorCode>", status);
-        ap_rprintf(rc->r, "<loginErrorMessage>%s</loginErrorMessage>",
-                   apr_xml_quote_string(rc->r->pool,
-                                        webauth_error_message(rc->ctx, status),
-                                        false));
+        out_number(rc, "loginErrorCode", status);
+        out_element(rc, "loginErrorMessage",
+                    webauth_error_message(rc->ctx, status));
     }
 
     if (response->user_message != NULL)
-        ap_rprintf(rc->r, "<userMessage><![CDATA[%s]]></userMessage>",
-                   response->user_message);
+        out_element(rc, "userMessage", response->user_message);
 
     if (response->login_state != NULL) {
         char *out_login_state =
@@ -1657,9 +1722,7 @@ handle_requestTokenRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
                        apr_base64_encode_len(strlen(response->login_state)));
         apr_base64_encode(out_login_state, response->login_state,
                           strlen(response->login_state));
-        ap_rvputs(rc->r,
-                  "<loginState>", out_login_state , "</loginState>",
-                  NULL);
+        out_element(rc, "loginState", out_login_state);
     }
 
     if (response->factors_configured != NULL) {
@@ -1668,135 +1731,108 @@ handle_requestTokenRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
         wanted = webauth_factors_array(rc->ctx, response->factors_wanted);
         configured = webauth_factors_array(rc->ctx,
                                            response->factors_configured);
-        ap_rvputs(rc->r, "<multifactorRequired>", NULL);
+        out_start(rc, "multifactorRequired");
         print_xml_array(rc, "factor", wanted);
         print_xml_array(rc, "configuredFactor", configured);
         if (response->default_device != NULL
             || response->default_factor != NULL) {
-            ap_rvputs(rc->r, "<defaultFactor>", NULL);
+            out_start(rc, "defaultFactor");
             if (response->default_device != NULL)
-                ap_rprintf(rc->r, "<id>%s</id>",
-                           apr_xml_quote_string(rc->r->pool,
-                                                response->default_device,
-                                                false));
+                out_element(rc, "id", response->default_device);
             if (response->default_factor != NULL)
-                ap_rprintf(rc->r, "<factor>%s</factor>",
-                           response->default_factor);
-            ap_rvputs(rc->r, "</defaultFactor>", NULL);
+                out_element(rc, "factor", response->default_factor);
+            out_end(rc, "defaultFactor");
         }
         if (response->devices != NULL) {
             apr_array_header_t *factors;
             const apr_array_header_t *devices = response->devices;
             struct webauth_device *device;
 
-            ap_rvputs(rc->r, "<devices>", NULL);
+            out_start(rc, "devices");
             for (i = 0; i < response->devices->nelts; i++) {
                 device = &APR_ARRAY_IDX(devices, i, struct webauth_device);
-                ap_rvputs(rc->r, "<device>", NULL);
+                out_start(rc, "device");
                 if (device->name != NULL)
-                    ap_rprintf(rc->r, "<name>%s</name>",
-                               apr_xml_quote_string(rc->r->pool, device->name,
-                                                    false));
+                    out_element(rc, "name", device->name);
                 if (device->id != NULL)
-                    ap_rprintf(rc->r, "<id>%s</id>",
-                               apr_xml_quote_string(rc->r->pool, device->id,
-                                                    false));
+                    out_element(rc, "id", device->id);
                 if (device->factors != NULL) {
                     factors = webauth_factors_array(rc->ctx, device->factors);
                     print_xml_array(rc, "factor", factors);
                 }
-                ap_rvputs(rc->r, "</device>", NULL);
+                out_end(rc, "device");
             }
-            ap_rvputs(rc->r, "</devices>", NULL);
+            out_end(rc, "devices");
         }
-        ap_rvputs(rc->r, "</multifactorRequired>", NULL);
+        out_end(rc, "multifactorRequired");
     }
 
     if (response->proxies != NULL) {
         struct webauth_webkdc_proxy_data *data;
 
-        ap_rvputs(rc->r, "<proxyTokens>", NULL);
+        out_start(rc, "proxyTokens");
         for (i = 0; i < response->proxies->nelts; i++) {
             data = &APR_ARRAY_IDX(response->proxies, i,
                                   struct webauth_webkdc_proxy_data);
-            ap_rvputs(rc->r, "<proxyToken type='", data->type, "'>",
-                      data->token, "</proxyToken>", NULL);
+            out_start(rc, "proxyToken");
+            out_attr(rc, "type", data->type);
+            out_text(rc, data->token);
+            out_end(rc, "proxyToken");
         }
-        ap_rvputs(rc->r, "</proxyTokens>", NULL);
+        out_end(rc, "proxyTokens");
     }
 
     if (response->factor_tokens != NULL) {
         struct webauth_webkdc_factor_data *data;
 
-        ap_rvputs(rc->r, "<factorTokens>", NULL);
+        out_start(rc, "factorTokens");
         for (i = 0; i < response->factor_tokens->nelts; i++) {
             data = &APR_ARRAY_IDX(response->factor_tokens, i,
                                   struct webauth_webkdc_factor_data);
-            ap_rprintf(rc->r, "<factorToken expires='%lu'>%s</factorToken>",
-                       (unsigned long) data->expiration, data->token);
+            out_start(rc, "factorToken");
+            out_attr(rc, "expires",
+                     apr_psprintf(rc->r->pool, "%lu",
+                                  (unsigned long) data->expiration));
+            out_text(rc, data->token);
+            out_end(rc, "factorToken");
         }
-        ap_rvputs(rc->r, "</factorTokens>", NULL);
+        out_end(rc, "factorTokens");
     }
 
     /* put out return-url */
-    ap_rvputs(rc->r,"<returnUrl>",
-              apr_xml_quote_string(rc->r->pool, response->return_url, 1),
-              "</returnUrl>", NULL);
+    out_element(rc, "returnUrl", response->return_url);
 
     /* requesterSubject */
-    ap_rvputs(rc->r,
-              "<requesterSubject>",
-              apr_xml_quote_string(rc->r->pool, response->requester, 1),
-              "</requesterSubject>", NULL);
+    out_element(rc, "requesterSubject", response->requester);
 
     /* subject (if present) */
-    if (response->subject != NULL) {
-        ap_rvputs(rc->r,
-                  "<subject>",
-                  apr_xml_quote_string(rc->r->pool, response->subject, 1),
-                  "</subject>", NULL);
-    }
+    if (response->subject != NULL)
+        out_element(rc, "subject", response->subject);
 
     /* authzSubject (if present) */
-    if (response->authz_subject != NULL) {
-        ap_rvputs(rc->r,
-                  "<authzSubject>",
-                  apr_xml_quote_string(rc->r->pool, response->authz_subject,
-                                       1),
-                  "</authzSubject>", NULL);
-    }
+    if (response->authz_subject != NULL)
+        out_element(rc, "authzSubject", response->authz_subject);
 
     /* permittedAuthzSubjects (if present) */
     if (response->permitted_authz != NULL) {
         const char *authz;
 
-        ap_rvputs(rc->r, "<permittedAuthzSubjects>", NULL);
+        out_start(rc, "permittedAuthzSubjects");
         for (i = 0; i < response->permitted_authz->nelts; i++) {
             authz = APR_ARRAY_IDX(response->permitted_authz, i, const char *);
-            ap_rvputs(rc->r, "<authzSubject>",
-                      apr_xml_quote_string(rc->r->pool, authz, 1),
-                      "</authzSubject>", NULL);
+            out_element(rc, "authzSubject", authz);
         }
-        ap_rvputs(rc->r, "</permittedAuthzSubjects>", NULL);
+        out_end(rc, "permittedAuthzSubjects");
     }
 
-    /* requestedToken, don't need to quote */
+    /* requestedToken */
     if (response->result != NULL) {
-        ap_rvputs(rc->r,
-                  "<requestedToken>",
-                  response->result,
-                  "</requestedToken>",
-                  NULL);
-        ap_rvputs(rc->r,
-                  "<requestedTokenType>",
-                  apr_xml_quote_string(rc->r->pool, response->result_type, 1),
-                  "</requestedTokenType>", NULL);
+        out_element(rc, "requestedToken", response->result);
+        out_element(rc, "requestedTokenType", response->result_type);
     }
 
-    if (response->login_cancel != NULL) {
-        ap_rvputs(rc->r, "<loginCanceledToken>", response->login_cancel,
-                  "</loginCanceledToken>", NULL);
-    }
+    if (response->login_cancel != NULL)
+        out_element(rc, "loginCanceledToken", response->login_cancel);
 
     /* appState, need to base64-encode */
     if (response->app_state != NULL) {
@@ -1805,36 +1841,35 @@ handle_requestTokenRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
                        apr_base64_encode_len(response->app_state_len));
         apr_base64_encode(out_state, response->app_state,
                           response->app_state_len);
-        /*  don't need to quote */
-        ap_rvputs(rc->r,
-                  "<appState>", out_state , "</appState>",
-                  NULL);
+        out_element(rc, "appState", out_state);
     }
 
     /* loginHistory (if present) */
     if (response->logins != NULL) {
         struct webauth_login *login;
 
-        ap_rvputs(rc->r, "<loginHistory>", NULL);
+        out_start(rc, "loginHistory");
         for (i = 0; i < response->logins->nelts; i++) {
             login = &APR_ARRAY_IDX(response->logins, i, struct webauth_login);
-            ap_rvputs(rc->r, "<loginLocation", NULL);
+            out_start(rc, "loginLocation");
             if (login->hostname != NULL)
-                ap_rvputs(rc->r, " name=\"", login->hostname, "\"", NULL);
+                out_attr(rc, "name", login->hostname);
             if (login->timestamp != 0)
-                ap_rprintf(rc->r, " time=\"%lu\"",
-                           (unsigned long) login->timestamp);
-            ap_rvputs(rc->r, ">", login->ip, "</loginLocation>", NULL);
+                out_attr(rc, "time",
+                         apr_psprintf(rc->r->pool, "%lu",
+                                      (unsigned long) login->timestamp));
+            out_text(rc, login->ip);
+            out_end(rc, "loginLocation");
         }
-        ap_rvputs(rc->r, "</loginHistory>", NULL);
+        out_end(rc, "loginHistory");
     }
 
     /* passwordExpires (if present) */
     if (response->password_expires > 0)
-        ap_rprintf(rc->r, "<passwordExpires>%lu</passwordExpires>",
+        out_number(rc, "passwordExpires",
                    (unsigned long) response->password_expires);
 
-    ap_rvputs(rc->r, "</requestTokenResponse>", NULL);
+    out_end(rc, "requestTokenResponse");
     ap_rflush(rc->r);
 
     return MWK_OK;
@@ -2024,23 +2059,14 @@ handle_webkdcProxyTokenRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
     if (ms != MWK_OK)
         goto cleanup;
 
-    ap_rvputs(rc->r, "<webkdcProxyTokenResponse>", NULL);
-
-    ap_rvputs(rc->r,
-              "<webkdcProxyToken>",
-              token_data,
-              "</webkdcProxyToken>",
-              NULL);
+    out_start(rc, "webkdcProxyTokenResponse");
+    out_element(rc, "webkdcProxyToken", token_data);
 
     /* subject */
-    if (*subject_out != NULL) {
-        ap_rvputs(rc->r,
-                  "<subject>",
-                  apr_xml_quote_string(rc->r->pool, *subject_out, 1),
-                  "</subject>", NULL);
-    }
+    if (*subject_out != NULL)
+        out_element(rc, "subject", *subject_out);
 
-    ap_rvputs(rc->r, "</webkdcProxyTokenResponse>", NULL);
+    out_end(rc, "webkdcProxyTokenResponse");
     ap_rflush(rc->r);
 
     ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, rc->r->server,
@@ -2090,23 +2116,12 @@ handle_webkdcProxyTokenInfoRequest(MWK_REQ_CTXT *rc,
     if (!parse_webkdc_proxy_token(rc, pt_data, &pt))
         return MWK_ERROR;
 
-    ap_rvputs(rc->r, "<webkdcProxyTokenInfoResponse>", NULL);
-
-    /* subject */
-    ap_rvputs(rc->r,
-             "<subject>",
-             apr_xml_quote_string(rc->r->pool, pt.subject, 1),
-             "</subject>", NULL);
-
-    ap_rvputs(rc->r,
-             "<proxyType>",
-             apr_xml_quote_string(rc->r->pool, pt.proxy_type, 1),
-             "</proxyType>", NULL);
-
-    ap_rprintf(rc->r, "<creationTime>%d</creationTime>", (int)pt.creation);
-    ap_rprintf(rc->r, "<expirationTime>%d</expirationTime>", (int)pt.expiration);
-
-    ap_rvputs(rc->r, "</webkdcProxyTokenInfoResponse>", NULL);
+    out_start(rc, "webkdcProxyTokenInfoResponse");
+    out_element(rc, "subject", pt.subject);
+    out_element(rc, "proxyType", pt.proxy_type);
+    out_number(rc, "creationTime", (unsigned long) pt.creation);
+    out_number(rc, "expirationTime", (unsigned long) pt.expiration);
+    out_end(rc, "webkdcProxyTokenInfoResponse");
     ap_rflush(rc->r);
 
     *subject_out = pt.subject;
@@ -2125,48 +2140,38 @@ parse_request(MWK_REQ_CTXT *rc)
     int s;
     ssize_t num_read;
     char buff[8192];
-    apr_xml_parser *xp;
-    apr_xml_doc *xd;
-    apr_status_t astatus;
+    struct mwk_xml_parser *xp;
+    apr_xml_elem *root = NULL;
+    bool okay = true;
     const char *mwk_func = "parse_request";
 
-    xp = apr_xml_parser_create(rc->r->pool);
-    if (xp == NULL) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
-                     "mod_webkdc: %s: "
-                     "apr_xml_parser_create failed", mwk_func);
-        set_errorResponse(rc, WA_PEC_SERVER_FAILURE,
-                          "server failure", mwk_func, false);
-        generate_errorResponse(rc);
-        return OK;
-    }
+    xp = mwk_xml_parser_create(rc->r->pool, ap_get_limit_xml_body(rc->r),
+                               rc->compact_request);
 
     s = ap_setup_client_block(rc->r, REQUEST_CHUNKED_DECHUNK);
     if (s!= OK)
         return s;
 
-    astatus = APR_SUCCESS;
+    /* Parse the body as it's read, stopping at the first error. */
     num_read = 0;
-
-    while (astatus == APR_SUCCESS &&
+    while (okay &&
            ((num_read = ap_get_client_block(rc->r, buff, sizeof(buff))) > 0)) {
-        astatus = apr_xml_parser_feed(xp, buff, num_read);
+        okay = mwk_xml_parser_feed(xp, buff, num_read);
     }
 
-    if (num_read == 0 && astatus == APR_SUCCESS)
-        astatus = apr_xml_parser_done(xp, &xd);
+    if (num_read == 0 && okay) {
+        root = mwk_xml_parser_done(xp);
+        okay = (root != NULL);
+    }
+
+    if ((num_read < 0) || !okay) {
+        if (!okay) {
+            const char *error = mwk_xml_parser_error(xp);
 
-    if ((num_read < 0) || astatus != APR_SUCCESS) {
-        if (astatus != APR_SUCCESS) {
-            char errbuff[1024] = "";
-            apr_xml_parser_geterror(xp, errbuff, sizeof(errbuff));
             ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
-                         "mod_webkdc: %s: "
-                         "apr_xml_parser_feed failed: %s (%d)",
-                         mwk_func,
-                         errbuff,
-                         astatus);
-            set_errorResponse(rc, WA_PEC_INVALID_REQUEST, errbuff,
+                         "mod_webkdc: %s: XML parsing failed: %s",
+                         mwk_func, error);
+            set_errorResponse(rc, WA_PEC_INVALID_REQUEST, error,
                               mwk_func, false);
             generate_errorResponse(rc);
             return OK;
@@ -2180,10 +2185,10 @@ parse_request(MWK_REQ_CTXT *rc)
         }
     }
 
-    if (strcmp(xd->root->name, "getTokensRequest") == 0) {
+    if (strcmp(root->name, "getTokensRequest") == 0) {
         const char *req, *sub;
 
-        if (!handle_getTokensRequest(rc, xd->root, &req, &sub)) {
+        if (!handle_getTokensRequest(rc, root, &req, &sub)) {
             generate_errorResponse(rc);
             ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, rc->r->server,
                          "mod_webkdc: event=getTokens from=%s "
@@ -2199,10 +2204,10 @@ parse_request(MWK_REQ_CTXT *rc)
                                       log_escape(rc, rc->error_message))
                          );
         }
-    } else if (strcmp(xd->root->name, "requestTokenRequest") == 0) {
+    } else if (strcmp(root->name, "requestTokenRequest") == 0) {
         const char *req, *sub;
 
-        if (!handle_requestTokenRequest(rc, xd->root, &req, &sub)) {
+        if (!handle_requestTokenRequest(rc, root, &req, &sub)) {
             generate_errorResponse(rc);
             ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, rc->r->server,
                          "mod_webkdc: event=requestToken from=%s "
@@ -2218,10 +2223,10 @@ parse_request(MWK_REQ_CTXT *rc)
                                       log_escape(rc, rc->error_message))
                          );
         }
-    } else if (strcmp(xd->root->name, "webkdcProxyTokenRequest") == 0) {
+    } else if (strcmp(root->name, "webkdcProxyTokenRequest") == 0) {
         char *sub;
 
-        if (!handle_webkdcProxyTokenRequest(rc, xd->root, &sub)) {
+        if (!handle_webkdcProxyTokenRequest(rc, root, &sub)) {
             generate_errorResponse(rc);
             ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, rc->r->server,
                          "mod_webkdc: event=webkdcProxyToken from=%s "
@@ -2236,10 +2241,10 @@ parse_request(MWK_REQ_CTXT *rc)
                                       log_escape(rc, rc->error_message))
                          );
         }
-    } else if (strcmp(xd->root->name, "webkdcProxyTokenInfoRequest") == 0) {
+    } else if (strcmp(root->name, "webkdcProxyTokenInfoRequest") == 0) {
         const char *sub;
 
-        if (!handle_webkdcProxyTokenInfoRequest(rc, xd->root, &sub)) {
+        if (!handle_webkdcProxyTokenInfoRequest(rc, root, &sub)) {
             generate_errorResponse(rc);
             ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, rc->r->server,
                          "mod_webkdc: event=webkdcProxyTokenInfo from=%s "
@@ -2256,7 +2261,7 @@ parse_request(MWK_REQ_CTXT *rc)
         }
     } else {
         char *m = apr_psprintf(rc->r->pool, "invalid command: %s",
-                               xd->root->name);
+                               root->name);
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
                      "mod_webkdc: %s: %s (from %s)", mwk_func, m,
                      rc->r->useragent_ip);
@@ -2267,87 +2272,288 @@ parse_request(MWK_REQ_CTXT *rc)
     return OK;
 }
 
-/* The content handler */
+/*
+ * Handle a request once the WebAuth context has been set up.  Configures the
+ * context for this virtual host, checks the request, and then dispatches it
+ * to parse_request.
+ */
 static int
-handler_hook(request_rec *r)
+handle_request(MWK_REQ_CTXT *rc)
 {
-    MWK_REQ_CTXT rc;
+    request_rec *r = rc->r;
     int status;
-    const char *req_content_type;
+    const char *req_content_type, *accept;
     struct webauth_webkdc_config config;
 
-    /* Make sure that we weren't called inappropriately. */
-    if (strcmp(r->handler, "webkdc"))
-        return DECLINED;
-
-    /* Initialize our request context. */
-    memset(&rc, 0, sizeof(rc));
-    rc.r = r;
-    status = webauth_context_init_apr(&rc.ctx, r->pool);
-    if (status != WA_ERR_NONE) {
-        ap_log_error(APLOG_MARK, APLOG_CRIT, 0, r->server,
-                     "mod_webkdc: webauth_context_init failed: %s",
-                     webauth_error_message(NULL, status));
-        return DECLINED;
-    }
-    webauth_log_callback(rc.ctx, WA_LOG_TRACE,  mwk_log_trace,   r);
-    webauth_log_callback(rc.ctx, WA_LOG_INFO,   mwk_log_info,    r);
-    webauth_log_callback(rc.ctx, WA_LOG_NOTICE, mwk_log_notice,  r);
-    webauth_log_callback(rc.ctx, WA_LOG_WARN,   mwk_log_warning, r);
+    webauth_log_callback(rc->ctx, WA_LOG_TRACE,  mwk_log_trace,   r);
+    webauth_log_callback(rc->ctx, WA_LOG_INFO,   mwk_log_info,    r);
+    webauth_log_callback(rc->ctx, WA_LOG_NOTICE, mwk_log_notice,  r);
+    webauth_log_callback(rc->ctx, WA_LOG_WARN,   mwk_log_warning, r);
 
     /* Set up the WebKDC configuration. */
-    rc.sconf = ap_get_module_config(r->server->module_config, &webkdc_module);
-    config.fast_armor_path  = rc.sconf->fast_armor_path;
-    config.id_acl_path      = rc.sconf->identity_acl_path;
-    config.keytab_path      = rc.sconf->keytab_path;
-    config.principal        = rc.sconf->keytab_principal;
-    config.proxy_lifetime   = rc.sconf->proxy_lifetime;
-    config.login_time_limit = rc.sconf->login_time_limit;
-    config.permitted_realms = rc.sconf->permitted_realms;
-    config.local_realms     = rc.sconf->local_realms;
-    status = webauth_webkdc_config(rc.ctx, &config);
+    rc->sconf = ap_get_module_config(r->server->module_config, &webkdc_module);
+    config.fast_armor_path  = rc->sconf->fast_armor_path;
+    config.id_acl_path      = rc->sconf->identity_acl_path;
+    config.keytab_path      = rc->sconf->keytab_path;
+    config.principal        = rc->sconf->keytab_principal;
+    config.proxy_lifetime   = rc->sconf->proxy_lifetime;
+    config.login_time_limit = rc->sconf->login_time_limit;
+    config.login_deadline   = rc->sconf->login_deadline;
+    config.speculative_userinfo = rc->sconf->userinfo_speculative;
+    config.permitted_realms = rc->sconf->permitted_realms;
+    config.local_realms     = rc->sconf->local_realms;
+    status = webauth_webkdc_config(rc->ctx, &config);
     if (status != WA_ERR_NONE) {
         ap_log_error(APLOG_MARK, APLOG_CRIT, 0, r->server,
                      "mod_webkdc: webauth_webkdc_config failed: %s",
-                     webauth_error_message(rc.ctx, status));
+                     webauth_error_message(rc->ctx, status));
         return HTTP_INTERNAL_SERVER_ERROR;
     }
 
     /* Set up the user information service configuration. */
-    if (rc.sconf->userinfo_config != NULL) {
-        struct webauth_user_config *user = rc.sconf->userinfo_config;
-
-        user->identity       = rc.sconf->userinfo_principal;
-        user->timeout        = rc.sconf->userinfo_timeout;
-        user->ignore_failure = rc.sconf->userinfo_ignore_fail;
-        user->json           = rc.sconf->userinfo_json;
-        user->keytab         = rc.sconf->keytab_path;
-        user->principal      = rc.sconf->keytab_principal;
-        status = webauth_user_config(rc.ctx, user);
+    if (rc->sconf->userinfo_config != NULL) {
+        struct webauth_user_config *user = rc->sconf->userinfo_config;
+
+        user->identity       = rc->sconf->userinfo_principal;
+        user->timeout        = rc->sconf->userinfo_timeout;
+        user->ignore_failure = rc->sconf->userinfo_ignore_fail;
+        user->json           = rc->sconf->userinfo_json;
+        user->keytab         = rc->sconf->keytab_path;
+        user->principal      = rc->sconf->keytab_principal;
+        status = webauth_user_config(rc->ctx, user);
         if (status != WA_ERR_NONE) {
             ap_log_error(APLOG_MARK, APLOG_CRIT, 0, r->server,
                          "mod_webkdc: webauth_user_config failed: %s",
-                         webauth_error_message(rc.ctx, status));
+                         webauth_error_message(rc->ctx, status));
             return HTTP_INTERNAL_SERVER_ERROR;
         }
     }
 
+    /* Look for service tickets in the ticket cache before the KDC. */
+    mwk_tickets_use(rc);
+
     /* Ensure we can load the keyring. */
-    if (!ensure_keyring_loaded(&rc))
+    if (!ensure_keyring_loaded(rc))
         return HTTP_INTERNAL_SERVER_ERROR;
 
     /* Ensure the client sent POST with the right content type. */
     if (r->method_number != M_POST)
         return HTTP_METHOD_NOT_ALLOWED;
     req_content_type = apr_table_get(r->headers_in, "content-type");
-    if (!req_content_type || strcmp(req_content_type, "text/xml") != 0)
+    if (req_content_type == NULL)
+        return HTTP_BAD_REQUEST;
+    if (strcmp(req_content_type, MWK_COMPACT_TYPE) == 0)
+        rc->compact_request = true;
+    else if (strcmp(req_content_type, "text/xml") != 0)
         return HTTP_BAD_REQUEST;
 
-    /* Our response will also be text/xml. */
-    ap_set_content_type(r, "text/xml");
+    /*
+     * Reply in the compact encoding if the request used it or the client
+     * said it can read it, so that clients can discover support with an
+     * ordinary XML request.  Otherwise, our response will also be text/xml.
+     */
+    accept = apr_table_get(r->headers_in, "accept");
+    if (rc->compact_request
+        || (accept != NULL && ap_strstr_c(accept, MWK_COMPACT_TYPE) != NULL))
+        rc->out.compact = true;
+    ap_set_content_type(r, rc->out.compact ? MWK_COMPACT_TYPE : "text/xml");
 
     /* All the real work happens in parse_request. */
-    return parse_request(&rc);
+    return parse_request(rc);
+}
+
+
+/*
+ * The content handler.  Requests use the WebAuth context of the thread
+ * handling them, which keeps its Kerberos library context between requests
+ * and is reset afterwards, so that the Kerberos configuration isn't reread
+ * and its plugins reloaded for every request.
+ */
+static int
+handler_hook(request_rec *r)
+{
+    MWK_REQ_CTXT rc;
+    int status;
+
+    /* Make sure that we weren't called inappropriately. */
+    if (strcmp(r->handler, "webkdc"))
+        return DECLINED;
+
+    /* Initialize our request context. */
+    memset(&rc, 0, sizeof(rc));
+    rc.r = r;
+    rc.out.write = write_response;
+    rc.out.data = r;
+    rc.out.pool = r->pool;
+    status = mwk_get_context(r, &rc.ctx);
+    if (status != WA_ERR_NONE) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, 0, r->server,
+                     "mod_webkdc: webauth_context_init failed: %s",
+                     webauth_error_message(NULL, status));
+        return DECLINED;
+    }
+    status = handle_request(&rc);
+    mwk_release_context(rc.ctx);
+    return status;
+}
+
+
+/*
+ * Print a heading, with an optional value, in a definition list on the
+ * status page.
+ */
+static void
+status_heading(request_rec *r, const char *name, const char *value)
+{
+    ap_rprintf(r, "<dt><strong>%s:</strong>", name);
+    if (value != NULL)
+        ap_rprintf(r, " <tt>%s</tt>", ap_escape_html(r->pool, value));
+    ap_rputs("</dt>\n", r);
+}
+
+
+/*
+ * Print a name and value as an item in a definition list on the status page.
+ */
+static void
+status_item(request_rec *r, const char *name, const char *value)
+{
+    ap_rprintf(r, "<dd><tt>%s %s</tt></dd>\n", ap_escape_html(r->pool, name),
+               ap_escape_html(r->pool, value));
+}
+
+
+/*
+ * Format a time for the status page, or return "never" if it's zero.
+ */
+static const char *
+status_time(request_rec *r, apr_time_t when)
+{
+    char *buffer;
+
+    if (when == 0)
+        return "never";
+    buffer = apr_palloc(r->pool, APR_CTIME_LEN + 1);
+    apr_ctime(buffer, when);
+    return buffer;
+}
+
+
+/*
+ * The status handler, which reports the state of the token ACL, the ticket
+ * cache, and the user information connections and cache in the child process
+ * that handles the request.  Like the mod_webauth status page, this only
+ * shows anything if debugging is enabled.
+ */
+static int
+status_hook(request_rec *r)
+{
+    struct config *sconf;
+    struct mwk_acl_info info;
+    struct mwk_tickets_info tickets;
+    struct webauth_user_pool_stats stats;
+    struct webauth_user_cache_stats cstats;
+
+    if (strcmp(r->handler, "webkdc-status"))
+        return DECLINED;
+    r->allowed |= (AP_METHOD_BIT << M_GET);
+    if (r->method_number != M_GET)
+        return DECLINED;
+
+    sconf = ap_get_module_config(r->server->module_config, &webkdc_module);
+    ap_set_content_type(r, "text/html");
+    ap_rputs(DOCTYPE_HTML_3_2
+             "<html><head><title>mod_webkdc status</title></head>\n", r);
+    ap_rputs("<body><h1 align=\"center\">mod_webkdc status</h1>\n", r);
+    if (!sconf->debug) {
+        ap_rputs("<b>You must have \"WebKdcDebug on\" in your config file "
+                 "to enable this information.</b>", r);
+        ap_rputs("</body></html>\n", r);
+        return OK;
+    }
+    ap_rputs("<hr/>", r);
+
+    ap_rputs("<dl>", r);
+    status_heading(r, "Server Version", ap_get_server_description());
+    status_heading(r, "Server Built", ap_get_server_built());
+    status_heading(r, "WebKDC Info Version", VERSION);
+    status_heading(r, "WebKDC Info Build", PACKAGE_BUILD_INFO);
+    ap_rputs("</dl>", r);
+    ap_rputs("<hr/>", r);
+
+    ap_rputs("<dl>", r);
+    status_heading(r, "Token ACL (this process)", sconf->token_acl_path);
+    if (mwk_acl_info(&info)) {
+        status_item(r, "generation",
+                    apr_psprintf(r->pool, "%lu", info.generation));
+        status_item(r, "last reload", status_time(r, info.loaded));
+        status_item(r, "file modified", status_time(r, info.mtime));
+    } else {
+        ap_rputs("<dd>"
+                 "no token ACL is loaded.  This usually indicates a syntax "
+                 "error in or a permissions problem with the ACL file."
+                 "</dd>\n", r);
+    }
+    status_item(r, "last checked", status_time(r, info.checked));
+    ap_rputs("</dl>", r);
+    ap_rputs("<hr/>", r);
+
+    if (mwk_tickets_info(&tickets)) {
+        ap_rputs("<dl>", r);
+        status_heading(r, "Service Ticket Cache",
+                       tickets.shared ? "shared" : "this process");
+        status_item(r, "entries",
+                    apr_psprintf(r->pool, "%lu of %lu", tickets.used,
+                                 tickets.entries));
+        status_item(r, "hits", apr_psprintf(r->pool, "%lu", tickets.hits));
+        status_item(r, "misses",
+                    apr_psprintf(r->pool, "%lu", tickets.misses));
+        status_item(r, "stores",
+                    apr_psprintf(r->pool, "%lu", tickets.stores));
+        ap_rputs("</dl>", r);
+        ap_rputs("<hr/>", r);
+    }
+
+    if (sconf->userinfo_config != NULL
+        && sconf->userinfo_config->pool != NULL) {
+        webauth_user_pool_stats(sconf->userinfo_config->pool, &stats);
+        ap_rputs("<dl>", r);
+        status_heading(r, "User Information Connections", "this process");
+        status_item(r, "idle", apr_psprintf(r->pool, "%lu", stats.idle));
+        status_item(r, "created",
+                    apr_psprintf(r->pool, "%lu", stats.created));
+        status_item(r, "reused", apr_psprintf(r->pool, "%lu", stats.reused));
+        status_item(r, "expired",
+                    apr_psprintf(r->pool, "%lu", stats.expired));
+        status_item(r, "retried",
+                    apr_psprintf(r->pool, "%lu", stats.retried));
+        status_item(r, "credentials obtained",
+                    apr_psprintf(r->pool, "%lu", stats.renewed));
+        ap_rputs("</dl>", r);
+        ap_rputs("<hr/>", r);
+    }
+
+    if (sconf->userinfo_config != NULL
+        && sconf->userinfo_config->cache != NULL) {
+        webauth_user_cache_stats(sconf->userinfo_config->cache, &cstats);
+        ap_rputs("<dl>", r);
+        status_heading(r, "User Information Cache", "this process");
+        status_item(r, "entries",
+                    apr_psprintf(r->pool, "%lu of %lu", cstats.entries,
+                                 sconf->userinfo_cache_size));
+        status_item(r, "hits", apr_psprintf(r->pool, "%lu", cstats.hits));
+        status_item(r, "misses",
+                    apr_psprintf(r->pool, "%lu", cstats.misses));
+        status_item(r, "stores",
+                    apr_psprintf(r->pool, "%lu", cstats.stores));
+        status_item(r, "flushed",
+                    apr_psprintf(r->pool, "%lu", cstats.flushed));
+        ap_rputs("</dl>", r);
+        ap_rputs("<hr/>", r);
+    }
+    ap_rputs(ap_psignature("", r), r);
+    ap_rputs("</body></html>\n", r);
+    return OK;
 }
 
 
@@ -2373,6 +2579,9 @@ mod_webkdc_init(apr_pool_t *pconf, apr_pool_t *plog UNUSED,
 
     ap_add_version_component(pconf, "WebKDC/" VERSION);
 
+    /* Create the service ticket cache if it's shared between children. */
+    mwk_tickets_init(s, pconf);
+
     if (sconf->debug)
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
                      "mod_webkdc: initialized (%s) (%s)", VERSION,
@@ -2381,14 +2590,77 @@ mod_webkdc_init(apr_pool_t *pconf, apr_pool_t *plog UNUSED,
     return OK;
 }
 
+/*
+ * Create the pools of connections to the user information service and the
+ * caches of its results for this child process.  Virtual hosts that inherit
+ * the user information service configuration share its pool and cache.  If
+ * either can't be created, the service is called as before.
+ */
+static void
+init_userinfo(server_rec *s, apr_pool_t *p)
+{
+    struct config *sconf;
+    struct webauth_user_config *user;
+    struct webauth_context *ctx;
+    server_rec *scheck;
+    int status;
+
+    for (scheck = s; scheck != NULL; scheck = scheck->next) {
+        sconf = ap_get_module_config(scheck->module_config, &webkdc_module);
+        user = sconf->userinfo_config;
+        if (user == NULL)
+            continue;
+        status = webauth_context_init_apr(&ctx, p);
+        if (status != WA_ERR_NONE) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, scheck,
+                         "mod_webkdc: cannot create WebAuth context: %s",
+                         webauth_error_message(NULL, status));
+            continue;
+        }
+        if (user->pool == NULL && sconf->userinfo_pool_size > 0) {
+            status = webauth_user_pool_new(ctx, sconf->userinfo_pool_size,
+                                           sconf->userinfo_pool_idle,
+                                           &user->pool);
+            if (status != WA_ERR_NONE)
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, scheck,
+                             "mod_webkdc: cannot create user information"
+                             " connection pool: %s",
+                             webauth_error_message(ctx, status));
+        }
+        if (user->cache == NULL && sconf->userinfo_cache_size > 0
+            && sconf->userinfo_cache_ttl > 0) {
+            status = webauth_user_cache_new(ctx, sconf->userinfo_cache_size,
+                                            sconf->userinfo_cache_ttl,
+                                            &user->cache);
+            if (status != WA_ERR_NONE)
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, scheck,
+                             "mod_webkdc: cannot create user information"
+                             " cache: %s",
+                             webauth_error_message(ctx, status));
+        }
+    }
+}
+
 /*
  * called once per-child
  */
 static void
-mod_webkdc_child_init(apr_pool_t *p UNUSED, server_rec *s)
+mod_webkdc_child_init(apr_pool_t *p, server_rec *s)
 {
     /* initialize mutexes */
     mwk_init_mutexes(s);
+
+    /* prepare the per-thread WebAuth contexts */
+    mwk_init_contexts(s, p);
+
+    /* load the token ACL and start watching it for changes */
+    mwk_acl_init(s, p);
+
+    /* set up or attach to the service ticket cache */
+    mwk_tickets_child_init(s, p);
+
+    /* create the user information service connection pools and caches */
+    init_userinfo(s, p);
 }
 
 static void
@@ -2397,6 +2669,7 @@ register_hooks(apr_pool_t *p UNUSED)
     ap_hook_post_config(mod_webkdc_init, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_child_init(mod_webkdc_child_init, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_handler(handler_hook, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(status_hook, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 /* Dispatch list for API hooks */
@@ -21,6 +21,10 @@
 
 #include <webauth/tokens.h>
 
+struct apr_xml_elem;
+struct mwk_acl;
+struct mwk_glob_dfa;
+struct mwk_xml_parser;
 struct webauth_context;
 struct webauth_keyring;
 
@@ -34,9 +38,42 @@ struct webauth_keyring;
 #define MAX_PROXY_TOKENS_ACCEPTED 64
 #define MAX_PROXY_TOKENS_RETURNED 64
 
+/*
+ * Limits on the XML of a request.  The body as a whole is limited by Apache's
+ * LimitXMLRequestBody setting.
+ */
+#define MWK_XML_MAX_ELEMENTS 1024       /* Elements in the document. */
+#define MWK_XML_MAX_DEPTH 16            /* Nesting of elements. */
+#define MWK_XML_MAX_TAG 8192            /* Bytes in one tag. */
+#define MWK_XML_MAX_TEXT (64 * 1024)    /* Bytes of text in one element. */
+
+/*
+ * Media type of the compact encoding of protocol messages, accepted as an
+ * alternative to text/xml.  It encodes the same element tree as a sequence of
+ * records, each starting with a type byte: 'S' starts an element and is
+ * followed by a one-byte name length and the name; 'A' adds an attribute to
+ * the element just started and is followed by a one-byte name length, the
+ * name, a four-byte value length in network byte order, and the value; 'T'
+ * is text of the current element, with a four-byte length and the text; and
+ * 'E' ends the current element.  Nothing is escaped.
+ */
+#define MWK_COMPACT_TYPE "application/x-webauth-compact"
+
+/*
+ * Writer for protocol messages in either XML or, if compact is true, the
+ * compact encoding.  Output is passed to write along with data as it's
+ * generated.  XML escaping is done with pool.  See xml.c.
+ */
+struct mwk_xml_writer {
+    void (*write)(void *data, const char *, size_t);
+    void *data;
+    apr_pool_t *pool;
+    bool compact;
+    bool tag_open;              /* Start tag written without its closing >. */
+};
+
 /* enum for mutexes */
 enum mwk_mutex_type {
-    MWK_MUTEX_TOKENACL,
     MWK_MUTEX_KEYRING,
     MWK_MUTEX_MAX /* MUST BE LAST! */
 };
@@ -67,12 +104,20 @@ struct config {
     unsigned long userinfo_timeout;
     bool userinfo_ignore_fail;
     bool userinfo_json;
+    unsigned long userinfo_pool_size;
+    unsigned long userinfo_pool_idle;
+    unsigned long userinfo_cache_size;
+    unsigned long userinfo_cache_ttl;
+    bool userinfo_speculative;
     bool debug;
     bool keyring_auto_update;
     unsigned long key_lifetime;
+    unsigned long login_deadline;
     unsigned long login_time_limit;
     unsigned long proxy_lifetime;
     unsigned long service_lifetime;
+    unsigned long ticket_cache_size;
+    bool ticket_cache_shared;
     unsigned long token_max_ttl;
     apr_array_header_t *local_realms;           /* Array of const char * */
     apr_array_header_t *permitted_realms;       /* Array of const char * */
@@ -82,11 +127,19 @@ struct config {
     bool userinfo_timeout_set;
     bool userinfo_ignore_fail_set;
     bool userinfo_json_set;
+    bool userinfo_pool_size_set;
+    bool userinfo_pool_idle_set;
+    bool userinfo_cache_size_set;
+    bool userinfo_cache_ttl_set;
+    bool userinfo_speculative_set;
     bool debug_set;
     bool keyring_auto_update_set;
     bool key_lifetime_set;
+    bool login_deadline_set;
     bool login_time_limit_set;
     bool proxy_lifetime_set;
+    bool ticket_cache_size_set;
+    bool ticket_cache_shared_set;
     bool token_max_ttl_set;
 
     /*
@@ -170,12 +223,39 @@ typedef struct {
     const char *error_message;
     const char *mwk_func; /* function error occurred in */
     bool need_to_log; /* set if we need to log error  */
+    struct mwk_acl *acl; /* token ACL for this request, once checked */
+    bool compact_request; /* request is in the compact encoding */
+    struct mwk_xml_writer out; /* writer for the response */
 } MWK_REQ_CTXT;
 
+/* Information about the loaded token ACL, for the status page. */
+struct mwk_acl_info {
+    unsigned long generation;   /* Number of times loaded in this process. */
+    apr_time_t loaded;          /* When the current ACL was loaded. */
+    apr_time_t mtime;           /* Modification time of the file loaded. */
+    apr_time_t checked;         /* When the file was last checked. */
+};
+
+/* Information about the service ticket cache, for the status page. */
+struct mwk_tickets_info {
+    bool shared;                /* Whether shared by all child processes. */
+    unsigned long entries;      /* Number of slots. */
+    unsigned long used;         /* Number of slots holding a valid ticket. */
+    unsigned long hits;         /* Lookups that found a ticket. */
+    unsigned long misses;       /* Lookups that didn't. */
+    unsigned long stores;       /* Tickets added. */
+};
+
 BEGIN_DECLS
 
 /* acl.c */
 
+/* Load the token ACL and start the thread that reloads it, once per child. */
+void mwk_acl_init(server_rec *, apr_pool_t *);
+
+/* Get information about the current token ACL.  False if none is loaded. */
+bool mwk_acl_info(struct mwk_acl_info *);
+
 int
 mwk_can_use_proxy_token(MWK_REQ_CTXT *rc,
                         const char *subject,
@@ -214,6 +294,26 @@ void *webkdc_config_merge(apr_pool_t *, void *, void *);
 void webkdc_config_init(server_rec *, struct config *, apr_pool_t *);
 
 
+/* glob.c */
+
+/*
+ * A set of wildcard patterns, matched as by ap_strcmp_match.  The patterns
+ * are compiled together into a DFA unless it would have more than the given
+ * number of transitions, in which case dfa is NULL and each pattern is tried
+ * in turn.  MWK_GLOB_MAX_CELLS is the limit used for the token ACL.
+ */
+#define MWK_GLOB_MAX_CELLS (1024 * 1024)
+struct mwk_glob_set {
+    const apr_array_header_t *patterns;
+    struct mwk_glob_dfa *dfa;
+};
+
+/* Compile a set of patterns, and check whether a subject matches any. */
+struct mwk_glob_set *mwk_glob_compile(apr_pool_t *, apr_pool_t *scratch,
+                                      const apr_array_header_t *patterns,
+                                      size_t max_cells);
+bool mwk_glob_match(const struct mwk_glob_set *, const char *subject);
+
 /* logging.c */
 
 /* Logging functions used as context callbacks for library messages. */
@@ -243,6 +343,21 @@ mwk_lock_mutex(MWK_REQ_CTXT *rc, enum mwk_mutex_type type);
 void
 mwk_unlock_mutex(MWK_REQ_CTXT *rc, enum mwk_mutex_type type);
 
+/*
+ * create the key for the per-thread WebAuth contexts
+ */
+void
+mwk_init_contexts(server_rec *s, apr_pool_t *pool);
+
+/*
+ * get the WebAuth context for a request, normally the one of the current
+ * thread, and reset it for the next request when done
+ */
+int
+mwk_get_context(request_rec *r, struct webauth_context **ctx);
+void
+mwk_release_context(struct webauth_context *ctx);
+
 /*
  * get a WEBAUTH_KRB5_CTXT, log errors
  */
@@ -287,4 +402,47 @@ mwk_append_string(MWK_STRING *string, const char *in_data, size_t in_size);
 int
 mwk_cache_keyring(server_rec *serv, struct config *sconf);
 
+/* tickets.c */
+
+/*
+ * Set up the service ticket cache, first in the parent process after reading
+ * the configuration and then once per child.
+ */
+void mwk_tickets_init(server_rec *, apr_pool_t *);
+void mwk_tickets_child_init(server_rec *, apr_pool_t *);
+
+/* Use the service ticket cache, if any, for this request. */
+void mwk_tickets_use(MWK_REQ_CTXT *);
+
+/* Get information about the ticket cache.  False if there isn't one. */
+bool mwk_tickets_info(struct mwk_tickets_info *);
+
+/* xml.c */
+
+/*
+ * Streaming parser for request bodies.  Create a parser allocating from the
+ * given pool and accepting at most max_size bytes (0 for no limit), reading
+ * either XML or, if compact is true, the compact encoding.  Feed it the body
+ * as it's read, and then get the root element of the document.  feed returns
+ * false and done returns NULL if the document is invalid or over a limit,
+ * and the error function then returns the reason.
+ */
+struct mwk_xml_parser *mwk_xml_parser_create(apr_pool_t *, size_t max_size,
+                                             bool compact);
+bool mwk_xml_parser_feed(struct mwk_xml_parser *, const char *, size_t);
+struct apr_xml_elem *mwk_xml_parser_done(struct mwk_xml_parser *);
+const char *mwk_xml_parser_error(struct mwk_xml_parser *);
+
+/*
+ * Write protocol messages with a struct mwk_xml_writer.  Start an element,
+ * add attributes to the element just started, add text to the current
+ * element, and end the current element, whose name is needed for XML.  Names
+ * must be at most 255 bytes for the compact encoding.
+ */
+void mwk_xml_start(struct mwk_xml_writer *, const char *name);
+void mwk_xml_attr(struct mwk_xml_writer *, const char *name,
+                  const char *value);
+void mwk_xml_text(struct mwk_xml_writer *, const char *text);
+void mwk_xml_end(struct mwk_xml_writer *, const char *name);
+
 #endif
@@ -0,0 +1,363 @@
+/*
+ * Service ticket cache for the Apache WebKDC module.
+ *
+ * Creating an id token with a Kerberos authenticator or a cred token for a
+ * WebAuth Application Server means getting a service ticket for that server
+ * with the TGT from the user's webkdc-proxy token, which is a round trip to
+ * the KDC.  Users visit the same applications over and over, so libwebauth
+ * can consult a cache of those tickets first, through the callbacks set with
+ * webauth_krb5_set_ticket_cache.  This is the storage behind those
+ * callbacks.  libwebauth derives the cache keys from the TGT and the
+ * principals and encrypts each ticket with a key derived from the TGT, so
+ * the cache holds neither principal names nor usable tickets.
+ *
+ * The cache is a fixed-size, four-way set-associative table of slots, each
+ * big enough for a typical encrypted ticket.  A new ticket replaces an
+ * expired one in its set or else the one that expires soonest.  Normally
+ * each child process has its own table protected by a thread mutex.  With
+ * WebKdcTicketCacheShared, the table is created in shared memory before the
+ * children are forked and protected by a global mutex, so that all children
+ * share one table.  The size and sharing are taken from the main server
+ * configuration.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/apache.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+
+#include <apr_global_mutex.h>
+#include <apr_shm.h>
+#include <apr_thread_mutex.h>
+#include <unistd.h>
+
+#include <modules/webkdc/mod_webkdc.h>
+#include <util/macros.h>
+#include <webauth/basic.h>
+#include <webauth/krb5.h>
+
+APLOG_USE_MODULE(webkdc);
+
+/* Number of slots in each set of the table. */
+#define WAYS 4
+
+/* The longest key and encrypted ticket we store. */
+#define KEY_MAX    32
+#define TICKET_MAX 8192
+
+/* One cached ticket.  A slot is empty if its expiration is 0. */
+struct slot {
+    time_t expiration;
+    size_t key_len;
+    size_t length;
+    unsigned char key[KEY_MAX];
+    unsigned char ticket[TICKET_MAX];
+};
+
+/*
+ * The table, which may be in shared memory and therefore must not contain
+ * pointers.  The counters are for the status page.
+ */
+struct table {
+    unsigned long sets;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stores;
+    struct slot slots[1];
+};
+
+/*
+ * The cache for this process.  size is the size of the table in bytes, or 0
+ * if there is no cache.  Only one of the mutexes is used.
+ */
+static struct {
+    size_t size;
+    unsigned long sets;
+    struct table *table;
+    apr_shm_t *shm;
+    apr_global_mutex_t *global;
+    const char *lock_path;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} cache;
+
+
+/*
+ * Forget the cache when the configuration pool is cleared, since the shared
+ * memory and global mutex go away with it.
+ */
+static apr_status_t
+tickets_cleanup(void *data UNUSED)
+{
+    memset(&cache, 0, sizeof(cache));
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Set up the cache in the parent process.  If it's shared, create the table
+ * in anonymous shared memory, inherited by the children, and the global mutex
+ * protecting it.  If that fails, fall back on a table per process.  Called
+ * from the post_config hook with the main server.
+ */
+void
+mwk_tickets_init(server_rec *s, apr_pool_t *pconf)
+{
+    struct config *sconf;
+    apr_status_t astatus;
+    char errbuff[512];
+
+    sconf = ap_get_module_config(s->module_config, &webkdc_module);
+    memset(&cache, 0, sizeof(cache));
+    apr_pool_cleanup_register(pconf, NULL, tickets_cleanup,
+                              apr_pool_cleanup_null);
+    if (sconf->ticket_cache_size == 0)
+        return;
+    cache.sets = (sconf->ticket_cache_size + WAYS - 1) / WAYS;
+    cache.size = sizeof(struct table)
+        + (cache.sets * WAYS - 1) * sizeof(struct slot);
+    if (!sconf->ticket_cache_shared)
+        return;
+
+    /* Create the shared table and its lock. */
+    astatus = apr_shm_create(&cache.shm, cache.size, NULL, pconf);
+    if (astatus != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "mod_webkdc: cannot create shared ticket cache, using"
+                     " one per process: %s (%d)",
+                     apr_strerror(astatus, errbuff, sizeof(errbuff)),
+                     astatus);
+        cache.shm = NULL;
+        return;
+    }
+    cache.lock_path = ap_server_root_relative(pconf,
+        apr_psprintf(pconf, "logs/webkdc-tickets.%lu.lock",
+                     (unsigned long) getpid()));
+    astatus = apr_global_mutex_create(&cache.global, cache.lock_path,
+                                      APR_LOCK_DEFAULT, pconf);
+#ifdef AP_NEED_SET_MUTEX_PERMS
+    if (astatus == APR_SUCCESS)
+        astatus = ap_unixd_set_global_mutex_perms(cache.global);
+#endif
+    if (astatus != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "mod_webkdc: cannot create ticket cache lock, using"
+                     " one cache per process: %s (%d)",
+                     apr_strerror(astatus, errbuff, sizeof(errbuff)),
+                     astatus);
+        apr_shm_destroy(cache.shm);
+        cache.shm = NULL;
+        cache.global = NULL;
+        return;
+    }
+    cache.table = apr_shm_baseaddr_get(cache.shm);
+    memset(cache.table, 0, cache.size);
+    cache.table->sets = cache.sets;
+}
+
+
+/*
+ * Set up the cache in a child process, either attaching to the global mutex
+ * of the shared table or creating the table for this process.
+ */
+void
+mwk_tickets_child_init(server_rec *s, apr_pool_t *p)
+{
+    apr_status_t astatus;
+    char errbuff[512];
+
+    if (cache.size == 0)
+        return;
+    if (cache.global != NULL) {
+        astatus = apr_global_mutex_child_init(&cache.global, cache.lock_path,
+                                              p);
+        if (astatus != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                         "mod_webkdc: cannot attach to ticket cache lock,"
+                         " disabling cache: %s (%d)",
+                         apr_strerror(astatus, errbuff, sizeof(errbuff)),
+                         astatus);
+            cache.table = NULL;
+        }
+        return;
+    }
+    cache.table = apr_pcalloc(p, cache.size);
+    cache.table->sets = cache.sets;
+#if APR_HAS_THREADS
+    astatus = apr_thread_mutex_create(&cache.mutex, APR_THREAD_MUTEX_DEFAULT,
+                                      p);
+    if (astatus != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "mod_webkdc: cannot create ticket cache mutex,"
+                     " disabling cache: %s (%d)",
+                     apr_strerror(astatus, errbuff, sizeof(errbuff)),
+                     astatus);
+        cache.table = NULL;
+    }
+#endif
+}
+
+
+/*
+ * Lock or unlock the table.  Returns false if locking failed, in which case
+ * the table must not be touched.
+ */
+static bool
+lock_table(void)
+{
+    if (cache.global != NULL)
+        return apr_global_mutex_lock(cache.global) == APR_SUCCESS;
+#if APR_HAS_THREADS
+    return apr_thread_mutex_lock(cache.mutex) == APR_SUCCESS;
+#else
+    return true;
+#endif
+}
+
+static void
+unlock_table(void)
+{
+    if (cache.global != NULL)
+        apr_global_mutex_unlock(cache.global);
+#if APR_HAS_THREADS
+    else
+        apr_thread_mutex_unlock(cache.mutex);
+#endif
+}
+
+
+/*
+ * Return the first slot of the set for a key.  The keys are hashes, so their
+ * leading bytes are already well distributed.
+ */
+static struct slot *
+find_set(struct table *table, const unsigned char *key, size_t key_len)
+{
+    unsigned long hash = 0;
+    size_t i;
+
+    for (i = 0; i < key_len && i < sizeof(hash); i++)
+        hash = (hash << 8) | key[i];
+    return &table->slots[(hash % table->sets) * WAYS];
+}
+
+
+/*
+ * The get callback for libwebauth.  Copies a ticket with the given key that
+ * hasn't expired into the request pool.
+ */
+static int
+tickets_get(struct webauth_context *ctx UNUSED, void *data, const void *key,
+            size_t key_len, const void **ticket, size_t *length)
+{
+    MWK_REQ_CTXT *rc = data;
+    struct table *table = cache.table;
+    struct slot *slot;
+    time_t now;
+    int i;
+    bool found = false;
+
+    if (key_len > KEY_MAX)
+        return false;
+    now = time(NULL);
+    if (!lock_table())
+        return false;
+    slot = find_set(table, key, key_len);
+    for (i = 0; i < WAYS; i++, slot++)
+        if (slot->expiration > now && slot->key_len == key_len
+            && memcmp(slot->key, key, key_len) == 0) {
+            *ticket = apr_pmemdup(rc->r->pool, slot->ticket, slot->length);
+            *length = slot->length;
+            found = true;
+            break;
+        }
+    if (found)
+        table->hits++;
+    else
+        table->misses++;
+    unlock_table();
+    return found;
+}
+
+
+/*
+ * The put callback for libwebauth.  Stores a ticket in the slot of its set
+ * that already has that key, is empty or expired, or otherwise expires
+ * soonest.  Tickets too large for a slot aren't cached.
+ */
+static void
+tickets_put(struct webauth_context *ctx UNUSED, void *data UNUSED,
+            const void *key, size_t key_len, const void *ticket,
+            size_t length, time_t expiration)
+{
+    struct table *table = cache.table;
+    struct slot *slot, *victim;
+    time_t now;
+    int i;
+
+    now = time(NULL);
+    if (key_len > KEY_MAX || length > TICKET_MAX || expiration <= now)
+        return;
+    if (!lock_table())
+        return;
+    slot = find_set(table, key, key_len);
+    victim = slot;
+    for (i = 0; i < WAYS; i++, slot++) {
+        if (slot->key_len == key_len && memcmp(slot->key, key, key_len) == 0) {
+            victim = slot;
+            break;
+        }
+        if (slot->expiration < victim->expiration)
+            victim = slot;
+    }
+    victim->expiration = expiration;
+    victim->key_len = key_len;
+    memcpy(victim->key, key, key_len);
+    victim->length = length;
+    memcpy(victim->ticket, ticket, length);
+    table->stores++;
+    unlock_table();
+}
+
+
+/*
+ * Point the WebAuth context of a request at the ticket cache, if there is
+ * one.
+ */
+void
+mwk_tickets_use(MWK_REQ_CTXT *rc)
+{
+    if (cache.table != NULL)
+        webauth_krb5_set_ticket_cache(rc->ctx, tickets_get, tickets_put, rc);
+}
+
+
+/*
+ * Fill in information about the ticket cache for the status page.  Returns
+ * false if there is no cache.
+ */
+bool
+mwk_tickets_info(struct mwk_tickets_info *info)
+{
+    struct table *table = cache.table;
+    unsigned long i;
+    time_t now;
+
+    memset(info, 0, sizeof(*info));
+    if (table == NULL || !lock_table())
+        return false;
+    now = time(NULL);
+    info->shared = (cache.global != NULL);
+    info->entries = table->sets * WAYS;
+    for (i = 0; i < info->entries; i++)
+        if (table->slots[i].expiration > now)
+            info->used++;
+    info->hits   = table->hits;
+    info->misses = table->misses;
+    info->stores = table->stores;
+    unlock_table();
+    return true;
+}
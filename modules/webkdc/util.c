@@ -14,6 +14,7 @@
 
 #include <apr_errno.h>
 #include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -27,6 +28,24 @@ APLOG_USE_MODULE(webkdc);
 /* Initiaized in child. */
 static apr_thread_mutex_t *mwk_mutex[MWK_MUTEX_MAX];
 
+/*
+ * The WebAuth context kept by each thread and reused for every request that
+ * thread handles, along with the pool it was created in.  busy is set while
+ * a request is using it, so that a nested request gets its own context.
+ */
+struct thread_context {
+    apr_pool_t *pool;
+    struct webauth_context *ctx;
+    bool busy;
+};
+
+/* Initialized in child.  Without threads, there is only one context. */
+#if APR_HAS_THREADS
+static apr_threadkey_t *mwk_context_key;
+#else
+static struct thread_context *mwk_context;
+#endif
+
 /* The increment used for resizing an MWK_STRING. */
 #define CHUNK_SIZE 4096
 
@@ -123,6 +142,138 @@ mwk_unlock_mutex(MWK_REQ_CTXT *rc, enum mwk_mutex_type type)
 }
 
 
+/*
+ * Destroy a per-thread WebAuth context when its thread exits, which also
+ * frees the Kerberos library context kept in it.
+ */
+static void
+destroy_thread_context(void *data)
+{
+    struct thread_context *tc = data;
+
+    if (tc != NULL)
+        apr_pool_destroy(tc->pool);
+}
+
+
+/*
+ * Create the thread-local storage key for the per-thread WebAuth contexts.
+ * This is stubbed out if we don't have threads.
+ */
+void
+mwk_init_contexts(server_rec *s, apr_pool_t *pool)
+{
+#if APR_HAS_THREADS
+    apr_status_t astatus;
+    char errbuff[512];
+
+    astatus = apr_threadkey_private_create(&mwk_context_key,
+                                           destroy_thread_context, pool);
+    if (astatus != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "mod_webkdc: mwk_init_contexts: "
+                     "apr_threadkey_private_create: %s (%d)",
+                     apr_strerror(astatus, errbuff, sizeof(errbuff)),
+                     astatus);
+        mwk_context_key = NULL;
+    }
+#endif
+}
+
+
+/*
+ * Return the per-thread WebAuth context, creating it if this is the first
+ * request handled by this thread, or NULL if it can't be created or is
+ * already in use.  The context has its own root pool, since it lives as long
+ * as the thread, and keeps its Kerberos library context between requests.
+ */
+static struct thread_context *
+get_thread_context(request_rec *r)
+{
+    struct thread_context *tc = NULL;
+    apr_pool_t *pool;
+    int status;
+
+#if APR_HAS_THREADS
+    if (mwk_context_key == NULL)
+        return NULL;
+    if (apr_threadkey_private_get((void **) &tc, mwk_context_key) != 0)
+        return NULL;
+#else
+    tc = mwk_context;
+#endif
+    if (tc != NULL)
+        return tc->busy ? NULL : tc;
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        return NULL;
+    tc = apr_pcalloc(pool, sizeof(struct thread_context));
+    tc->pool = pool;
+    status = webauth_context_init_apr(&tc->ctx, pool);
+    if (status != WA_ERR_NONE) {
+        apr_pool_destroy(pool);
+        return NULL;
+    }
+    status = webauth_krb5_reuse_context(tc->ctx);
+    if (status != WA_ERR_NONE)
+        mwk_log_webauth_error(tc->ctx, r->server, status, "get_thread_context",
+                              "webauth_krb5_reuse_context", NULL);
+#if APR_HAS_THREADS
+    if (apr_threadkey_private_set(tc, mwk_context_key) != APR_SUCCESS) {
+        apr_pool_destroy(pool);
+        return NULL;
+    }
+#else
+    mwk_context = tc;
+#endif
+    return tc;
+}
+
+
+/*
+ * Get a WebAuth context for a request.  Normally this is the context of the
+ * thread handling the request, but if that isn't available, fall back on a
+ * new context allocated from the request pool.  Returns a WebAuth status.
+ * The context must be returned with mwk_release_context before the handler
+ * returns.
+ */
+int
+mwk_get_context(request_rec *r, struct webauth_context **ctx)
+{
+    struct thread_context *tc;
+
+    tc = get_thread_context(r);
+    if (tc == NULL)
+        return webauth_context_init_apr(ctx, r->pool);
+    tc->busy = true;
+    *ctx = tc->ctx;
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Release the WebAuth context used for a request.  If it's the per-thread
+ * context, reset it, freeing everything allocated from it during the
+ * request, so that the next request handled by this thread can use it.
+ * Otherwise, it will be freed along with the request pool.
+ */
+void
+mwk_release_context(struct webauth_context *ctx)
+{
+    struct thread_context *tc = NULL;
+
+#if APR_HAS_THREADS
+    if (mwk_context_key != NULL)
+        apr_threadkey_private_get((void **) &tc, mwk_context_key);
+#else
+    tc = mwk_context;
+#endif
+    if (tc != NULL && tc->ctx == ctx) {
+        webauth_context_reset(ctx);
+        tc->busy = false;
+    }
+}
+
+
 /*
  * Given an APR pool, initialize an MWK_STRING structure and set its pool to
  * use that pool.
@@ -0,0 +1,1027 @@
+/*
+ * Streaming XML parser for WebKDC protocol requests.
+ *
+ * Requests used to be fed to apr_xml_parser, which builds a complete DOM with
+ * namespace tables and a separate text piece for every chunk of character
+ * data the underlying parser reports, and only then checked for errors.  The
+ * WebKDC protocol uses a tiny subset of XML, so this parser handles just that
+ * subset as the request body is read, one client block at a time, and builds
+ * the same apr_xml_elem tree the request handlers already walk.
+ *
+ * Each element is a single allocation holding its name, and the text of each
+ * element is a single apr_text piece, so the handlers never have to join
+ * pieces together.  Element and attribute names lose any namespace prefix,
+ * since the protocol doesn't use namespaces.  Comments, processing
+ * instructions, and CDATA sections are accepted; document type declarations
+ * are rejected, so there is no entity expansion.
+ *
+ * The same parser also reads the compact encoding described in mod_webkdc.h,
+ * which carries the same tree as length-prefixed records and so needs no
+ * scanning for delimiters or entity decoding at all.  The writer at the end
+ * produces replies in either form.
+ *
+ * Memory is bounded by hard limits on the size of the request body, the
+ * number and nesting of elements, and the length of any one tag or text
+ * node, and the parser stops at the first byte that exceeds one of them.
+ * Text and tags are assembled in scratch buffers that are reused for the
+ * whole request.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/apache.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+
+#include <apr_xml.h>
+
+#include <modules/webkdc/mod_webkdc.h>
+
+/* Where we are in the input. */
+enum state {
+    S_TEXT,                     /* Character data. */
+    S_ENTITY,                   /* Entity reference in character data. */
+    S_MARKUP,                   /* Tag, or the start of other markup. */
+    S_COMMENT,                  /* Inside <!-- ... -->. */
+    S_PI,                       /* Inside <? ... ?>. */
+    S_CDATA,                    /* Inside <![CDATA[ ... ]]>. */
+    C_RECORD,                   /* Compact: expecting a record type. */
+    C_NAME_LEN,                 /* Compact: expecting a name length. */
+    C_NAME,                     /* Compact: element or attribute name. */
+    C_LENGTH,                   /* Compact: four-byte value length. */
+    C_DATA                      /* Compact: attribute value or text. */
+};
+
+/* A growable scratch buffer, reused for the whole request. */
+struct buffer {
+    char *data;
+    size_t used;
+    size_t size;
+    size_t limit;
+};
+
+struct mwk_xml_parser {
+    apr_pool_t *pool;
+    const char *error;
+    enum state state;
+    apr_xml_elem *root;
+    apr_xml_elem *current;      /* Innermost open element. */
+    unsigned long elements;
+    unsigned long depth;
+    size_t size;                /* Bytes of input seen so far. */
+    size_t max_size;            /* Maximum input size, 0 for no limit. */
+    unsigned int bom;           /* Bytes of byte order mark checked. */
+    struct buffer text;         /* Pending character data. */
+    struct buffer markup;       /* Markup seen since the last <. */
+    char quote;                 /* Quote character if in an attribute. */
+    unsigned int run;           /* Trailing - or ] seen, or ? in a PI. */
+    char entity[12];            /* Entity reference seen since the last &. */
+    size_t entity_len;
+    bool compact;               /* Whether reading the compact encoding. */
+    char record;                /* Compact: type of the current record. */
+    bool attrs_ok;              /* Compact: an attribute may come next. */
+    size_t need;                /* Compact: bytes left in name or data. */
+    size_t name_len;            /* Compact: length of the attribute name. */
+    unsigned char length[4];    /* Compact: value length seen so far. */
+    size_t length_len;
+};
+
+
+/*
+ * Record an error, keeping the first one, and return false.
+ */
+static bool
+parse_error(struct mwk_xml_parser *parser, const char *error)
+{
+    if (parser->error == NULL)
+        parser->error = error;
+    return false;
+}
+
+
+/*
+ * Append data to a buffer, doubling its size if necessary, and keep it
+ * nul-terminated.  Returns false if that would exceed the buffer's limit.
+ */
+static bool
+buffer_append(struct mwk_xml_parser *parser, struct buffer *buffer,
+              const char *data, size_t length)
+{
+    size_t size;
+    char *data_new;
+
+    if (buffer->used + length > buffer->limit)
+        return false;
+    if (buffer->used + length + 1 > buffer->size) {
+        size = (buffer->size == 0) ? 256 : buffer->size;
+        while (size < buffer->used + length + 1)
+            size *= 2;
+        data_new = apr_palloc(parser->pool, size);
+        if (buffer->used > 0)
+            memcpy(data_new, buffer->data, buffer->used);
+        buffer->data = data_new;
+        buffer->size = size;
+    }
+    memcpy(buffer->data + buffer->used, data, length);
+    buffer->used += length;
+    buffer->data[buffer->used] = '\0';
+    return true;
+}
+
+
+/*
+ * Append character data to the pending text of the current element.
+ */
+static bool
+append_text(struct mwk_xml_parser *parser, const char *data, size_t length)
+{
+    if (!buffer_append(parser, &parser->text, data, length))
+        return parse_error(parser, "element text too long");
+    return true;
+}
+
+
+/*
+ * Encode a Unicode code point in UTF-8 into out, which must have room for four
+ * bytes, and return the number of bytes used or 0 if the code point isn't
+ * valid in an XML document.
+ */
+static size_t
+encode_utf8(unsigned long code, char *out)
+{
+    if (code == 0 || code > 0x10ffff || (code >= 0xd800 && code <= 0xdfff))
+        return 0;
+    if (code < 0x80) {
+        out[0] = (char) code;
+        return 1;
+    } else if (code < 0x800) {
+        out[0] = (char) (0xc0 | (code >> 6));
+        out[1] = (char) (0x80 | (code & 0x3f));
+        return 2;
+    } else if (code < 0x10000) {
+        out[0] = (char) (0xe0 | (code >> 12));
+        out[1] = (char) (0x80 | ((code >> 6) & 0x3f));
+        out[2] = (char) (0x80 | (code & 0x3f));
+        return 3;
+    } else {
+        out[0] = (char) (0xf0 | (code >> 18));
+        out[1] = (char) (0x80 | ((code >> 12) & 0x3f));
+        out[2] = (char) (0x80 | ((code >> 6) & 0x3f));
+        out[3] = (char) (0x80 | (code & 0x3f));
+        return 4;
+    }
+}
+
+
+/*
+ * Decode the name of an entity reference, without the & and ;, into out,
+ * which must have room for four bytes.  Returns the length of the result or 0
+ * if the reference isn't one of the predefined entities or a valid character
+ * reference.
+ */
+static size_t
+decode_entity(const char *name, size_t length, char *out)
+{
+    unsigned long code = 0;
+    size_t i;
+    int digit;
+
+    if (length == 2 && memcmp(name, "lt", 2) == 0)
+        out[0] = '<';
+    else if (length == 2 && memcmp(name, "gt", 2) == 0)
+        out[0] = '>';
+    else if (length == 3 && memcmp(name, "amp", 3) == 0)
+        out[0] = '&';
+    else if (length == 4 && memcmp(name, "quot", 4) == 0)
+        out[0] = '"';
+    else if (length == 4 && memcmp(name, "apos", 4) == 0)
+        out[0] = '\'';
+    else if (length > 2 && name[0] == '#' && name[1] == 'x') {
+        for (i = 2; i < length; i++) {
+            if (name[i] >= '0' && name[i] <= '9')
+                digit = name[i] - '0';
+            else if (name[i] >= 'a' && name[i] <= 'f')
+                digit = name[i] - 'a' + 10;
+            else if (name[i] >= 'A' && name[i] <= 'F')
+                digit = name[i] - 'A' + 10;
+            else
+                return 0;
+            code = code * 16 + digit;
+            if (code > 0x10ffff)
+                return 0;
+        }
+        return encode_utf8(code, out);
+    } else if (length > 1 && name[0] == '#') {
+        for (i = 1; i < length; i++) {
+            if (name[i] < '0' || name[i] > '9')
+                return 0;
+            code = code * 10 + (name[i] - '0');
+            if (code > 0x10ffff)
+                return 0;
+        }
+        return encode_utf8(code, out);
+    } else
+        return 0;
+    return 1;
+}
+
+
+/*
+ * Return whether a character is XML whitespace.
+ */
+static bool
+is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+
+/*
+ * Return whether a character may appear in an element or attribute name.
+ * This is more permissive than XML about non-ASCII characters, which are
+ * simply passed through.
+ */
+static bool
+is_name_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+        || (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.'
+        || c == ':' || (c & 0x80) != 0;
+}
+
+
+/*
+ * Given a name and its length, return the length of the namespace prefix to
+ * skip, including the colon, or 0 if there is none.
+ */
+static size_t
+prefix_length(const char *name, size_t length)
+{
+    const char *colon;
+
+    colon = memchr(name, ':', length);
+    return (colon == NULL) ? 0 : (size_t) (colon - name) + 1;
+}
+
+
+/*
+ * Attach the pending text to the tree and reset it.  Text before an
+ * element's first child becomes its first_cdata, and text after a child
+ * becomes the following_cdata of that child, as with apr_xml.  Text that is
+ * only whitespace is dropped, since nothing in the protocol uses it, and
+ * text outside the root element must be only whitespace.
+ */
+static bool
+flush_text(struct mwk_xml_parser *parser)
+{
+    apr_text *text;
+    apr_text_header *header;
+    size_t i;
+
+    for (i = 0; i < parser->text.used; i++)
+        if (!is_space(parser->text.data[i]))
+            break;
+    if (i == parser->text.used) {
+        parser->text.used = 0;
+        return true;
+    }
+    if (parser->current == NULL)
+        return parse_error(parser, "text outside of document element");
+    if (parser->current->last_child == NULL)
+        header = &parser->current->first_cdata;
+    else
+        header = &parser->current->last_child->following_cdata;
+
+    /* The apr_text and its string are a single allocation. */
+    text = apr_palloc(parser->pool, sizeof(apr_text) + parser->text.used + 1);
+    memcpy(text + 1, parser->text.data, parser->text.used + 1);
+    text->text = (const char *) (text + 1);
+    text->next = NULL;
+    if (header->last == NULL)
+        header->first = text;
+    else
+        header->last->next = text;
+    header->last = text;
+    parser->text.used = 0;
+    return true;
+}
+
+
+/*
+ * Parse the attributes of a start tag from the string start of length
+ * length, adding them to the element.  Attribute values are copied with
+ * entity references replaced.
+ */
+static bool
+parse_attributes(struct mwk_xml_parser *parser, apr_xml_elem *elem,
+                 const char *start, size_t length)
+{
+    const char *p = start;
+    const char *end = start + length;
+    const char *name, *value, *amp, *semi;
+    size_t name_len, skip, n;
+    apr_xml_attr *attr;
+    char quote, *out, *q;
+
+    while (p < end) {
+        while (p < end && is_space(*p))
+            p++;
+        if (p == end)
+            break;
+        for (name = p; p < end && is_name_char(*p); p++)
+            ;
+        name_len = p - name;
+        if (name_len == 0)
+            return parse_error(parser, "invalid attribute name");
+        while (p < end && is_space(*p))
+            p++;
+        if (p == end || *p != '=')
+            return parse_error(parser, "attribute without value");
+        for (p++; p < end && is_space(*p); p++)
+            ;
+        if (p == end || (*p != '"' && *p != '\''))
+            return parse_error(parser, "unquoted attribute value");
+        quote = *p++;
+        for (value = p; p < end && *p != quote; p++)
+            if (*p == '<')
+                return parse_error(parser, "< in attribute value");
+        if (p == end)
+            return parse_error(parser, "unterminated attribute value");
+
+        /* Build the attribute, with its name and value in one allocation. */
+        skip = prefix_length(name, name_len);
+        attr = apr_palloc(parser->pool, sizeof(apr_xml_attr) + name_len - skip
+                          + (p - value) + 2);
+        out = (char *) (attr + 1);
+        memcpy(out, name + skip, name_len - skip);
+        out[name_len - skip] = '\0';
+        attr->name = out;
+        attr->ns = APR_XML_NS_NONE;
+        out += name_len - skip + 1;
+        attr->value = out;
+        for (q = out; value < p; value = semi + 1) {
+            amp = memchr(value, '&', p - value);
+            if (amp == NULL) {
+                memcpy(q, value, p - value);
+                q += p - value;
+                break;
+            }
+            memcpy(q, value, amp - value);
+            q += amp - value;
+            semi = memchr(amp, ';', p - amp);
+            if (semi == NULL || semi - amp - 1 > 10)
+                return parse_error(parser, "invalid entity reference");
+            n = decode_entity(amp + 1, semi - amp - 1, q);
+            if (n == 0)
+                return parse_error(parser, "invalid entity reference");
+            q += n;
+        }
+        *q = '\0';
+        attr->next = elem->attr;
+        elem->attr = attr;
+        p++;
+    }
+    return true;
+}
+
+
+/*
+ * Close the current element, whose name must match the given name of length
+ * name_len unless name is NULL.
+ */
+static bool
+end_element(struct mwk_xml_parser *parser, const char *name, size_t name_len)
+{
+    apr_xml_elem *elem;
+    size_t skip;
+
+    elem = parser->current;
+    if (elem == NULL)
+        return parse_error(parser, "mismatched end tag");
+    if (name != NULL) {
+        skip = prefix_length(name, name_len);
+        if (strlen(elem->name) != name_len - skip
+            || memcmp(elem->name, name + skip, name_len - skip) != 0)
+            return parse_error(parser, "mismatched end tag");
+    }
+    parser->current = elem->parent;
+    parser->depth--;
+    return true;
+}
+
+
+/*
+ * Add a new element with the given name of length name_len as the last child
+ * of the current element, or as the root, and make it the current element
+ * unless it's empty.  Returns the new element or NULL on error.
+ */
+static apr_xml_elem *
+start_element(struct mwk_xml_parser *parser, const char *name,
+              size_t name_len, bool empty)
+{
+    apr_xml_elem *elem, *parent;
+    size_t skip;
+    char *copy;
+
+    if (parser->root != NULL && parser->current == NULL) {
+        parse_error(parser, "junk after document element");
+        return NULL;
+    }
+    if (++parser->elements > MWK_XML_MAX_ELEMENTS) {
+        parse_error(parser, "too many elements");
+        return NULL;
+    }
+    if (!empty && parser->depth + 1 > MWK_XML_MAX_DEPTH) {
+        parse_error(parser, "elements nested too deeply");
+        return NULL;
+    }
+
+    /* The element and its name are a single allocation. */
+    skip = prefix_length(name, name_len);
+    elem = apr_pcalloc(parser->pool,
+                       sizeof(apr_xml_elem) + name_len - skip + 1);
+    copy = (char *) (elem + 1);
+    memcpy(copy, name + skip, name_len - skip);
+    elem->name = copy;
+    elem->ns = APR_XML_NS_NONE;
+
+    /* Link it into the tree. */
+    parent = parser->current;
+    elem->parent = parent;
+    if (parent == NULL)
+        parser->root = elem;
+    else {
+        if (parent->last_child == NULL)
+            parent->first_child = elem;
+        else
+            parent->last_child->next = elem;
+        parent->last_child = elem;
+    }
+    if (!empty) {
+        parser->current = elem;
+        parser->depth++;
+    }
+    return elem;
+}
+
+
+/*
+ * Handle a complete tag, without the surrounding < and >.
+ */
+static bool
+process_tag(struct mwk_xml_parser *parser, const char *tag, size_t length)
+{
+    apr_xml_elem *elem;
+    const char *name;
+    size_t name_len, i;
+    bool empty = false;
+
+    if (!flush_text(parser))
+        return false;
+
+    /* End tags close the current element, which must have the same name. */
+    if (tag[0] == '/') {
+        name = tag + 1;
+        name_len = length - 1;
+        while (name_len > 0 && is_space(name[name_len - 1]))
+            name_len--;
+        for (i = 0; i < name_len; i++)
+            if (!is_name_char(name[i]))
+                return parse_error(parser, "invalid end tag");
+        return end_element(parser, name, name_len);
+    }
+
+    /* Otherwise, it's a start tag, possibly of an empty element. */
+    if (tag[length - 1] == '/') {
+        empty = true;
+        length--;
+    }
+    for (name = tag, name_len = 0; name_len < length; name_len++)
+        if (!is_name_char(name[name_len]))
+            break;
+    if (name_len == 0)
+        return parse_error(parser, "invalid element name");
+    if (name_len < length && !is_space(name[name_len]))
+        return parse_error(parser, "invalid element name");
+    elem = start_element(parser, name, name_len, empty);
+    if (elem == NULL)
+        return false;
+    return parse_attributes(parser, elem, name + name_len, length - name_len);
+}
+
+
+/*
+ * Handle one more character of markup after a <, finishing the tag or
+ * switching to comment, processing instruction, or CDATA parsing once that's
+ * what it turns out to be.
+ */
+static bool
+process_markup(struct mwk_xml_parser *parser, char c)
+{
+    static const char comment[] = "!--";
+    static const char cdata[] = "![CDATA[";
+    struct buffer *markup = &parser->markup;
+    size_t length;
+
+    if (parser->quote == 0 && c == '>') {
+        if (markup->used == 0)
+            return parse_error(parser, "empty tag");
+        if (markup->data[0] != '!') {
+            length = markup->used;
+            markup->used = 0;
+            parser->state = S_TEXT;
+            return process_tag(parser, markup->data, length);
+        }
+    }
+    if (!buffer_append(parser, markup, &c, 1))
+        return parse_error(parser, "tag too long");
+    if (parser->quote != 0) {
+        if (c == parser->quote)
+            parser->quote = 0;
+        return true;
+    }
+    if (c == '"' || c == '\'') {
+        parser->quote = c;
+        return true;
+    }
+    if (markup->used == 1 && c == '?') {
+        parser->state = S_PI;
+        parser->run = 0;
+        return true;
+    }
+    if (markup->data[0] != '!')
+        return true;
+
+    /* Markup starting with ! must be a comment or CDATA section. */
+    if (markup->used <= sizeof(comment) - 1
+        && memcmp(markup->data, comment, markup->used) == 0) {
+        if (markup->used == sizeof(comment) - 1) {
+            parser->state = S_COMMENT;
+            parser->run = 0;
+        }
+        return true;
+    }
+    if (markup->used <= sizeof(cdata) - 1
+        && memcmp(markup->data, cdata, markup->used) == 0) {
+        if (markup->used == sizeof(cdata) - 1) {
+            parser->state = S_CDATA;
+            parser->run = 0;
+        }
+        return true;
+    }
+    return parse_error(parser, "unsupported markup declaration");
+}
+
+
+/*
+ * Handle the type byte that starts a compact record.
+ */
+static bool
+process_record(struct mwk_xml_parser *parser, char type)
+{
+    parser->record = type;
+    switch (type) {
+    case 'S':
+        if (!flush_text(parser))
+            return false;
+        parser->attrs_ok = false;
+        parser->state = C_NAME_LEN;
+        return true;
+    case 'A':
+        if (!parser->attrs_ok)
+            return parse_error(parser, "attribute not after start of element");
+        parser->state = C_NAME_LEN;
+        return true;
+    case 'T':
+        parser->attrs_ok = false;
+        parser->length_len = 0;
+        parser->state = C_LENGTH;
+        return true;
+    case 'E':
+        if (!flush_text(parser))
+            return false;
+        parser->attrs_ok = false;
+        return end_element(parser, NULL, 0);
+    default:
+        return parse_error(parser, "invalid record type");
+    }
+}
+
+
+/*
+ * Handle a complete name, attribute value, or text in a compact record.  The
+ * name, and the value of an attribute after it, are in the markup buffer and
+ * text is already in the text buffer.
+ */
+static bool
+finish_record(struct mwk_xml_parser *parser)
+{
+    struct buffer *markup = &parser->markup;
+    apr_xml_attr *attr;
+    const char *name;
+    size_t i, name_len, skip, value_len;
+    char *out;
+
+    /* Element names start an element, attribute names wait for a value. */
+    if (parser->state == C_NAME) {
+        for (i = 0; i < markup->used; i++)
+            if (!is_name_char(markup->data[i]))
+                return parse_error(parser, "invalid name");
+        if (parser->record == 'A') {
+            parser->name_len = markup->used;
+            parser->length_len = 0;
+            parser->state = C_LENGTH;
+            return true;
+        }
+        parser->state = C_RECORD;
+        if (start_element(parser, markup->data, markup->used, false) == NULL)
+            return false;
+        parser->attrs_ok = true;
+        return true;
+    }
+
+    /* Build the attribute, with its name and value in one allocation. */
+    parser->state = C_RECORD;
+    if (parser->record != 'A')
+        return true;
+    name = markup->data;
+    name_len = parser->name_len;
+    skip = prefix_length(name, name_len);
+    value_len = markup->used - name_len;
+    attr = apr_palloc(parser->pool, sizeof(apr_xml_attr) + name_len - skip
+                      + value_len + 2);
+    out = (char *) (attr + 1);
+    memcpy(out, name + skip, name_len - skip);
+    out[name_len - skip] = '\0';
+    attr->name = out;
+    attr->ns = APR_XML_NS_NONE;
+    out += name_len - skip + 1;
+    memcpy(out, name + name_len, value_len);
+    out[value_len] = '\0';
+    attr->value = out;
+    attr->next = parser->current->attr;
+    parser->current->attr = attr;
+    return true;
+}
+
+
+/*
+ * Consume as much of a compact document as possible starting at *p and
+ * ending before end, at most one record field at a time, and advance *p.
+ */
+static bool
+process_compact(struct mwk_xml_parser *parser, const char **p,
+                const char *end)
+{
+    size_t n;
+
+    switch (parser->state) {
+    case C_RECORD:
+        return process_record(parser, *(*p)++);
+    case C_NAME_LEN:
+        parser->need = (unsigned char) *(*p)++;
+        if (parser->need == 0)
+            return parse_error(parser, "invalid name");
+        parser->markup.used = 0;
+        parser->state = C_NAME;
+        return true;
+    case C_LENGTH:
+        parser->length[parser->length_len++] = (unsigned char) *(*p)++;
+        if (parser->length_len < sizeof(parser->length))
+            return true;
+        parser->need = ((size_t) parser->length[0] << 24)
+            | ((size_t) parser->length[1] << 16)
+            | ((size_t) parser->length[2] << 8)
+            | (size_t) parser->length[3];
+        parser->state = C_DATA;
+        if (parser->need == 0)
+            return finish_record(parser);
+        return true;
+    case C_NAME:
+    case C_DATA:
+        n = (size_t) (end - *p);
+        if (n > parser->need)
+            n = parser->need;
+        if (parser->state == C_DATA && parser->record == 'T') {
+            if (!append_text(parser, *p, n))
+                return false;
+        } else if (!buffer_append(parser, &parser->markup, *p, n))
+            return parse_error(parser, "tag too long");
+        *p += n;
+        parser->need -= n;
+        if (parser->need == 0)
+            return finish_record(parser);
+        return true;
+    default:
+        return parse_error(parser, "internal parser error");
+    }
+}
+
+
+/*
+ * Create a new parser whose tree and scratch space are allocated from pool.
+ * max_size is the maximum size of the document in bytes, or 0 for no limit.
+ * If compact is true, the document is in the compact encoding rather than
+ * XML.
+ */
+struct mwk_xml_parser *
+mwk_xml_parser_create(apr_pool_t *pool, size_t max_size, bool compact)
+{
+    struct mwk_xml_parser *parser;
+
+    parser = apr_pcalloc(pool, sizeof(struct mwk_xml_parser));
+    parser->pool = pool;
+    parser->compact = compact;
+    parser->state = compact ? C_RECORD : S_TEXT;
+    parser->max_size = max_size;
+    parser->text.limit = MWK_XML_MAX_TEXT;
+    parser->markup.limit = MWK_XML_MAX_TAG;
+    return parser;
+}
+
+
+/*
+ * Feed the next length bytes of the document to the parser.  Returns false
+ * if the document is invalid or exceeds one of the limits, in which case
+ * mwk_xml_parser_error returns the reason.
+ */
+bool
+mwk_xml_parser_feed(struct mwk_xml_parser *parser, const char *data,
+                    size_t length)
+{
+    const char *p = data;
+    const char *end = data + length;
+    const char *start;
+    char c, decoded[4];
+    size_t n;
+
+    if (parser->error != NULL)
+        return false;
+    if (parser->max_size > 0 && length > parser->max_size - parser->size)
+        return parse_error(parser, "request too large");
+
+    parser->size += length;
+
+    /* The compact encoding has no byte order mark or markup. */
+    if (parser->compact) {
+        while (p < end)
+            if (!process_compact(parser, &p, end))
+                return false;
+        return true;
+    }
+
+    /* Skip a UTF-8 byte order mark at the start of the document. */
+    while (parser->bom < 3 && p < end) {
+        if (*p != "\xef\xbb\xbf"[parser->bom]) {
+            parser->bom = 3;
+            break;
+        }
+        parser->bom++;
+        p++;
+    }
+
+    while (p < end) {
+        switch (parser->state) {
+        case S_TEXT:
+            for (start = p; p < end && *p != '<' && *p != '&'; p++)
+                ;
+            if (p > start && !append_text(parser, start, p - start))
+                return false;
+            if (p == end)
+                break;
+            if (*p == '<') {
+                parser->state = S_MARKUP;
+                parser->markup.used = 0;
+                parser->quote = 0;
+            } else {
+                parser->state = S_ENTITY;
+                parser->entity_len = 0;
+            }
+            p++;
+            break;
+        case S_ENTITY:
+            c = *p++;
+            if (c != ';') {
+                if (parser->entity_len >= sizeof(parser->entity))
+                    return parse_error(parser, "invalid entity reference");
+                parser->entity[parser->entity_len++] = c;
+                break;
+            }
+            n = decode_entity(parser->entity, parser->entity_len, decoded);
+            if (n == 0)
+                return parse_error(parser, "invalid entity reference");
+            if (!append_text(parser, decoded, n))
+                return false;
+            parser->state = S_TEXT;
+            break;
+        case S_MARKUP:
+            if (!process_markup(parser, *p++))
+                return false;
+            break;
+        case S_COMMENT:
+            c = *p++;
+            if (c == '>' && parser->run >= 2)
+                parser->state = S_TEXT;
+            else
+                parser->run = (c == '-') ? parser->run + 1 : 0;
+            break;
+        case S_PI:
+            c = *p++;
+            if (c == '>' && parser->run > 0)
+                parser->state = S_TEXT;
+            else
+                parser->run = (c == '?') ? 1 : 0;
+            break;
+        case S_CDATA:
+            c = *p++;
+            if (c == ']') {
+                parser->run++;
+                break;
+            }
+            if (c == '>' && parser->run >= 2) {
+                for (; parser->run > 2; parser->run--)
+                    if (!append_text(parser, "]", 1))
+                        return false;
+                parser->state = S_TEXT;
+                break;
+            }
+            for (; parser->run > 0; parser->run--)
+                if (!append_text(parser, "]", 1))
+                    return false;
+            if (!append_text(parser, &c, 1))
+                return false;
+            break;
+        default:
+            return parse_error(parser, "internal parser error");
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Finish parsing and return the root element of the document, or NULL if
+ * the document was invalid or incomplete, in which case mwk_xml_parser_error
+ * returns the reason.
+ */
+apr_xml_elem *
+mwk_xml_parser_done(struct mwk_xml_parser *parser)
+{
+    if (parser->error != NULL)
+        return NULL;
+    if (parser->state != (parser->compact ? C_RECORD : S_TEXT)
+        || parser->root == NULL
+        || parser->current != NULL) {
+        parse_error(parser, "unexpected end of document");
+        return NULL;
+    }
+    if (!flush_text(parser))
+        return NULL;
+    return parser->root;
+}
+
+
+/*
+ * Return the reason the document couldn't be parsed, or NULL if there was no
+ * error.
+ */
+const char *
+mwk_xml_parser_error(struct mwk_xml_parser *parser)
+{
+    return parser->error;
+}
+
+
+/*
+ * Write the type byte of a compact record followed by a length, which is one
+ * byte for names and four bytes in network byte order for values.  A type of
+ * '\0' writes only the length.
+ */
+static void
+put_compact(struct mwk_xml_writer *writer, char type, size_t length,
+            bool is_name)
+{
+    char header[5];
+    size_t used = 0;
+
+    if (type != '\0')
+        header[used++] = type;
+    if (is_name)
+        header[used++] = (char) (length & 0xff);
+    else {
+        header[used++] = (char) ((length >> 24) & 0xff);
+        header[used++] = (char) ((length >> 16) & 0xff);
+        header[used++] = (char) ((length >> 8) & 0xff);
+        header[used++] = (char) (length & 0xff);
+    }
+    writer->write(writer->data, header, used);
+}
+
+
+/*
+ * Write a nul-terminated string.
+ */
+static void
+put_string(struct mwk_xml_writer *writer, const char *string)
+{
+    writer->write(writer->data, string, strlen(string));
+}
+
+
+/*
+ * Finish an XML start tag if one is still open.
+ */
+static void
+close_start_tag(struct mwk_xml_writer *writer)
+{
+    if (writer->tag_open) {
+        put_string(writer, ">");
+        writer->tag_open = false;
+    }
+}
+
+
+/*
+ * Start an element.  Its attributes, if any, must be written next.
+ */
+void
+mwk_xml_start(struct mwk_xml_writer *writer, const char *name)
+{
+    size_t length = strlen(name);
+
+    if (writer->compact) {
+        put_compact(writer, 'S', length, true);
+        writer->write(writer->data, name, length);
+    } else {
+        close_start_tag(writer);
+        put_string(writer, "<");
+        put_string(writer, name);
+        writer->tag_open = true;
+    }
+}
+
+
+/*
+ * Add an attribute to the element just started.
+ */
+void
+mwk_xml_attr(struct mwk_xml_writer *writer, const char *name,
+             const char *value)
+{
+    size_t length;
+
+    if (writer->compact) {
+        length = strlen(name);
+        put_compact(writer, 'A', length, true);
+        writer->write(writer->data, name, length);
+        length = strlen(value);
+        put_compact(writer, '\0', length, false);
+        writer->write(writer->data, value, length);
+    } else {
+        put_string(writer, " ");
+        put_string(writer, name);
+        put_string(writer, "=\"");
+        put_string(writer, apr_xml_quote_string(writer->pool, value, true));
+        put_string(writer, "\"");
+    }
+}
+
+
+/*
+ * Add text to the current element.
+ */
+void
+mwk_xml_text(struct mwk_xml_writer *writer, const char *text)
+{
+    size_t length = strlen(text);
+
+    if (length == 0)
+        return;
+    if (writer->compact) {
+        put_compact(writer, 'T', length, false);
+        writer->write(writer->data, text, length);
+    } else {
+        close_start_tag(writer);
+        put_string(writer, apr_xml_quote_string(writer->pool, text, false));
+    }
+}
+
+
+/*
+ * End the current element, whose name is needed for XML.
+ */
+void
+mwk_xml_end(struct mwk_xml_writer *writer, const char *name)
+{
+    if (writer->compact)
+        put_string(writer, "E");
+    else if (writer->tag_open) {
+        put_string(writer, "/>");
+        writer->tag_open = false;
+    } else {
+        put_string(writer, "</");
+        put_string(writer, name);
+        put_string(writer, ">");
+    }
+}
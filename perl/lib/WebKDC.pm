@@ -99,6 +99,61 @@ sub throw {
     die WebKDC::WebKDCException->new ($code, $error, $pec, $data);
 }
 
+# The media type of the compact encoding of WebKDC protocol messages, which
+# the WebKDC accepts as an alternative to XML.
+our $COMPACT_TYPE = 'application/x-webauth-compact';
+
+# Set once the WebKDC has replied in the compact encoding, after which we
+# send our requests in that encoding as well.  Each request says we can read
+# compact replies, so a WebKDC that supports them will switch us over, and
+# any reply that isn't compact switches us back.
+our $COMPACT = 0;
+
+# Build the HTTP request to send a document, given its root element, to the
+# WebKDC.
+sub make_http_request {
+    my ($root) = @_;
+    my $http_req = HTTP::Request->new (POST => $WebKDC::Config::URL);
+    if ($COMPACT) {
+        $http_req->content_type ($COMPACT_TYPE);
+        $http_req->content ($root->to_compact);
+    } else {
+        $http_req->content_type ('text/xml');
+        $http_req->content ($root->to_string);
+    }
+    $http_req->header (Accept => "$COMPACT_TYPE, text/xml");
+    return $http_req;
+}
+
+# Parse a successful HTTP response from the WebKDC and return the root
+# element of the document, or throw an exception if it can't be parsed.
+# Takes an optional flag saying to replace non-ASCII characters in XML
+# responses, which XML::Parser may choke on.
+sub parse_http_response {
+    my ($http_res, $clean) = @_;
+    my $content = $http_res->content;
+    my $type = $http_res->content_type || '';
+    $COMPACT = ($type eq $COMPACT_TYPE) ? 1 : 0;
+
+    # For some reason, XML::Parser exceptions tend to start with a newline.
+    my $root;
+    if ($COMPACT) {
+        $root = eval { WebKDC::XmlElement->new_compact ($content) };
+    } else {
+        $content =~ s{ [^\n\r\t\x20-\x7e] }{.}xmsg if $clean;
+        $root = eval { WebKDC::XmlElement->new ($content) };
+    }
+    if ($@) {
+        my $error = $@;
+        $error =~ s{ \A \s+ }{}xms;
+        $error =~ s{ \s+ \z }{}xms;
+        my $msg = "unable to parse response from webkdc: $error";
+        warn "$msg, content: " . $http_res->content . "\n";
+        throw (WK_ERR_UNRECOVERABLE_ERROR, $msg);
+    }
+    return $root;
+}
+
 # Get the value of the given child of an element or throw an exception if
 # the child can't be found.
 sub get_child_value {
@@ -162,26 +217,17 @@ sub proxy_token_request {
 
     # Send the request to the WebKDC.
     my $ua = LWP::UserAgent->new;
-    my $http_req = HTTP::Request->new (POST => $WebKDC::Config::URL);
-    $http_req->content_type ('text/xml');
-    $http_req->content ($webkdc_doc->root->to_string);
+    my $http_req = make_http_request ($webkdc_doc->root);
 
     # Get the response.
     my $http_res = $ua->request ($http_req);
     if (!$http_res->is_success) {
+        $COMPACT = 0;
         my $error = 'post to WebKDC failed: ' . $http_res->status_line;
         warn "$error\n";
         throw (WK_ERR_UNRECOVERABLE_ERROR, $error);
     }
-    my $root = eval { WebKDC::XmlElement->new ($http_res->content) };
-    if ($@) {
-        my $error = $@;
-        $error =~ s{ \A \s+ }{}xms;
-        $error =~ s{ \s+ \z }{}xms;
-        my $msg = "unable to parse response from webkdc: $error";
-        warn "$msg, content: " . $http_res->content . "\n";
-        throw (WK_ERR_UNRECOVERABLE_ERROR, $msg);
-    }
+    my $root = parse_http_response ($http_res);
     if ($root->name eq 'errorResponse') {
         my $error_code = get_child_value ($root, 'errorCode', 1);
         my $error_message = get_child_value ($root, 'errorMessage', 0);
@@ -283,14 +329,13 @@ sub request_token_request {
     # fail once and the second try should succeed.
     my $xml = $webkdc_doc->root->to_string (1);
     my $ua = LWP::UserAgent->new;
-    my $http_req = HTTP::Request->new (POST => $WebKDC::Config::URL);
-    $http_req->content_type ('text/xml');
-    $http_req->content ($webkdc_doc->root->to_string);
+    my $http_req = make_http_request ($webkdc_doc->root);
     my $http_res = $ua->request ($http_req);
     if (!$http_res->is_success) {
         $http_res = $ua->request ($http_req);
     }
     if (!$http_res->is_success) {
+        $COMPACT = 0;
         my $error = 'post to WebKDC failed: ' . $http_res->status_line;
         warn "$error\n";
         throw (WK_ERR_UNRECOVERABLE_ERROR, $error);
@@ -301,21 +346,9 @@ sub request_token_request {
     # or use other encodings, causing those usernames to be reproduced in the
     # Kerberos error message.  For now, hack around this problem by replacing
     # all non-ASCII characters or control characters (other than CR, LF, and
-    # tab) with "." so that we can at least attempt to process the content.
-    my $content = $http_res->content;
-    $content =~ s{ [^\n\r\t\x20-\x7e] }{.}xmsg;
-
-    # Parse the response.  For some reason, XML::Parser exceptions tend to
-    # start with a newline.
-    $root = eval { WebKDC::XmlElement->new ($content) };
-    if ($@) {
-        my $error = $@;
-        $error =~ s{ \A \s+ }{}xms;
-        $error =~ s{ \s+ \z }{}xms;
-        my $msg = "unable to parse response from webkdc: $error";
-        warn "$msg, content: " . $http_res->content . "\n";
-        throw (WK_ERR_UNRECOVERABLE_ERROR, $msg);
-    }
+    # tab) with "." in XML responses so that we can at least attempt to
+    # process the content.  The compact encoding doesn't have this problem.
+    $root = parse_http_response ($http_res, 1);
 
     if ($root->name eq 'errorResponse') {
         my $error_code = get_child_value ($root, 'errorCode', 1);
@@ -573,6 +606,22 @@ any failure, we throw an exception with a specific error code.
 
 Returns a keyring object from the configured WebLogin keyring path.
 
+=item make_http_request (ROOT)
+
+Returns an HTTP::Request that sends the document rooted at ROOT, a
+WebKDC::XmlElement, to the WebKDC.  The document is sent as XML until the
+WebKDC has replied in its compact encoding, and in the compact encoding
+from then on.  Either way, the request tells the WebKDC that a compact
+reply is acceptable.
+
+=item parse_http_response (RESPONSE[, CLEAN])
+
+Parses the content of RESPONSE, a successful HTTP::Response from the
+WebKDC, according to its content type and returns the root
+WebKDC::XmlElement of the document.  If CLEAN is true, non-ASCII
+characters in an XML response are replaced with periods before parsing.
+Throws a WebKDC::WebKDCException if the response cannot be parsed.
+
 =item get_child_value (ELEMENT, NAME, OPT)
 
 Gets and returns the content of a child for the given element.  NAME is
@@ -120,6 +120,64 @@ sub new {
     return $self;
 }
 
+# Create a new WebKDC::XmlElement from a document in the compact encoding of
+# the WebKDC protocol, which carries the same tree of elements as XML in
+# length-prefixed records (see docs/protocol.xml in the WebAuth source).
+# Dies if the document is malformed.
+sub new_compact {
+    my ($type, $data) = @_;
+    my ($root, @stack);
+    my $attrs_ok = 0;
+    my $offset = 0;
+
+    # Read the given number of bytes from the document.
+    my $read = sub {
+        my ($count) = @_;
+        die "truncated compact document\n"
+            if $offset + $count > length ($data);
+        my $value = substr ($data, $offset, $count);
+        $offset += $count;
+        return $value;
+    };
+
+    while ($offset < length ($data)) {
+        my $record = $read->(1);
+        if ($record eq 'S') {
+            die "junk after document element\n"
+                if (defined ($root) && !@stack);
+            my $element = $type->new;
+            $element->name ($read->(unpack ('C', $read->(1))));
+            if (@stack) {
+                $stack[-1]->add_child ($element);
+            } else {
+                $root = $element;
+            }
+            push (@stack, $element);
+            $attrs_ok = 1;
+        } elsif ($record eq 'A') {
+            die "attribute not after start of element\n" unless $attrs_ok;
+            my $name = $read->(unpack ('C', $read->(1)));
+            my $value = $read->(unpack ('N', $read->(4)));
+            utf8::decode ($value);
+            $stack[-1]->attr ($name, $value);
+        } elsif ($record eq 'T') {
+            die "text outside of document element\n" unless @stack;
+            my $text = $read->(unpack ('N', $read->(4)));
+            utf8::decode ($text);
+            $stack[-1]->append_content ($text);
+            $attrs_ok = 0;
+        } elsif ($record eq 'E') {
+            die "mismatched end of element\n" unless @stack;
+            pop @stack;
+            $attrs_ok = 0;
+        } else {
+            die "invalid record type in compact document\n";
+        }
+    }
+    die "truncated compact document\n" if (@stack || !defined ($root));
+    return $root;
+}
+
 # Shared code for all simple accessor methods.  Takes the object, the
 # attribute name, and the value.  Sets the value if one was given, and returns
 # the current value of that attribute.
@@ -242,6 +300,54 @@ sub _recursive_to_string {
     }
 }
 
+# Internal function to return the UTF-8 encoding of a string as bytes, for
+# the compact encoding.
+sub _bytes {
+    my ($self, $text) = @_;
+    utf8::encode ($text);
+    return $text;
+}
+
+# Internal function to return the UTF-8 encoding of an element or attribute
+# name as bytes, dying if it won't fit in the one-byte length of the compact
+# encoding.
+sub _name_bytes {
+    my ($self, $name) = @_;
+    my $bytes = $self->_bytes ($name);
+    if (length ($bytes) == 0 || length ($bytes) > 255) {
+        die "invalid name length for compact encoding: $name\n";
+    }
+    return $bytes;
+}
+
+# Internal recursive function implementing the core of to_compact.  Takes the
+# element to encode and a reference to the output string.  Appends the output
+# to the output buffer and returns nothing.
+sub _recursive_to_compact {
+    my ($e, $out) = @_;
+    $$out .= pack ('a C/a*', 'S', $e->_name_bytes ($e->name));
+    for my $attr (sort keys %{ $e->attrs }) {
+        my $value = $e->_bytes ($e->attrs->{$attr});
+        $$out .= pack ('a C/a* N/a*', 'A', $e->_name_bytes ($attr), $value);
+    }
+    if (defined ($e->content) && $e->content ne '') {
+        $$out .= pack ('a N/a*', 'T', $e->_bytes ($e->content));
+    }
+    for my $child (@{ $e->children }) {
+        $child->_recursive_to_compact ($out);
+    }
+    $$out .= 'E';
+}
+
+# Convert this element (and hence the whole document rooted at this element)
+# into the compact encoding of the WebKDC protocol and return the result.
+sub to_compact {
+    my ($self) = @_;
+    my $output = '';
+    $self->_recursive_to_compact (\$output);
+    return $output;
+}
+
 # Convert this element (and hence the whole document rooted at this element)
 # into XML and return the result.  Tags a flag saying whether to pretty-print
 # the output.
@@ -292,6 +398,13 @@ XML using XML::Parser.  The resulting element will represent the complete
 structure of that document, including any nested elements, any attributes,
 and any non-element content.
 
+=item new_compact (DATA)
+
+Create a new WebKDC::XmlElement by parsing DATA, which is a document in
+the compact encoding of the WebKDC protocol rather than XML.  The result
+is the same as parsing the equivalent XML document.  Dies if DATA is not a
+valid document.
+
 =back
 
 =head1 INSTANCE METHODS
@@ -350,6 +463,13 @@ Returns true if this element has children, false otherwise.
 
 Retrieve or set the name of this element as a string.
 
+=item to_compact ()
+
+Convert this XML element (and, recursively, all of its children) to the
+compact encoding of the WebKDC protocol, the counterpart of new_compact.
+Dies if an element or attribute name is empty or longer than 255 bytes,
+since names have a one-byte length in that encoding.
+
 =item to_string ()
 
 Convert this XML element (and, recursively, all of its children) to XML.
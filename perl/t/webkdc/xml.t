@@ -3,13 +3,13 @@
 # Basic tests for WebKDC::XmlDoc and WebKDC::XmlElement.
 #
 # Written by Russ Allbery <eagle@eyrie.org>
-# Copyright 2012
+# Copyright 2012, 2014
 #     The Board of Trustees of the Leland Stanford Junior University
 #
 # See LICENSE for licensing terms.
 
 use strict;
-use Test::More tests => 56;
+use Test::More tests => 69;
 
 BEGIN {
     use_ok ('WebKDC::XmlDoc');
@@ -119,3 +119,38 @@ is ($doc->current->name, 'foo', 'Closing a tag by name works');
 eval { $doc->end ('baz') };
 like ($@, qr{^name mismatch in end: expecting baz, saw foo}ms,
       '... and giving a wrong tag name croaks');
+
+# Round-trip the document through the compact encoding.
+$e = WebKDC::XmlElement->new ('<foo a="1" b="">x<bar>y</bar><baz/></foo>');
+my $compact = $e->to_compact;
+is ($compact,
+    "S\003fooA\001a\0\0\0\0011A\001b\0\0\0\0T\0\0\0\001x"
+    . "S\003barT\0\0\0\001yES\003bazEE",
+    'Compact encoding correct');
+is_deeply (WebKDC::XmlElement->new_compact ($compact), $e,
+           '... and decoding it gives the same element');
+$e = WebKDC::XmlElement->new;
+$e->name ('foo');
+$e->content ("caf\x{e9} \x{263a}");
+is_deeply (WebKDC::XmlElement->new_compact ($e->to_compact), $e,
+           'Non-ASCII content survives the compact encoding');
+for my $bad ('', 'S', "S\003fo", "S\003foo", "S\003fooE\001", 'E',
+             "S\003fooT\0\0\0\011xE") {
+    eval { WebKDC::XmlElement->new_compact ($bad) };
+    ok ($@, 'Invalid compact document ' . unpack ('H*', $bad) . ' fails');
+}
+eval { WebKDC::XmlElement->new_compact ("S\003fooES\003barE") };
+like ($@, qr/^junk after document element/,
+      '... and a second root element is rejected');
+
+# Names that don't fit in the one-byte length are rejected, not truncated.
+$e = WebKDC::XmlElement->new;
+$e->name ('a' x 256);
+eval { $e->to_compact };
+like ($@, qr/^invalid name length for compact encoding/,
+      'Element name over 255 bytes is rejected');
+$e->name ('foo');
+$e->attrs ({ ('b' x 256) => 'x' });
+eval { $e->to_compact };
+like ($@, qr/^invalid name length for compact encoding/,
+      '... as is an attribute name');
@@ -85,9 +85,10 @@
 # define useragent_ip connection->remote_ip
 #endif
 
-/* Apache 2.4 renamed this to stay in the ap_* namespace. */
+/* Apache 2.4 renamed these to stay in the ap_* namespace. */
 #if !HAVE_DECL_AP_UNIXD_CONFIG
 # define ap_unixd_config unixd_config
+# define ap_unixd_set_global_mutex_perms unixd_set_global_mutex_perms
 #endif
 
 /*
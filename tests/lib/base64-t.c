@@ -0,0 +1,107 @@
+/*
+ * Test suite for libwebauth base64 encoding and decoding.
+ *
+ * Checks the encoding against known values and round-trips data of every
+ * length up to a limit at every alignment, which exercises the vector code,
+ * if any, and the transitions between it and the portable code.  Also checks
+ * that decoding stops at the first character outside the base64 alphabet.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <lib/internal.h>
+#include <tests/tap/basic.h>
+#include <util/macros.h>
+
+#define BUFSIZE 1024
+
+/* Known encodings from RFC 4648. */
+static const struct {
+    const char *data;
+    const char *encoded;
+} known[] = {
+    { "",       ""         },
+    { "f",      "Zg=="     },
+    { "fo",     "Zm8="     },
+    { "foo",    "Zm9v"     },
+    { "foob",   "Zm9vYg==" },
+    { "fooba",  "Zm9vYmE=" },
+    { "foobar", "Zm9vYmFy" },
+};
+
+
+int
+main(void)
+{
+    unsigned char orig[BUFSIZE + 16];
+    unsigned char decoded[BUFSIZE + 16];
+    char encoded[BUFSIZE * 2];
+    size_t i, j, offset, length;
+    bool okay;
+
+    plan(ARRAY_SIZE(known) * 2 + 4 + 4 + 3);
+
+    /* Known values. */
+    for (i = 0; i < ARRAY_SIZE(known); i++) {
+        length = wai_base64_encode(known[i].data, strlen(known[i].data),
+                                   encoded);
+        is_string(known[i].encoded, encoded, "Encoding %s", known[i].data);
+        length = wai_base64_decode(encoded, length, decoded);
+        decoded[length] = '\0';
+        is_string(known[i].data, (char *) decoded, "...and decoding");
+    }
+
+    /* Round trips of every length at every alignment. */
+    for (i = 0; i < BUFSIZE + 16; i++)
+        orig[i] = (i * 7 + 3) % 256;
+    for (offset = 0; offset < 4; offset++) {
+        okay = true;
+        for (i = 0; i < BUFSIZE; i++) {
+            length = wai_base64_encode(orig + offset, i, encoded + offset);
+            if (length != wai_base64_encoded_length(i))
+                okay = false;
+            if (length != strlen(encoded + offset))
+                okay = false;
+            if (wai_base64_decoded_length(length) < i)
+                okay = false;
+            length = wai_base64_decode(encoded + offset, length,
+                                       decoded + offset);
+            if (length != i)
+                okay = false;
+            if (memcmp(orig + offset, decoded + offset, i) != 0)
+                okay = false;
+        }
+        ok(okay, "Round trips at offset %lu", (unsigned long) offset);
+    }
+
+    /*
+     * Decoding stops at an invalid character anywhere in a long string,
+     * keeping only the complete bytes before it.
+     */
+    length = wai_base64_encode(orig, 600, encoded);
+    for (j = 0; j < 4; j++) {
+        okay = true;
+        for (i = j; i < length; i += 4) {
+            char save = encoded[i];
+
+            encoded[i] = (i % 3 == 0) ? '=' : '.';
+            if (wai_base64_decode(encoded, length, decoded) != i * 3 / 4)
+                okay = false;
+            if (memcmp(orig, decoded, i * 3 / 4) != 0)
+                okay = false;
+            encoded[i] = save;
+        }
+        ok(okay, "Decoding stops at invalid character %lu mod 4",
+           (unsigned long) j);
+    }
+
+    /* Unpadded and truncated input. */
+    is_int(2, wai_base64_decode("Zm8", 3, decoded), "Unpadded decoding");
+    is_int(0, wai_base64_decode("Z", 1, decoded), "Single character");
+    is_int(3, wai_base64_decode("Zm9vY", 5, decoded), "Trailing character");
+
+    return 0;
+}
@@ -25,7 +25,7 @@ main(void)
     struct webauth_factors *one, *two, *result;
     apr_array_header_t *factors;
 
-    plan(49);
+    plan(55);
 
     if (apr_initialize() != APR_SUCCESS)
         bail("cannot initialize APR");
@@ -210,6 +210,25 @@ main(void)
     is_string(NULL, webauth_factors_string(ctx, result),
               "Subtracting m from rm results in the empty set");
 
+    /* Factors we don't know about are kept and compared as strings. */
+    one = webauth_factors_parse(ctx, "p,o4,z");
+    is_string("p,o4,z,m", webauth_factors_string(ctx, one),
+              "Parsed p,o4,z into p,o4,z,m");
+    is_int(1, webauth_factors_contains(ctx, one, "z"),
+           "...and contains z");
+    two = webauth_factors_parse(ctx, "z,p");
+    is_int(1, webauth_factors_satisfies(ctx, one, two),
+           "p,o4,z,m satisfies z,p");
+    is_int(0, webauth_factors_satisfies(ctx, two, one),
+           "z,p does not satisfy p,o4,z,m");
+    result = webauth_factors_subtract(ctx, one, two);
+    is_string("o4,m", webauth_factors_string(ctx, result),
+              "Subtracting z,p from p,o4,z,m returns o4,m");
+    one = webauth_factors_union(ctx, webauth_factors_parse(ctx, "y"),
+                                webauth_factors_parse(ctx, "z,y"));
+    is_string("y,z", webauth_factors_string(ctx, one),
+              "Merging y and z,y gives y,z");
+
     /* Clean up. */
     apr_terminate();
     return 0;
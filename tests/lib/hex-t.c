@@ -32,7 +32,7 @@ main(void)
     int s;
     size_t elen, rlen, dlen, dlen2;
 
-    plan(7 * 512);
+    plan(7 * 512 + 4);
 
     for (i = 0; i < 512; i++) {
         for (j = 0; j < i; j++)
@@ -54,5 +54,19 @@ main(void)
         ok(memcmp(decoded_buffer, orig_buffer, i) == 0, "...and data");
     }
 
+    /* Uppercase is accepted and invalid characters anywhere are rejected. */
+    memset(encoded_buffer, 'A', 200);
+    s = wai_hex_decode(encoded_buffer, 200, decoded_buffer, &dlen, BUFSIZE);
+    is_int(WA_ERR_NONE, s, "Decoding uppercase succeeds");
+    ok(dlen == 100 && (unsigned char) decoded_buffer[99] == 0xaa,
+       "...and returns the correct data");
+    encoded_buffer[150] = 'g';
+    s = wai_hex_decode(encoded_buffer, 200, decoded_buffer, &dlen, BUFSIZE);
+    is_int(WA_ERR_CORRUPT, s, "Decoding an invalid character fails");
+    encoded_buffer[150] = 'A';
+    encoded_buffer[5] = '\0';
+    s = wai_hex_decode(encoded_buffer, 200, decoded_buffer, &dlen, BUFSIZE);
+    is_int(WA_ERR_CORRUPT, s, "...as does decoding a nul");
+
     return 0;
 }
@@ -0,0 +1,216 @@
+/*
+ * Test suite for background jobs.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+#include <portable/system.h>
+
+#include <time.h>
+
+#include <lib/internal.h>
+#include <tests/tap/basic.h>
+#include <webauth/basic.h>
+#include <webauth/webkdc.h>
+
+/* Set by the abandoned job once it has used the result cache. */
+static volatile bool abandoned_done = false;
+
+
+/*
+ * Log callback that counts the messages it sees and saves the last one.
+ */
+struct log_output {
+    unsigned long count;
+    char *message;
+};
+
+static void
+log_callback(struct webauth_context *ctx UNUSED, void *data,
+             const char *message)
+{
+    struct log_output *output = data;
+
+    output->count++;
+    free(output->message);
+    output->message = bstrdup(message);
+}
+
+
+/*
+ * Job functions.  job_success logs a message and succeeds, job_failure sets
+ * an error, and job_user checks that the job context has a copy of the user
+ * information service configuration.
+ */
+static int
+job_success(struct webauth_context *ctx, void *data UNUSED)
+{
+    wai_log_notice(ctx, "job ran");
+    return WA_ERR_NONE;
+}
+
+static int
+job_failure(struct webauth_context *ctx, void *data UNUSED)
+{
+    return wai_error_set(ctx, WA_ERR_INVALID, "job failed");
+}
+
+static int
+job_user(struct webauth_context *ctx, void *data)
+{
+    struct webauth_context *caller = data;
+
+    if (ctx->user == NULL || ctx->user == caller->user)
+        return WA_ERR_INVALID;
+    if (strcmp(ctx->user->host, caller->user->host) != 0)
+        return WA_ERR_INVALID;
+    if (ctx->user->cache != caller->user->cache)
+        return WA_ERR_INVALID;
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Job functions that take longer than the deadline.  job_slow just sleeps,
+ * and job_abandoned then uses the result cache from its copy of the user
+ * configuration, which must still be valid even though everything else that
+ * referred to it is gone by then.
+ */
+static int
+job_slow(struct webauth_context *ctx UNUSED, void *data UNUSED)
+{
+    sleep(3);
+    return WA_ERR_NONE;
+}
+
+static int
+job_abandoned(struct webauth_context *ctx, void *data UNUSED)
+{
+    struct webauth_user_cache_stats stats;
+
+    sleep(2);
+    webauth_user_cache_stats(ctx->user->cache, &stats);
+    abandoned_done = true;
+    return WA_ERR_NONE;
+}
+
+
+int
+main(void)
+{
+    apr_pool_t *pool, *owner_pool;
+    struct webauth_context *ctx, *owner;
+    struct webauth_user_config config;
+    struct webauth_user_cache *cache;
+    struct log_output output = { 0, NULL };
+    struct wai_job *job;
+    int i, s;
+
+    if (apr_initialize() != APR_SUCCESS)
+        bail("cannot initialize APR");
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    if (webauth_context_init_apr(&ctx, pool) != WA_ERR_NONE)
+        bail("cannot initialize WebAuth context");
+
+    plan(15);
+
+    /* A successful job, whose log message should be passed on once. */
+    webauth_log_callback(ctx, WA_LOG_NOTICE, log_callback, &output);
+    s = wai_job_create(ctx, &job);
+    is_int(WA_ERR_NONE, s, "Creating a job succeeds");
+    wai_job_start(job, job_success, NULL);
+    is_int(WA_ERR_NONE, wai_job_wait(ctx, job, 0), "...and it succeeds");
+    is_string("job ran", output.message, "...and its message is logged");
+    wai_job_wait(ctx, job, 0);
+    is_int(1, output.count, "...only once");
+
+    /* A failing job, whose error should be copied to the caller. */
+    s = wai_job_create(ctx, &job);
+    if (s != WA_ERR_NONE)
+        bail("cannot create job: %s", webauth_error_message(ctx, s));
+    wai_job_start(job, job_failure, NULL);
+    s = wai_job_wait(ctx, job, 0);
+    is_int(WA_ERR_INVALID, s, "Failing job returns its status");
+    is_string("invalid argument to function (job failed)",
+              webauth_error_message(ctx, s), "...and its error message");
+
+    /*
+     * Configure the user information service with a result cache, owned by
+     * a separate context, and check that the job gets a copy.
+     */
+    if (apr_pool_create(&owner_pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    if (webauth_context_init_apr(&owner, owner_pool) != WA_ERR_NONE)
+        bail("cannot initialize WebAuth context");
+    s = webauth_user_cache_new(owner, 16, 60, &cache);
+    if (s != WA_ERR_NONE)
+        bail("cannot create cache: %s", webauth_error_message(owner, s));
+    memset(&config, 0, sizeof(config));
+    config.protocol = WA_PROTOCOL_REMCTL;
+    config.host     = "localhost";
+    config.keytab   = "keytab";
+    config.cache    = cache;
+    s = webauth_user_config(ctx, &config);
+    is_int(WA_ERR_NONE, s, "Setting user information config succeeds");
+    s = wai_job_create(ctx, &job);
+    if (s != WA_ERR_NONE)
+        bail("cannot create job: %s", webauth_error_message(ctx, s));
+    wai_job_start(job, job_user, ctx);
+    s = wai_job_wait(ctx, job, 0);
+    is_int(WA_ERR_NONE, s, "Job has a copy of the user config");
+
+    /* The remaining tests need threads to be able to miss a deadline. */
+#if !APR_HAS_THREADS
+    skip_block(7, "built without thread support");
+#else
+
+    /* A job that doesn't finish by its deadline. */
+    s = wai_job_create(ctx, &job);
+    if (s != WA_ERR_NONE)
+        bail("cannot create job: %s", webauth_error_message(ctx, s));
+    wai_job_start(job, job_slow, NULL);
+    s = wai_job_wait(ctx, job, time(NULL) + 1);
+    is_int(WA_ERR_REMOTE_TIMEOUT, s, "Slow job misses its deadline");
+    is_string("remote call timed out (deadline exceeded)",
+              webauth_error_message(ctx, s), "...with the right error");
+
+    /*
+     * A job that is abandoned and keeps using the cache after both the
+     * context that created it and the caller are gone.
+     */
+    s = wai_job_create(ctx, &job);
+    if (s != WA_ERR_NONE)
+        bail("cannot create job: %s", webauth_error_message(ctx, s));
+    wai_job_start(job, job_abandoned, NULL);
+    s = wai_job_wait(ctx, job, time(NULL) + 1);
+    is_int(WA_ERR_REMOTE_TIMEOUT, s, "Abandoned job misses its deadline");
+    ok(!abandoned_done, "...and is still running");
+    apr_pool_destroy(owner_pool);
+    apr_pool_destroy(pool);
+    for (i = 0; i < 50 && !abandoned_done; i++)
+        usleep(100 * 1000);
+    ok(abandoned_done, "...and finishes after its caller is gone");
+
+    /*
+     * The abandoned job's thread dropped the last reference, so the job is
+     * freed by the next job created, after joining that thread.
+     */
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    if (webauth_context_init_apr(&ctx, pool) != WA_ERR_NONE)
+        bail("cannot initialize WebAuth context");
+    s = wai_job_create(ctx, &job);
+    is_int(WA_ERR_NONE, s, "Creating a job after an abandoned one succeeds");
+    wai_job_start(job, job_success, NULL);
+    is_int(WA_ERR_NONE, wai_job_wait(ctx, job, 0), "...and it runs");
+    apr_pool_destroy(pool);
+#endif
+
+    free(output.message);
+    apr_terminate();
+    return 0;
+}
@@ -18,9 +18,45 @@
 
 #include <tests/tap/basic.h>
 #include <tests/tap/string.h>
+#include <util/macros.h>
 #include <webauth/basic.h>
 #include <webauth/keys.h>
 
+/* A valid encoded keyring entry, used to build keyrings to decode. */
+#define ENTRY \
+    "ct0=1308779086;va0=1308692686;kt0=1;" \
+    "kd0=dc4fbf34487ffdb10c553c1df673a567;"
+
+/*
+ * Encoded keyrings exercising the attribute decoder on repeated elements,
+ * with the expected status and, for errors, the expected message.  Unknown
+ * attributes, including element numbers out of range, are ignored, but
+ * duplicates of any attribute are rejected.
+ */
+static const struct {
+    const char *data;
+    int status;
+    const char *message;
+} decode_tests[] = {
+    { "v=1;n=1;" ENTRY, WA_ERR_NONE, NULL },
+    { "v=1;n=1;zz=1;" ENTRY "zz0=2;ct1=5;", WA_ERR_NONE, NULL },
+    { "v=1;n=1;" ENTRY "ct0=5;", WA_ERR_CORRUPT, "duplicate attribute ct0" },
+    { "v=1;n=1;v=1;" ENTRY, WA_ERR_CORRUPT, "duplicate attribute v" },
+    { "v=1;zz=1;n=1;" ENTRY "zz=2;", WA_ERR_CORRUPT,
+      "duplicate attribute zz" },
+    { "v=1;n=1;" ENTRY "zz0=1;zz0=2;", WA_ERR_CORRUPT,
+      "duplicate attribute zz0" },
+    { "v=1;n=1;ct0=1308779086;va0=1308692686;kd0=00;", WA_ERR_CORRUPT, NULL },
+    { "v=1;n=2;" ENTRY, WA_ERR_CORRUPT, NULL },
+    { "v=1;" ENTRY, WA_ERR_CORRUPT, NULL },
+};
+
+/* Key material for checking the exact encoding of a keyring. */
+static const unsigned char key_data[WA_AES_128] = {
+    0xdc, 0x4f, 0xbf, 0x34, 0x48, 0x7f, 0xfd, 0xb1,
+    0x0c, 0x55, 0x3c, 0x1d, 0xf6, 0x73, 0xa5, 0x67
+};
+
 
 int
 main(void)
@@ -30,7 +66,8 @@ main(void)
     const struct webauth_key *best;
     struct webauth_keyring *ring, *ring2;
     struct webauth_keyring_entry *entry, *entry2;
-    char *tmpdir, *keyring, *lock, *buf2;
+    char *tmpdir, *keyring, *lock, *buf2, *expected, *old;
+    const char *data;
     char buf[4096];
     FILE *file;
     int s, ks, fd;
@@ -39,7 +76,7 @@ main(void)
     enum webauth_kau_status kau;
     struct stat st;
 
-    plan(98);
+    plan(98 + 9 + 4 + 3);
 
     if (webauth_context_init(&ctx, NULL) != WA_ERR_NONE)
         bail("cannot initialize WebAuth context");
@@ -273,6 +310,45 @@ main(void)
     is_int(S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP, st.st_mode,
            "...and writing the keyring preserves permissions");
 
+    /* Test decoding keyrings with unknown and duplicate attributes. */
+    for (i = 0; i < ARRAY_SIZE(decode_tests); i++) {
+        data = decode_tests[i].data;
+        s = webauth_keyring_decode(ctx, data, strlen(data), &ring);
+        is_int(decode_tests[i].status, s, "Decoding keyring %lu",
+               (unsigned long) i);
+        if (decode_tests[i].message == NULL)
+            continue;
+        basprintf(&expected, "%s (%s)", webauth_error_message(NULL, s),
+                  decode_tests[i].message);
+        is_string(expected, webauth_error_message(ctx, s), "...with error");
+        free(expected);
+    }
+
+    /*
+     * Check the exact encoding of a keyring with more than ten entries, so
+     * that element numbers have more than one digit, and with a zero time,
+     * against one built by hand.
+     */
+    ring = webauth_keyring_new(ctx, 1);
+    s = webauth_key_create(ctx, WA_KEY_AES, WA_AES_128, key_data, &key);
+    if (s != WA_ERR_NONE)
+        bail("cannot create key: %s", webauth_error_message(ctx, s));
+    expected = bstrdup("v=1;n=12;");
+    for (i = 0; i < 12; i++) {
+        webauth_keyring_add(ctx, ring, i, 1308692686 + i, key);
+        old = expected;
+        basprintf(&expected, "%sct%lu=%lu;va%lu=%lu;kt%lu=1;kd%lu=%s;", old,
+                  (unsigned long) i, (unsigned long) i, (unsigned long) i,
+                  (unsigned long) 1308692686 + i, (unsigned long) i,
+                  (unsigned long) i, "dc4fbf34487ffdb10c553c1df673a567");
+        free(old);
+    }
+    s = webauth_keyring_encode(ctx, ring, &buf2, &size);
+    is_int(WA_ERR_NONE, s, "Encoding a keyring with twelve keys works");
+    is_int(strlen(expected), size, "...with the right length");
+    is_string(expected, buf2, "...and the right encoding");
+    free(expected);
+
     /* Clean up. */
     unlink(keyring);
     free(keyring);
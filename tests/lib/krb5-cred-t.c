@@ -203,6 +203,32 @@ free_cred_data(struct cred_data *data)
 }
 
 
+/*
+ * Read the encoded credential from a test data file into buffer, which must
+ * be BUFSIZ long.  Returns the length of the credential.
+ */
+static size_t
+read_cred(const char *file, char *buffer)
+{
+    char *path;
+    FILE *input;
+    size_t size;
+
+    path = test_file_path(file);
+    if (path == NULL)
+        sysbail("cannot find %s", file);
+    input = fopen(path, "r");
+    if (input == NULL)
+        sysbail("cannot open %s", path);
+    size = fread(buffer, 1, BUFSIZ, input);
+    if (ferror(input))
+        sysbail("cannot read %s", path);
+    fclose(input);
+    test_file_path_free(path);
+    return size;
+}
+
+
 /*
  * Given the path to a test credential and the credential included in it,
  * create a new WebAuth Kerberos context and initialize it from that test
@@ -212,8 +238,7 @@ free_cred_data(struct cred_data *data)
 static struct cred_data *
 import_cred(struct webauth_context *ctx, const char *file)
 {
-    char *path, *tmpdir, *cache, *message;
-    FILE *input;
+    char *tmpdir, *cache, *message;
     char buffer[BUFSIZ];
     size_t size;
     int s;
@@ -225,19 +250,8 @@ import_cred(struct webauth_context *ctx, const char *file)
     krb5_error_code code;
     struct cred_data *data;
 
-    /* Read the encoded token. */
-    path = test_file_path(file);
-    if (path == NULL)
-        sysbail("cannot find %s", file);
-    input = fopen(path, "r");
-    if (input == NULL)
-        sysbail("cannot open %s", path);
-    size = fread(buffer, 1, sizeof(buffer), input);
-    if (ferror(input))
-        sysbail("cannot read %s", path);
-    fclose(input);
-
     /* Import the credential and create a ticket cache. */
+    size = read_cred(file, buffer);
     tmpdir = test_tmpdir();
     basprintf(&cache, "%s/krb5cc_import", tmpdir);
     s = webauth_krb5_new(ctx, &kc);
@@ -267,13 +281,48 @@ import_cred(struct webauth_context *ctx, const char *file)
     krb5_free_cred_contents(krb5_ctx, &cred);
 
     /* Clean up and return. */
-    test_file_path_free(path);
     free(cache);
     test_tmpdir_free(tmpdir);
     return data;
 }
 
 
+/*
+ * Test keeping a ticket cache past the end of its Kerberos context.
+ */
+static void
+test_keep_cache(struct webauth_context *ctx)
+{
+    char *tmpdir, *cache;
+    char buffer[BUFSIZ];
+    size_t size;
+    int s;
+    struct webauth_krb5 *kc;
+
+    /* Keeping the cache fails if there isn't one yet. */
+    s = webauth_krb5_new(ctx, &kc);
+    CHECK_BAIL(ctx, s);
+    s = webauth_krb5_keep_cache(ctx, kc);
+    is_int(WA_ERR_INVALID_CONTEXT, s, "keep cache without a cache fails");
+
+    /* Import a credential into a file cache and keep it. */
+    size = read_cred("data/creds/basic", buffer);
+    tmpdir = test_tmpdir();
+    basprintf(&cache, "%s/krb5cc_keep", tmpdir);
+    s = webauth_krb5_import_cred(ctx, kc, buffer, size, cache);
+    CHECK(ctx, s, "import cred to keep");
+    s = webauth_krb5_keep_cache(ctx, kc);
+    CHECK(ctx, s, "keep cache");
+    webauth_krb5_free(ctx, kc);
+    ok(access(cache, F_OK) == 0, "... cache still exists after free");
+
+    /* Clean up. */
+    unlink(cache);
+    free(cache);
+    test_tmpdir_free(tmpdir);
+}
+
+
 int
 main(void)
 {
@@ -283,7 +332,7 @@ main(void)
     if (webauth_context_init(&ctx, NULL) != WA_ERR_NONE)
         bail("cannot initialize WebAuth context");
 
-    plan(63);
+    plan(67);
 
     /* Basic credential with nothing special. */
     data = import_cred(ctx, "data/creds/basic");
@@ -374,6 +423,9 @@ main(void)
     ok(!HAS_ADDRESSES(data), "... no addresses");
     free_cred_data(data);
 
+    /* Keeping the ticket cache. */
+    test_keep_cache(ctx);
+
     /* Clean up. */
     webauth_context_free(ctx);
     return 0;
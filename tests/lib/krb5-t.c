@@ -18,6 +18,7 @@
 #include <tests/tap/basic.h>
 #include <tests/tap/kerberos.h>
 #include <tests/tap/string.h>
+#include <util/macros.h>
 #include <webauth/basic.h>
 #include <webauth/krb5.h>
 
@@ -42,6 +43,16 @@ static krb5_addresses *const test_addrlist_ptr
     = (krb5_addresses *) &test_addrlist;
 #endif
 
+/* The state of the single-entry service ticket cache used for testing. */
+struct test_tickets {
+    unsigned char key[64];
+    size_t key_len;
+    void *ticket;
+    size_t length;
+    unsigned long hits;
+    unsigned long stores;
+};
+
 #define CHECK(ctx, s, m) check_status((ctx), (s), (m), __FILE__, __LINE__)
 #define CHECK_CHANGE(ctx, s, m) \
     check_change((ctx), (s), (m), __FILE__, __LINE__)
@@ -89,6 +100,44 @@ check_change(struct webauth_context *ctx, int s, const char *message,
 }
 
 
+/*
+ * Service ticket cache callbacks that store a single ticket and count how
+ * often they're used.
+ */
+static int
+cache_get(struct webauth_context *ctx UNUSED, void *data, const void *key,
+          size_t key_len, const void **ticket, size_t *length)
+{
+    struct test_tickets *tickets = data;
+
+    if (tickets->ticket == NULL || key_len != tickets->key_len
+        || memcmp(key, tickets->key, key_len) != 0)
+        return false;
+    *ticket = tickets->ticket;
+    *length = tickets->length;
+    tickets->hits++;
+    return true;
+}
+
+static void
+cache_put(struct webauth_context *ctx UNUSED, void *data, const void *key,
+          size_t key_len, const void *ticket, size_t length,
+          time_t expiration UNUSED)
+{
+    struct test_tickets *tickets = data;
+
+    if (key_len > sizeof(tickets->key))
+        return;
+    memcpy(tickets->key, key, key_len);
+    tickets->key_len = key_len;
+    free(tickets->ticket);
+    tickets->ticket = bmalloc(length);
+    memcpy(tickets->ticket, ticket, length);
+    tickets->length = length;
+    tickets->stores++;
+}
+
+
 /*
  * Obtain Kerberos credentials from the configured keytab, but set addresses
  * on the ticket.  This tests encoding of tickets with addresses (which has
@@ -177,7 +226,7 @@ main(void)
 {
     int s;
     struct webauth_context *ctx;
-    struct webauth_krb5 *kc;
+    struct webauth_krb5 *kc, *kc2;
     struct kerberos_config *config;
     char *server, *cp, *prealm, *cache, *tmpdir, *password;
     void *sa, *tgt, *ticket, *tmp;
@@ -186,11 +235,13 @@ main(void)
     char *cprinc = NULL;
     char *crealm = NULL;
     char *ccache = NULL;
+    struct test_tickets tickets;
 
     /* Read the configuration information. */
     config = kerberos_setup(TAP_KRB_NEEDS_BOTH);
+    memset(&tickets, 0, sizeof(tickets));
     
-    plan(53);
+    plan(76);
 
     if (webauth_context_init(&ctx, NULL) != WA_ERR_NONE)
         bail("cannot initialize WebAuth context");
@@ -285,7 +336,6 @@ main(void)
         s = webauth_krb5_get_principal(ctx, kc, &cp, WA_KRB5_CANON_NONE);
         CHECK(ctx, s, "...and we can get the principal name");
         is_string(config->userprinc, cp, "...and it matches expectations");
-        free(tgt);
         if (ticket == NULL)
             skip("Service ticket exporting failed");
         else {
@@ -295,6 +345,40 @@ main(void)
         webauth_krb5_free(ctx, kc);
     }
 
+    /*
+     * Test the service ticket cache.  A context initialized from the TGT
+     * offers the service ticket it gets to the cache, and a second context
+     * initialized from the same TGT uses that ticket.
+     */
+    if (tgt == NULL)
+        skip_block(9, "TGT creation failed");
+    else {
+        webauth_krb5_set_ticket_cache(ctx, cache_get, cache_put, &tickets);
+        s = webauth_krb5_new(ctx, &kc);
+        CHECK(ctx, s, "Creating a new context");
+        s = webauth_krb5_import_cred(ctx, kc, tgt, tgtlen, NULL);
+        CHECK(ctx, s, "Initializing with a credential and a ticket cache");
+        s = webauth_krb5_export_cred(ctx, kc, config->principal, &tmp,
+                                     &salen, NULL);
+        CHECK(ctx, s, "...and exporting a service ticket");
+        is_int(1, tickets.stores, "...which is stored in the cache");
+        webauth_krb5_free(ctx, kc);
+        s = webauth_krb5_new(ctx, &kc);
+        CHECK(ctx, s, "Creating a new context");
+        s = webauth_krb5_import_cred(ctx, kc, tgt, tgtlen, NULL);
+        CHECK(ctx, s, "Initializing with the same credential");
+        s = webauth_krb5_make_auth(ctx, kc, config->principal, &sa, &salen);
+        CHECK(ctx, s, "...and building an AP-REQ");
+        is_int(1, tickets.hits, "...with the ticket from the cache");
+        s = webauth_krb5_read_auth(ctx, kc, sa, salen, config->keytab, NULL,
+                                   &cp, WA_KRB5_CANON_NONE);
+        CHECK(ctx, s, "...and it validates");
+        webauth_krb5_free(ctx, kc);
+        webauth_krb5_set_ticket_cache(ctx, NULL, NULL, NULL);
+        free(tickets.ticket);
+        free(tgt);
+    }
+
     /* Test importing just a regular ticket without a TGT. */
     if (ticket == NULL)
         skip_block(4, "Ticket exporting failed");
@@ -359,6 +443,39 @@ main(void)
     webauth_krb5_free(ctx, kc);
     ok(access(cache, F_OK) < 0, "...and the cache is destroyed on free");
 
+    /*
+     * Test reuse of the Kerberos library context.  Two webauth_krb5 contexts
+     * can use it at the same time, and it survives a reset of the WebAuth
+     * context.
+     */
+    s = webauth_krb5_reuse_context(ctx);
+    CHECK(ctx, s, "Reusing the Kerberos library context");
+    s = webauth_krb5_new(ctx, &kc);
+    CHECK(ctx, s, "...and creating a context that uses it");
+    s = webauth_krb5_new(ctx, &kc2);
+    CHECK(ctx, s, "...and creating another one");
+    s = webauth_krb5_init_via_keytab(ctx, kc, config->keytab, NULL, NULL);
+    CHECK(ctx, s, "...and initializing the first with a keytab");
+    s = webauth_krb5_init_via_keytab(ctx, kc2, config->keytab, NULL, NULL);
+    CHECK(ctx, s, "...and initializing the second with a keytab");
+    s = webauth_krb5_get_principal(ctx, kc2, &cp, WA_KRB5_CANON_NONE);
+    CHECK(ctx, s, "...and getting the principal");
+    is_string(config->principal, cp, "...and it matches expectations");
+    s = webauth_krb5_make_auth(ctx, kc2, config->principal, &sa, &salen);
+    CHECK(ctx, s, "Building an AP-REQ with a shared context");
+    s = webauth_krb5_read_auth(ctx, kc, sa, salen, config->keytab, NULL, &cp,
+                               WA_KRB5_CANON_NONE);
+    CHECK(ctx, s, "...and it validates against the keytab copy");
+    is_string(config->principal, cp, "...and returns the correct identity");
+    webauth_context_reset(ctx);
+    s = webauth_krb5_new(ctx, &kc);
+    CHECK(ctx, s, "Creating a context after a reset");
+    s = webauth_krb5_init_via_keytab(ctx, kc, config->keytab, NULL, NULL);
+    CHECK(ctx, s, "...and initializing it with a keytab");
+    s = webauth_krb5_get_principal(ctx, kc, &cp, WA_KRB5_CANON_NONE);
+    CHECK(ctx, s, "...and getting the principal");
+    is_string(config->principal, cp, "...and it matches expectations");
+
     /*
      * Test password change.
      *
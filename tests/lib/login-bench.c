@@ -0,0 +1,214 @@
+/*
+ * Load test for password logins.
+ *
+ * Performs password logins against the test KDC the way the WebKDC does for
+ * a login token, verifying the resulting TGT with the test keytab, and
+ * reports the login rate.  Each run is done first with a new WebAuth context
+ * and Kerberos library context for every login, as mod_webkdc used to do,
+ * and then with one context per thread that is reset between logins, which
+ * keeps the Kerberos context and in-memory copies of the keytab and FAST
+ * armor cache.  Runs are done with one thread and with several, and with and
+ * without FAST armor if the KDC supports it, using the test ticket cache as
+ * the armor cache.
+ *
+ * This needs the Kerberos test configuration in tests/config, both the
+ * keytab and the password file described in tests/config/README, and so
+ * needs an existing KDC for that realm; there is no mode that starts a local
+ * KDC.  Without that configuration the benchmark skips entirely, printing
+ * only a skip line and reporting no numbers, and make bench still succeeds.
+ * It puts real load on that KDC, so it's not part of the test suite; run it
+ * with make bench.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+#include <portable/system.h>
+
+#include <apr_pools.h>
+#include <apr_thread_proc.h>
+#include <sys/time.h>
+
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <webauth/basic.h>
+#include <webauth/krb5.h>
+
+/* Number of logins for each measurement, divided among the threads. */
+#define ITERATIONS 400
+
+/* Number of threads for the concurrent runs. */
+#define THREADS 4
+
+/* The settings for one run and what each thread needs to do its share. */
+struct run {
+    struct kerberos_config *config;
+    const char *armor;          /* FAST armor cache, or NULL for none. */
+    bool reuse;                 /* Whether to keep one context per thread. */
+    unsigned long logins;       /* Number of logins per thread. */
+};
+
+
+/*
+ * Return the number of seconds, as a double, since some fixed point in the
+ * past.  Only differences between two calls are meaningful.
+ */
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+/*
+ * Perform one password login with the given WebAuth context, the way
+ * do_login_krb in lib/webkdc-login.c does, and return the status.
+ */
+static int
+login(struct webauth_context *ctx, const struct run *run)
+{
+    struct webauth_krb5 *kc;
+    struct kerberos_config *config = run->config;
+    char *server;
+    int s;
+
+    s = webauth_krb5_new(ctx, &kc);
+    if (s != WA_ERR_NONE)
+        return s;
+    if (run->armor != NULL) {
+        s = webauth_krb5_set_fast_armor_path(ctx, kc, run->armor);
+        if (s != WA_ERR_NONE)
+            goto done;
+    }
+    s = webauth_krb5_init_via_password(ctx, kc, config->userprinc,
+                                       config->password, NULL,
+                                       config->keytab, config->principal,
+                                       NULL, &server);
+
+done:
+    webauth_krb5_free(ctx, kc);
+    return s;
+}
+
+
+/*
+ * The body of each thread.  Either creates a new WebAuth context for each
+ * login in a pool that is cleared afterwards, or creates one context that
+ * keeps its Kerberos context and resets it after each login.
+ */
+static void * APR_THREAD_FUNC
+run_thread(apr_thread_t *thread, void *data)
+{
+    const struct run *run = data;
+    struct webauth_context *ctx = NULL;
+    apr_pool_t *pool;
+    unsigned long i;
+    int s;
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    if (run->reuse) {
+        if (webauth_context_init_apr(&ctx, pool) != WA_ERR_NONE)
+            bail("cannot initialize WebAuth context");
+        if (webauth_krb5_reuse_context(ctx) != WA_ERR_NONE)
+            bail("cannot reuse Kerberos context");
+    }
+    for (i = 0; i < run->logins; i++) {
+        if (!run->reuse)
+            if (webauth_context_init_apr(&ctx, pool) != WA_ERR_NONE)
+                bail("cannot initialize WebAuth context");
+        s = login(ctx, run);
+        if (s != WA_ERR_NONE)
+            bail("login failed: %s", webauth_error_message(ctx, s));
+        if (run->reuse)
+            webauth_context_reset(ctx);
+        else
+            apr_pool_clear(pool);
+    }
+    apr_pool_destroy(pool);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+
+/*
+ * Do ITERATIONS logins spread over the given number of threads and report
+ * the login rate and the average time per login.
+ */
+static void
+run_bench(apr_pool_t *pool, struct run *run, int threads)
+{
+    apr_thread_t *thread[THREADS];
+    apr_status_t status;
+    double start, elapsed;
+    unsigned long total;
+    int i;
+
+    run->logins = ITERATIONS / threads;
+    total = run->logins * threads;
+    start = now();
+    for (i = 0; i < threads; i++)
+        if (apr_thread_create(&thread[i], NULL, run_thread, run, pool)
+            != APR_SUCCESS)
+            bail("cannot create thread");
+    for (i = 0; i < threads; i++)
+        apr_thread_join(&status, thread[i]);
+    elapsed = now() - start;
+    printf("%-6s  %-5s  %d threads  %7.1f logins/s  %7.2f ms/login\n",
+           run->reuse ? "pooled" : "fresh", run->armor ? "FAST" : "plain",
+           threads, total / elapsed, elapsed * 1000 * threads / total);
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct webauth_context *ctx;
+    struct run run;
+    apr_pool_t *pool;
+    const char *armor_path;
+    int armor, reuse, s;
+
+    /* Skips the whole benchmark if tests/config isn't set up. */
+    config = kerberos_setup(TAP_KRB_NEEDS_BOTH);
+    if (webauth_context_init(&ctx, NULL) != WA_ERR_NONE)
+        bail("cannot initialize WebAuth context");
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+
+    /* Check that logins work at all, and whether FAST armor does. */
+    memset(&run, 0, sizeof(run));
+    run.config = config;
+    s = login(ctx, &run);
+    if (s != WA_ERR_NONE)
+        bail("login failed: %s", webauth_error_message(ctx, s));
+    armor_path = config->cache;
+    run.armor = armor_path;
+    s = login(ctx, &run);
+    if (s != WA_ERR_NONE) {
+        printf("skipping FAST runs: %s\n", webauth_error_message(ctx, s));
+        armor_path = NULL;
+    }
+
+    /* Run each combination of FAST armor and context reuse. */
+    for (armor = 0; armor < 2; armor++) {
+        if (armor && armor_path == NULL)
+            continue;
+        for (reuse = 0; reuse < 2; reuse++) {
+            run.armor = armor ? armor_path : NULL;
+            run.reuse = reuse;
+            run_bench(pool, &run, 1);
+            run_bench(pool, &run, THREADS);
+        }
+    }
+
+    apr_pool_destroy(pool);
+    webauth_context_free(ctx);
+    return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * Benchmark low-level token crypto routines.
+ *
+ * Measures the rate at which tokens can be encrypted and decrypted with a key
+ * from a keyring built with webauth_keyring_add, which keeps the crypto state
+ * for its keys, and with a keyring whose entry was added directly to the
+ * entries array, which has no state for its key and so has to expand the key
+ * schedules and HMAC key on every call as the library used to do.  This is
+ * not part of the test suite; run it with make bench.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/apr.h>
+#include <portable/system.h>
+
+#include <sys/time.h>
+
+#include <tests/tap/basic.h>
+#include <webauth/basic.h>
+#include <webauth/keys.h>
+#include <webauth/tokens.h>
+
+/* Number of tokens to encrypt and decrypt for each measurement. */
+#define ITERATIONS 50000
+
+
+/*
+ * Return the number of seconds, as a double, since some fixed point in the
+ * past.  Only differences between two calls are meaningful.
+ */
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+/*
+ * Encrypt and then decrypt ITERATIONS copies of the provided data with the
+ * given keyring and report the rate for each operation.
+ */
+static void
+run_bench(const char *label, struct webauth_keyring *ring, const void *input,
+          size_t length)
+{
+    struct webauth_context *ctx;
+    void *token, *out;
+    size_t token_len, out_len;
+    double start, encrypt, decrypt;
+    unsigned long i;
+    int s;
+
+    if (webauth_context_init(&ctx, NULL) != WA_ERR_NONE)
+        bail("cannot initialize WebAuth context");
+    start = now();
+    for (i = 0; i < ITERATIONS; i++) {
+        s = webauth_token_encrypt(ctx, input, length, &token, &token_len,
+                                  ring);
+        if (s != WA_ERR_NONE)
+            bail("encryption failed: %s", webauth_error_message(ctx, s));
+    }
+    encrypt = now() - start;
+    start = now();
+    for (i = 0; i < ITERATIONS; i++) {
+        s = webauth_token_decrypt(ctx, token, token_len, &out, &out_len,
+                                  ring);
+        if (s != WA_ERR_NONE)
+            bail("decryption failed: %s", webauth_error_message(ctx, s));
+    }
+    decrypt = now() - start;
+    printf("%-10s encrypt %10.0f tokens/sec   decrypt %10.0f tokens/sec\n",
+           label, ITERATIONS / encrypt, ITERATIONS / decrypt);
+    webauth_context_free(ctx);
+}
+
+int
+main(void)
+{
+    struct webauth_context *ctx;
+    struct webauth_keyring *ring, *cached, *uncached;
+    struct webauth_keyring_entry *entry;
+    const struct webauth_key *key;
+    char *keyring;
+    int s;
+    const char app_raw[] =
+        "t=app;s=testuser;lt=N\2]\312;ia=p;san=c;loa=\0\0\0\1;ct=N\2]\254;"
+        "et=\177\377\377\320;";
+
+    if (webauth_context_init(&ctx, NULL) != WA_ERR_NONE)
+        bail("cannot initialize WebAuth context");
+    keyring = test_file_path("data/keyring");
+    if (keyring == NULL)
+        bail("cannot find data/keyring");
+    s = webauth_keyring_read(ctx, keyring, &ring);
+    if (s != WA_ERR_NONE)
+        bail("cannot read %s: %s", keyring, webauth_error_message(ctx, s));
+    test_file_path_free(keyring);
+
+    /*
+     * Build a single-key ring around the encryption key in the normal way,
+     * and another by adding the key to the entries array directly.
+     */
+    s = webauth_keyring_best_key(ctx, ring, WA_KEY_ENCRYPT, 0, &key);
+    if (s != WA_ERR_NONE)
+        bail("cannot find key: %s", webauth_error_message(ctx, s));
+    cached = webauth_keyring_from_key(ctx, key);
+    uncached = webauth_keyring_new(ctx, 1);
+    entry = apr_array_push(uncached->entries);
+    entry->creation = 0;
+    entry->valid_after = 0;
+    entry->key = webauth_key_copy(ctx, key);
+
+    run_bench("uncached", uncached, app_raw, sizeof(app_raw) - 1);
+    run_bench("cached", cached, app_raw, sizeof(app_raw) - 1);
+
+    webauth_context_free(ctx);
+    return 0;
+}
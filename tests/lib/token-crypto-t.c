@@ -3,7 +3,9 @@
  *
  * Test encrypting and decrypting data using the token algorithm.  We can test
  * this with arbitrary data, since these routines don't care about the
- * attribute formatting or content.
+ * attribute formatting or content.  Tokens are also checked against a simple
+ * reference implementation of the token format, so that the EVP and legacy
+ * token crypto backends are both held to the same fixed results.
  *
  * Written by Russ Allbery <eagle@eyrie.org>
  * Copyright 2012, 2013
@@ -15,6 +17,10 @@
 #include <config.h>
 #include <portable/system.h>
 
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <time.h>
+
 #include <tests/tap/basic.h>
 #include <webauth/basic.h>
 #include <webauth/keys.h>
@@ -48,21 +54,104 @@ read_token(const char *filename, void **data, size_t *length)
 }
 
 
+/*
+ * AES-CBC encrypt (enc is 1) or decrypt (enc is 0) data in place with an
+ * all-zero IV and no padding.  This and reference_encrypt are an independent
+ * implementation of the token format, used to check that whichever token
+ * crypto backend the library was built with produces and accepts exactly the
+ * same tokens.
+ */
+static void
+reference_cbc(const struct webauth_key *key, unsigned char *data,
+              size_t length, int enc)
+{
+    static const unsigned char iv[16] = { 0 };
+    const EVP_CIPHER *cipher;
+    EVP_CIPHER_CTX *ctx;
+    int outlen;
+
+    switch (key->length) {
+    case WA_AES_128: cipher = EVP_aes_128_cbc(); break;
+    case WA_AES_192: cipher = EVP_aes_192_cbc(); break;
+    case WA_AES_256: cipher = EVP_aes_256_cbc(); break;
+    default:         bail("unknown key length %d", key->length);
+    }
+    ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL)
+        bail("cannot create cipher context");
+    if (!EVP_CipherInit_ex(ctx, cipher, NULL, key->data, iv, enc))
+        bail("cannot initialize cipher");
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    if (!EVP_CipherUpdate(ctx, data, &outlen, data, (int) length))
+        bail("cannot run cipher");
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+
+/*
+ * Build a token from its first 20 bytes (the key hint and nonce) and the
+ * data to encrypt, following the token format: the HMAC-SHA1 of the data and
+ * padding follows the nonce, and everything after the hint is encrypted.
+ * Returns the token in newly allocated memory and stores its length.
+ */
+static unsigned char *
+reference_encrypt(const struct webauth_key *key, const unsigned char *header,
+                  const void *data, size_t length, size_t *token_len)
+{
+    unsigned char *token;
+    size_t plen;
+
+    plen = 16 - (16 + 20 + length) % 16;
+    *token_len = 4 + 16 + 20 + length + plen;
+    token = bmalloc(*token_len);
+    memcpy(token, header, 20);
+    memcpy(token + 40, data, length);
+    memset(token + 40 + length, (int) plen, plen);
+    if (HMAC(EVP_sha1(), key->data, key->length, token + 40, length + plen,
+             token + 20, NULL) == NULL)
+        bail("cannot compute HMAC");
+    reference_cbc(key, token + 4, *token_len - 4, 1);
+    return token;
+}
+
+
+/*
+ * Given a token, recover its key hint and nonce by decrypting its first
+ * block and store them in header, which must have room for 20 bytes.
+ */
+static void
+reference_header(const struct webauth_key *key, const unsigned char *token,
+                 unsigned char *header)
+{
+    memcpy(header, token, 20);
+    reference_cbc(key, header + 4, 16, 0);
+}
+
+
 int
 main(void)
 {
     struct webauth_context *ctx;
-    struct webauth_keyring *ring;
+    struct webauth_keyring *ring, *hand, *rotated, *oldest;
+    const struct webauth_key *key;
+    struct webauth_key *new_key, hand_key;
+    unsigned char key_data[WA_AES_256];
+    unsigned char header[20];
+    unsigned char *expected;
     char *keyring;
-    int s;
+    int s, i;
+    time_t now;
     void *data, *out, *token;
-    size_t length, outlen;
+    size_t length, outlen, expected_len, j;
+    const enum webauth_key_size sizes[] = {
+        WA_AES_128, WA_AES_192, WA_AES_256
+    };
     const char raw_data[] = { ';', ';', 0, ';', 't', '4', 1, 255 };
     const char app_raw[] =
         "t=app;s=testuser;lt=N\2]\312;ia=p;san=c;loa=\0\0\0\1;ct=N\2]\254;"
         "et=\177\377\377\320;";
 
-    plan(10);
+    plan(36);
 
     if (webauth_context_init(&ctx, NULL) != WA_ERR_NONE)
         bail("cannot initialize WebAuth context");
@@ -115,6 +204,148 @@ main(void)
     ok(memcmp(app_raw, out, sizeof(app_raw) - 1) == 0,
        "...and output data is correct");
 
+    /*
+     * The reference implementation must produce app-raw from its key hint
+     * and nonce, so that it can stand in for the token format.  The test
+     * keyring only has the one key.
+     */
+    s = webauth_keyring_best_key(ctx, ring, WA_KEY_ENCRYPT, 0, &key);
+    if (s != WA_ERR_NONE)
+        bail("cannot find key: %s", webauth_error_message(ctx, s));
+    reference_header(key, token, header);
+    expected = reference_encrypt(key, header, app_raw, sizeof(app_raw) - 1,
+                                 &expected_len);
+    ok(expected_len == length && memcmp(expected, token, length) == 0,
+       "Reference encryption reproduces app-raw");
+    free(expected);
+
+    /*
+     * For each key size and fixed key material, the library must decrypt a
+     * token built by the reference implementation from a fixed hint and
+     * nonce, and the tokens it encrypts must be exactly what the reference
+     * implementation produces from the same hint and nonce.
+     */
+    for (i = 0; i < 3; i++) {
+        memset(key_data, 0, sizeof(key_data));
+        memset(header, 0, sizeof(header));
+        for (j = 0; j < sizeof(key_data); j++)
+            key_data[j] = (unsigned char) (j * 7 + i);
+        for (j = 0; j < sizeof(header); j++)
+            header[j] = (unsigned char) (j * 13 + i);
+        s = webauth_key_create(ctx, WA_KEY_AES, sizes[i], key_data, &new_key);
+        if (s != WA_ERR_NONE)
+            bail("cannot create key: %s", webauth_error_message(ctx, s));
+        hand = webauth_keyring_from_key(ctx, new_key);
+        expected = reference_encrypt(new_key, header, app_raw,
+                                     sizeof(app_raw) - 1, &expected_len);
+        s = webauth_token_decrypt(ctx, expected, expected_len, &out, &outlen,
+                                  hand);
+        is_int(WA_ERR_NONE, s, "Decrypt reference token with %d-byte key",
+               (int) sizes[i]);
+        ok(outlen == sizeof(app_raw) - 1
+           && memcmp(app_raw, out, outlen) == 0,
+           "...and output data is correct");
+        free(expected);
+        s = webauth_token_encrypt(ctx, app_raw, sizeof(app_raw) - 1, &data,
+                                  &length, hand);
+        if (s != WA_ERR_NONE)
+            bail("cannot encrypt: %s", webauth_error_message(ctx, s));
+        reference_header(new_key, data, header);
+        expected = reference_encrypt(new_key, header, app_raw,
+                                     sizeof(app_raw) - 1, &expected_len);
+        ok(expected_len == length && memcmp(expected, data, length) == 0,
+           "...and encryption matches the reference byte for byte");
+        free(expected);
+    }
+
+    /*
+     * Keys built by hand, and keys whose data is changed after they've been
+     * used, must get the crypto state for their current key material.
+     */
+    s = webauth_keyring_best_key(ctx, ring, WA_KEY_ENCRYPT, 0, &key);
+    if (s != WA_ERR_NONE)
+        bail("cannot find key: %s", webauth_error_message(ctx, s));
+    memcpy(key_data, key->data, key->length);
+    hand_key.type = key->type;
+    hand_key.length = key->length;
+    hand_key.data = key_data;
+    hand = webauth_keyring_from_key(ctx, &hand_key);
+    s = webauth_token_encrypt(ctx, raw_data, sizeof(raw_data), &data, &length,
+                              hand);
+    is_int(WA_ERR_NONE, s, "Encryption with key built by hand works");
+    s = webauth_token_decrypt(ctx, data, length, &out, &outlen, ring);
+    is_int(WA_ERR_NONE, s, "...and decryption with original key works");
+    s = webauth_token_encrypt(ctx, raw_data, sizeof(raw_data), &data, &length,
+                              ring);
+    s = webauth_token_decrypt(ctx, data, length, &out, &outlen, hand);
+    is_int(WA_ERR_NONE, s, "Decryption with key built by hand works");
+    ok(out != NULL && memcmp(raw_data, out, sizeof(raw_data)) == 0,
+       "...and output data is correct");
+    s = webauth_keyring_best_key(ctx, hand, WA_KEY_ENCRYPT, 0, &key);
+    if (s != WA_ERR_NONE)
+        bail("cannot find key: %s", webauth_error_message(ctx, s));
+    key->data[0] ^= 0xff;
+    s = webauth_token_decrypt(ctx, data, length, &out, &outlen, hand);
+    is_int(WA_ERR_BAD_HMAC, s, "Decryption fails after changing key data");
+    s = webauth_token_encrypt(ctx, raw_data, sizeof(raw_data), &data, &length,
+                              hand);
+    s = webauth_token_decrypt(ctx, data, length, &out, &outlen, ring);
+    is_int(WA_ERR_BAD_HMAC, s, "...and its tokens use the new key data");
+    key->data[0] ^= 0xff;
+    s = webauth_token_decrypt(ctx, data, length, &out, &outlen, hand);
+    is_int(WA_ERR_BAD_HMAC, s, "...and fail once the data is changed back");
+
+    /*
+     * Build a keyring of rotated keys and encrypt a token with the oldest,
+     * so that the key hint points at the newest key.  Decryption should try
+     * every key, newest first, unless limited.
+     */
+    now = time(NULL);
+    rotated = webauth_keyring_new(ctx, 4);
+    oldest = NULL;
+    for (i = 4; i > 0; i--) {
+        s = webauth_key_create(ctx, WA_KEY_AES, WA_AES_128, NULL, &new_key);
+        if (s != WA_ERR_NONE)
+            bail("cannot create key: %s", webauth_error_message(ctx, s));
+        webauth_keyring_add(ctx, rotated, now - i * 100, now - i * 100,
+                            new_key);
+        if (oldest == NULL)
+            oldest = webauth_keyring_from_key(ctx, new_key);
+    }
+    s = webauth_token_encrypt(ctx, raw_data, sizeof(raw_data), &data, &length,
+                              rotated);
+    s = webauth_token_decrypt(ctx, data, length, &out, &outlen, rotated);
+    is_int(WA_ERR_NONE, s, "Decryption with rotated keyring works");
+    is_int(1, webauth_token_decrypt_trials(ctx), "...with one key tried");
+    s = webauth_token_encrypt(ctx, raw_data, sizeof(raw_data), &data, &length,
+                              oldest);
+    s = webauth_token_decrypt(ctx, data, length, &out, &outlen, rotated);
+    is_int(WA_ERR_NONE, s, "Decryption with the oldest key works");
+    is_int(4, webauth_token_decrypt_trials(ctx), "...with all keys tried");
+    webauth_token_decrypt_limit(ctx, 2);
+    s = webauth_token_decrypt(ctx, data, length, &out, &outlen, rotated);
+    is_int(WA_ERR_BAD_HMAC, s, "Decryption fails with a limit of two keys");
+    is_int(2, webauth_token_decrypt_trials(ctx), "...with two keys tried");
+    webauth_token_decrypt_limit(ctx, 0);
+    s = webauth_token_decrypt(ctx, data, length, &out, &outlen, rotated);
+    is_int(WA_ERR_NONE, s, "...and works again without a limit");
+
+    /*
+     * Replace the newest key with another, keeping the same number of keys.
+     * The new key has to be found for both encryption and decryption.
+     */
+    webauth_keyring_remove(ctx, rotated, 3);
+    s = webauth_key_create(ctx, WA_KEY_AES, WA_AES_128, NULL, &new_key);
+    if (s != WA_ERR_NONE)
+        bail("cannot create key: %s", webauth_error_message(ctx, s));
+    webauth_keyring_add(ctx, rotated, now - 50, now - 50, new_key);
+    s = webauth_keyring_best_key(ctx, rotated, WA_KEY_ENCRYPT, 0, &key);
+    ok(s == WA_ERR_NONE && memcmp(key->data, new_key->data, 16) == 0,
+       "Replaced key is used for encryption");
+    s = webauth_keyring_best_key(ctx, rotated, WA_KEY_DECRYPT, now, &key);
+    ok(s == WA_ERR_NONE && memcmp(key->data, new_key->data, 16) == 0,
+       "...and is the best key for decryption");
+
     /* Clean up. */
     free(token);
     webauth_context_free(ctx);
@@ -0,0 +1,154 @@
+/*
+ * Benchmark token decoding.
+ *
+ * Measures the time to base64-decode, decrypt, and decode app, id, and
+ * webkdc-proxy tokens from the test suite data, which exercises the whole
+ * path from the wire format to a token struct.  This is not part of the test
+ * suite; run it with make bench.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/apr.h>
+#include <portable/system.h>
+
+#include <apr_pools.h>
+#include <sys/time.h>
+
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <util/macros.h>
+#include <util/xmalloc.h>
+#include <webauth/basic.h>
+#include <webauth/keys.h>
+#include <webauth/tokens.h>
+
+/* Number of tokens to decode for each measurement. */
+#define ITERATIONS 100000
+
+/* Number of tokens to decode before clearing the pool. */
+#define BATCH 1000
+
+/* The tokens to decode, as names of files in tests/data/tokens. */
+static const struct {
+    enum webauth_token_type type;
+    const char *name;
+} tokens[] = {
+    { WA_TOKEN_APP,          "app-ok"     },
+    { WA_TOKEN_ID,           "id-webkdc"  },
+    { WA_TOKEN_WEBKDC_PROXY, "wkproxy-ok" },
+};
+
+
+/*
+ * Return the number of seconds, as a double, since some fixed point in the
+ * past.  Only differences between two calls are meaningful.
+ */
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+/*
+ * Read a token from a file in tests/data/tokens and return it in newly
+ * allocated memory.
+ */
+static char *
+read_token(const char *name)
+{
+    char buffer[4096];
+    char *file, *path;
+    FILE *token;
+    size_t length;
+
+    basprintf(&file, "data/tokens/%s", name);
+    path = test_file_path(file);
+    if (path == NULL)
+        bail("cannot find test file %s", file);
+    free(file);
+    token = fopen(path, "r");
+    if (token == NULL)
+        sysbail("cannot open %s", path);
+    if (fgets(buffer, sizeof(buffer), token) == NULL)
+        sysbail("cannot read %s", path);
+    fclose(token);
+    test_file_path_free(path);
+    length = strlen(buffer);
+    if (buffer[length - 1] == '\n')
+        buffer[length - 1] = '\0';
+    return xstrdup(buffer);
+}
+
+
+/*
+ * Decode ITERATIONS copies of the given token with the given keyring and
+ * report the time per token.  The WebAuth context used for decoding lives in
+ * a pool that is cleared every BATCH tokens so that memory use stays bounded
+ * without the cost of creating a pool per token.
+ */
+static void
+run_bench(apr_pool_t *pool, const struct webauth_keyring *ring,
+          enum webauth_token_type type, const char *name)
+{
+    struct webauth_context *ctx;
+    struct webauth_token *result;
+    char *token;
+    double start, elapsed;
+    unsigned long i;
+    int s;
+
+    token = read_token(name);
+    start = now();
+    for (i = 0; i < ITERATIONS; i++) {
+        if (i % BATCH == 0) {
+            apr_pool_clear(pool);
+            if (webauth_context_init_apr(&ctx, pool) != WA_ERR_NONE)
+                bail("cannot initialize WebAuth context");
+        }
+        s = webauth_token_decode(ctx, type, token, ring, &result);
+        if (s != WA_ERR_NONE)
+            bail("decoding %s failed: %s", name,
+                 webauth_error_message(ctx, s));
+    }
+    elapsed = now() - start;
+    printf("%-12s %6lu bytes  %8.0f ns/token\n", name,
+           (unsigned long) strlen(token), elapsed * 1e9 / ITERATIONS);
+    free(token);
+}
+
+
+int
+main(void)
+{
+    struct webauth_context *ctx;
+    struct webauth_keyring *ring;
+    apr_pool_t *pool;
+    char *keyring;
+    size_t i;
+    int s;
+
+    if (webauth_context_init(&ctx, NULL) != WA_ERR_NONE)
+        bail("cannot initialize WebAuth context");
+    keyring = test_file_path("data/keyring");
+    if (keyring == NULL)
+        bail("cannot find data/keyring");
+    s = webauth_keyring_read(ctx, keyring, &ring);
+    if (s != WA_ERR_NONE)
+        bail("cannot read %s: %s", keyring, webauth_error_message(ctx, s));
+    test_file_path_free(keyring);
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+
+    for (i = 0; i < ARRAY_SIZE(tokens); i++)
+        run_bench(pool, ring, tokens[i].type, tokens[i].name);
+
+    apr_pool_destroy(pool);
+    webauth_context_free(ctx);
+    return 0;
+}
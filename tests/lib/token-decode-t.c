@@ -13,11 +13,29 @@
 
 #include <tests/tap/basic.h>
 #include <tests/tap/string.h>
+#include <util/macros.h>
 #include <util/xmalloc.h>
 #include <webauth/basic.h>
 #include <webauth/keys.h>
 #include <webauth/tokens.h>
 
+/* Tokens and expected types for testing batch decoding. */
+static const char *const batch_names[] = {
+    "app-ok", "proxy-ok", "cred-ok", "app-bad-hmac", "cred-ok", "app-expired"
+};
+static const enum webauth_token_type batch_types[] = {
+    WA_TOKEN_APP, WA_TOKEN_PROXY, WA_TOKEN_CRED, WA_TOKEN_ANY, WA_TOKEN_APP,
+    WA_TOKEN_APP
+};
+
+/*
+ * The attributes of a raw app token, used to build tokens with unknown and
+ * duplicate attributes.
+ */
+#define APP_ATTRS \
+    "t=app;s=testuser;lt=N\2]\312;ia=p;san=c;loa=\0\0\0\1;ct=N\2]\254;" \
+    "et=\177\377\377\320;"
+
 
 /*
  * Read a token from a file name and return it in newly allocated memory.
@@ -154,6 +172,33 @@ check_error(struct webauth_context *ctx, enum webauth_token_type type,
 }
 
 
+/*
+ * Encrypt the given attributes into a token with the keyring and check the
+ * result of decoding it as a token of any type.  If message is not NULL, the
+ * error message must contain it.
+ */
+static void
+check_attrs(struct webauth_context *ctx, const char *attrs, size_t length,
+            const struct webauth_keyring *ring, int code, const char *message,
+            const char *desc)
+{
+    int s;
+    void *token;
+    size_t token_len;
+    struct webauth_token *result;
+
+    s = webauth_token_encrypt(ctx, attrs, length, &token, &token_len, ring);
+    if (s != WA_ERR_NONE)
+        bail("cannot encrypt token: %s", webauth_error_message(ctx, s));
+    s = webauth_token_decode_raw(ctx, WA_TOKEN_ANY, token, token_len, ring,
+                                 &result);
+    is_int(code, s, "Decode token with %s", desc);
+    if (message != NULL)
+        ok(strstr(webauth_error_message(ctx, s), message) != NULL,
+           "...with error %s", message);
+}
+
+
 int
 main(void)
 {
@@ -173,6 +218,9 @@ main(void)
     struct webauth_token_webkdc_factor *wkfactor;
     struct webauth_token_webkdc_proxy *wkproxy;
     struct webauth_token_webkdc_service *service;
+    struct webauth_token_batch batch[6];
+    char *path;
+    size_t i;
 
     plan_lazy();
 
@@ -734,6 +782,47 @@ main(void)
     check_error(ctx, WA_TOKEN_ANY, "app-bad-hmac", ring, WA_ERR_BAD_HMAC,
                 NULL, NULL);
 
+    /*
+     * Test batch decoding with a mix of good tokens and errors.  Each result
+     * should match decoding that token by itself, including the error.
+     */
+    for (i = 0; i < ARRAY_SIZE(batch_names); i++) {
+        basprintf(&path, "data/tokens/%s", batch_names[i]);
+        batch[i].type = batch_types[i];
+        batch[i].token = read_token(path);
+        free(path);
+    }
+    s = webauth_token_decode_batch(ctx, batch, ARRAY_SIZE(batch), ring);
+    is_int(WA_ERR_BAD_HMAC, s, "Batch decode returns first failure");
+    is_string(batch[3].error, webauth_error_message(ctx, s),
+              "...with its error");
+    for (i = 0; i < ARRAY_SIZE(batch); i++) {
+        s = webauth_token_decode(ctx, batch[i].type, batch[i].token, ring,
+                                 &result);
+        is_int(s, batch[i].status, "Batch status for %s", batch_names[i]);
+        if (s == WA_ERR_NONE) {
+            ok(batch[i].decoded != NULL, "...decoded");
+            ok(batch[i].error == NULL, "...no error");
+            if (batch[i].decoded != NULL)
+                is_int(result->type, batch[i].decoded->type, "...type");
+            else
+                ok(0, "...type");
+        } else {
+            ok(batch[i].decoded == NULL, "...not decoded");
+            is_string(webauth_error_message(ctx, s), batch[i].error,
+                      "...error");
+            ok(batch[i].trials > 0, "...keys tried");
+        }
+        free((char *) batch[i].token);
+    }
+    if (batch[0].decoded != NULL)
+        is_string("testuser", batch[0].decoded->token.app.subject,
+                  "Batch app token subject");
+    else
+        ok(0, "Batch app token subject");
+    is_int(WA_ERR_NONE, webauth_token_decode_batch(ctx, batch, 0, ring),
+           "Empty batch decode");
+
     /* Test decoding of a raw app token. */
     result = check_decode_raw(ctx, WA_TOKEN_APP, "app-raw", ring, 9);
     if (result != NULL) {
@@ -749,6 +838,22 @@ main(void)
         is_int(2147483600, app->expiration, "...expiration");
     }
 
+    /*
+     * Unknown attributes are ignored, but duplicate attributes are rejected
+     * whether or not they're known, including the token type.
+     */
+    check_attrs(ctx, APP_ATTRS "zz=1;", sizeof(APP_ATTRS "zz=1;") - 1, ring,
+                WA_ERR_NONE, NULL, "unknown attribute");
+    check_attrs(ctx, APP_ATTRS "s=other;", sizeof(APP_ATTRS "s=other;") - 1,
+                ring, WA_ERR_CORRUPT, "duplicate attribute s",
+                "duplicate subject");
+    check_attrs(ctx, APP_ATTRS "zz=1;zz=2;",
+                sizeof(APP_ATTRS "zz=1;zz=2;") - 1, ring, WA_ERR_CORRUPT,
+                "duplicate attribute zz", "duplicate unknown attribute");
+    check_attrs(ctx, "t=app;" APP_ATTRS, sizeof("t=app;" APP_ATTRS) - 1,
+                ring, WA_ERR_CORRUPT, "duplicate attribute t",
+                "duplicate token type");
+
     /* Clean up. */
     webauth_context_free(ctx);
     return 0;
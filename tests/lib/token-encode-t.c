@@ -25,6 +25,17 @@
 #include <webauth/tokens.h>
 
 
+/*
+ * The exact encoded attributes of two error tokens.  The binary creation time
+ * in the first contains semicolons, which are doubled, and the second has
+ * the longest possible error code.
+ */
+static const char error_attrs[] =
+    "t=error;ec=12345;em=a;;;;b;;;ct=;;;;\0\001;";
+static const char error_max_attrs[] =
+    "t=error;ec=4294967295;em=x;ct=\0\0\0\001;";
+
+
 /*
  * Encode and decode a token of a particular type, returning the new generic
  * token on success and NULL on failure.  Takes the context, token, keyring,
@@ -102,6 +113,42 @@ encode_decode_raw(struct webauth_context *ctx, struct webauth_token *data,
 }
 
 
+/*
+ * Encode a raw token and decrypt it without decoding, checking that the
+ * encoded attributes exactly match the expected data.  Takes the context,
+ * token, keyring, expected attributes and their length, and the name of the
+ * token for reporting.
+ */
+static void
+check_attrs(struct webauth_context *ctx, struct webauth_token *data,
+            const struct webauth_keyring *ring, const void *expected,
+            size_t length, const char *name)
+{
+    int s;
+    const void *token;
+    void *attrs;
+    size_t token_len, attrs_len;
+
+    s = webauth_token_encode_raw(ctx, data, ring, &token, &token_len);
+    is_int(WA_ERR_NONE, s, "Encoding %s %s succeeds",
+           webauth_token_type_string(data->type), name);
+    if (s != WA_ERR_NONE) {
+        ok_block(3, 0, "...encoding failed");
+        return;
+    }
+    s = webauth_token_decrypt(ctx, token, token_len, &attrs, &attrs_len,
+                              ring);
+    is_int(WA_ERR_NONE, s, "...and decrypting succeeds");
+    if (s != WA_ERR_NONE) {
+        ok_block(2, 0, "...decrypting failed");
+        return;
+    }
+    is_int(length, attrs_len, "...attribute length");
+    ok(attrs_len == length && memcmp(attrs, expected, length) == 0,
+       "...attributes");
+}
+
+
 /*
  * Check an application token by encoding the struct and then decoding it,
  * ensuring that all attributes in the decoded struct match the encoded one.
@@ -517,7 +564,7 @@ main(void)
     char *expected;
     const char *result;
 
-    plan(498);
+    plan(498 + 8);
 
     if (webauth_context_init(&ctx, NULL) != WA_ERR_NONE)
         bail("cannot initialize WebAuth context");
@@ -638,6 +685,19 @@ main(void)
     check_error_error(ctx, &err, ring, "without message", "missing message",
                       "error");
 
+    /* Check the exact encoded attributes of error tokens. */
+    in.type = WA_TOKEN_ERROR;
+    in.token.error.code = 12345;
+    in.token.error.message = "a;;b;";
+    in.token.error.creation = 0x3b3b0001;
+    check_attrs(ctx, &in, ring, error_attrs, sizeof(error_attrs) - 1,
+                "with semicolons");
+    in.token.error.code = 4294967295UL;
+    in.token.error.message = "x";
+    in.token.error.creation = 1;
+    check_attrs(ctx, &in, ring, error_max_attrs,
+                sizeof(error_max_attrs) - 1, "with maximum code");
+
     /* Flesh out an id token, and then encode and decode it. */
     id.subject = NULL;
     id.authz_subject = "someone";
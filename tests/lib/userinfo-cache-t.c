@@ -0,0 +1,182 @@
+/*
+ * Test suite for the user information result cache.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/apr.h>
+#include <portable/system.h>
+
+#include <time.h>
+
+#include <lib/internal.h>
+#include <tests/tap/basic.h>
+#include <webauth/basic.h>
+#include <webauth/factors.h>
+#include <webauth/webkdc.h>
+
+/* The URLs used for the cached calls. */
+#define URL       "https://example.com/"
+#define OTHER_URL "https://example.org/"
+
+
+/*
+ * Return the statistics of a cache.  Just a wrapper so that the tests can
+ * look at a single field.
+ */
+static struct webauth_user_cache_stats
+cache_stats(struct webauth_user_cache *cache)
+{
+    struct webauth_user_cache_stats stats;
+
+    webauth_user_cache_stats(cache, &stats);
+    return stats;
+}
+
+
+int
+main(void)
+{
+    apr_pool_t *pool;
+    struct webauth_context *ctx;
+    struct webauth_user_config config;
+    struct webauth_user_cache *cache;
+    struct webauth_user_info info, *result;
+    apr_array_header_t *logins;
+    struct webauth_login *login;
+    bool found;
+    int s;
+
+    if (apr_initialize() != APR_SUCCESS)
+        bail("cannot initialize APR");
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    if (webauth_context_init_apr(&ctx, pool) != WA_ERR_NONE)
+        bail("cannot initialize WebAuth context");
+
+    plan(33);
+
+    /* Set up a cache of three entries in the user configuration. */
+    s = webauth_user_cache_new(ctx, 3, 60, &cache);
+    is_int(WA_ERR_NONE, s, "Creating a cache succeeds");
+    memset(&config, 0, sizeof(config));
+    config.cache = cache;
+    ctx->user = &config;
+
+    /* Build a result to cache. */
+    memset(&info, 0, sizeof(info));
+    info.factors = webauth_factors_parse(ctx, "p,o");
+    info.max_loa = 3;
+    info.user_message = "message";
+    logins = apr_array_make(ctx->pool, 1, sizeof(struct webauth_login));
+    login = apr_array_push(logins);
+    login->ip = "192.0.2.1";
+    login->hostname = "example.net";
+    login->timestamp = 1365630519;
+    info.logins = logins;
+
+    /* Nothing is cached yet. */
+    found = wai_user_cache_get(ctx, "user", "192.0.2.2", 0, URL, "p",
+                               &result);
+    ok(!found, "Empty cache has no result");
+
+    /* Store the result and get a copy back for the same arguments. */
+    wai_user_cache_put(ctx, "user", "192.0.2.2", 0, URL, "p", &info);
+    result = NULL;
+    found = wai_user_cache_get(ctx, "user", "192.0.2.2", 0, URL, "p",
+                               &result);
+    ok(found, "Cached result is found");
+    if (result == NULL)
+        ok_block(6, false, "No cached result");
+    else {
+        ok(result != &info, "...and is a copy");
+        is_string(webauth_factors_string(ctx, info.factors),
+                  webauth_factors_string(ctx, result->factors),
+                  "...with the right factors");
+        is_int(3, result->max_loa, "...and max LoA");
+        is_string("message", result->user_message, "...and message");
+        is_int(1, result->logins->nelts, "...and one login");
+        login = &APR_ARRAY_IDX(result->logins, 0, struct webauth_login);
+        is_string("example.net", login->hostname, "...with the hostname");
+    }
+
+    /* Any difference in the arguments is a miss. */
+    ok(!wai_user_cache_get(ctx, "other", "192.0.2.2", 0, URL, "p", &result),
+       "...but not for another user");
+    ok(!wai_user_cache_get(ctx, "user", NULL, 0, URL, "p", &result),
+       "...or another IP address");
+    ok(!wai_user_cache_get(ctx, "user", "192.0.2.2", 1, URL, "p", &result),
+       "...or with random multifactor");
+    ok(!wai_user_cache_get(ctx, "user", "192.0.2.2", 0, OTHER_URL, "p",
+                           &result),
+       "...or another URL");
+    ok(!wai_user_cache_get(ctx, "user", "192.0.2.2", 0, URL, "p,o",
+                           &result),
+       "...or other factors");
+    is_int(1, cache_stats(cache).hits, "One hit");
+    is_int(6, cache_stats(cache).misses, "...and six misses");
+
+    /* Only the origin of the URL matters, so other pages of a site hit. */
+    ok(wai_user_cache_get(ctx, "user", "192.0.2.2", 0,
+                          "https://example.com/other/page?a=b", "p", &result),
+       "Other path on the same site is found");
+    ok(wai_user_cache_get(ctx, "user", "192.0.2.2", 0,
+                          "HTTPS://Example.COM:443/", "p", &result),
+       "...as is the same origin written differently");
+    ok(!wai_user_cache_get(ctx, "user", "192.0.2.2", 0,
+                           "https://example.com:8443/", "p", &result),
+       "...but not another port");
+    ok(!wai_user_cache_get(ctx, "user", "192.0.2.2", 0,
+                           "http://example.com/", "p", &result),
+       "...or another scheme");
+    is_int(3, cache_stats(cache).hits, "Three hits");
+    is_int(8, cache_stats(cache).misses, "...and eight misses");
+
+    /* Flushing a user drops all of their entries and only theirs. */
+    wai_user_cache_put(ctx, "user", NULL, 0, OTHER_URL, NULL, &info);
+    wai_user_cache_put(ctx, "other", NULL, 0, URL, NULL, &info);
+    is_int(3, cache_stats(cache).entries, "Three entries cached");
+    wai_user_cache_flush(ctx, "user");
+    is_int(2, cache_stats(cache).flushed, "Flush drops two entries");
+    is_int(1, cache_stats(cache).entries, "...leaving one");
+    ok(!wai_user_cache_get(ctx, "user", "192.0.2.2", 0, URL, "p", &result),
+       "...and the user's results are gone");
+    ok(!wai_user_cache_get(ctx, "user", NULL, 0, OTHER_URL, NULL, &result),
+       "...all of them");
+    ok(wai_user_cache_get(ctx, "other", NULL, 0, URL, NULL, &result),
+       "...but the other user's result is still there");
+
+    /* The cache doesn't grow past its size. */
+    wai_user_cache_put(ctx, "a", NULL, 0, URL, NULL, &info);
+    wai_user_cache_put(ctx, "b", NULL, 0, URL, NULL, &info);
+    wai_user_cache_put(ctx, "c", NULL, 0, URL, NULL, &info);
+    is_int(3, cache_stats(cache).entries, "Cache stays at its size");
+
+    /* Expired entries aren't returned and are dropped. */
+    s = webauth_user_cache_new(ctx, 3, 1, &cache);
+    if (s != WA_ERR_NONE)
+        bail("cannot create cache: %s", webauth_error_message(ctx, s));
+    config.cache = cache;
+    wai_user_cache_put(ctx, "user", NULL, 0, URL, NULL, &info);
+    ok(wai_user_cache_get(ctx, "user", NULL, 0, URL, NULL, &result),
+       "Result with short TTL is found");
+    sleep(2);
+    ok(!wai_user_cache_get(ctx, "user", NULL, 0, URL, NULL, &result),
+       "...but not once it has expired");
+    is_int(0, cache_stats(cache).entries, "...and has been dropped");
+
+    /* A cache with no TTL stores nothing. */
+    s = webauth_user_cache_new(ctx, 3, 0, &cache);
+    if (s != WA_ERR_NONE)
+        bail("cannot create cache: %s", webauth_error_message(ctx, s));
+    config.cache = cache;
+    wai_user_cache_put(ctx, "user", NULL, 0, URL, NULL, &info);
+    is_int(0, cache_stats(cache).stores, "Cache with no TTL stores nothing");
+
+    /* Clean up. */
+    ctx->user = NULL;
+    apr_pool_destroy(pool);
+    apr_terminate();
+    return 0;
+}
@@ -401,7 +401,10 @@ main(void)
     struct webauth_context *ctx;
     struct webauth_user_config config;
     struct webauth_user_info *info;
+    struct webauth_user_pool_stats stats;
+    struct webauth_user_cache_stats cache_stats;
     const char url[] = "https://example.com/";
+    unsigned long stores;
     int s;
 
     /* Skip this test if built without remctl support. */
@@ -415,7 +418,7 @@ main(void)
     if (webauth_context_init(&ctx, NULL) != WA_ERR_NONE)
         bail("cannot initialize WebAuth context");
 
-    plan(15 + 158 * 2);
+    plan(27 + 158 * 5);
 
     /* Empty the KRB5CCNAME environment variable and make the library cope. */
     putenv((char *) "KRB5CCNAME=");
@@ -475,6 +478,51 @@ main(void)
     skip_block(159, "not built with JSON support");
 #endif
 
+    /* Run the tests again, taking connections from a connection pool. */
+    s = webauth_user_pool_new(ctx, 2, 60, &config.pool);
+    is_int(WA_ERR_NONE, s, "Create connection pool");
+    config.command = "test";
+    config.json = false;
+    s = webauth_user_config(ctx, &config);
+    is_int(WA_ERR_NONE, s, "Configuration with connection pool");
+    test_userinfo_calls(ctx, &config);
+    webauth_user_pool_stats(config.pool, &stats);
+    ok(stats.created > 0, "...connections were opened");
+    ok(stats.reused > 0, "...and reused");
+    is_int(1, stats.renewed, "...with one set of keytab credentials");
+
+    /*
+     * Run the tests twice more with a result cache, so that the second time
+     * the successful calls are answered from the cache.
+     */
+    s = webauth_user_cache_new(ctx, 100, 60, &config.cache);
+    is_int(WA_ERR_NONE, s, "Create result cache");
+    s = webauth_user_config(ctx, &config);
+    is_int(WA_ERR_NONE, s, "Configuration with result cache");
+    test_userinfo_calls(ctx, &config);
+    test_userinfo_calls(ctx, &config);
+    webauth_user_cache_stats(config.cache, &cache_stats);
+    ok(cache_stats.stores > 0, "...results were cached");
+    ok(cache_stats.hits > 0, "...and returned from the cache");
+
+    /*
+     * The empty result returned when ignoring a failure to reach the service
+     * must not be cached, or it would hide the real answer once the service
+     * is back.  Drop the warning callback, which points into a function that
+     * has returned.
+     */
+    webauth_log_callback(ctx, WA_LOG_WARN, NULL, NULL);
+    config.timeout = 1;
+    config.ignore_failure = true;
+    s = webauth_user_config(ctx, &config);
+    is_int(WA_ERR_NONE, s, "Configuration with ignore failure and cache");
+    webauth_user_cache_stats(config.cache, &cache_stats);
+    stores = cache_stats.stores;
+    s = webauth_user_info(ctx, "delay", NULL, 0, url, NULL, &info);
+    is_int(WA_ERR_NONE, s, "Metadata for delay succeeds");
+    webauth_user_cache_stats(config.cache, &cache_stats);
+    is_int(stores, cache_stats.stores, "...and the result isn't cached");
+
     /* Clean up. */
     webauth_context_free(ctx);
     return 0;
@@ -1556,6 +1556,51 @@ static const struct wat_login_test tests_timeout[] = {
 };
 
 
+/*
+ * Tests that should be run with a short login deadline, so that the OTP
+ * validation call is made in the background while the password login is done.
+ */
+static const struct wat_login_test tests_deadline[] = {
+
+    /*
+     * The validation service doesn't answer for the delay user in time, so
+     * the login should fail with a login timeout once the password login is
+     * done, without waiting for the validation call to finish.
+     */
+    {
+        "OTP validation past login deadline",
+        WA_PEC_LOGIN_TIMEOUT,
+        "remote call timed out (deadline exceeded)",
+        {
+            { "krb5:webauth/example.com@EXAMPLE.COM", 0, 0 },
+            {
+                { "delay", NULL, "123456", NULL, NULL, 0 },
+                { "<userprinc>", "<password>", NULL, NULL, NULL, 0 },
+                EMPTY_TOKEN_LOGIN
+            },
+            NO_TOKENS_WKPROXY,
+            NO_TOKENS_WKFACTOR,
+            NULL,
+            {
+                "id", "webkdc", NULL, NULL, 0, "https://example.com/", NULL,
+                "o", NULL, 0, NULL, 0
+            }
+        },
+        {
+            NULL, NULL,
+            NO_FACTOR_DATA,
+            NO_TOKENS_WKPROXY,
+            EMPTY_TOKEN_WKFACTOR,
+            EMPTY_TOKEN_ID,
+            EMPTY_TOKEN_PROXY,
+            NO_LOGINS,
+            0,
+            NO_AUTHZ_IDS
+        }
+    }
+};
+
+
 /* Tests that should be run with a timeout and ignore errors. */
 static const struct wat_login_test tests_ignore_failure[] = {
 
@@ -1656,6 +1701,32 @@ static const struct wat_login_test tests_ignore_failure[] = {
 };
 
 
+/* Counts of the remote calls that were started in the background. */
+struct background_calls {
+    unsigned long otp;
+    unsigned long userinfo;
+};
+
+
+/*
+ * Trace log callback that counts the background calls reported by the login
+ * code, so that we can check that the concurrent path was taken.
+ */
+static void
+trace_callback(struct webauth_context *ctx UNUSED, void *data,
+               const char *message)
+{
+    struct background_calls *calls = data;
+
+    if (strstr(message, "in the background") == NULL)
+        return;
+    if (strncmp(message, "validating OTP ", 15) == 0)
+        calls->otp++;
+    else if (strncmp(message, "calling user information ", 25) == 0)
+        calls->userinfo++;
+}
+
+
 int
 main(void)
 {
@@ -1666,6 +1737,7 @@ main(void)
     struct webauth_keyring *ring;
     struct webauth_user_config user_config;
     struct webauth_webkdc_config config;
+    struct background_calls calls = { 0, 0 };
     char *keyring;
     int s;
     size_t i;
@@ -1728,6 +1800,39 @@ main(void)
     for (i = 0; i < ARRAY_SIZE(tests_default); i++)
         run_login_test(ctx, &tests_default[i], ring, krbconf);
 
+    /*
+     * Re-run the basic tests with a login deadline and speculative user
+     * information calls, which makes the user information service calls in
+     * the background while the Kerberos logins are done.  The results should
+     * be the same.
+     */
+    webauth_log_callback(ctx, WA_LOG_TRACE, trace_callback, &calls);
+    config.login_deadline = 30;
+    config.speculative_userinfo = true;
+    s = webauth_webkdc_config(ctx, &config);
+    is_int(WA_ERR_NONE, s, "Setting login deadline succeeds");
+    for (i = 0; i < ARRAY_SIZE(tests_default); i++)
+        run_login_test(ctx, &tests_default[i], ring, krbconf);
+    ok(calls.userinfo > 0, "...and user information calls were speculative");
+
+    /*
+     * With a short deadline, an OTP validation call that takes too long
+     * should time out the login.  Check that it was made in the background.
+     */
+    config.login_deadline = 1;
+    config.speculative_userinfo = false;
+    s = webauth_webkdc_config(ctx, &config);
+    is_int(WA_ERR_NONE, s, "Setting short login deadline succeeds");
+    calls.otp = 0;
+    for (i = 0; i < ARRAY_SIZE(tests_deadline); i++)
+        run_login_test(ctx, &tests_deadline[i], ring, krbconf);
+    is_int(ARRAY_SIZE(tests_deadline), calls.otp,
+           "...and OTP validation was done in the background");
+    webauth_log_callback(ctx, WA_LOG_TRACE, NULL, NULL);
+    config.login_deadline = 0;
+    s = webauth_webkdc_config(ctx, &config);
+    is_int(WA_ERR_NONE, s, "Clearing login deadline succeeds");
+
     /* Add a timeout to the user information service queries. */
     user_config.timeout = 1;
     s = webauth_user_config(ctx, &user_config);
@@ -0,0 +1,233 @@
+/*
+ * Test suite for wildcard pattern sets in mod_webkdc.
+ *
+ * Compiled pattern sets must match exactly the subjects that ap_strcmp_match
+ * would match with one of their patterns, both when they are compiled into a
+ * DFA and when the DFA would be too large and they fall back on matching each
+ * pattern in turn.  Check some fixed cases and then random pattern sets and
+ * subjects against ap_strcmp_match.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/apache.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+
+#include <modules/webkdc/mod_webkdc.h>
+#include <tests/tap/basic.h>
+#include <util/macros.h>
+
+/* Number of random pattern sets and subjects for each set. */
+#define ROUNDS   100
+#define SUBJECTS 200
+
+/* Characters used to build random patterns and subjects. */
+static const char pattern_chars[] = "ab**??";
+static const char subject_chars[] = "abx";
+
+/* Fixed patterns and whether each subject should match. */
+static const struct {
+    const char *pattern;
+    const char *subject;
+    bool match;
+} fixed_tests[] = {
+    { "*",                  "",                     true  },
+    { "*",                  "anything",             true  },
+    { "?",                  "",                     false },
+    { "?",                  "a",                    true  },
+    { "a*b",                "ab",                   true  },
+    { "a*b",                "axxb",                 true  },
+    { "a*b",                "axxba",                false },
+    { "**a**",              "xax",                  true  },
+    { "*@EXAMPLE.COM",      "user@EXAMPLE.COM",     true  },
+    { "*@EXAMPLE.COM",      "user@EXAMPLE.ORG",     false },
+    { "webauth/*.example.com", "webauth/a.example.com", true },
+    { "webauth/*.example.com", "webauth/example.com", false },
+    { "a?c",                "abc",                  true  },
+    { "a?c",                "ac",                   false },
+};
+
+
+/*
+ * The ap_strcmp_match function from server/util.c in Apache httpd, so that
+ * glob.c can be linked and checked without the server.  Returns 0 if str
+ * matches expected, where * matches any sequence of characters and ?
+ * matches any one character, and non-zero otherwise.
+ */
+int
+ap_strcmp_match(const char *str, const char *expected)
+{
+    int x, y;
+
+    for (x = 0, y = 0; expected[y]; ++y, ++x) {
+        if ((!str[x]) && (expected[y] != '*'))
+            return -1;
+        if (expected[y] == '*') {
+            while (expected[++y] == '*')
+                ;
+            if (!expected[y])
+                return 0;
+            while (str[x]) {
+                int ret;
+
+                if ((ret = ap_strcmp_match(&str[x++], &expected[y])) != 1)
+                    return ret;
+            }
+            return -1;
+        } else if ((expected[y] != '?') && (str[x] != expected[y]))
+            return 1;
+    }
+    return (str[x] != '\0');
+}
+
+
+/*
+ * Return a random string of up to max characters from chars, allocated from
+ * pool.
+ */
+static char *
+random_string(apr_pool_t *pool, const char *chars, size_t max)
+{
+    char *string;
+    size_t length, i;
+
+    length = (size_t) rand() % (max + 1);
+    string = apr_palloc(pool, length + 1);
+    for (i = 0; i < length; i++)
+        string[i] = chars[(size_t) rand() % strlen(chars)];
+    string[length] = '\0';
+    return string;
+}
+
+
+/*
+ * Return whether subject matches any of the patterns according to
+ * ap_strcmp_match.
+ */
+static bool
+reference_match(const apr_array_header_t *patterns, const char *subject)
+{
+    int i;
+
+    for (i = 0; i < patterns->nelts; i++)
+        if (ap_strcmp_match(subject, APR_ARRAY_IDX(patterns, i, char *)) == 0)
+            return true;
+    return false;
+}
+
+
+/*
+ * Check SUBJECTS random subjects, and each of the patterns as a subject,
+ * against a compiled pattern set and the reference matcher, and return the
+ * number of subjects on which they disagree.
+ */
+static unsigned long
+count_mismatches(apr_pool_t *pool, const struct mwk_glob_set *set,
+                 const apr_array_header_t *patterns)
+{
+    const char *subject;
+    unsigned long mismatches = 0;
+    size_t i;
+    int j;
+
+    for (i = 0; i < SUBJECTS; i++) {
+        subject = random_string(pool, subject_chars, 12);
+        if (mwk_glob_match(set, subject) != reference_match(patterns, subject))
+            mismatches++;
+    }
+
+    /* Make sure that some subjects match by trying the patterns as is. */
+    for (j = 0; j < patterns->nelts; j++) {
+        subject = APR_ARRAY_IDX(patterns, j, char *);
+        if (mwk_glob_match(set, subject) != reference_match(patterns, subject))
+            mismatches++;
+    }
+    return mismatches;
+}
+
+
+int
+main(void)
+{
+    apr_pool_t *pool, *scratch;
+    apr_array_header_t *patterns;
+    struct mwk_glob_set *set, *fallback;
+    char *pattern;
+    size_t i, count, j;
+
+    if (apr_initialize() != APR_SUCCESS)
+        bail("cannot initialize APR");
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    if (apr_pool_create(&scratch, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+
+    plan(ARRAY_SIZE(fixed_tests) * 2 + 3 + ROUNDS * 3 + 3);
+
+    /* Check the fixed cases with and without a DFA. */
+    for (i = 0; i < ARRAY_SIZE(fixed_tests); i++) {
+        patterns = apr_array_make(pool, 1, sizeof(const char *));
+        APR_ARRAY_PUSH(patterns, const char *) = fixed_tests[i].pattern;
+        set = mwk_glob_compile(pool, scratch, patterns, MWK_GLOB_MAX_CELLS);
+        fallback = mwk_glob_compile(pool, scratch, patterns, 0);
+        ok(mwk_glob_match(set, fixed_tests[i].subject)
+           == fixed_tests[i].match, "%s against %s", fixed_tests[i].subject,
+           fixed_tests[i].pattern);
+        ok(mwk_glob_match(fallback, fixed_tests[i].subject)
+           == fixed_tests[i].match, "...and without a DFA");
+    }
+
+    /* An empty set matches nothing, not even the empty string. */
+    patterns = apr_array_make(pool, 1, sizeof(const char *));
+    set = mwk_glob_compile(pool, scratch, patterns, MWK_GLOB_MAX_CELLS);
+    ok(set->dfa == NULL, "Empty set has no DFA");
+    ok(!mwk_glob_match(set, ""), "...and doesn't match nothing");
+    ok(!mwk_glob_match(set, "a"), "...or something");
+
+    /*
+     * Check random sets of patterns against random subjects, compiled into a
+     * DFA and with a limit of no transitions so that they always fall back.
+     */
+    srand(42);
+    for (i = 0; i < ROUNDS; i++) {
+        apr_pool_clear(scratch);
+        count = 1 + (size_t) rand() % 8;
+        patterns = apr_array_make(pool, count, sizeof(char *));
+        for (j = 0; j < count; j++) {
+            pattern = random_string(pool, pattern_chars, 8);
+            APR_ARRAY_PUSH(patterns, char *) = pattern;
+        }
+        set = mwk_glob_compile(pool, scratch, patterns, MWK_GLOB_MAX_CELLS);
+        fallback = mwk_glob_compile(pool, scratch, patterns, 0);
+        ok(set->dfa != NULL, "Random set %lu compiles", (unsigned long) i);
+        is_int(0, count_mismatches(scratch, set, patterns),
+               "...and matches like ap_strcmp_match");
+        is_int(0, count_mismatches(scratch, fallback, patterns),
+               "...and without a DFA");
+    }
+
+    /*
+     * Patterns that need a DFA state for every combination of the last
+     * sixteen characters, with enough distinct characters in another pattern
+     * that the DFA would go over MWK_GLOB_MAX_CELLS.  These must fall back
+     * on matching each pattern in turn with the default limit.
+     */
+    apr_pool_clear(scratch);
+    patterns = apr_array_make(pool, 2, sizeof(char *));
+    APR_ARRAY_PUSH(patterns, char *) = apr_pstrdup(pool, "*a???????????????");
+    APR_ARRAY_PUSH(patterns, char *) = apr_pstrdup(pool,
+        "bcdefghijklmnopqrstuvwyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789");
+    set = mwk_glob_compile(pool, scratch, patterns, MWK_GLOB_MAX_CELLS);
+    ok(set->dfa == NULL, "Exponential set is too large for a DFA");
+    is_int(0, count_mismatches(scratch, set, patterns),
+           "...and still matches like ap_strcmp_match");
+    ok(mwk_glob_match(set, "xxxabbbbbbbbbbbbbbb"),
+       "...including a match of the exponential pattern");
+
+    apr_pool_destroy(scratch);
+    apr_pool_destroy(pool);
+    apr_terminate();
+    return 0;
+}
@@ -0,0 +1,337 @@
+/*
+ * Benchmark parsing of WebKDC requests.
+ *
+ * Measures the time to parse a typical requestTokenRequest and extract the
+ * text of the elements the WebKDC uses, first with apr_xml_parser, which
+ * mod_webkdc used to use, and then with the streaming parser in
+ * modules/webkdc/xml.c, and finally with the same parser reading the compact
+ * encoding of the request.  The request is fed in the same 8KB blocks that
+ * mod_webkdc reads from the client.  This is not part of the test suite; run
+ * it with make bench.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/apache.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+
+#include <apr_xml.h>
+#include <sys/time.h>
+
+#include <modules/webkdc/mod_webkdc.h>
+#include <tests/tap/basic.h>
+
+/* Number of requests to parse for each measurement. */
+#define ITERATIONS 100000
+
+/* Size of the blocks in which the request is fed to the parser. */
+#define BLOCK 8192
+
+/* Parse a document, returning its root element or NULL on failure. */
+typedef apr_xml_elem *(*parse_func)(apr_pool_t *, const char *, size_t);
+
+
+/*
+ * Return the number of seconds, as a double, since some fixed point in the
+ * past.  Only differences between two calls are meaningful.
+ */
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+/*
+ * Return a string of length characters of base64-like data, standing in for
+ * a token, allocated from pool.
+ */
+static char *
+fake_token(apr_pool_t *pool, size_t length)
+{
+    static const char chars[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char *token;
+    size_t i;
+
+    token = apr_palloc(pool, length + 1);
+    for (i = 0; i < length; i++)
+        token[i] = chars[(i * 7) % 64];
+    token[length] = '\0';
+    return token;
+}
+
+
+/*
+ * Build a requestTokenRequest like the one WebLogin sends when a user with a
+ * single sign-on cookie visits a new site.
+ */
+static const char *
+build_request(apr_pool_t *pool)
+{
+    return apr_pstrcat(pool,
+        "<requestTokenRequest>"
+        "<requesterCredential type=\"service\">", fake_token(pool, 400),
+        "</requesterCredential>"
+        "<subjectCredential>"
+        "<proxyToken type=\"krb5\" source=\"c\">", fake_token(pool, 2400),
+        "</proxyToken>"
+        "<proxyToken type=\"remuser\" source=\"c\">", fake_token(pool, 500),
+        "</proxyToken>"
+        "<factorToken>", fake_token(pool, 300), "</factorToken>"
+        "</subjectCredential>"
+        "<requestToken>", fake_token(pool, 600), "</requestToken>"
+        "<requestInfo>"
+        "<localIpAddr>192.0.2.10</localIpAddr>"
+        "<localIpPort>443</localIpPort>"
+        "<remoteIpAddr>198.51.100.20</remoteIpAddr>"
+        "<remoteIpPort>52311</remoteIpPort>"
+        "</requestInfo>"
+        "</requestTokenRequest>\n", (char *) NULL);
+}
+
+
+/*
+ * Append data of the given length to a growing buffer allocated from pool.
+ */
+static void
+append(apr_pool_t *pool, char **buffer, size_t *used, size_t *size,
+       const void *data, size_t length)
+{
+    char *data_new;
+
+    if (*used + length > *size) {
+        *size = (*size + length) * 2;
+        data_new = apr_palloc(pool, *size);
+        if (*used > 0)
+            memcpy(data_new, *buffer, *used);
+        *buffer = data_new;
+    }
+    memcpy(*buffer + *used, data, length);
+    *used += length;
+}
+
+
+/*
+ * Append a compact record type and a length, one byte for names and four
+ * bytes in network byte order for values, omitting the type if it's '\0'.
+ */
+static void
+append_header(apr_pool_t *pool, char **buffer, size_t *used, size_t *size,
+              char type, size_t length, bool is_name)
+{
+    unsigned char header[5];
+    size_t n = 0;
+
+    if (type != '\0')
+        header[n++] = (unsigned char) type;
+    if (is_name)
+        header[n++] = (unsigned char) length;
+    else {
+        header[n++] = (unsigned char) ((length >> 24) & 0xff);
+        header[n++] = (unsigned char) ((length >> 16) & 0xff);
+        header[n++] = (unsigned char) ((length >> 8) & 0xff);
+        header[n++] = (unsigned char) (length & 0xff);
+    }
+    append(pool, buffer, used, size, header, n);
+}
+
+
+/*
+ * Encode an element and its children in the compact encoding, the way
+ * mod_webauth does when sending a request.
+ */
+static void
+encode(apr_pool_t *pool, apr_xml_elem *e, char **buffer, size_t *used,
+       size_t *size)
+{
+    apr_xml_attr *attr;
+    apr_xml_elem *child;
+    apr_text *t;
+    size_t length;
+
+    length = strlen(e->name);
+    append_header(pool, buffer, used, size, 'S', length, true);
+    append(pool, buffer, used, size, e->name, length);
+    for (attr = e->attr; attr != NULL; attr = attr->next) {
+        length = strlen(attr->name);
+        append_header(pool, buffer, used, size, 'A', length, true);
+        append(pool, buffer, used, size, attr->name, length);
+        length = strlen(attr->value);
+        append_header(pool, buffer, used, size, '\0', length, false);
+        append(pool, buffer, used, size, attr->value, length);
+    }
+    for (t = e->first_cdata.first; t != NULL; t = t->next) {
+        length = strlen(t->text);
+        append_header(pool, buffer, used, size, 'T', length, false);
+        append(pool, buffer, used, size, t->text, length);
+    }
+    for (child = e->first_child; child != NULL; child = child->next)
+        encode(pool, child, buffer, used, size);
+    append(pool, buffer, used, size, "E", 1);
+}
+
+
+/*
+ * Parse a document with apr_xml_parser.
+ */
+static apr_xml_elem *
+parse_dom(apr_pool_t *pool, const char *doc, size_t length)
+{
+    apr_xml_parser *xp;
+    apr_xml_doc *xd;
+    size_t i, n;
+
+    xp = apr_xml_parser_create(pool);
+    for (i = 0; i < length; i += n) {
+        n = (length - i < BLOCK) ? length - i : BLOCK;
+        if (apr_xml_parser_feed(xp, doc + i, n) != APR_SUCCESS)
+            return NULL;
+    }
+    if (apr_xml_parser_done(xp, &xd) != APR_SUCCESS)
+        return NULL;
+    return xd->root;
+}
+
+
+/*
+ * Parse a document with the streaming parser.
+ */
+static apr_xml_elem *
+parse_stream(apr_pool_t *pool, const char *doc, size_t length)
+{
+    struct mwk_xml_parser *xp;
+    size_t i, n;
+
+    xp = mwk_xml_parser_create(pool, 0, false);
+    for (i = 0; i < length; i += n) {
+        n = (length - i < BLOCK) ? length - i : BLOCK;
+        if (!mwk_xml_parser_feed(xp, doc + i, n))
+            return NULL;
+    }
+    return mwk_xml_parser_done(xp);
+}
+
+
+/*
+ * Parse a document in the compact encoding with the streaming parser.
+ */
+static apr_xml_elem *
+parse_compact(apr_pool_t *pool, const char *doc, size_t length)
+{
+    struct mwk_xml_parser *xp;
+    size_t i, n;
+
+    xp = mwk_xml_parser_create(pool, 0, true);
+    for (i = 0; i < length; i += n) {
+        n = (length - i < BLOCK) ? length - i : BLOCK;
+        if (!mwk_xml_parser_feed(xp, doc + i, n))
+            return NULL;
+    }
+    return mwk_xml_parser_done(xp);
+}
+
+
+/*
+ * Return the text of an element the way mod_webkdc's get_elem_text does,
+ * joining the pieces only if there is more than one.
+ */
+static const char *
+elem_text(apr_pool_t *pool, apr_xml_elem *e)
+{
+    apr_text *t;
+    char *text = NULL;
+
+    if (e->first_cdata.first == NULL)
+        return "";
+    if (e->first_cdata.first->next == NULL)
+        return e->first_cdata.first->text;
+    for (t = e->first_cdata.first; t != NULL; t = t->next)
+        text = apr_pstrcat(pool, text == NULL ? "" : text, t->text,
+                           (char *) NULL);
+    return text;
+}
+
+
+/*
+ * Walk the request the way handle_requestTokenRequest does, getting the text
+ * of every leaf element, and return the total length of that text.
+ */
+static size_t
+walk(apr_pool_t *pool, apr_xml_elem *e)
+{
+    size_t total = 0;
+
+    if (e->first_child == NULL)
+        return strlen(elem_text(pool, e));
+    for (e = e->first_child; e != NULL; e = e->next)
+        total += walk(pool, e);
+    return total;
+}
+
+
+/*
+ * Parse and walk ITERATIONS copies of the request with the given parser,
+ * clearing the pool after each as mod_webkdc does at the end of a request,
+ * and report the time per request.
+ */
+static void
+run_bench(apr_pool_t *pool, const char *name, parse_func parse,
+          const char *doc, size_t length, size_t expected)
+{
+    apr_xml_elem *root;
+    double start, elapsed;
+    unsigned long i;
+
+    start = now();
+    for (i = 0; i < ITERATIONS; i++) {
+        root = parse(pool, doc, length);
+        if (root == NULL)
+            bail("%s parser failed", name);
+        if (walk(pool, root) != expected)
+            bail("%s parser returned the wrong text", name);
+        apr_pool_clear(pool);
+    }
+    elapsed = now() - start;
+    printf("%-10s %6lu bytes  %8.0f ns/request\n", name,
+           (unsigned long) length, elapsed * 1e9 / ITERATIONS);
+}
+
+
+int
+main(void)
+{
+    apr_pool_t *pool, *request;
+    apr_xml_elem *root;
+    const char *doc;
+    char *compact = NULL;
+    size_t expected, used = 0, size = 0;
+
+    if (apr_initialize() != APR_SUCCESS)
+        bail("cannot initialize APR");
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    if (apr_pool_create(&request, pool) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    doc = build_request(pool);
+    root = parse_dom(request, doc, strlen(doc));
+    if (root == NULL)
+        bail("cannot parse request");
+    expected = walk(request, root);
+    encode(pool, root, &compact, &used, &size);
+    apr_pool_clear(request);
+
+    run_bench(request, "apr_xml", parse_dom, doc, strlen(doc), expected);
+    run_bench(request, "streaming", parse_stream, doc, strlen(doc),
+              expected);
+    run_bench(request, "compact", parse_compact, compact, used, expected);
+
+    apr_pool_destroy(pool);
+    apr_terminate();
+    return 0;
+}
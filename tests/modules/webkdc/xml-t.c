@@ -0,0 +1,485 @@
+/*
+ * Test suite for the mod_webkdc XML parser and writer.
+ *
+ * Parse documents in XML and in the compact encoding, both all at once and
+ * one byte at a time so that every token is split across chunks, and compare
+ * a dump of the resulting tree or the error against what's expected.  Then
+ * check that each limit is enforced at exactly its boundary and that the
+ * writer's output in both forms parses back into the same tree.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/apache.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+
+#include <apr_xml.h>
+
+#include <modules/webkdc/mod_webkdc.h>
+#include <tests/tap/basic.h>
+#include <util/macros.h>
+
+/* Give a string literal and its length, for data that may contain nuls. */
+#define DATA(s) s, sizeof(s) - 1
+
+/*
+ * Documents and either the dump of the tree they should produce or "error: "
+ * followed by the parse error.
+ */
+static const struct {
+    const char *data;
+    size_t length;
+    bool compact;
+    const char *result;
+} parse_tests[] = {
+    /* Basic structure and attribute quoting. */
+    { DATA("<a x=\"1\" y='2'>text<b/>tail<c>more</c></a>"), false,
+      "a y=2 x=1['text'b[]'tail'c['more']]" },
+    { DATA("<a\n  x = \"1\"\n><b\t/></a >"), false, "a x=1[b[]]" },
+    { DATA("<s:a xmlns:s=\"urn:x\"><s:b/></s:a>"), false, "a s=urn:x[b[]]" },
+
+    /* Entities in text and attributes. */
+    { DATA("<a v=\"&lt;&amp;&#65;&#x42;\">&lt;&gt;&amp;&quot;&apos;</a>"),
+      false, "a v=<&AB['<>&\"'']" },
+    { DATA("<a>&#233;&#x20AC;&#x1F600;</a>"), false,
+      "a['\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80']" },
+    { DATA("<a>&foo;</a>"), false, "error: invalid entity reference" },
+    { DATA("<a>&#0;</a>"), false, "error: invalid entity reference" },
+    { DATA("<a>&#xD800;</a>"), false, "error: invalid entity reference" },
+    { DATA("<a>&#x110000;</a>"), false, "error: invalid entity reference" },
+    { DATA("<a>&#1a;</a>"), false, "error: invalid entity reference" },
+    { DATA("<a>&aaaaaaaaaaaaaaaaaaaa;</a>"), false,
+      "error: invalid entity reference" },
+    { DATA("<a v=\"&bogus;\"/>"), false, "error: invalid entity reference" },
+    { DATA("<a v=\"&amp\"/>"), false, "error: invalid entity reference" },
+
+    /* CDATA sections, including ] just before the end. */
+    { DATA("<a><![CDATA[<b>&amp;]]></a>"), false, "a['<b>&amp;']" },
+    { DATA("<a>x<![CDATA[]]]]>y</a>"), false, "a['x]]y']" },
+    { DATA("<a><![CDATA[a]b]]c]]></a>"), false, "a['a]b]]c']" },
+
+    /* Comments and processing instructions are skipped. */
+    { DATA("<?xml version=\"1.0\"?>\n<!-- <a> -->\n<a>t<!-- x - -->u"
+           "<?pi a>b?" "?>v</a>\n<!-- end -->\n"), false, "a['tuv']" },
+
+    /* Document type declarations are rejected. */
+    { DATA("<!DOCTYPE a [<!ENTITY x \"y\">]><a>&x;</a>"), false,
+      "error: unsupported markup declaration" },
+    { DATA("<a><!ELEMENT a ANY></a>"), false,
+      "error: unsupported markup declaration" },
+
+    /* Mismatched, stray, and unclosed tags. */
+    { DATA("<a><b></a></b>"), false, "error: mismatched end tag" },
+    { DATA("<a></b>"), false, "error: mismatched end tag" },
+    { DATA("</a>"), false, "error: mismatched end tag" },
+    { DATA("<a><b></b>"), false, "error: unexpected end of document" },
+    { DATA("<a><b"), false, "error: unexpected end of document" },
+    { DATA("<a><!-- x -></a>"), false, "error: unexpected end of document" },
+    { DATA(""), false, "error: unexpected end of document" },
+    { DATA("<a/><b/>"), false, "error: junk after document element" },
+    { DATA("x<a/>"), false, "error: text outside of document element" },
+    { DATA("<a/>x"), false, "error: text outside of document element" },
+    { DATA("<a><></a>"), false, "error: empty tag" },
+    { DATA("<a><=b/></a>"), false, "error: invalid element name" },
+    { DATA("<a x=1/>"), false, "error: unquoted attribute value" },
+    { DATA("<a x/>"), false, "error: attribute without value" },
+
+    /* A byte order mark is skipped, but only at the start. */
+    { DATA("\xef\xbb\xbf<a>x</a>"), false, "a['x']" },
+    { DATA("<a>\xef\xbb\xbf</a>"), false, "a['\xef\xbb\xbf']" },
+    { DATA("\xef\xbb\xbf\xef\xbb\xbf<a/>"), false,
+      "error: text outside of document element" },
+
+    /* Whitespace-only text is dropped, but other text is kept as is. */
+    { DATA("\n <a>\n  <b> </b>\n  <c>x</c>\n</a>\n "), false, "a[b[]c['x']]" },
+    { DATA("<a> x </a>"), false, "a[' x ']" },
+
+    /* The compact encoding. */
+    { DATA("S\001a" "A\001x" "\0\0\0\001" "1" "T\0\0\0\004" "text"
+           "S\001b" "E" "T\0\0\0\004" "tail" "E"), true,
+      "a x=1['text'b[]'tail']" },
+    { DATA("S\003s:a" "A\007xmlns:s" "\0\0\0\0" "E"), true, "a s=[]" },
+    { DATA("S\001a" "T\0\0\0\003" " \n\t" "E"), true, "a[]" },
+    { DATA("X"), true, "error: invalid record type" },
+    { DATA("<a/>"), true, "error: invalid record type" },
+    { DATA("A\001a" "\0\0\0\0"), true,
+      "error: attribute not after start of element" },
+    { DATA("S\001a" "T\0\0\0\001" "x" "A\001b" "\0\0\0\0" "E"), true,
+      "error: attribute not after start of element" },
+    { DATA("S\000"), true, "error: invalid name" },
+    { DATA("S\001<" "E"), true, "error: invalid name" },
+    { DATA("S\001a" "A\000"), true, "error: invalid name" },
+    { DATA("S\001a" "E" "E"), true, "error: mismatched end tag" },
+    { DATA("S\001a" "E" "S\001b" "E"), true,
+      "error: junk after document element" },
+    { DATA("T\0\0\0\001" "x" "S\001a" "E"), true,
+      "error: text outside of document element" },
+    { DATA("S\001a"), true, "error: unexpected end of document" },
+    { DATA("S\002a"), true, "error: unexpected end of document" },
+    { DATA("S\001a" "T\0\0\0\005" "ab" "E"), true,
+      "error: unexpected end of document" },
+    { DATA("S\001a" "A\001x" "\0\0"), true,
+      "error: unexpected end of document" },
+    { DATA("S\001a" "T\0\001\0\001" "x"), true,
+      "error: unexpected end of document" },
+};
+
+
+/*
+ * Output collected from the writer, and the write callback that collects it.
+ */
+struct output {
+    char *data;
+    size_t used;
+};
+
+static void
+output_write(void *data, const char *buffer, size_t length)
+{
+    struct output *output = data;
+
+    output->data = brealloc(output->data, output->used + length + 1);
+    memcpy(output->data + output->used, buffer, length);
+    output->used += length;
+    output->data[output->used] = '\0';
+}
+
+
+/*
+ * Append the text pieces of an apr_text_header to a dump, quoted.
+ */
+static const char *
+dump_text(apr_pool_t *pool, const char *dump, const apr_text_header *header)
+{
+    const apr_text *text;
+
+    for (text = header->first; text != NULL; text = text->next)
+        dump = apr_pstrcat(pool, dump, "'", text->text, "'", (char *) 0);
+    return dump;
+}
+
+
+/*
+ * Return a dump of an element and its children.  The dump is the element
+ * name, then each attribute as " name=value" in list order, then in square
+ * brackets the element text and each child followed by its trailing text,
+ * with text in single quotes.
+ */
+static const char *
+dump_elem(apr_pool_t *pool, const apr_xml_elem *elem)
+{
+    const apr_xml_attr *attr;
+    const apr_xml_elem *child;
+    const char *dump;
+
+    dump = elem->name;
+    for (attr = elem->attr; attr != NULL; attr = attr->next)
+        dump = apr_pstrcat(pool, dump, " ", attr->name, "=", attr->value,
+                           (char *) 0);
+    dump = apr_pstrcat(pool, dump, "[", (char *) 0);
+    dump = dump_text(pool, dump, &elem->first_cdata);
+    for (child = elem->first_child; child != NULL; child = child->next) {
+        dump = apr_pstrcat(pool, dump, dump_elem(pool, child), (char *) 0);
+        dump = dump_text(pool, dump, &child->following_cdata);
+    }
+    return apr_pstrcat(pool, dump, "]", (char *) 0);
+}
+
+
+/*
+ * Parse a document of the given length, feeding it to the parser at most
+ * chunk bytes at a time, and return a dump of the tree or "error: " followed
+ * by the parse error.  max_size is passed to the parser.
+ */
+static const char *
+parse(apr_pool_t *pool, const char *data, size_t length, size_t chunk,
+      bool compact, size_t max_size)
+{
+    struct mwk_xml_parser *parser;
+    apr_xml_elem *root;
+    size_t i, n;
+
+    parser = mwk_xml_parser_create(pool, max_size, compact);
+    for (i = 0; i < length; i += n) {
+        n = (length - i < chunk) ? length - i : chunk;
+        if (!mwk_xml_parser_feed(parser, data + i, n))
+            break;
+    }
+    root = mwk_xml_parser_done(parser);
+    if (root == NULL)
+        return apr_pstrcat(pool, "error: ", mwk_xml_parser_error(parser),
+                           (char *) 0);
+    return dump_elem(pool, root);
+}
+
+
+/*
+ * Check a document both in one chunk and one byte at a time.  This is two
+ * tests.
+ */
+static void
+check_parse(apr_pool_t *pool, const char *data, size_t length, bool compact,
+            const char *result, const char *name)
+{
+    is_string(result, parse(pool, data, length, length, compact, 0),
+              "%s", name);
+    is_string(result, parse(pool, data, length, 1, compact, 0),
+              "...%s one byte at a time", name);
+}
+
+
+/*
+ * Return a document of count nested elements, or count empty elements
+ * inside a root if flat is true, in XML or compact form.  Stores the length
+ * in length.
+ */
+static char *
+build_elements(apr_pool_t *pool, unsigned long count, bool flat,
+               bool compact, size_t *length)
+{
+    const char *open, *empty, *close;
+    size_t open_len, empty_len, close_len, n;
+    unsigned long i;
+    char *data, *p;
+
+    if (compact) {
+        open = "S\001a";
+        empty = "S\001aE";
+        close = "E";
+    } else {
+        open = "<a>";
+        empty = "<a/>";
+        close = "</a>";
+    }
+    open_len = strlen(open);
+    empty_len = strlen(empty);
+    close_len = strlen(close);
+    n = flat ? open_len + (count - 1) * empty_len + close_len
+             : count * (open_len + close_len);
+    data = apr_palloc(pool, n + 1);
+    p = data;
+    if (flat) {
+        memcpy(p, open, open_len);
+        p += open_len;
+        for (i = 1; i < count; i++, p += empty_len)
+            memcpy(p, empty, empty_len);
+        memcpy(p, close, close_len);
+        p += close_len;
+    } else {
+        for (i = 0; i < count; i++, p += open_len)
+            memcpy(p, open, open_len);
+        for (i = 0; i < count; i++, p += close_len)
+            memcpy(p, close, close_len);
+    }
+    *p = '\0';
+    *length = n;
+    return data;
+}
+
+
+/*
+ * Check the element count and depth limits at the limit and one past it, in
+ * both encodings.  This is eight tests.
+ */
+static void
+check_element_limits(apr_pool_t *pool)
+{
+    const char *form, *result;
+    size_t length;
+    char *data;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        form = (i == 0) ? "XML" : "compact";
+        data = build_elements(pool, MWK_XML_MAX_ELEMENTS, true, i, &length);
+        result = parse(pool, data, length, length, i, 0);
+        ok(strncmp(result, "error", 5) != 0, "%d elements in %s",
+           MWK_XML_MAX_ELEMENTS, form);
+        data = build_elements(pool, MWK_XML_MAX_ELEMENTS + 1, true, i,
+                              &length);
+        is_string("error: too many elements",
+                  parse(pool, data, length, length, i, 0), "...but not %d",
+                  MWK_XML_MAX_ELEMENTS + 1);
+        data = build_elements(pool, MWK_XML_MAX_DEPTH, false, i, &length);
+        result = parse(pool, data, length, length, i, 0);
+        ok(strncmp(result, "error", 5) != 0, "Nesting of %d in %s",
+           MWK_XML_MAX_DEPTH, form);
+        data = build_elements(pool, MWK_XML_MAX_DEPTH + 1, false, i, &length);
+        is_string("error: elements nested too deeply",
+                  parse(pool, data, length, length, i, 0), "...but not %d",
+                  MWK_XML_MAX_DEPTH + 1);
+    }
+}
+
+
+/*
+ * Check the tag, text, and document size limits at the limit and one past
+ * it.  This is ten tests.
+ */
+static void
+check_size_limits(apr_pool_t *pool)
+{
+    const char *result;
+    char *data;
+    size_t length, i;
+
+    /* A tag is everything between < and >, here a name and a /. */
+    data = apr_palloc(pool, MWK_XML_MAX_TAG + 4);
+    for (i = 0; i < 2; i++) {
+        length = MWK_XML_MAX_TAG - 1 + i;
+        data[0] = '<';
+        memset(data + 1, 'a', length);
+        memcpy(data + 1 + length, "/>", 3);
+        result = parse(pool, data, length + 3, length + 3, false, 0);
+        if (i == 0)
+            ok(strncmp(result, "error", 5) != 0, "Tag of %d bytes",
+               MWK_XML_MAX_TAG);
+        else
+            is_string("error: tag too long", result, "...but not %d",
+                      MWK_XML_MAX_TAG + 1);
+    }
+
+    /* Text, in XML and as a compact text record. */
+    data = apr_palloc(pool, MWK_XML_MAX_TEXT + 16);
+    for (i = 0; i < 2; i++) {
+        length = MWK_XML_MAX_TEXT + i;
+        memcpy(data, "<a>", 3);
+        memset(data + 3, 'x', length);
+        memcpy(data + 3 + length, "</a>", 4);
+        result = parse(pool, data, length + 7, length + 7, false, 0);
+        if (i == 0)
+            ok(strncmp(result, "error", 5) != 0, "Text of %d bytes",
+               MWK_XML_MAX_TEXT);
+        else
+            is_string("error: element text too long", result,
+                      "...but not %d", MWK_XML_MAX_TEXT + 1);
+    }
+    for (i = 0; i < 2; i++) {
+        length = MWK_XML_MAX_TEXT + i;
+        memcpy(data, "S\001aT", 4);
+        data[4] = (char) ((length >> 24) & 0xff);
+        data[5] = (char) ((length >> 16) & 0xff);
+        data[6] = (char) ((length >> 8) & 0xff);
+        data[7] = (char) (length & 0xff);
+        memset(data + 8, 'x', length);
+        data[8 + length] = 'E';
+        result = parse(pool, data, length + 9, length + 9, true, 0);
+        if (i == 0)
+            ok(strncmp(result, "error", 5) != 0,
+               "Compact text of %d bytes", MWK_XML_MAX_TEXT);
+        else
+            is_string("error: element text too long", result,
+                      "...but not %d", MWK_XML_MAX_TEXT + 1);
+    }
+
+    /* The size limit, whether the excess is in one chunk or spread out. */
+    data = apr_pstrdup(pool, "<a>xxxx</a>");
+    length = strlen(data);
+    is_string("a['xxxx']", parse(pool, data, length, length, false, length),
+              "Document at the size limit");
+    is_string("error: request too large",
+              parse(pool, data, length, length, false, length - 1),
+              "...but not one byte over");
+    is_string("error: request too large",
+              parse(pool, data, length, 1, false, length - 1),
+              "...even one byte at a time");
+    is_string("error: request too large",
+              parse(pool, DATA("S\001aE"), 1, true, 2),
+              "...or in compact form");
+}
+
+
+/*
+ * Write the same document with the writer in either form, returning the
+ * output.  The caller must free output->data.
+ */
+static void
+write_document(apr_pool_t *pool, bool compact, struct output *output)
+{
+    struct mwk_xml_writer writer;
+
+    output->data = NULL;
+    output->used = 0;
+    writer.write = output_write;
+    writer.data = output;
+    writer.pool = pool;
+    writer.compact = compact;
+    writer.tag_open = false;
+    mwk_xml_start(&writer, "a");
+    mwk_xml_attr(&writer, "id", "v<&\"");
+    mwk_xml_text(&writer, "hi <&>");
+    mwk_xml_start(&writer, "b");
+    mwk_xml_end(&writer, "b");
+    mwk_xml_text(&writer, "tail");
+    mwk_xml_start(&writer, "c");
+    mwk_xml_attr(&writer, "x", "");
+    mwk_xml_text(&writer, "");
+    mwk_xml_end(&writer, "c");
+    mwk_xml_end(&writer, "a");
+}
+
+
+/*
+ * Check the writer's output in both forms and that it parses back into the
+ * tree that was written.  This is eight tests.
+ */
+static void
+check_writer(apr_pool_t *pool)
+{
+    static const char xml[] =
+        "<a id=\"v&lt;&amp;&quot;\">hi &lt;&amp;&gt;<b/>tail<c x=\"\"/></a>";
+    static const char compact[] =
+        "S\001a" "A\002id" "\0\0\0\004" "v<&\"" "T\0\0\0\006" "hi <&>"
+        "S\001b" "E" "T\0\0\0\004" "tail" "S\001c" "A\001x" "\0\0\0\0"
+        "E" "E";
+    static const char tree[] = "a id=v<&\"['hi <&>'b[]'tail'c x=[]]";
+    struct output output;
+
+    write_document(pool, false, &output);
+    is_string(xml, output.data, "XML writer output");
+    is_string(tree, parse(pool, output.data, output.used, output.used, false,
+                          0), "...parses back");
+    is_string(tree, parse(pool, output.data, output.used, 1, false, 0),
+              "...one byte at a time");
+    free(output.data);
+
+    write_document(pool, true, &output);
+    is_int(sizeof(compact) - 1, output.used, "Compact writer output length");
+    ok(memcmp(compact, output.data, output.used) == 0, "...and contents");
+    is_string(tree, parse(pool, output.data, output.used, output.used, true,
+                          0), "...parses back");
+    is_string(tree, parse(pool, output.data, output.used, 1, true, 0),
+              "...one byte at a time");
+    is_string(tree, parse(pool, output.data, output.used, 3, true, 0),
+              "...and three bytes at a time");
+    free(output.data);
+}
+
+
+int
+main(void)
+{
+    apr_pool_t *pool;
+    size_t i;
+
+    if (apr_initialize() != APR_SUCCESS)
+        bail("cannot initialize APR");
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+
+    plan(ARRAY_SIZE(parse_tests) * 2 + 8 + 10 + 8);
+
+    for (i = 0; i < ARRAY_SIZE(parse_tests); i++)
+        check_parse(pool, parse_tests[i].data, parse_tests[i].length,
+                    parse_tests[i].compact, parse_tests[i].result,
+                    apr_psprintf(pool, "Document %lu", (unsigned long) i));
+    check_element_limits(pool);
+    check_size_limits(pool);
+    check_writer(pool);
+
+    apr_pool_destroy(pool);
+    apr_terminate();
+    return 0;
+}